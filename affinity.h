@@ -0,0 +1,152 @@
+/*
+CPU topology and thread placement shared by server and load balancer.
+
+topology_init() reads the CPUs this process may run on (sched_getaffinity(), so taskset and cgroup cpusets are honoured)
+and the NUMA node of every CPU from /sys/devices/system/node. CPUs are kept sorted by node, so consecutive placement
+indexes stay on one node and threads working on the same data share its caches and memory.
+Pinning is optional (-a option of both programs). a pinned thread calls pin_thread() itself before it allocates
+its own state, Linux places memory on the node of the CPU that first touches it, so per-thread buffers become
+NUMA local without libnuma. local_alloc() returns fresh pages for that purpose.
+Guests usually have one node, then this only pins threads to cores.
+*/
+
+#include <sched.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#define TOPO_MAX_CPUS 1024
+#define TOPO_MAX_NODES 64
+
+struct cpu_topology {
+	int n_cpus; // CPUs this process may run on.
+	int cpus[TOPO_MAX_CPUS]; // CPU ids sorted by node.
+	int node_of[TOPO_MAX_CPUS]; // node of cpus[i].
+	int n_nodes; // nodes having at least one of our CPUs.
+} topo;
+
+bool pinning = false; // -a option.
+
+
+// parse sysfs cpulist like "0-3,8,10-11" into node_of_cpu[] (indexed by CPU id).
+static void topology_read_cpulist(const char *path, int node, int *node_of_cpu) {
+	FILE *f = fopen(path, "r");
+	if(f == NULL) return;
+	int low, high;
+	char sep;
+	while(fscanf(f, "%d", &low) == 1) {
+		high = low;
+		sep = fgetc(f);
+		if(sep == '-') {
+			if(fscanf(f, "%d", &high) != 1) break;
+			sep = fgetc(f);
+		}
+		for(int cpu = low; cpu <= high && cpu < TOPO_MAX_CPUS; cpu++) node_of_cpu[cpu] = node;
+		if(sep != ',') break;
+	}
+	fclose(f);
+}
+
+void topology_init() {
+	int node_of_cpu[TOPO_MAX_CPUS];
+	for(int cpu = 0; cpu < TOPO_MAX_CPUS; cpu++) node_of_cpu[cpu] = 0; // no sysfs nodes means one node.
+	DIR *dir = opendir("/sys/devices/system/node");
+	struct dirent *d;
+	while(dir != NULL && (d = readdir(dir)) != NULL) {
+		int node;
+		if(sscanf(d->d_name, "node%d", &node) != 1 || node >= TOPO_MAX_NODES) continue;
+		char path[300];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", d->d_name);
+		topology_read_cpulist(path, node, node_of_cpu);
+	}
+	if(dir != NULL) closedir(dir);
+
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		for(int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &allowed);
+	}
+	topo.n_cpus = 0;
+	topo.n_nodes = 0;
+	for(int node = 0; node < TOPO_MAX_NODES; node++) {
+		bool used = false;
+		for(int cpu = 0; cpu < CPU_SETSIZE && cpu < TOPO_MAX_CPUS; cpu++) {
+			if(!CPU_ISSET(cpu, &allowed) || node_of_cpu[cpu] != node) continue;
+			topo.cpus[topo.n_cpus] = cpu;
+			topo.node_of[topo.n_cpus] = node;
+			topo.n_cpus += 1;
+			used = true;
+		}
+		if(used) topo.n_nodes += 1;
+	}
+	if(topo.n_cpus == 0) { // affinity mask and sysfs disagree, don't pin anything.
+		topo.cpus[0] = 0;
+		topo.node_of[0] = 0;
+		topo.n_cpus = 1;
+		topo.n_nodes = 1;
+	}
+}
+
+// CPU id of placement index, indexes wrap around when there are more threads than CPUs.
+int topology_cpu(int idx) {
+	return topo.cpus[idx % topo.n_cpus];
+}
+
+int topology_node(int idx) {
+	return topo.node_of[idx % topo.n_cpus];
+}
+
+// pin calling thread to CPU of placement index. no-op without -a, returns false if kernel refused.
+bool pin_thread(int idx) {
+	if(!pinning) return true;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(topology_cpu(idx), &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// zeroed memory first touched by the calling thread, lands on its node once it is pinned.
+void *local_alloc(size_t size) {
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ptr == MAP_FAILED) return NULL;
+	memset(ptr, 0, size); // fault pages in now, on this thread's node.
+	return ptr;
+}
+
+// "0-3,6" style list of CPUs of placement indexes.
+static void topology_format(char *out, int out_len, int *places, int count) {
+	int len = 0;
+	out[0] = '\0';
+	for(int i = 0; i < count && len < out_len - 12; ) {
+		int low = topology_cpu(places[i]), j = i + 1;
+		while(j < count && topology_cpu(places[j]) == topology_cpu(places[j - 1]) + 1) j++;
+		int high = topology_cpu(places[j - 1]);
+		len += snprintf(out + len, out_len - len, low == high? "%s%d": "%s%d-%d", len > 0? ",": "", low, high);
+		i = j;
+	}
+}
+
+// CPUs and nodes found, printed once at startup.
+void topology_report(FILE *fd) {
+	char list[256];
+	int places[TOPO_MAX_CPUS];
+	fprintf(fd, "Topology: %d CPUs on %d NUMA node(s)", topo.n_cpus, topo.n_nodes);
+	for(int i = 0; i < topo.n_cpus; ) {
+		int first = i;
+		while(i < topo.n_cpus && topo.node_of[i] == topo.node_of[first]) places[i - first] = i, i++;
+		topology_format(list, sizeof(list), places, i - first);
+		fprintf(fd, ", node%d: %s", topo.node_of[first], list);
+	}
+	fprintf(fd, "\n");
+	fflush(fd);
+}
+
+// where count threads of one role run, places[] are their placement indexes.
+void placement_report(FILE *fd, const char *role, int *places, int count) {
+	char list[256];
+	if(!pinning) fprintf(fd, "Placement: %d %s, not pinned\n", count, role);
+	else {
+		topology_format(list, sizeof(list), places, count);
+		fprintf(fd, "Placement: %d %s pinned on CPUs %s\n", count, role, list);
+	}
+	fflush(fd);
+}
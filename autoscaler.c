@@ -9,8 +9,21 @@
 #include <sys/socket.h> 
 #include <sys/types.h>
 #include <arpa/inet.h>
-#include <libvirt/libvirt.h>
 #include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#ifndef HV_SIM_ONLY // autoscaler_sim is built without libvirt.
+#include <libvirt/libvirt.h>
+#include <sys/inotify.h>
+#endif
 
 // CPU stats flags.
 #define CPU_USAGE_HIGH 2
@@ -30,49 +43,189 @@
 // flags used to call notify function. TYPE params of notify_load_balancer method
 #define NOTI_SCALE_OUT 1	// notify load balancer to start sending request to new domain specified in params
 #define NOTI_SCALE_IN 0		// notify load balancer to stop sending request to domain specified in params
-#define NOTI_CONSISTENT 2	// notify load balancer that sever is running it must be serving request.
-
-int notify_load_balancer(virDomainPtr domPtr, int TYPE);
+#define NOTI_SYNC 2		// send load balancer the whole or changed set of domains that must be serving.
+#define NOTI_OUTSTANDING 3	// ask load balancer how many requests of domain are not answered yet.
+#define NOTI_CLASS_LOAD 4	// ask load balancer for latency and backlog of one request class.
+
+#define LB_MSG_LEN 50 // every message and reply between autoscaler and load balancer.
+#define LB_MAX_PENDING 64 // messages sent and not yet answered.
+#define LB_ADDR_LEN 24 // backend address of a domain, IP or "vsock:<cid>" (transport.h of load balancer).
+#define LB_SYNC_MAX_PAYLOAD 16384 // SYNC_MAX_PAYLOAD of load balancer, bigger membership is refused there.
+
+// event loop ticks (seconds). decision is taken on every sample so a load spike is seen within one tick.
+#define SAMPLE_INTERVAL 1
+#define CONSISTENCY_INTERVAL 10
+#define SYNC_FULL_EVERY 30 // consistency ticks between full snapshots, deltas in between. unchanged set sends nothing.
+#define REPORT_INTERVAL 60
+#define HIGH_PATIENCE 0 // extra high samples before scale out, samples are already smoothed over 3 ticks.
+#define LOW_PATIENCE 30 // extra low samples before scale in.
+#define SCALE_TARGET_CPU 0.60 // step scale out sizes the fleet for this average cpu, middle of moderate band.
+#define SCALE_SATURATED_CPU 0.95 // cpu above this hides how much load there really is, fleet is doubled instead.
+
+// load reports of servers in guests (PONG frames to load balancer, OUTSTANDING replies to autoscaler). busy fraction of
+// compute workers replaces host side cpu time which counts boot noise and knows nothing about queueing.
+#define GUEST_REPORT_MAX_AGE 3 // seconds, older report is not used and host side cpu time counts again.
+#define GUEST_QUEUE_HIGH 1.0 // queued requests per compute worker above which load is high whatever cpu says.
+
+// host contention.
+#define MAX_HOSTS 16
+#define STEAL_HIGH 0.10 // share of vCPU time spent waiting for a host cpu above which domain is host starved, not busy.
+#define HOST_BUSY_HIGH 0.90 // host cpu utilization above which host is oversubscribed, no scale out onto it.
+
+// scale in victim score, domain with lowest score is shut down. every term is roughly 0..1 before weight.
+#define VICTIM_W_LOAD 1.0 // cpu usage, busy domain has more work to drain.
+#define VICTIM_W_OUTSTANDING 1.0 // requests in flight reported by load balancer, they are retried elsewhere.
+#define VICTIM_W_UPTIME 0.5 // young domain has cold caches, cheapest to lose.
+#define VICTIM_W_PACKING 0.75 // domain sharing its host with many others, removing a lonely one frees a host.
+#define OUTSTANDING_NORM 50 // outstanding requests counted as full disruption.
+#define WARM_SECONDS 600 // uptime after which caches are considered warm.
+
+// request classes of load balancer (-Q there). p99 of a class against its SLO is a load signal besides cpu usage,
+// interactive class can miss its SLO while cpu looks moderate because it waits behind batch work.
+#define MAX_CLASSES 8
+#define CLASS_OVER_SLO 1.0 // p99 / slo above this is high load.
+#define CLASS_NEAR_SLO 0.5 // above this load is not counted low, scale in would push the class over.
+
+// checkpoint of domain stats for restarts (-k option).
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_MAX_AGE 300 // seconds, older load history is not used, notification states still are.
+
+#include "pool.h"
+#include "event_loop.h"
+#include "hypervisor.h"
+#ifndef HV_SIM_ONLY
+#include "hv_libvirt.h"
+#endif
+#include "hv_sim.h"
+#include "hv_local.h"
+
+int notify_load_balancer(hv_domain domPtr, int TYPE);
+void on_lb_reply(hv_domain domPtr, int NOTI_TYPE, bool success, char *message);
+double now_seconds();
 int connect_to_load_balancer();
 void scale_out();
 void scale_in();
-void stablize_cpu_usage();
-
-// Gloabal data.
-int load_bal_sock_fd; // socket fd of load balancer.
-virConnectPtr conn;
+bool send_sync();
+
+// Gloabal data. only the event loop thread touches it.
+int max_doms = 2; // -m option, domains beyond this are not used.
+int max_surge = 4; // -U option, domains booting at once.
+int out_cooldown = 10; // -O option, seconds after a domain starts serving before next scale out, its boot cpu is high.
+int in_cooldown = 3; // -I option, seconds after a scale in before next one.
+time_t out_hold_until = 0; // no scale out before this time, load is settling after last action.
+time_t in_hold_until = 0;
+double avg_cpu = 0; // of serving domains, last sample tick.
+int serving_count = 0;
+int high_count = 0; // consecutive high samples.
+int low_count = 0;
+const char *checkpoint_path = NULL; // -k option, NULL is no checkpoint.
+int drop_pct = 0; // -x option, chaos runs: share of messages to load balancer lost while SIGUSR1 has dropping on.
+volatile sig_atomic_t lb_dropping = 0;
+long lb_dropped = 0;
+
+struct lb_link {	// connection to load balancer. replies come back in the order messages were sent.
+	int sock_fd; // -1 when disconnected.
+	int watch; // event loop fd watch.
+	char rbuff[LB_MSG_LEN]; // partially received reply.
+	int rlen;
+	struct lb_request {
+		hv_domain domPtr;
+		int type;
+		int arg; // class index of NOTI_CLASS_LOAD.
+	} pending[LB_MAX_PENDING]; // FIFO of messages waiting for reply.
+	int head;
+	int count;
+} lb = {.sock_fd = -1, .watch = -1};
+
+
+struct class_load {	// signal of one request class, refreshed every sample tick.
+	char name[16];
+	long queued; // held back by load balancer, servers are full.
+	long p99_us; // of last load balancer report interval.
+	long slo_us; // 0 is none.
+	bool pending; // CLASS_LOAD sent and not answered yet.
+} lb_classes[MAX_CLASSES];
+int lb_class_count = 0; // classes load balancer has answered for.
+
+
+struct lb_membership {	// live servers of load balancer as last acknowledged, consistency ticks send only the difference.
+	long gen; // membership generation of load balancer, 0 is unknown and next SYNC is a full snapshot.
+	char (*IPs)[LB_ADDR_LEN]; // my_doms.doms_count entries.
+	int count;
+	char (*sent)[LB_ADDR_LEN]; // serving set of the SYNC waiting for reply, becomes IPs on success.
+	int sent_count;
+	bool pending; // SYNC sent and not answered yet.
+	int ticks; // since last full snapshot.
+	long deltas, fulls, skipped; // consistency ticks by what they sent.
+} lb_view;
 
 
 struct my_doms {	// my custom structure to store info.
 	int doms_count;
-	virDomainPtr *domains; // domain is pointer to structure array.
+	hv_domain *domains; // domain is pointer to structure array.
 } my_doms;
 
 
 struct doms_stats {	// list of active domains
-	virDomainPtr domPtr;
+	hv_domain domPtr;
 	struct doms_stats *next;
 	unsigned long long int llast; // total cpu time when measured 2nd last time
 	unsigned long long int last;	// total cpu time when measured last time
 	unsigned long long int current;	// total cpu time when measured this time.
 	double cpu_percent;	// calculated using cpu usage see server process in top.
-	int notified; // 4 notification flags default false.
+	int notified; // 4 notification flags default false. NOTI_DOM_SHTDWN_SUCC means domain is stopping.
+	time_t started_at; // when domain was started, long running domains have warm caches.
+	unsigned long long int sample_cpu; // guest cpu time of last sample, vCPU run time when vcpus > 0.
+	unsigned long long int sample_steal; // vCPU steal time of last sample.
+	int vcpus; // 0 when backend has no vCPU stats, cpu is one number per domain then.
+	double steal; // share of vCPU time spent waiting for host cpu, last tick.
+	double sample_at; // time of last sample, seconds.
+	bool noti_pending; // SCALE_OUT/SCALE_IN sent and not answered yet.
+	bool query_pending; // OUTSTANDING sent and not answered yet.
+	long outstanding; // last answer of load balancer.
+	long guest_queued; // load report of server in the domain, from the same answer.
+	long guest_workers;
+	double guest_busy; // 0..1
+	long guest_rps;
+	long guest_p99_us; // compute time.
+	double guest_at; // time of report, 0 when server sent none.
 } *statsPtr;
 
+struct mem_pool dom_stat_pool; // domains start and stop all day long, entries are recycled.
+
+struct host_stats {	// hosts running my domains, sampled every tick.
+	char name[64];
+	unsigned long long busy_ns, total_ns; // last sample.
+	double util; // 0..1 since previous sample, -1 when backend does not know.
+	double steal; // highest steal of its serving domains, last tick.
+	int starved; // serving domains over STEAL_HIGH.
+} hosts[MAX_HOSTS];
+int host_count = 0;
+
 
-struct doms_stats* insert_dom_stat(virDomainPtr domPtr) {	// insert dom into active domains list. called when VM starts or resume
+struct doms_stats* insert_dom_stat(hv_domain domPtr) {	// insert dom into active domains list. called when VM starts or resume
 	if(domPtr == NULL) {
 		printf("Invalid insert ops domPtr is NULL\n");
 		return NULL;
 	}
-	struct doms_stats *dom_stat = malloc(sizeof(struct doms_stats));
+	struct doms_stats *dom_stat = pool_alloc(&dom_stat_pool);
 	dom_stat->domPtr = domPtr;
 	dom_stat->next = NULL;
 	dom_stat->llast = 0;
 	dom_stat->last = 0;
 	dom_stat->current = 0;
 	dom_stat->cpu_percent = 0;
-	dom_stat->notified = false;
+	dom_stat->notified = NOTI_DOM_CRT_FAILD; // serving only after load balancer is notified.
+	dom_stat->started_at = hv->now();
+	dom_stat->sample_cpu = 0;
+	dom_stat->sample_steal = 0;
+	dom_stat->vcpus = 0;
+	dom_stat->steal = 0;
+	dom_stat->sample_at = 0;
+	dom_stat->noti_pending = false;
+	dom_stat->query_pending = false;
+	dom_stat->outstanding = 0;
+	dom_stat->guest_at = 0;
 
 	if(statsPtr == NULL) {
 		statsPtr = dom_stat;
@@ -82,7 +235,7 @@ struct doms_stats* insert_dom_stat(virDomainPtr domPtr) {	// insert dom into act
 	statsPtr = dom_stat;
 	return dom_stat;
 }
-void delete_dom_stat(virDomainPtr domPtr) {	// delete dom from active domain list called when VM is shutdown or paused.
+void delete_dom_stat(hv_domain domPtr) {	// delete dom from active domain list called when VM is shutdown or paused.
 	struct doms_stats *ptr = statsPtr;
 	if(domPtr == NULL || statsPtr == NULL) {
 		printf("Invalid delete ops domPtr/statsPtr is NULL\n");
@@ -90,7 +243,7 @@ void delete_dom_stat(virDomainPtr domPtr) {	// delete dom from active domain lis
 	}
 	if(ptr->domPtr == domPtr) {
 		statsPtr = ptr->next;
-		free(ptr);
+		pool_free(&dom_stat_pool, ptr);
 		return;
 	}
 	while(ptr->next != NULL && ptr->next->domPtr != domPtr) {
@@ -102,11 +255,11 @@ void delete_dom_stat(virDomainPtr domPtr) {	// delete dom from active domain lis
 	}
 	struct doms_stats *tmp = ptr->next;
 	ptr->next = ptr->next->next;
-	free(tmp);
+	pool_free(&dom_stat_pool, tmp);
 	return;
 }
 
-struct doms_stats* get_dom_stat(virDomainPtr domPtr) {
+struct doms_stats* get_dom_stat(hv_domain domPtr) {
 	struct doms_stats *ptr = statsPtr;
 	if(domPtr == NULL) {
 		printf("Invalid dom_stat get domPtr is NULL\n");
@@ -121,75 +274,201 @@ struct doms_stats* get_dom_stat(virDomainPtr domPtr) {
 	return NULL;
 }
 
-void init_server() { // make sure at least one server is started.
+/*
+checkpoint is a text file, one header line and one line per domain:
+  autoscaler <version> <saved_at> <out_hold_until> <in_hold_until> <high_count> <low_count>
+  <name> <notified> <started_at> <llast> <last> <current> <cpu_percent> <sample_cpu> <sample_at> <vcpus> <sample_steal>
+times are hv->now() seconds. sample_at is kept in the same clock, monotonic clock of now_seconds() starts again with the
+process. written every sample tick to <path>.tmp and renamed, a crash leaves the previous one.
+*/
+void save_checkpoint() {
+	static bool warned = false;
+	if(checkpoint_path == NULL) return;
+	char tmp[strlen(checkpoint_path) + 5];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint_path);
+	FILE *fp = fopen(tmp, "w");
+	if(fp == NULL) {
+		if(!warned) fprintf(stderr, "Error writing checkpoint %s: %s\n", tmp, strerror(errno));
+		warned = true;
+		return;
+	}
+	time_t now = hv->now();
+	double mono = now_seconds();
+	fprintf(fp, "autoscaler %d %ld %ld %ld %d %d\n", CHECKPOINT_VERSION, (long)now, (long)out_hold_until, (long)in_hold_until, high_count, low_count);
+	for(struct doms_stats *sptr = statsPtr; sptr != NULL; sptr = sptr->next) {
+		double sample_at = sptr->sample_at > 0? now - (mono - sptr->sample_at): 0;
+		fprintf(fp, "%s %d %ld %llu %llu %llu %.4lf %llu %.3lf %d %llu\n", hv->domain_name(sptr->domPtr), sptr->notified, (long)sptr->started_at,
+			sptr->llast, sptr->last, sptr->current, sptr->cpu_percent, sptr->sample_cpu, sample_at, sptr->vcpus, sptr->sample_steal);
+	}
+	if(fclose(fp) != 0 || rename(tmp, checkpoint_path) != 0) {
+		if(!warned) fprintf(stderr, "Error writing checkpoint %s: %s\n", checkpoint_path, strerror(errno));
+		warned = true;
+		unlink(tmp);
+		return;
+	}
+	warned = false;
+}
 
-	int count = 0;
+// restore domains of the checkpoint that are still running (active[] of init_server()), the rest stopped meanwhile.
+// serving ones stay serving without a new SCALE_OUT, first SYNC is a full snapshot that fixes load balancer if it
+// disagrees. load history resumes so that first sample tick compares against the last sample before the restart.
+int load_checkpoint(char *active) {
+	if(checkpoint_path == NULL) return 0;
+	FILE *fp = fopen(checkpoint_path, "r");
+	if(fp == NULL) return 0;
+	int version, high, low;
+	long saved, out_hold, in_hold;
+	if(fscanf(fp, "autoscaler %d %ld %ld %ld %d %d\n", &version, &saved, &out_hold, &in_hold, &high, &low) != 6 || version != CHECKPOINT_VERSION) {
+		printf("Ignoring checkpoint %s, unknown format\n", checkpoint_path);
+		fclose(fp);
+		return 0;
+	}
+	time_t now = hv->now();
+	double mono = now_seconds();
+	bool fresh = now >= saved && now - saved <= CHECKPOINT_MAX_AGE;
+	if(fresh) {
+		out_hold_until = out_hold;
+		in_hold_until = in_hold;
+		high_count = high;
+		low_count = low;
+	}
+
+	char name[64];
+	int notified, vcpus, restored = 0, stopped = 0;
+	long started;
+	unsigned long long llast, last, current, sample_cpu, sample_steal;
+	double cpu_percent, sample_at;
+	while(fscanf(fp, "%63s %d %ld %llu %llu %llu %lf %llu %lf %d %llu", name, &notified, &started, &llast, &last, &current,
+		&cpu_percent, &sample_cpu, &sample_at, &vcpus, &sample_steal) == 11) {
+		int i = 0;
+		while(i < my_doms.doms_count && strcmp(hv->domain_name(my_doms.domains[i]), name) != 0) i++;
+		if(i == my_doms.doms_count || active[i] != 1 || get_dom_stat(my_doms.domains[i]) != NULL) {
+			stopped += 1;
+			continue;
+		}
+		struct doms_stats *sptr = insert_dom_stat(my_doms.domains[i]);
+		if(notified >= NOTI_DOM_CRT_SUCC && notified <= NOTI_DOM_SHTDWN_FAILD) sptr->notified = notified;
+		sptr->started_at = started;
+		if(fresh) {
+			sptr->llast = llast;
+			sptr->last = last;
+			sptr->current = current;
+			sptr->cpu_percent = cpu_percent;
+			sptr->sample_cpu = sample_cpu; // domain rebooted meanwhile has less, first tick takes a new sample then.
+			sptr->sample_steal = sample_steal;
+			sptr->vcpus = vcpus;
+			sptr->sample_at = sample_at > 0? mono - (now - sample_at): 0;
+		}
+		restored += 1;
+	}
+	fclose(fp);
+	printf("Checkpoint %s: %d domain(s) restored, %d stopped meanwhile%s\n", checkpoint_path, restored, stopped,
+		fresh? "": ", load history too old");
+	return restored;
+}
+
+// make sure at least one server is started. sample ticks notify load balancer once domains have IPs. returns number of
+// domains restored from checkpoint.
+int init_server() {
+	char active[my_doms.doms_count];
+	if(hv->active_states(my_doms.domains, my_doms.doms_count, active) != 0) {
+		for(int i = 0; i < my_doms.doms_count; i++) active[i] = hv->is_active(my_doms.domains[i]) == 1;
+	}
+	int restored = load_checkpoint(active);
+	int count = restored;
 	for(int i = 0; i < my_doms.doms_count; i++) {
-		if(virDomainIsActive(my_doms.domains[i]) == 1) {	// inform already running domains
-			printf("Domain already running: %s\n", virDomainGetName(my_doms.domains[i]));
-			struct doms_stats* ptr = insert_dom_stat(my_doms.domains[i]);
-			int notified = notify_load_balancer(ptr->domPtr, NOTI_SCALE_OUT);
-			if(notified == SUCCESS) {
-				ptr->notified = NOTI_DOM_CRT_SUCC;
-			} else {
-				ptr->notified = NOTI_DOM_CRT_FAILD;
-			}
+		if(active[i] == 1 && get_dom_stat(my_doms.domains[i]) == NULL) {	// inform already running domains
+			printf("Domain already running: %s\n", hv->domain_name(my_doms.domains[i]));
+			insert_dom_stat(my_doms.domains[i]);
 			count += 1;
 		}
 	}
-	if(count > 0) return;
+	if(count > 0) return restored;
 	
-	if(virDomainCreate(my_doms.domains[0]) == 0) { 	// 0: success.
-		virDomainPtr domPtr = my_doms.domains[0];
-		while(notify_load_balancer(domPtr, NOTI_SCALE_OUT) != SUCCESS) sleep(3); // start sending request to this.
-
-		struct doms_stats *sptr = insert_dom_stat(domPtr);
-		sptr->notified = NOTI_DOM_CRT_SUCC;
-		// just wait for sometime let domain serve some requests.
-		printf("Waiting for boot up cpu usage to stabilize 10 seconds...\n"); // cpu usage is high during boot so it might trigger scale out again.
-		sleep(10); // delay calculating cpu usage because it is high just wait.
-		return;
+	if(hv->create(my_doms.domains[0]) == 0) { 	// 0: success.
+		insert_dom_stat(my_doms.domains[0]);
+		printf("Starting domain: %s\n", hv->domain_name(my_doms.domains[0]));
+		return 0;
 	}
 	printf("Domain creation failed\n");
 	exit(1);
 }
 
+void on_lb_readable(int id, int fd, int events, void *arg);
+void on_class_load(int idx, bool success, char *message);
+void on_lb_sync(bool success, char *message);
+
+bool lb_connect() {
+	lb.sock_fd = connect_to_load_balancer();
+	if(lb.sock_fd < 0) return false;
+	fcntl(lb.sock_fd, F_SETFL, fcntl(lb.sock_fd, F_GETFL, 0) | O_NONBLOCK); // replies are read by event loop.
+	lb.rlen = 0;
+	lb_view.gen = 0; // may be a restarted load balancer.
+	lb.watch = loop_add_fd(lb.sock_fd, EPOLLIN | EPOLLRDHUP, on_lb_readable, NULL);
+	return true;
+}
+
+void lb_disconnected() {
+	printf("Load balancer disconnected, reconnecting on next consistency tick\n");
+	loop_remove_fd(lb.watch);
+	close(lb.sock_fd);
+	lb.sock_fd = -1;
+	lb.watch = -1;
+	while(lb.count > 0) { // messages on the dead connection are failed, ticks send them again.
+		struct lb_request r = lb.pending[lb.head];
+		lb.head = (lb.head + 1) % LB_MAX_PENDING;
+		lb.count -= 1;
+		if(r.type == NOTI_CLASS_LOAD) on_class_load(r.arg, false, "");
+		else if(r.type == NOTI_SYNC) on_lb_sync(false, "");
+		else on_lb_reply(r.domPtr, r.type, false, "");
+	}
+}
+
+void on_lifecycle(hv_domain domPtr, int event);
+
 void init() {
 	statsPtr = NULL; // active dom list
+	pool_init(&dom_stat_pool, "domain stats", sizeof(struct doms_stats), 0);
+	hv_lifecycle = on_lifecycle;
 
-	conn = virConnectOpen("qemu:///system");
-	if(conn == NULL) {
+	if(hv->open("qemu:///system") != SUCCESS) {
 		fprintf(stderr, "Error Connecting Hypervisor\n");
 		exit(1);
 	}
-	printf("Connected to qemu:///system\n");
+	printf("Connected to %s hypervisor\n", hv->name);
 
-	my_doms.doms_count = virConnectListAllDomains(conn, &(my_doms.domains), 0); // flags = 0
+	my_doms.doms_count = hv->list_domains(&(my_doms.domains));
 	printf("No of domains: %d\n", my_doms.doms_count);
-	if(my_doms.doms_count == 0) {
+	if(my_doms.doms_count <= 0) {
 		fprintf(stderr, "Error no domains found\n");
 		exit(1);
 	}
-	if(my_doms.doms_count > 2) {
-		printf("Considering only two domains out of %d\n", my_doms.doms_count);
-		my_doms.doms_count = 2;
+	if(my_doms.doms_count > max_doms) {
+		printf("Considering only %d domains out of %d\n", max_doms, my_doms.doms_count);
+		my_doms.doms_count = max_doms;
 	}
 	for(int i = 0; i < my_doms.doms_count; i++) {
-		printf("Domain%d name: %s\n", i, virDomainGetName(my_doms.domains[i]));
+		printf("Domain%d name: %s\n", i, hv->domain_name(my_doms.domains[i]));
 	}
 	
-	load_bal_sock_fd = connect_to_load_balancer();
-	init_server();
+	if(hv->notify == NULL && !lb_connect()) exit(0); // simulation has its own load balancer model.
+	lb_view.IPs = malloc(my_doms.doms_count * sizeof(*lb_view.IPs));
+	lb_view.sent = malloc(my_doms.doms_count * sizeof(*lb_view.sent));
+	if(init_server() > 0 && lb.sock_fd >= 0) send_sync(); // full snapshot, load balancer agrees before first tick.
 	return;
 }
 
 void destroy() {
-	virConnectClose(conn);
+	save_checkpoint();
+	pool_report(stdout);
+	if(hv->notify == NULL) printf("Membership syncs: %ld full, %ld delta, %ld unchanged\n", lb_view.fulls, lb_view.deltas, lb_view.skipped);
+	if(drop_pct > 0) printf("Messages to load balancer dropped: %ld\n", lb_dropped);
+	hv->close();
 	printf("Server stopped\n");
 	return;
 }
 
-int connect_to_load_balancer() {
+int connect_to_load_balancer() {	// returns socket fd or -1.
 	struct sockaddr_in load_bal_address;
 
 	int sock_fd, flag;
@@ -208,309 +487,723 @@ int connect_to_load_balancer() {
 	flag = connect(sock_fd, (struct sockaddr *)&load_bal_address, sizeof(load_bal_address));
 	if(flag == -1) {
 		printf("Error conecting load balancer\n");
-		exit(0);
+		close(sock_fd);
+		return -1;
 	} else printf("Connected to load balancer\n");
 
 	return sock_fd;
 }
 
-int notify_load_balancer(virDomainPtr domPtr, int NOTI_TYPE) {
-	// printf("noti called\n");
-	static int msg_len = 50;
-	char *STR_SUCCESS = "SUCCESS";
-	char *STR_FAILED = "FAILED";
+void on_sigusr1(int sig) {
+	lb_dropping = !lb_dropping;
+}
+
+// message is lost on the way (bench/chaos), sender sees it as not sent and ticks try again.
+bool lb_drop() {
+	if(!lb_dropping || rand() % 100 >= drop_pct) return false;
+	lb_dropped += 1;
+	return true;
+}
 
-	char message[msg_len]; // use strtok and send space filled message.
+// send notification without waiting for the reply, on_lb_reply() handles it. FAILED means nothing was sent.
+int notify_load_balancer(hv_domain domPtr, int NOTI_TYPE) {
+	char message[LB_MSG_LEN]; // use strtok and send space filled message.
 
-	char *IP = NULL; // IP of domPtr
+	char IP[64]; // IP of domPtr
 	char *TYPE;
 
-	// printf("getting interfaces\n");
-	virDomainInterfacePtr *ifaces = NULL;
-	int ifaces_count;
-	do {
-		sleep(1);	// wait for a second don't busy wait.
-		ifaces_count = virDomainInterfaceAddresses(domPtr, &ifaces, 0, 0);
-	}while(ifaces == NULL);		// when machine is booting it gives NULL sometimes.
-	
-	if(ifaces_count < 0) {
-		printf("Error getting interfaces\n");
-		return FAILED;
-	}
-
-	virDomainIPAddressPtr ip_addr = ifaces[0]->addrs + 0; // only one interface hence ifaces[0] is used for VM IP. +0 for first entry of array of IPs of interface. 
-	
-	IP = ip_addr->addr;
-	if(IP == NULL) {
+	int found = hv->domain_ip(domPtr, IP, sizeof(IP));
+	if(found == HV_IP_PENDING) return FAILED; // machine is booting and has no address yet, next tick tries again.
+	if(found != HV_IP_FOUND) {
 		fprintf(stderr, "Error getting IP address\n");
 		return FAILED;
 	}
+	if(hv->notify != NULL) { // simulated load balancer answers at once.
+		int notified = hv->notify(domPtr, NOTI_TYPE, IP);
+		on_lb_reply(domPtr, NOTI_TYPE, notified == SUCCESS, "");
+		return SUCCESS;
+	}
+	if(lb.sock_fd < 0 || lb.count == LB_MAX_PENDING || lb_drop()) return FAILED;
 
-	IP = strcat(IP, ";");
 	if(NOTI_TYPE == NOTI_SCALE_OUT) {
-		TYPE = "SCALE_OUT;";
+		TYPE = "SCALE_OUT";
 	} else if(NOTI_TYPE == NOTI_SCALE_IN) {
-		TYPE = "SCALE_IN;";
-	} else if(NOTI_TYPE == NOTI_CONSISTENT) {
-		TYPE = "CONSISTENT;";
+		TYPE = "SCALE_IN";
+	} else {
+		TYPE = "OUTSTANDING";
 	}
-	printf("Notifying server IP:%s to load_balancer for NOTI_TYPE: %s\n", IP, TYPE);
+	if(NOTI_TYPE != NOTI_OUTSTANDING) printf("Notifying server IP:%s to load_balancer for NOTI_TYPE: %s\n", IP, TYPE);
 
-	strcpy(message, TYPE);
-	strcat(message, IP);	
+	memset(message, 0, LB_MSG_LEN);
+	snprintf(message, LB_MSG_LEN, "%s;%s;", TYPE, IP);
 
-	int flag = write(load_bal_sock_fd, message, msg_len);
-	if(flag != msg_len) {
+	int flag = write(lb.sock_fd, message, LB_MSG_LEN); // small message, fits socket buffer unless load balancer is stuck.
+	if(flag != LB_MSG_LEN) {
 		fprintf(stderr, "Error notifying\n");
+		if(flag > 0) lb_disconnected(); // stream is out of sync now.
 		return FAILED;
 	}
+	int tail = (lb.head + lb.count) % LB_MAX_PENDING;
+	lb.pending[tail].domPtr = domPtr;
+	lb.pending[tail].type = NOTI_TYPE;
+	lb.count += 1;
+	return SUCCESS;
+}
 
-	flag = read(load_bal_sock_fd, message, msg_len);
-	// printf("NOTI response from load balancer: %s, flag:%d, message length:%ld\n", message, flag, sizeof(message));
-	if(flag != msg_len) {
-		fprintf(stderr, "Error getting ACK\n");
-		return FAILED;
+void on_lb_readable(int id, int fd, int events, void *arg) {
+	while(true) {
+		int n = read(fd, lb.rbuff + lb.rlen, LB_MSG_LEN - lb.rlen);
+		if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			lb_disconnected();
+			return;
+		}
+		if(n < 0) return;
+		lb.rlen += n;
+		if(lb.rlen < LB_MSG_LEN) continue;
+		lb.rlen = 0;
+		if(lb.count == 0) {
+			fprintf(stderr, "Unexpected message from load balancer\n");
+			continue;
+		}
+		struct lb_request r = lb.pending[lb.head];
+		lb.head = (lb.head + 1) % LB_MAX_PENDING;
+		lb.count -= 1;
+		lb.rbuff[LB_MSG_LEN - 1] = '\0';
+		bool success = strncmp(lb.rbuff, "SUCCESS", strlen("SUCCESS")) == 0;
+		if(r.type == NOTI_CLASS_LOAD) {
+			on_class_load(r.arg, success, lb.rbuff);
+			continue;
+		}
+		if(r.type == NOTI_SYNC) {
+			on_lb_sync(success, lb.rbuff);
+			continue;
+		}
+		if(r.type != NOTI_OUTSTANDING) printf("NOTI %s\n", success? "SUCCESS": "FAILED");
+		on_lb_reply(r.domPtr, r.type, success, lb.rbuff);
 	}
-	
-	if(strncmp(message, STR_SUCCESS, strlen(STR_SUCCESS)) == 0) {
-		printf("NOTI SUCCESS\n");
-		return SUCCESS;
+}
+
+// ask load balancer for signal of class idx, not tied to a domain. returns true if sent.
+bool query_class_load(int idx) {
+	char message[LB_MSG_LEN];
+	if(lb.sock_fd < 0 || lb.count == LB_MAX_PENDING || lb_drop()) return false;
+	memset(message, 0, LB_MSG_LEN);
+	snprintf(message, LB_MSG_LEN, "CLASS_LOAD;%d;", idx);
+	int flag = write(lb.sock_fd, message, LB_MSG_LEN);
+	if(flag != LB_MSG_LEN) {
+		fprintf(stderr, "Error querying class load\n");
+		if(flag > 0) lb_disconnected();
+		return false;
 	}
-	printf("NOTI FAILED\n");
-	return FAILED;
+	int tail = (lb.head + lb.count) % LB_MAX_PENDING;
+	lb.pending[tail].domPtr = NULL;
+	lb.pending[tail].type = NOTI_CLASS_LOAD;
+	lb.pending[tail].arg = idx;
+	lb.count += 1;
+	return true;
 }
 
-unsigned long long int get_total_cpu_time(struct doms_stats* ptr) {
-	int nparams = virDomainGetCPUStats(ptr->domPtr, NULL, 0, -1, 1, 0); // nparams
-	virTypedParameterPtr params = calloc(nparams, sizeof(virTypedParameter));
-	virDomainGetCPUStats(ptr->domPtr, params, nparams, -1, 1, 0); // total stats.
-	
-	// printf("Printing parameters and value\n");
-	// for(int i = 0; i < nparams; i++) {
-	// 	printf("%s: %lld\n", params[i].field, params[i].value.ul); // this time is in nano seconds.
-	// }
-	return params[0].value.ul; // total cpu time in nano seconds since boot(system setup may be it depends).
+// "SUCCESS;<name>;<queued>;<p99_us>;<slo_us>;", FAILED means idx is past the last class.
+void on_class_load(int idx, bool success, char *message) {
+	struct class_load *c = &lb_classes[idx];
+	c->pending = false;
+	if(!success) {
+		if(message[0] != '\0' && idx < lb_class_count) lb_class_count = idx; // load balancer restarted with fewer classes.
+		return;
+	}
+	if(sscanf(message, "SUCCESS;%15[^;];%ld;%ld;%ld;", c->name, &c->queued, &c->p99_us, &c->slo_us) != 4) return;
+	if(idx >= lb_class_count) lb_class_count = idx + 1;
+}
+
+// ask for every known class and one more, so classes are found without configuring them here too.
+void refresh_class_load() {
+	if(hv->notify != NULL) return; // simulated load balancer has no classes.
+	for(int i = 0; i <= lb_class_count && i < MAX_CLASSES; i++) {
+		if(lb_classes[i].pending) continue;
+		lb_classes[i].pending = query_class_load(i);
+	}
+}
+
+// worst p99 / slo over classes having an SLO, 0 when none. *name is that class.
+double class_pressure(const char **name) {
+	double worst = 0;
+	*name = "";
+	for(int i = 0; i < lb_class_count; i++) {
+		struct class_load *c = &lb_classes[i];
+		if(c->slo_us <= 0 || 1.0 * c->p99_us / c->slo_us <= worst) continue;
+		worst = 1.0 * c->p99_us / c->slo_us;
+		*name = c->name;
+	}
+	return worst;
+}
+
+// notify once at a time per domain. returns true if sent.
+bool notify_dom(struct doms_stats *sptr, int NOTI_TYPE) {
+	bool *pending = NOTI_TYPE == NOTI_OUTSTANDING? &sptr->query_pending: &sptr->noti_pending;
+	if(*pending) return false;
+	*pending = true; // set first, simulated load balancer replies inside notify_load_balancer().
+	if(notify_load_balancer(sptr->domPtr, NOTI_TYPE) != SUCCESS) {
+		*pending = false;
+		return false;
+	}
+	return true;
+}
+
+static int view_find(char (*IPs)[LB_ADDR_LEN], int count, const char *IP) {
+	for(int i = 0; i < count; i++) {
+		if(strcmp(IPs[i], IP) == 0) return i;
+	}
+	return -1;
+}
+
+// SCALE_OUT/SCALE_IN went through, reply is "SUCCESS;<gen>;". view follows if it was one step behind, otherwise
+// something else changed load balancer and next SYNC is a full snapshot. old load balancer replies just SUCCESS.
+void lb_view_changed(hv_domain domPtr, bool added, char *message) {
+	char IP[64];
+	long gen = 0;
+	if(hv->notify != NULL || hv->domain_ip(domPtr, IP, sizeof(IP)) != HV_IP_FOUND) return;
+	sscanf(message, "SUCCESS;%ld;", &gen);
+	int i = view_find(lb_view.IPs, lb_view.count, IP);
+	if(added && i < 0 && lb_view.count < my_doms.doms_count) snprintf(lb_view.IPs[lb_view.count++], LB_ADDR_LEN, "%s", IP);
+	if(!added && i >= 0) memcpy(lb_view.IPs[i], lb_view.IPs[--lb_view.count], LB_ADDR_LEN);
+	lb_view.gen = lb_view.gen != 0 && (gen == lb_view.gen || gen == lb_view.gen + 1)? gen: 0;
+}
+
+// "SUCCESS;<gen>;<failed connects>;" or "FAILED;<gen>;" when delta was for an older generation.
+void on_lb_sync(bool success, char *message) {
+	long gen = 0;
+	int failed = 0;
+	lb_view.pending = false;
+	if(!success || sscanf(message, "SUCCESS;%ld;%d;", &gen, &failed) != 2 || failed > 0) {
+		if(success) printf("Load balancer could not connect %d server(s), sending full snapshot next\n", failed);
+		lb_view.gen = 0;
+		return;
+	}
+	if(gen != lb_view.gen) printf("Load balancer membership generation %ld, %d server(s)\n", gen, lb_view.sent_count);
+	memcpy(lb_view.IPs, lb_view.sent, lb_view.sent_count * sizeof(*lb_view.sent));
+	lb_view.count = lb_view.sent_count;
+	lb_view.gen = gen;
+}
+
+// one SYNC message for the whole fleet: header "SYNC;<base_gen>;<payload_len>;" and comma separated IPs. with a known
+// generation only the difference to lb_view goes ("+ip", "-ip"), base 0 sends everything: serving domains as they
+// are, domains being scaled out/in as "~ip" so load balancer leaves them alone.
+bool send_sync() {
+	int cap = my_doms.doms_count * (LB_ADDR_LEN + 2) + 1;
+	char message[LB_MSG_LEN + cap];
+	char *payload = message + LB_MSG_LEN;
+	bool full = lb_view.gen == 0 || lb_view.ticks >= SYNC_FULL_EVERY;
+	int len = 0, changes = 0;
+	lb_view.sent_count = 0;
+	for(struct doms_stats *sptr = statsPtr; sptr != NULL; sptr = sptr->next) {
+		char IP[64];
+		bool serving = sptr->notified == NOTI_DOM_CRT_SUCC;
+		bool moving = sptr->notified == NOTI_DOM_CRT_FAILD || sptr->notified == NOTI_DOM_SHTDWN_FAILD;
+		if((!serving && !moving) || hv->domain_ip(sptr->domPtr, IP, sizeof(IP)) != HV_IP_FOUND) continue;
+		if(serving) snprintf(lb_view.sent[lb_view.sent_count++], LB_ADDR_LEN, "%s", IP);
+		if(full) len += snprintf(payload + len, cap - len, "%s%s%s", len > 0? ",": "", serving? "": "~", IP);
+		else if(serving && view_find(lb_view.IPs, lb_view.count, IP) < 0) {
+			len += snprintf(payload + len, cap - len, "%s+%s", len > 0? ",": "", IP);
+			changes += 1;
+		}
+	}
+	for(int i = 0; !full && i < lb_view.count; i++) { // gone from serving set. moving ones are left to SCALE_IN.
+		if(view_find(lb_view.sent, lb_view.sent_count, lb_view.IPs[i]) >= 0) continue;
+		len += snprintf(payload + len, cap - len, "%s-%s", len > 0? ",": "", lb_view.IPs[i]);
+		changes += 1;
+	}
+	if(!full && changes == 0) {
+		lb_view.ticks += 1;
+		lb_view.skipped += 1;
+		return false; // nothing to say.
+	}
+
+	if(len > LB_SYNC_MAX_PAYLOAD) {
+		fprintf(stderr, "Membership of %d bytes is above %d, not sent\n", len, LB_SYNC_MAX_PAYLOAD);
+		return false;
+	}
+	if(lb.sock_fd < 0 || lb.count == LB_MAX_PENDING || lb_drop()) return false; // next tick tries again.
+	memset(message, 0, LB_MSG_LEN);
+	snprintf(message, LB_MSG_LEN, "SYNC;%ld;%d;", full? 0: lb_view.gen, len);
+	int flag = write(lb.sock_fd, message, LB_MSG_LEN + len);
+	if(flag != LB_MSG_LEN + len) {
+		fprintf(stderr, "Error sending membership\n");
+		if(flag > 0) lb_disconnected();
+		return false;
+	}
+	int tail = (lb.head + lb.count) % LB_MAX_PENDING;
+	lb.pending[tail].domPtr = NULL;
+	lb.pending[tail].type = NOTI_SYNC;
+	lb.count += 1;
+	lb_view.pending = true;
+	if(full) {
+		lb_view.ticks = 0;
+		lb_view.fulls += 1;
+	} else {
+		lb_view.ticks += 1;
+		lb_view.deltas += 1;
+	}
+	return true;
+}
+
+void on_lb_reply(hv_domain domPtr, int NOTI_TYPE, bool success, char *message) {
+	struct doms_stats *sptr = get_dom_stat(domPtr);
+	if(NOTI_TYPE == NOTI_OUTSTANDING) {
+		if(sptr == NULL) return;
+		sptr->query_pending = false;
+		if(!success) return;
+		long busy_permille = 0; // "SUCCESS;<count>;<queued>;<workers>;<busy_permille>;<rps>;<p99_us>;", older load balancer sends count only.
+		int n = sscanf(message, "SUCCESS;%ld;%ld;%ld;%ld;%ld;%ld;", &sptr->outstanding, &sptr->guest_queued, &sptr->guest_workers,
+			&busy_permille, &sptr->guest_rps, &sptr->guest_p99_us);
+		if(n == 6 && sptr->guest_workers > 0) {
+			sptr->guest_busy = busy_permille / 1000.0;
+			sptr->guest_at = now_seconds();
+		}
+		return;
+	}
+	if(sptr != NULL) sptr->noti_pending = false;
+
+	if(NOTI_TYPE == NOTI_SCALE_OUT) {
+		if(sptr == NULL || sptr->notified != NOTI_DOM_CRT_FAILD || !success) return; // load balancer could not connect yet, next tick tries again.
+		sptr->notified = NOTI_DOM_CRT_SUCC;
+		lb_view_changed(domPtr, true, message);
+		out_hold_until = hv->now() + out_cooldown; // let domain serve some requests.
+		if(in_hold_until < out_hold_until) in_hold_until = out_hold_until;
+		printf("Domain created: %s\n", hv->domain_name(domPtr));
+		return;
+	}
+	if(NOTI_TYPE == NOTI_SCALE_IN) {
+		if(sptr == NULL || sptr->notified != NOTI_DOM_SHTDWN_FAILD) return;
+		if(success && hv->shutdown(domPtr) == 0) { // 0: success
+			sptr->notified = NOTI_DOM_SHTDWN_SUCC; // entry is removed when domain has stopped.
+			lb_view_changed(domPtr, false, message);
+			in_hold_until = hv->now() + in_cooldown;
+			printf("Shutting down domain: %s\n", hv->domain_name(domPtr));
+		}
+		return; // otherwise next tick tries again.
+	}
 }
 
 unsigned long long int get_guest_cpu_time(struct doms_stats* ptr) {
-	int nparams = virDomainGetCPUStats(ptr->domPtr, NULL, 0, -1, 1, 0); // nparams
-	virTypedParameterPtr params = calloc(nparams, sizeof(virTypedParameter));
-	virDomainGetCPUStats(ptr->domPtr, params, nparams, -1, 1, 0); // total stats.
-	unsigned long long int guest_time = params[0].value.ul - (params[1].value.ul + params[2].value.ul);	// guest time = total - (user + system)
-	return guest_time > 0? guest_time: 0;	// somtimes guest time is -ve so to avoid overflow.
+	return hv->guest_cpu_time(ptr->domPtr);
 }
 
-unsigned long long int get_cpu_time_interval(struct doms_stats* ptr, int seconds) {
-	unsigned long long int begin = get_guest_cpu_time(ptr);
-	sleep(seconds);
-	unsigned long long int end = get_guest_cpu_time(ptr);
-	return (end - begin) > 0? end-begin: 0;
+double now_seconds() {
+	if(loop.virtual_clock) return hv->now();
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct host_stats *get_host(const char *name) {	// added on first use, NULL when table is full.
+	for(int i = 0; i < host_count; i++) {
+		if(strcmp(hosts[i].name, name) == 0) return &hosts[i];
+	}
+	if(host_count == MAX_HOSTS) return NULL;
+	struct host_stats *h = &hosts[host_count++];
+	memset(h, 0, sizeof(*h));
+	snprintf(h->name, sizeof(h->name), "%s", name);
+	h->util = -1;
+	return h;
 }
 
+// host is short of cpu: busy above HOST_BUSY_HIGH or some domain on it waits for cpu. another domain there only adds to the queue.
+bool host_oversubscribed(const char *name) {
+	struct host_stats *h = get_host(name);
+	return h != NULL && (h->util > HOST_BUSY_HIGH || h->starved > 0);
+}
+
+// cpu utilization of every host of my domains since previous tick, one query per host.
+void sample_hosts() {
+	bool sampled[MAX_HOSTS] = {false};
+	for(int i = 0; i < my_doms.doms_count && hv->host_cpu != NULL; i++) {
+		struct host_stats *h = get_host(hv->host_name(my_doms.domains[i]));
+		if(h == NULL || sampled[h - hosts]) continue;
+		sampled[h - hosts] = true;
+		h->steal = 0;
+		h->starved = 0;
+		struct hv_host_sample sample;
+		if(hv->host_cpu(my_doms.domains[i], &sample) != 0) {
+			h->util = -1;
+			continue;
+		}
+		if(h->total_ns > 0 && sample.total_ns > h->total_ns && sample.busy_ns >= h->busy_ns) {
+			h->util = 1.0 * (sample.busy_ns - h->busy_ns) / (sample.total_ns - h->total_ns);
+		}
+		h->busy_ns = sample.busy_ns;
+		h->total_ns = sample.total_ns;
+	}
+}
+
+/*
+take one cpu sample of every serving domain, no waiting: usage is the difference to previous tick's sample. vCPU stats
+of all serving domains come in one query: run time per vCPU is what the domain got and steal time is what it wanted
+on top but its host had no cpu for. demand (run + steal) decides the load, a domain with high steal is host starved
+rather than busy and scale_out() keeps away from its host.
+*/
 int analyse_cpu_usage() {
 
 	double avg_cpu_per = 0;
-	int dom_count = 0;
-	struct doms_stats *ptr = statsPtr;
-	while(ptr != NULL) {
-		/*	
-		dont't include those VMs which are created but not notifed in calculation.
-		*/	
-		if(ptr->notified == NOTI_DOM_CRT_FAILD) {
-			ptr = ptr->next;
-			continue; // since it is booting so don't include.
+	int dom_count = 0, starved = 0;
+	long queued = 0, workers = 0; // of domains with fresh load report.
+	double now = now_seconds();
+	sample_hosts();
+
+	struct doms_stats *serving[my_doms.doms_count];
+	hv_domain doms[my_doms.doms_count];
+	struct hv_vcpu_sample vcpu[my_doms.doms_count];
+	int n = 0;
+	for(struct doms_stats *ptr = statsPtr; ptr != NULL && n < my_doms.doms_count; ptr = ptr->next) {
+		if(ptr->notified != NOTI_DOM_CRT_SUCC) continue; // booting or going away so don't include.
+		serving[n] = ptr;
+		doms[n++] = ptr->domPtr;
+	}
+	if(n > 0 && (hv->vcpu_stats == NULL || hv->vcpu_stats(doms, n, vcpu) != 0)) memset(vcpu, 0, n * sizeof(*vcpu)); // one number per domain.
+
+	for(int k = 0; k < n; k++) {
+		struct doms_stats *ptr = serving[k];
+		int vcpus = vcpu[k].vcpus;
+		unsigned long long int cpu = vcpus > 0? vcpu[k].run_ns: get_guest_cpu_time(ptr);
+		if(ptr->sample_at == 0 || now <= ptr->sample_at || cpu < ptr->sample_cpu || vcpus != ptr->vcpus) { // first sample, domain restarted or vCPUs changed, nothing to compare with.
+			ptr->sample_cpu = cpu;
+			ptr->sample_steal = vcpu[k].steal_ns;
+			ptr->vcpus = vcpus;
+			ptr->sample_at = now;
+			ptr->steal = 0;
+			continue;
 		}
+		double elapsed = now - ptr->sample_at;
+		int per = vcpus > 0? vcpus: 1;
 		ptr->llast = ptr->last;
 		ptr->last = ptr->current;
-		ptr->current = get_cpu_time_interval(ptr, 1); // 1000 msec. if sleeping for n seconds divide time difference by n during calulation.
+		ptr->current = (cpu - ptr->sample_cpu) / elapsed / per; // cpu nano seconds per second and vCPU since last tick.
+		ptr->steal = vcpu[k].steal_ns >= ptr->sample_steal? (vcpu[k].steal_ns - ptr->sample_steal) / elapsed / per / 1e9: 0;
+		ptr->sample_cpu = cpu;
+		ptr->sample_steal = vcpu[k].steal_ns;
+		ptr->sample_at = now;
 
 		double avg_cpu_time = 0.20*(ptr->llast / 1.0e9) + 0.40*(ptr->last / 1.0e9) + 0.40*(ptr->current / 1.0e9); // divide by nano sec to get time spend per second.
-		double cur_cpu_per = avg_cpu_time / 1.00;	// our thread sleeps for 1.2 sec (that difference between two reading but thread nearly sleeps for 1 sec.)
+		double cur_cpu_per = avg_cpu_time / 1.00;
 		// time difference is actually sum of time difference of all the CPUs allocated so if you allocated more than one CPUs then dynamically check how many CPUs allocated
 		// to domain currently and then divide by that. NOTE: if one cpu is allocated cur_per == 1.0(approx) if 2 CPUs allocated to domain cur_per = 2.0(approx).
 		// if both VMs runs together then one CPU is allocated to each because there are not enough CPUs(PC has total 4 hence 3 cannot be allocated to VMs) so cur_per for both VMs is 1.0(approx).
 
 		ptr->cpu_percent = 0.00 * ptr->cpu_percent + 1.00 * cur_cpu_per; // considering long history with small factor.
-		avg_cpu_per += ptr->cpu_percent;
+		double demand = ptr->cpu_percent + ptr->steal;
+		struct host_stats *h = get_host(hv->host_name(ptr->domPtr));
+		if(h != NULL && ptr->steal > h->steal) h->steal = ptr->steal;
+		if(ptr->steal > STEAL_HIGH) {
+			if(h != NULL) h->starved += 1;
+			starved += 1;
+		}
+		if(ptr->guest_at > 0 && now - ptr->guest_at < GUEST_REPORT_MAX_AGE) { // server knows better how busy it is.
+			ptr->cpu_percent = ptr->guest_busy;
+			demand = ptr->guest_busy; // wall clock busy of workers, steal is in it already.
+			queued += ptr->guest_queued;
+			workers += ptr->guest_workers;
+			printf("Domain: %s, %%busy : %lf, queued: %ld, req/sec: %ld, compute p99: %ld us\n", hv->domain_name(ptr->domPtr),
+				ptr->cpu_percent * 100, ptr->guest_queued, ptr->guest_rps, ptr->guest_p99_us);
+		} else if(ptr->steal > 0) {
+			printf("Domain: %s, %%cpu : %lf, %%steal : %lf, vcpus: %d\n", hv->domain_name(ptr->domPtr), ptr->cpu_percent * 100, ptr->steal * 100, vcpus);
+		} else printf("Domain: %s, %%cpu : %lf\n", hv->domain_name(ptr->domPtr), ptr->cpu_percent * 100);
+		avg_cpu_per += demand;
 		dom_count += 1;
-
-		printf("Domain: %s, %%cpu : %lf\n", virDomainGetName(ptr->domPtr), ptr->cpu_percent * 100);
-		ptr = ptr->next;
 	}
 
-	avg_cpu_per /= dom_count;
+	for(int i = 0; i < host_count; i++) {
+		if(hosts[i].util < 0 && hosts[i].starved == 0) continue; // nothing known.
+		printf("Host: %s, %%cpu : %.1lf, max %%steal : %.1lf, starved domains: %d\n", hosts[i].name, hosts[i].util * 100, hosts[i].steal * 100, hosts[i].starved);
+	}
+	if(starved > 0) printf("%d domain(s) host starved, cpu demand includes their steal time\n", starved);
+	if(dom_count > 0) avg_cpu_per /= dom_count;
 	printf("Number of doms: %d, 	avg %%cpu %lf\n", dom_count, avg_cpu_per * 100);
+	avg_cpu = avg_cpu_per;
+	serving_count = dom_count;
+
+	if(workers > 0 && 1.0 * queued / workers > GUEST_QUEUE_HIGH) {
+		printf("Guests queue %.1lf requests per worker\n", 1.0 * queued / workers);
+		return CPU_USAGE_HIGH;
+	}
 
 	if(avg_cpu_per > 0.80) return CPU_USAGE_HIGH;
 	if(avg_cpu_per > 0.40) return CPU_USAGE_MOD;
 	return CPU_USAGE_LOW;
 }
 
-void stablize_cpu_usage(int rounds) {
-	for(int i = 0; i < rounds; i++) {
-		analyse_cpu_usage();
-	}
-}
-
-bool is_noti_dom_crt_faild() {	// check already created but not notified doms
+bool is_noti_dom_crt_faild() {	// check already created but not notified doms, sample ticks keep notifying them.
 	struct doms_stats* sptr = statsPtr;
 	while(sptr != NULL) {
-		if(sptr->notified == NOTI_DOM_CRT_FAILD) {
-			int notified = notify_load_balancer(sptr->domPtr, NOTI_SCALE_OUT); // start sending request to this.
-			if(notified == SUCCESS) {
-				sptr->notified = NOTI_DOM_CRT_SUCC;
-				// just wait for sometime let domain serve some requests.
-				stablize_cpu_usage(5);
-			}
-			return true;
-		}
+		if(sptr->notified == NOTI_DOM_CRT_FAILD) return true;
 		sptr = sptr->next;
 	}
 	return false;
 }
 
+/*
+step scale out: start as many domains as bring average cpu of the fleet to SCALE_TARGET_CPU, counting the ones still
+booting as capacity on the way, at most max_surge booting at once. they boot in parallel and sample ticks notify each
+to load balancer as soon as it answers, so recovering from a spike takes one boot instead of one boot per domain.
+*/
 void scale_out() {
-	
-	if(is_noti_dom_crt_faild() == true) return; // make sure all the created doms are notified before creating any new dom.
-
-	// create new domain
-	printf("Finding new domain to start.\n");
-	virDomainPtr domPtr = NULL;
+	int booting = 0, idle = 0, crowded = 0;
+	for(struct doms_stats* sptr = statsPtr; sptr != NULL; sptr = sptr->next) {
+		if(sptr->notified == NOTI_DOM_CRT_FAILD) booting += 1;
+	}
 	for(int i = 0; i < my_doms.doms_count; i++) {
-		if(virDomainIsActive(my_doms.domains[i]) == 0 && 	// 0: inactive  1: active  -1: error.
-			virDomainCreate(my_doms.domains[i]) == 0) { 	// 0: success.
-				domPtr = my_doms.domains[i];
-				break;
-		}
+		if(hv->is_active(my_doms.domains[i]) != 0) continue;
+		if(host_oversubscribed(hv->host_name(my_doms.domains[i]))) crowded += 1; // would take cpu from domains already there.
+		else idle += 1;
 	}
-	if(domPtr == NULL) {
-		printf("Not enough domains to scale out\n");
+	double needed = serving_count * (avg_cpu > SCALE_SATURATED_CPU? 2: avg_cpu / SCALE_TARGET_CPU);
+	int want = (int)ceil(needed) - serving_count;
+	if(want < 1) want = 1; // high by class latency while cpu looks fine, or nobody serving yet.
+	want -= booting;
+	if(want > max_surge - booting) want = max_surge - booting;
+	if(want <= 0) return; // enough is booting already.
+	if(want > idle) want = idle;
+	if(want == 0) {
+		if(crowded > 0) printf("Not scaling out, hosts of %d idle domain(s) are oversubscribed\n", crowded);
+		else printf("Not enough domains to scale out\n");
 		return;
 	}
-	printf("Got new domain to scale out\n");
-	struct doms_stats* sptr = insert_dom_stat(domPtr);
-	// sleep(20); // wait notify give segmentation fault while reading interfaces when machine is booting.
-	int notified = notify_load_balancer(sptr->domPtr, NOTI_SCALE_OUT); // start sending request to this.
-	if(notified == SUCCESS) {
-		sptr->notified = NOTI_DOM_CRT_SUCC;
-		stablize_cpu_usage(5);
-		printf("Domain created: %s\n", virDomainGetName(domPtr));
-	} else {
-		sptr->notified = NOTI_DOM_CRT_FAILD;
+
+	printf("Scale out: %d serving at %.0lf%% cpu, %d booting, starting %d\n", serving_count, avg_cpu * 100, booting, want);
+	int started = 0;
+	for(int i = 0; i < my_doms.doms_count && started < want; i++) {
+		if(hv->is_active(my_doms.domains[i]) != 0 || 	// 0: inactive  1: active  -1: error.
+			host_oversubscribed(hv->host_name(my_doms.domains[i])) ||
+			hv->create(my_doms.domains[i]) != 0) continue; 	// 0: success.
+		printf("Got new domain to scale out: %s\n", hv->domain_name(my_doms.domains[i]));
+		struct doms_stats* sptr = insert_dom_stat(my_doms.domains[i]);
+		notify_dom(sptr, NOTI_SCALE_OUT); // usually no IP yet, sample ticks retry until load balancer is connected.
+		started += 1;
 	}
+	if(started == 0) printf("Not enough domains to scale out\n");
+	high_count = 0;
 	return;
 }
 
+// ask load balancer for outstanding requests of serving domains, answers are used by next victim selection.
+void refresh_outstanding() {
+	for(struct doms_stats* sptr = statsPtr; sptr != NULL; sptr = sptr->next) {
+		if(sptr->notified != NOTI_DOM_CRT_SUCC) continue;
+		if(hv->outstanding != NULL) sptr->outstanding = hv->outstanding(sptr->domPtr);
+		else notify_dom(sptr, NOTI_OUTSTANDING);
+	}
+}
 
-void scale_in() {
-	// check already stopped but not notified doms
+// score every serving domain and return the one whose removal disturbs least, NULL if some domain is still shutting down.
+hv_domain pick_scale_in_victim() {
+	hv_domain candidates[my_doms.doms_count];
+	int count = 0;
+	for(int i = 0; i < my_doms.doms_count; i++) {
+		if(hv->is_active(my_doms.domains[i]) != 1) continue;
+		struct doms_stats* sptr = get_dom_stat(my_doms.domains[i]);
+		if(sptr == NULL) return NULL; // wait until lifecycle event or consistency tick adds it.
+		if(sptr->notified == NOTI_DOM_CRT_SUCC) candidates[count++] = my_doms.domains[i];
+	}
 
+	hv_domain victim = NULL;
+	double best = 0;
+	time_t now = hv->now();
+	for(int i = 0; i < count; i++) {
+		struct doms_stats* sptr = get_dom_stat(candidates[i]);
+		const char *host = hv->host_name(candidates[i]);
+		int host_doms = 0;
+		for(int j = 0; j < count; j++) {
+			if(strcmp(hv->host_name(candidates[j]), host) == 0) host_doms += 1;
+		}
+		long outstanding = sptr->outstanding;
+		double uptime = difftime(now, sptr->started_at);
+
+		double load = sptr->cpu_percent;
+		double disruption = outstanding < OUTSTANDING_NORM? 1.0 * outstanding / OUTSTANDING_NORM: 1.0;
+		double warmth = uptime < WARM_SECONDS? uptime / WARM_SECONDS: 1.0;
+		double packing = host_oversubscribed(host)? 1.0: 1.0 - 1.0 / host_doms; // 0 when domain is alone on its host, removing one from a starved host gives cpu back to the rest.
+		double score = VICTIM_W_LOAD * load + VICTIM_W_OUTSTANDING * disruption + VICTIM_W_UPTIME * warmth + VICTIM_W_PACKING * packing;
+		printf("Scale in candidate: %s, host: %s, %%cpu: %.1lf, outstanding: %ld, uptime: %.0lf s, score: %.3lf\n",
+			hv->domain_name(candidates[i]), host, load * 100, outstanding, uptime, score);
+		if(victim == NULL || score < best) {
+			victim = candidates[i];
+			best = score;
+		}
+	}
+	return victim;
+}
+
+void scale_in() {
 	if(is_noti_dom_crt_faild() == true) return; // all domain created must be notified before shuting down any random domain. it might be possible avg usage is low and connected one is shutdown.
 
 	struct doms_stats* sptr = statsPtr;
 	while(sptr != NULL) {
-		if(sptr->notified == NOTI_DOM_SHTDWN_FAILD) {
-			int notified = notify_load_balancer(sptr->domPtr, NOTI_SCALE_IN); // stop sending request to this.
-
-			if(notified == SUCCESS && 
-				virDomainShutdown(sptr->domPtr) == 0) { // 0: success
-					delete_dom_stat(sptr->domPtr);
-					printf("Shutting down domain: %s\n", virDomainGetName(sptr->domPtr));
-					stablize_cpu_usage(3);
-			}
-			return; // don't shutdown if any one noti is pending.
+		if(sptr->notified == NOTI_DOM_SHTDWN_FAILD || sptr->notified == NOTI_DOM_SHTDWN_SUCC) {
+			return; // don't shutdown if any one noti is pending or previous domain is still stopping.
 		}
 		sptr = sptr->next;
 	}
-	if(virConnectNumOfDomains(conn) <= 1) { // number of active domains. don't stop all the domains.
+	if(hv->num_active() <= 1) { // number of active domains. don't stop all the domains.
 		return;
 	}
 
-	virDomainPtr domPtr = NULL;
-	for(int i = 0; i < my_doms.doms_count; i++) {
-		if(virDomainIsActive(my_doms.domains[i]) == 1) { 	// virDomainState see the state it should not be shuting down state. but I am using doms_stats list to verify this.
-				domPtr = my_doms.domains[i]; 			// get any one domain to shutdown.
-				struct doms_stats* tmp = get_dom_stat(domPtr);
-				if(tmp == NULL) return; // wait until machine properly shutdown because entry is only deleted when machine is being shutdown.
-				break;
-		} 
-	}
-	int notified = notify_load_balancer(domPtr, NOTI_SCALE_IN); // inform to stop sending request
+	hv_domain domPtr = pick_scale_in_victim();
+	if(domPtr == NULL) return;
+	printf("Scale in victim: %s\n", hv->domain_name(domPtr));
 	sptr = get_dom_stat(domPtr);
 	sptr->notified = NOTI_DOM_SHTDWN_FAILD; // if noti success and domain shutdown success then only remove entry from live servers
-	if(notified == SUCCESS && 
-		virDomainShutdown(domPtr) == 0) { // 0: success
-			delete_dom_stat(domPtr);
-			printf("Shutting down domain: %s\n", virDomainGetName(domPtr));
-			stablize_cpu_usage(3);
-	}
+	notify_dom(sptr, NOTI_SCALE_IN); // inform to stop sending request, shutdown follows the reply.
+	low_count = 0;
 	return;
 }
 
-
-void *maintain_consistency(void *args) {
-	
-	while(true) {
-		sleep(10);
-		for(int i = 0; i < my_doms.doms_count; i++) {
-			if(virDomainIsActive(my_doms.domains[i]) == 1) { // nofify that is it connected or not.
-				virDomainPtr domPtr = my_doms.domains[i];
-				int notified = notify_load_balancer(domPtr, NOTI_CONSISTENT);
-				if(notified == SUCCESS) {
-					struct doms_stats *sptr = get_dom_stat(domPtr);
-					if(sptr == NULL) { // live but not in the live list add it. should never occur though.
-						sptr = insert_dom_stat(domPtr);
-						printf("Inconsistency resolved domain: %s added to live list\n", virDomainGetName(sptr->domPtr));
-					} else if(sptr->notified == NOTI_DOM_CRT_FAILD) {
-						printf("Inconsistency resolved idle domain: %s notified to load balancer\n", virDomainGetName(sptr->domPtr));
-					}
-					sptr->notified = NOTI_DOM_CRT_SUCC;
-				} else {
-					// domain might be booting up. don't do anything.
-				}
-			}
+// push notifications that have not gone through yet and drop domains that finished stopping.
+void retry_notifications() {
+	struct doms_stats* sptr = statsPtr;
+	while(sptr != NULL) {
+		struct doms_stats* next = sptr->next;
+		if(sptr->notified == NOTI_DOM_CRT_FAILD) {
+			notify_dom(sptr, NOTI_SCALE_OUT); // start sending request to this.
+		} else if(sptr->notified == NOTI_DOM_SHTDWN_FAILD) {
+			notify_dom(sptr, NOTI_SCALE_IN); // stop sending request to this.
+		} else if(sptr->notified == NOTI_DOM_SHTDWN_SUCC && hv->is_active(sptr->domPtr) == 0) {
+			delete_dom_stat(sptr->domPtr); // backend without lifecycle events.
 		}
+		sptr = next;
 	}
 }
 
+void on_sample_tick(int id, void *arg) {
+	retry_notifications();
+	if(hv->outstanding == NULL) refresh_outstanding(); // load reports of guests come with the answers, used by next tick.
+	int load = analyse_cpu_usage();
+	const char *cls;
+	double pressure = class_pressure(&cls); // answers of previous tick.
+	refresh_class_load();
+	if(pressure > CLASS_OVER_SLO && load != CPU_USAGE_HIGH) {
+		printf("Class %s p99 at %.0lf%% of its SLO\n", cls, pressure * 100);
+		load = CPU_USAGE_HIGH;
+	} else if(pressure > CLASS_NEAR_SLO && load == CPU_USAGE_LOW) {
+		load = CPU_USAGE_MOD;
+	}
+	time_t now = hv->now();
+
+	if(load == CPU_USAGE_HIGH) {
+		printf("CPU Usage High\n");
+		if(now < out_hold_until) return; // load is settling after last scale out.
+		low_count = 0;
+		high_count += 1;
+		if(high_count > HIGH_PATIENCE)
+			scale_out(); // increase resources
+
+	} else if(load == CPU_USAGE_LOW) {
+		printf("CPU Usage Low\n");
+		if(now < in_hold_until) return;
+		high_count = 0;
+		low_count += 1;
+		if(low_count == LOW_PATIENCE) refresh_outstanding(); // answers arrive before next tick.
+		if(low_count > LOW_PATIENCE)
+			scale_in();
 
-void main() {
-	
-	init();
+	} else {
+		printf("CPU Usage Moderate\n");
+		low_count = 0;
+		high_count = 0;
+	}
+}
 
-	pthread_t const_thread;
-	pthread_create(&const_thread, NULL, &maintain_consistency, NULL);
+// reconcile load balancer with the domains, one SYNC message (or none) however many domains there are.
+void on_consistency_tick(int id, void *arg) {
+	if(lb.sock_fd < 0 && !lb_connect()) return;
+	for(int i = 0; i < my_doms.doms_count; i++) {
+		if(hv->is_active(my_doms.domains[i]) != 1 || get_dom_stat(my_doms.domains[i]) != NULL) continue;
+		printf("Inconsistency resolved domain: %s added to live list\n", hv->domain_name(my_doms.domains[i]));
+		insert_dom_stat(my_doms.domains[i]); // running but unknown, sample ticks send its SCALE_OUT.
+	}
+	if(lb_view.pending) return;
+	for(int i = 0; i < lb.count; i++) { // generation moves with their replies, snapshot waits for them.
+		int type = lb.pending[(lb.head + i) % LB_MAX_PENDING].type;
+		if(type == NOTI_SCALE_OUT || type == NOTI_SCALE_IN) return;
+	}
+	send_sync();
+}
 
-	int HIGH_PATIENCE = 3;
-	int LOW_PATIENCE = 3;
+void on_checkpoint_tick(int id, void *arg) {
+	save_checkpoint();
+}
 
-	int high_count = 0;
-	int low_count = 0;
-	while(true) {
-		int load = analyse_cpu_usage();
-		if(load == CPU_USAGE_HIGH) {
-			printf("CPU Usage High\n");
-			low_count = 0;
-			high_count += 1;
-			if(high_count > HIGH_PATIENCE)
-				scale_out(); // increase resources
-
-		} else if(load == CPU_USAGE_LOW) {
-			printf("CPU Usage Low\n");
-			high_count = 0;
-			low_count += 1;
-			if(low_count > LOW_PATIENCE)
-				scale_in();
-	
-		} else {
-			printf("CPU Usage Moderate\n");
-			low_count = 0;
-			high_count = 0;
+void on_report_tick(int id, void *arg) {
+	pool_report(stdout); // leak accounting every minute.
+}
+
+void on_lifecycle(hv_domain domPtr, int event) {	// domain started or stopped, also by someone else than autoscaler.
+	bool mine = false;
+	for(int i = 0; i < my_doms.doms_count; i++) {
+		if(my_doms.domains[i] == domPtr) mine = true;
+	}
+	if(!mine) return;
+	struct doms_stats *sptr = get_dom_stat(domPtr);
+	if(event == HV_EVENT_STARTED && sptr == NULL) {
+		printf("Domain started outside autoscaler: %s\n", hv->domain_name(domPtr));
+		insert_dom_stat(domPtr);
+	} else if(event == HV_EVENT_STOPPED && sptr != NULL) {
+		if(sptr->notified != NOTI_DOM_SHTDWN_SUCC) printf("Domain stopped unexpectedly: %s\n", hv->domain_name(domPtr)); // health checks of load balancer eject it.
+		else printf("Domain stopped: %s\n", hv->domain_name(domPtr));
+		delete_dom_stat(domPtr);
+	}
+}
+
+
+void parse_args(int argc, char *argv[]) {
+	hv = NULL;
+	int opt;
+	while((opt = getopt(argc, argv, "sm:t:D:p:c:b:H:C:U:O:I:Vk:l:A:x:")) != -1) {
+		switch(opt) {
+			case 's': hv = &hv_sim; break; // simulation, no libvirt.
+			case 'm': max_doms = atoi(optarg); sim_cfg.doms_count = local_cfg.doms_count = max_doms; break;
+			case 't': sim_cfg.trace_file = optarg; break; // trace of "<second> <req/sec>" lines.
+			case 'D': sim_cfg.duration = atof(optarg); break; // virtual seconds to simulate.
+			case 'p': sim_cfg.peak_rps = atof(optarg); break;
+			case 'c': sim_cfg.cost_ms = atof(optarg); break;
+			case 'b': sim_cfg.boot_seconds = local_cfg.boot_seconds = atof(optarg); break;
+			case 'H': sim_cfg.hosts = atoi(optarg); break; // simulated hosts, domains are spread round robbin.
+			case 'C': sim_cfg.host_cpus = atof(optarg); break; // cpus of each simulated host.
+			case 'U': max_surge = atoi(optarg) > 0? atoi(optarg): 1; break;
+			case 'O': out_cooldown = atoi(optarg); break;
+			case 'I': in_cooldown = atoi(optarg); break;
+			case 'k': checkpoint_path = optarg; break; // state file for fast restart.
+			case 'l': hv = &hv_local; local_cfg.server = optarg; break; // domains are server processes on this host (hv_local.h).
+			case 'A': local_cfg.server_args = optarg; break;
+			case 'x': drop_pct = atoi(optarg); break;
+#ifndef HV_SIM_ONLY
+			case 'V': lv_use_vsock = true; break; // load balancer reaches servers over vsock.
+#endif
+			default:
+				fprintf(stderr, "Usage: %s [-m max_domains] [-U max_surge] [-O out_cooldown] [-I in_cooldown] [-V] [-k checkpoint_file] [-l server_path [-A server_args] [-b boot_seconds]] [-x drop_pct] [-s [-t trace_file] [-D sim_seconds] [-p peak_rps] [-c cost_ms] [-b boot_seconds] [-H hosts] [-C host_cpus]]\n", argv[0]);
+				exit(1);
 		}
-		sleep(5);
 	}
+#ifdef HV_SIM_ONLY
+	if(hv == NULL) hv = &hv_sim;
+#else
+	if(hv == NULL) hv = &hv_libvirt;
+#endif
+}
+
+void main(int argc, char *argv[]) {
+	
+	parse_args(argc, argv);
+	if(drop_pct > 0) signal(SIGUSR1, on_sigusr1); // chaos runs turn message loss on and off.
+	loop_init(hv == &hv_sim, hv->sleep, hv->now); // simulation runs the loop on its virtual clock.
+	init();
+
+	loop_add_timer(SAMPLE_INTERVAL, on_sample_tick, NULL);
+	if(checkpoint_path != NULL) loop_add_timer(SAMPLE_INTERVAL, on_checkpoint_tick, NULL);
+	if(hv->notify == NULL) { // simulated load balancer never gets inconsistent.
+		loop_add_timer(CONSISTENCY_INTERVAL, on_consistency_tick, NULL);
+		loop_add_timer(REPORT_INTERVAL, on_report_tick, NULL);
+	}
+	loop_run();
 
 	// close(sock_fd);
 	destroy();
 	
-}
\ No newline at end of file
+}
@@ -0,0 +1,371 @@
+/*
+Chaos benchmark of the scaling loop. Runs load balancer, autoscaler with local domains (autoscaler_sim -l, see
+hv_local.h) and servers on this host, breaks one thing per run and follows load balancer STATUS every 100 ms to see
+how fast it is noticed and repaired. Output is one JSON object per run:
+  {"scenario":"kill_server","run":1,"rps":60,"detect_ms":12,"recover_ms":6210,"lost":0,"retries":31,
+   "unanswered":0,"dip_pct":48.0,"peak_in_flight":120}
+scenarios:
+  kill_server   two servers serving, one gets SIGKILL (crashed VM). noticed when load balancer ejects it,
+                autoscaler has to start it again if the other can't carry the load.
+  stall_server  two servers serving, one gets SIGSTOP for -t seconds (hung guest, its socket stops moving) and then
+                SIGCONT. noticed when health checks open its circuit.
+  drop_control  one server at -l load, load steps up to -R and autoscaler loses every message to load balancer for
+                -t seconds. noticed when autoscaler starts a domain, repaired when load balancer serves from it.
+  boot_delay    load steps up like drop_control, nothing lost but new domain boots for -b seconds.
+detect_ms and recover_ms count from the fault, -1 when it did not happen within -o seconds. recovered is the first
+second from which served req/sec stays at 90% of sent for a whole second (and, for the two scale out scenarios, load
+balancer has two servers). lost is requests load balancer gave up, unanswered is sent minus served minus still in
+flight over the run (lost ones included, anything else vanished), dip_pct is the worst second of served against sent.
+
+usage: bench/chaos [-s scenario,...] [-n runs] [-r rps] [-l low_rps] [-R step_rps] [-w warmup_s] [-o observe_s]
+                   [-t fault_s] [-b boot_s] [-A server_args]
+from repo root after make load_balancer server autoscaler_sim bench/chaos. ports 8081, 8082 (servers), 8181 and
+8282 (load balancer) must be free. defaults need a few cores: servers run the reference prime loop (-k ref, ~20 ms
+per request) with one worker, so one server carries ~50 req/sec.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SAMPLE_MS 100
+#define MAX_SAMPLES 10000
+#define RECOVER_RATIO 0.9 // served against sent in one second.
+#define READY_TIMEOUT_S 30
+#define SERVER_BASE_PORT 8081 // same as hv_local.h.
+#define CONTROL_PORT 8282
+
+enum {KILL_SERVER, STALL_SERVER, DROP_CONTROL, BOOT_DELAY, SCENARIOS};
+const char *scenario_names[SCENARIOS] = {"kill_server", "stall_server", "drop_control", "boot_delay"};
+
+struct sample {
+	double t; // seconds from fault, negative during warmup.
+	long sent, served, retries, lost;
+	int servers, open, in_flight;
+	bool started; // second domain has a server process.
+};
+
+struct chaos_config {
+	bool run[SCENARIOS];
+	int runs;
+	double rps; // steady load, two servers at ~60% cpu.
+	double low_rps; // warmup of scale out scenarios, one server at ~40% cpu so that nothing scales out yet.
+	double step_rps; // after the step, one server at ~90% cpu, scales out.
+	double warmup_s;
+	double observe_s;
+	double fault_s; // stall and message loss.
+	double boot_s;
+	char *server_args;
+} cfg = {
+	.run = {true, true, true, true},
+	.runs = 3,
+	.rps = 60,
+	.low_rps = 20,
+	.step_rps = 45,
+	.warmup_s = 10,
+	.observe_s = 40,
+	.fault_s = 5,
+	.boot_s = 5,
+	.server_args = "-t 1 -w 1 -k ref",
+};
+
+char root[PATH_MAX]; // repo root, binaries are there.
+struct sample samples[MAX_SAMPLES];
+int n_samples;
+
+double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// fork and exec argv in directory dir with stdout and stderr to out. returns pid.
+pid_t spawn(char **argv, const char *dir, const char *out) {
+	pid_t pid = fork();
+	if(pid != 0) return pid;
+	if(dir != NULL && chdir(dir) != 0) _exit(1);
+	int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd >= 0) {
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+	execv(argv[0], argv);
+	_exit(1);
+}
+
+// server of domain local-<idx + 1> started like hv_local.h does, autoscaler adopts it as running domain.
+pid_t start_server(int idx) {
+	char dir[32], path[64], port[16], args[256], server[PATH_MAX + 16], *argv[32];
+	int argc = 0;
+	snprintf(dir, sizeof(dir), "local-%d", idx + 1);
+	snprintf(port, sizeof(port), "%d", SERVER_BASE_PORT + idx);
+	snprintf(server, sizeof(server), "%s/server", root);
+	snprintf(args, sizeof(args), "%s", cfg.server_args);
+	mkdir(dir, 0755);
+	argv[argc++] = server;
+	argv[argc++] = "-p";
+	argv[argc++] = port;
+	for(char *arg = strtok(args, " "); arg != NULL && argc < 31; arg = strtok(NULL, " ")) argv[argc++] = arg;
+	argv[argc] = NULL;
+	pid_t pid = spawn(argv, dir, "server.out");
+	snprintf(path, sizeof(path), "%s/server.pid", dir);
+	FILE *fp = fopen(path, "w");
+	if(fp != NULL) {
+		fprintf(fp, "%d\n", pid);
+		fclose(fp);
+	}
+	return pid;
+}
+
+pid_t server_pid(int idx) {	// 0 when domain has no server process.
+	char path[64];
+	int pid = 0;
+	snprintf(path, sizeof(path), "local-%d/server.pid", idx + 1);
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL) return 0;
+	if(fscanf(fp, "%d", &pid) != 1) pid = 0;
+	fclose(fp);
+	return pid;
+}
+
+int control_connect() {	// load balancer control socket, -1 while it is not up.
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(CONTROL_PORT)};
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) return fd;
+	close(fd);
+	return -1;
+}
+
+// send one command and read its one line answer into reply. false when load balancer is gone.
+bool control_command(int fd, const char *cmd, char *reply, int len) {
+	if(write(fd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd)) return false;
+	int got = 0;
+	while(got < len - 1) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		if(poll(&pfd, 1, 1000) <= 0) return false;
+		int n = read(fd, reply + got, len - 1 - got);
+		if(n <= 0) return false;
+		got += n;
+		reply[got] = '\0';
+		if(strchr(reply, '\n') != NULL) return true;
+	}
+	return true;
+}
+
+long status_value(const char *status, const char *key) {
+	const char *p = strstr(status, key);
+	return p != NULL? atol(p + strlen(key)): 0;
+}
+
+bool take_sample(int fd, struct sample *s, double t) {
+	char reply[512];
+	if(!control_command(fd, "STATUS\n", reply, sizeof(reply))) return false;
+	s->t = t;
+	s->servers = status_value(reply, " servers=");
+	s->open = status_value(reply, " open=");
+	s->sent = status_value(reply, " sent=");
+	s->served = status_value(reply, " served=");
+	s->in_flight = status_value(reply, " in_flight=");
+	s->retries = status_value(reply, " retries=");
+	s->lost = status_value(reply, " lost=");
+	s->started = server_pid(1) != 0;
+	return true;
+}
+
+// first sample at or after from which stays at RECOVER_RATIO for one second, with enough servers. -1 if none.
+int recovered_at(int from, int min_servers) {
+	int span = 1000 / SAMPLE_MS;
+	for(int i = from; i + span < n_samples; i++) {
+		bool ok = true;
+		for(int j = i; j < i + span && ok; j++) {
+			long sent = samples[j + span].sent - samples[j].sent;
+			long served = samples[j + span].served - samples[j].served;
+			ok = samples[j].servers >= min_servers && served >= RECOVER_RATIO * sent;
+		}
+		if(ok) return i;
+	}
+	return -1;
+}
+
+void stop_all(pid_t lb_pid, pid_t as_pid) {
+	kill(as_pid, SIGKILL);
+	kill(lb_pid, SIGKILL);
+	for(int i = 0; i < 2; i++) {
+		pid_t pid = server_pid(i);
+		if(pid <= 0) continue;
+		kill(pid, SIGCONT);
+		kill(pid, SIGKILL);
+	}
+	while(waitpid(-1, NULL, 0) > 0); // servers started by autoscaler are reparented, init reaps them.
+	usleep(500000); // ports are free again.
+}
+
+void run_scenario(int scenario, int run) {
+	char work[] = "/tmp/chaos.XXXXXX", cmd[64], reply[512];
+	if(mkdtemp(work) == NULL || chdir(work) != 0) {
+		fprintf(stderr, "chaos: can't create work directory\n");
+		exit(1);
+	}
+	bool scale = scenario == DROP_CONTROL || scenario == BOOT_DELAY;
+	for(int i = 0; i < (scale? 1: 2); i++) start_server(i);
+
+	double warm_rps = scale? cfg.low_rps: cfg.rps;
+	char lb[PATH_MAX + 16], as[PATH_MAX + 32], server[PATH_MAX + 16], delay[32], boot[32];
+	snprintf(lb, sizeof(lb), "%s/load_balancer", root);
+	snprintf(as, sizeof(as), "%s/autoscaler_sim", root);
+	snprintf(server, sizeof(server), "%s/server", root);
+	snprintf(delay, sizeof(delay), "%d", (int)(1e6 / warm_rps));
+	snprintf(boot, sizeof(boot), "%.1lf", scenario == BOOT_DELAY? cfg.boot_s: 0);
+	char *lb_argv[] = {lb, "-r", delay, NULL};
+	char *as_argv[] = {as, "-l", server, "-A", cfg.server_args, "-m", "2", "-b", boot, "-x", "100", NULL};
+	pid_t lb_pid = spawn(lb_argv, NULL, "lb.out");
+	usleep(300000);
+	pid_t as_pid = spawn(as_argv, NULL, "autoscaler.out");
+
+	int fd = -1;
+	struct sample s;
+	double start = now_seconds();
+	bool ready = false;
+	while(!ready && now_seconds() - start < READY_TIMEOUT_S) {
+		usleep(SAMPLE_MS * 1000);
+		if(fd < 0) fd = control_connect();
+		ready = fd >= 0 && take_sample(fd, &s, 0) && s.servers == (scale? 1: 2) && s.served > 0;
+	}
+	if(!ready) {
+		printf("{\"scenario\":\"%s\",\"run\":%d,\"error\":\"servers not serving after %d s, see %s\"}\n", scenario_names[scenario], run, READY_TIMEOUT_S, work);
+		fflush(stdout);
+		if(fd >= 0) close(fd);
+		stop_all(lb_pid, as_pid);
+		return;
+	}
+	snprintf(cmd, sizeof(cmd), "RPS %.1lf\n", warm_rps);
+	control_command(fd, cmd, reply, sizeof(reply));
+
+	n_samples = 0;
+	double fault_at = now_seconds() + cfg.warmup_s;
+	bool faulted = false, healed = false;
+	pid_t victim = server_pid(1);
+	while(n_samples < MAX_SAMPLES) {
+		double t = now_seconds() - fault_at;
+		if(t >= cfg.observe_s) break;
+		if(!faulted && t >= 0) {
+			faulted = true;
+			if(scenario == KILL_SERVER) kill(victim, SIGKILL);
+			else if(scenario == STALL_SERVER) kill(victim, SIGSTOP);
+			else {
+				if(scenario == DROP_CONTROL) kill(as_pid, SIGUSR1); // message loss on.
+				snprintf(cmd, sizeof(cmd), "RPS %.1lf\n", cfg.step_rps);
+				control_command(fd, cmd, reply, sizeof(reply));
+			}
+		}
+		if(faulted && !healed && t >= cfg.fault_s) {
+			healed = true;
+			if(scenario == STALL_SERVER) kill(victim, SIGCONT);
+			else if(scenario == DROP_CONTROL) kill(as_pid, SIGUSR1); // and off.
+		}
+		if(!take_sample(fd, &samples[n_samples], t)) break;
+		n_samples += 1;
+		while(waitpid(-1, NULL, WNOHANG) > 0); // killed server is not left as zombie, autoscaler sees it gone.
+		usleep(SAMPLE_MS * 1000);
+	}
+	close(fd);
+	stop_all(lb_pid, as_pid);
+
+	int first = 0, detect = -1;
+	while(first < n_samples && samples[first].t < 0) first++;
+	for(int i = first; i < n_samples && detect < 0; i++) {
+		bool seen = scale? samples[i].started: samples[i].open > 0 || samples[i].servers < 2;
+		if(seen) detect = i;
+	}
+	int recover = recovered_at(detect >= 0? detect: first, scale? 2: 1);
+	double worst = 1.0;
+	int peak = 0, span = 1000 / SAMPLE_MS;
+	for(int i = first; i + span < n_samples; i++) {
+		long sent = samples[i + span].sent - samples[i].sent;
+		long served = samples[i + span].served - samples[i].served;
+		if(sent > 0 && 1.0 * served / sent < worst) worst = 1.0 * served / sent;
+	}
+	for(int i = first; i < n_samples; i++) {
+		if(samples[i].in_flight > peak) peak = samples[i].in_flight;
+	}
+	struct sample *a = &samples[first > 0? first - 1: 0], *b = &samples[n_samples - 1];
+	long unanswered = (b->sent - a->sent) - (b->served - a->served) - (b->in_flight - a->in_flight);
+	printf("{\"scenario\":\"%s\",\"run\":%d,\"rps\":%.0lf,\"detect_ms\":%.0lf,\"recover_ms\":%.0lf,\"lost\":%ld,\"retries\":%ld,"
+		"\"unanswered\":%ld,\"dip_pct\":%.1lf,\"peak_in_flight\":%d}\n",
+		scenario_names[scenario], run, scale? cfg.step_rps: cfg.rps, detect >= 0? samples[detect].t * 1000: -1,
+		recover >= 0? samples[recover].t * 1000: -1, b->lost - a->lost, b->retries - a->retries,
+		unanswered, worst < 1? 100 * (1 - worst): 0.0, peak);
+	fflush(stdout);
+	if(chdir("/") == 0) {
+		char rm[64];
+		snprintf(rm, sizeof(rm), "rm -rf %s", work);
+		if(system(rm) != 0) fprintf(stderr, "chaos: can't remove %s\n", work);
+	}
+}
+
+void parse_args(int argc, char *argv[]) {
+	int opt;
+	while((opt = getopt(argc, argv, "s:n:r:l:R:w:o:t:b:A:")) != -1) {
+		switch(opt) {
+			case 's':
+				for(int i = 0; i < SCENARIOS; i++) cfg.run[i] = false;
+				for(char *name = strtok(optarg, ","); name != NULL; name = strtok(NULL, ",")) {
+					int i = 0;
+					while(i < SCENARIOS && strcmp(scenario_names[i], name) != 0) i++;
+					if(i == SCENARIOS) {
+						fprintf(stderr, "chaos: unknown scenario %s\n", name);
+						exit(1);
+					}
+					cfg.run[i] = true;
+				}
+				break;
+			case 'n': cfg.runs = atoi(optarg); break;
+			case 'r': cfg.rps = atof(optarg); break;
+			case 'l': cfg.low_rps = atof(optarg); break;
+			case 'R': cfg.step_rps = atof(optarg); break;
+			case 'w': cfg.warmup_s = atof(optarg); break;
+			case 'o': cfg.observe_s = atof(optarg); break;
+			case 't': cfg.fault_s = atof(optarg); break;
+			case 'b': cfg.boot_s = atof(optarg); break;
+			case 'A': cfg.server_args = optarg; break;
+			default:
+				fprintf(stderr, "Usage: %s [-s scenario,...] [-n runs] [-r rps] [-l low_rps] [-R step_rps] [-w warmup_s] [-o observe_s] [-t fault_s] [-b boot_s] [-A server_args]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if(cfg.rps <= 0 || cfg.low_rps <= 0 || cfg.step_rps <= cfg.low_rps || cfg.observe_s * 1000 / SAMPLE_MS >= MAX_SAMPLES) {
+		fprintf(stderr, "chaos: bad load or observe time\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	parse_args(argc, argv);
+	char self[PATH_MAX];
+	if(realpath(argv[0], self) == NULL) {
+		fprintf(stderr, "chaos: can't find myself\n");
+		return 1;
+	}
+	snprintf(root, sizeof(root), "%s", dirname(dirname(self))); // bench/chaos -> repo root.
+	signal(SIGPIPE, SIG_IGN);
+	for(int scenario = 0; scenario < SCENARIOS; scenario++) {
+		for(int run = 1; run <= cfg.runs && cfg.run[scenario]; run++) run_scenario(scenario, run);
+	}
+	return 0;
+}
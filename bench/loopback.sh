@@ -0,0 +1,75 @@
+#!/bin/sh
+# Loopback benchmark of load_balancer -> server pipeline, no libvirt or VMs needed.
+# Runs server, load_balancer and stub_autoscaler (SCALE_OUT of the backend address) on this host for every
+# combination of transport, server I/O threads, offered load and request size and prints one JSON line per run:
+#   {"transport":"tcp","io_threads":2,"delay_us":500,"range":"9000:10000", ...load_balancer BENCH fields...,
+#    "server_cpu_us_per_req":..,"lb_cpu_us_per_req":..}
+# transports are tcp (127.0.0.1), unix (socket file) and vsock (local CID 1, needs vsock_loopback module).
+#
+# usage: bench/loopback.sh            (from repo root, after make load_balancer server bench/stub_autoscaler)
+# sweep can be changed with environment variables, eg. THREADS="1 2" DELAYS="1000 100" RANGES="9000:10000" DURATION=10
+# TRANSPORTS="tcp unix"
+
+TRANSPORTS=${TRANSPORTS:-"tcp"}
+THREADS=${THREADS:-"1 2 4"}
+DELAYS=${DELAYS:-"2000 500 100"} # inter request delay of load balancer in micro-seconds (offered load).
+RANGES=${RANGES:-"1000:1100 5000:5100 9000:10000"} # REQ_DATA range, bigger numbers cost more compute.
+DURATION=${DURATION:-5}
+SERVER_ARGS=${SERVER_ARGS:-""}
+LB_ARGS=${LB_ARGS:-""}
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d) # logs and response.txt of every run go here.
+CLK_TCK=$(getconf CLK_TCK)
+
+cpu_ticks() { # utime + stime of process in clock ticks.
+	awk '{print $14 + $15}' /proc/$1/stat 2>/dev/null || echo 0
+}
+
+cleanup() {
+	kill $SERVER_PID $LB_PID $STUB_PID 2>/dev/null
+	wait 2>/dev/null
+}
+trap 'cleanup; rm -rf "$WORK"; exit 1' INT TERM
+
+for transport in $TRANSPORTS; do
+case $transport in
+	unix) backend="unix:$WORK/server.sock"; listen="-l $backend" ;;
+	vsock) backend="vsock:1"; listen="-l vsock" ;;
+	*) backend="127.0.0.1"; listen="" ;;
+esac
+for threads in $THREADS; do
+for delay in $DELAYS; do
+for range in $RANGES; do
+	low=${range%:*}
+	high=${range#*:}
+	cd "$WORK"
+	"$ROOT/server" -t $threads $listen $SERVER_ARGS &
+	SERVER_PID=$!
+	sleep 0.2
+	"$ROOT/load_balancer" -r $delay -L $low -H $high -d $DURATION $LB_ARGS > lb.out 2>&1 &
+	LB_PID=$!
+	"$ROOT/bench/stub_autoscaler" $backend 2>/dev/null &
+	STUB_PID=$!
+
+	sleep $((DURATION - 1))
+	lb_ticks=$(cpu_ticks $LB_PID) # before it waits for last responses.
+	wait $LB_PID
+	server_ticks=$(cpu_ticks $SERVER_PID)
+	kill $SERVER_PID $STUB_PID 2>/dev/null
+	wait 2>/dev/null
+
+	summary=$(grep '^BENCH ' lb.out | tail -1 | sed 's/^BENCH {//; s/}$//')
+	if [ -z "$summary" ]; then
+		echo "{\"transport\":\"$transport\",\"io_threads\":$threads,\"delay_us\":$delay,\"range\":\"$range\",\"error\":\"no BENCH summary\"}"
+		continue
+	fi
+	served=$(echo "$summary" | sed 's/.*"served":\([0-9]*\).*/\1/')
+	cpu_per_req=$(awk -v t=$server_ticks -v hz=$CLK_TCK -v n=$served 'BEGIN { if(n > 0) printf "%.1f", t * 1e6 / hz / n; else print 0 }')
+	lb_cpu_per_req=$(awk -v t=$lb_ticks -v hz=$CLK_TCK -v n=$served 'BEGIN { if(n > 0) printf "%.1f", t * 1e6 / hz / n; else print 0 }')
+	echo "{\"transport\":\"$transport\",\"io_threads\":$threads,\"delay_us\":$delay,\"range\":\"$range\",$summary,\"server_cpu_us_per_req\":$cpu_per_req,\"lb_cpu_us_per_req\":$lb_cpu_per_req}"
+done
+done
+done
+done
+rm -rf "$WORK"
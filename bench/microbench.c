@@ -0,0 +1,248 @@
+/*
+Microbenchmarks for hot paths shared by server and load balancer:
+prime kernels (reference and sieve backends, checked against each other), sum_prime() (server compute, cold and from
+result cache), frame codec, pool allocator against malloc, live server table
+lookups and consistent hash routing.
+Output is one JSON object per line so results can be diffed between builds.
+
+usage: ./microbench [min_seconds_per_case]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "../frame.h"
+#include "../stats.h"
+#include "../pool.h"
+#include "../kernels.h"
+#include "../server.h"
+#include "../live_servers.h"
+#include "../chash.h"
+
+double min_seconds = 0.2; // every case runs at least this long.
+volatile long sink; // results are stored here so that compiler can't remove the benchmarked code.
+
+// run fn(arg) in batches until min_seconds passed, return nano-seconds per call.
+double time_per_op(void (*fn)(long arg, long i), long arg, long *ops) {
+	long batch = 1, done = 0;
+	long start = now_usec();
+	long elapsed = 0;
+	while(elapsed < min_seconds * 1e6) {
+		for(long i = 0; i < batch; i++) fn(arg, done + i);
+		done += batch;
+		if(batch < (1L << 20)) batch *= 2;
+		elapsed = now_usec() - start;
+	}
+	*ops = done;
+	return elapsed * 1000.0 / done;
+}
+
+void report(const char *name, const char *param, long value, void (*fn)(long, long)) {
+	long ops;
+	double ns = time_per_op(fn, value, &ops);
+	printf("{\"bench\":\"%s\",\"%s\":%ld,\"ops\":%ld,\"ns_per_op\":%.1lf}\n", name, param, value, ops, ns);
+	fflush(stdout);
+}
+
+
+void bench_sum_prime(long n, long i) {
+	char buff[FRAME_LEN];
+	frame_encode_request(buff, i, n, 0);
+	sum_prime(buff, FRAME_LEN);
+	sink += buff[0];
+}
+
+void bench_reference(long n, long i) {
+	sink += sum_primes_reference(n);
+}
+
+uint64_t kernel_words[KERNEL_SEGMENT_WORDS];
+long kernel_sums[KERNEL_SEGMENT_WORDS];
+long kernel_prefix[KERNEL_SEGMENT_WORDS];
+void bench_word_sums(long n, long i) {
+	primes.backend->word_sums(kernel_words, n, 1, kernel_sums);
+	sink += kernel_sums[i % n];
+}
+
+void bench_scan(long n, long i) {
+	primes.backend->scan(kernel_sums, n, i, kernel_prefix);
+	sink += kernel_prefix[n - 1];
+}
+
+// every backend against reference upto 30000 and known sums above small table. returns false on mismatch.
+bool check_kernels(const struct kernel_backend *backend) {
+	init_kernels(1 << 20); // small table so that 10^7 and 10^8 go through the on the fly path too.
+	primes.backend = backend;
+	long sum = 0;
+	for(long n = 0; n <= 30000; n++) { // running reference, sum_primes_reference(n) for every n would take minutes.
+		if(is_prime(n)) sum += n;
+		if(kernel_sum_primes(n) != sum) {
+			fprintf(stderr, "%s kernel: sum of primes upto %ld is %ld, reference says %ld\n", backend->name, n, kernel_sum_primes(n), sum);
+			return false;
+		}
+	}
+	long known[][2] = {{1000000, 37550402023L}, {2000000, 142913828922L}, {10000000, 3203324994356L}, {100000000, 279209790387276L}};
+	for(int i = 0; i < 4; i++) {
+		if(kernel_sum_primes(known[i][0]) != known[i][1]) {
+			fprintf(stderr, "%s kernel: sum of primes upto %ld is %ld, should be %ld\n", backend->name, known[i][0], kernel_sum_primes(known[i][0]), known[i][1]);
+			return false;
+		}
+	}
+	return true;
+}
+
+void bench_frame_encode(long unused, long i) {
+	char buff[FRAME_LEN];
+	frame_encode_request(buff, i, 9000 + (i & 1023), 1234567890L + i);
+	sink += buff[FRAME_LEN - 1];
+}
+
+char response_frame[FRAME_LEN];
+void bench_frame_decode(long unused, long i) {
+	long req_id = 0, data = 0, ts = 0, res = 0;
+	frame_get_long(response_frame, "REQ_ID", &req_id);
+	frame_get_long(response_frame, "REQ_DATA", &data);
+	frame_get_long(response_frame, "TS", &ts);
+	frame_get_long(response_frame, "RES_DATA", &res);
+	sink += req_id + data + ts + res;
+}
+
+void bench_frame_reader(long frames, long i) {	// reassemble frames arriving in odd sized chunks.
+	static char stream[64 * FRAME_LEN];
+	static struct frame_reader reader;
+	char *data = stream;
+	int len = frames * FRAME_LEN;
+	while(len > 0) {
+		int chunk = len < 137? len: 137; // chunk size not multiple of FRAME_LEN.
+		int left = chunk;
+		char *frame;
+		while((frame = frame_next(&reader, &data, &left)) != NULL) sink += frame[0];
+		len -= chunk;
+	}
+}
+
+char table_ips[256][20];
+void bench_table_lookup(long n, long i) {	// lookup by IP, uniformly over n entries.
+	sink += get_server_entry(table_ips[i % n])->server_sock_fd;
+}
+
+void bench_table_lookup_fd(long n, long i) {
+	sink += get_server_entry_by_fd(1000 + i % n)->server_sock_fd;
+}
+
+void bench_chash_pick(long n, long i) {
+	sink += chash_pick(chash_key(i))->server_sock_fd;
+}
+
+// percent of keys that move to another server when one server is added to n.
+double chash_remap_pct(int n, int keys) {
+	int *home = malloc(keys * sizeof(int));
+	for(int k = 0; k < keys; k++) home[k] = chash_pick(chash_key(k))->server_sock_fd;
+	sprintf(table_ips[n], "10.0.%d.%d", n / 250, n % 250 + 1);
+	insert_server_entry(table_ips[n], 1000 + n);
+	chash_rebuild();
+	int moved = 0;
+	for(int k = 0; k < keys; k++) if(chash_pick(chash_key(k))->server_sock_fd != home[k]) moved += 1;
+	free(home);
+	return 100.0 * moved / keys;
+}
+
+#define POOL_BENCH_OBJS 64 // objects held at once, like tasks of a burst of requests.
+struct mem_pool bench_pool;
+void *held[POOL_BENCH_OBJS];
+
+void bench_pool_alloc_free(long size, long i) {
+	int k = i % POOL_BENCH_OBJS;
+	pool_free(&bench_pool, held[k]);
+	held[k] = pool_alloc(&bench_pool);
+}
+
+void bench_malloc_free(long size, long i) {
+	int k = i % POOL_BENCH_OBJS;
+	free(held[k]);
+	held[k] = calloc(1, size);
+}
+
+int main(int argc, char *argv[]) {
+	if(argc > 1) min_seconds = atof(argv[1]);
+
+	for(int b = 0; b < 3; b++) {
+		const struct kernel_backend *backend = &kernel_backends[b];
+		if((b == 1 && !__builtin_cpu_supports("sse2")) || (b == 2 && !__builtin_cpu_supports("avx2"))) continue;
+		if(!check_kernels(backend)) return 1;
+		for(int i = 0; i < KERNEL_SEGMENT_WORDS; i++) kernel_words[i] = primes.bits[i];
+		printf("{\"check\":\"prime_kernel\",\"backend\":\"%s\",\"ok\":true}\n", backend->name);
+		report(b == 0? "word_sums_scalar": b == 1? "word_sums_sse2": "word_sums_avx2", "words", KERNEL_SEGMENT_WORDS, bench_word_sums);
+		report(b == 0? "prefix_scan_scalar": b == 1? "prefix_scan_sse2": "prefix_scan_avx2", "words", KERNEL_SEGMENT_WORDS, bench_scan);
+		init_kernels(0);
+		primes.backend = backend;
+		long start = now_usec();
+		kernel_sum_primes(100000000);
+		printf("{\"bench\":\"sieve_table\",\"backend\":\"%s\",\"n\":100000000,\"ms\":%.1lf}\n", backend->name, (now_usec() - start) / 1e3);
+	}
+	init_kernels(0); // runtime dispatch, like server.
+	report("sum_prime_reference", "n", 10000, bench_reference);
+	long sizes[] = {1000, 5000, 10000, 100000000};
+	for(int i = 0; i < 4; i++) report("sum_prime", "n", sizes[i], bench_sum_prime);
+	init_cache(1024);
+	bench_sum_prime(sizes[2], 0); // fill the slot, every timed call hits.
+	report("sum_prime_cached", "n", sizes[2], bench_sum_prime);
+	cache.slots = 0; // rest of cases measure compute.
+
+	frame_encode_request(response_frame, 123456, 9876, 1234567890L);
+	frame_add_long(response_frame, "RES_DATA", 5736396);
+	report("frame_encode", "fields", 3, bench_frame_encode);
+	report("frame_decode", "fields", 4, bench_frame_decode);
+	report("frame_reader", "frames", 64, bench_frame_reader);
+
+	pool_init(&bench_pool, "bench", 2 * sizeof(void *) + FRAME_LEN, 0); // size of server task.
+	report("pool_alloc_free", "bytes", bench_pool.obj_size, bench_pool_alloc_free);
+	for(int i = 0; i < POOL_BENCH_OBJS; i++) pool_free(&bench_pool, held[i]), held[i] = NULL;
+	if(bench_pool.in_use != 0) {
+		fprintf(stderr, "pool leak accounting broken: %ld in use\n", bench_pool.in_use);
+		return 1;
+	}
+	report("malloc_free", "bytes", bench_pool.obj_size, bench_malloc_free);
+	for(int i = 0; i < POOL_BENCH_OBJS; i++) free(held[i]), held[i] = NULL;
+
+	long table_sizes[] = {2, 16, 256};
+	for(int t = 0; t < 3; t++) {
+		while(live_serv_list != NULL) { // drop previous table quietly, delete_server_entry() prints.
+			struct live_server_entry *next = live_serv_list->next;
+			free_server_entry(live_serv_list);
+			live_serv_list = next;
+		}
+		for(int i = 0; i < table_sizes[t]; i++) {
+			sprintf(table_ips[i], "10.0.%d.%d", i / 250, i % 250 + 1);
+			insert_server_entry(table_ips[i], 1000 + i);
+		}
+		report("table_lookup_ip", "servers", table_sizes[t], bench_table_lookup);
+		report("table_lookup_fd", "servers", table_sizes[t], bench_table_lookup_fd);
+	}
+
+	chash.enabled = true;
+	for(int t = 0; t < 3; t++) {
+		while(live_serv_list != NULL) {
+			struct live_server_entry *next = live_serv_list->next;
+			free_server_entry(live_serv_list);
+			live_serv_list = next;
+		}
+		for(int i = 0; i < table_sizes[t]; i++) insert_server_entry(table_ips[i], 1000 + i);
+		chash_rebuild();
+		report("chash_pick", "servers", table_sizes[t], bench_chash_pick);
+		if(t == 2) break; // table_ips has no room for one more.
+		double moved = chash_remap_pct(table_sizes[t], 100000);
+		printf("{\"check\":\"chash_remap\",\"servers\":%ld,\"moved_pct\":%.2lf,\"ideal_pct\":%.2lf}\n", table_sizes[t], moved, 100.0 / (table_sizes[t] + 1));
+		if(moved > 2 * 100.0 / (table_sizes[t] + 1)) {
+			fprintf(stderr, "consistent hash moved too many keys on scale out\n");
+			return 1;
+		}
+	}
+	return 0;
+}
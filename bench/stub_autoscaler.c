@@ -0,0 +1,49 @@
+/*
+Stub autoscaler for loopback benchmarks. Connects to load balancer like autoscaler.c does and
+notifies one server (default 127.0.0.1) with SCALE_OUT, then keeps the connection open without
+touching libvirt until it is killed.
+
+usage: ./stub_autoscaler [server IP ...]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+int connect_to_load_balancer() {
+	struct sockaddr_in load_bal_address;
+	load_bal_address.sin_family = AF_INET;
+	load_bal_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	load_bal_address.sin_port = htons(8181);
+
+	for(int i = 0; i < 100; i++) { // load balancer might be still starting, retry for 10 seconds.
+		int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+		if(connect(sock_fd, (struct sockaddr *)&load_bal_address, sizeof(load_bal_address)) == 0) return sock_fd;
+		close(sock_fd);
+		usleep(100000);
+	}
+	fprintf(stderr, "stub_autoscaler: error conecting load balancer\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	static int msg_len = 50; // same as autoscaler.c
+	char message[msg_len];
+
+	int sock_fd = connect_to_load_balancer();
+	for(int i = 1; i < argc || i == 1; i++) {
+		char *IP = argc > 1? argv[i]: "127.0.0.1";
+		memset(message, 0, msg_len);
+		snprintf(message, msg_len, "SCALE_OUT;%s;", IP);
+		if(write(sock_fd, message, msg_len) != msg_len || read(sock_fd, message, msg_len) != msg_len) {
+			fprintf(stderr, "stub_autoscaler: notify failed for %s\n", IP);
+			exit(1);
+		}
+		fprintf(stderr, "stub_autoscaler: SCALE_OUT %s: %s\n", IP, message);
+	}
+	while(1) pause(); // keep autoscaler connection open, load balancer blocks in accept when it is closed.
+}
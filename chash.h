@@ -0,0 +1,122 @@
+/*
+Consistent hash routing of load balancer (-C option), so that one REQ_DATA value (or one client in proxy mode) keeps
+going to the same server and its result stays in that server's cache.
+
+Maglev lookup table: every server fills table slots in the order of its own permutation of slots (offset and skip
+from hash of its IP), servers take turns until table is full. every server owns ~1/N of the slots and a scale out
+or scale in moves only ~1/N of the keys. table is rebuilt on membership change only, it doesn't move when a server
+is ejected by health checks: its keys walk to the next slots like overflow below.
+Bounded load: server having more than load_factor * average outstanding requests is skipped and the key walks on
+to next table slots, so a hot key can't overload its home server.
+Caller holds live_serv_lock, or is request thread which only runs while membership is not changing.
+*/
+
+#define MAGLEV_SIZE 65537 // prime, much larger than number of servers.
+
+struct chash_ring {
+	bool enabled;
+	double load_factor; // -B option.
+	struct live_server_entry **servers; // membership at last rebuild.
+	int count;
+	int *table; // MAGLEV_SIZE slots, index into servers.
+
+	// metrics, reported with throughput. request thread and proxy thread both pick, so they are added atomically.
+	long routed;
+	long overflows; // routed away from home server by bounded load or health.
+} chash = {.load_factor = 1.25};
+
+
+static inline unsigned long chash_mix(unsigned long x) {	// splitmix64 finalizer.
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9UL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebUL;
+	x ^= x >> 31;
+	return x;
+}
+
+static unsigned long chash_string(const char *s, unsigned long seed) {
+	unsigned long h = seed;
+	while(*s != '\0') h = chash_mix(h ^ (unsigned char)*s++);
+	return h;
+}
+
+unsigned long chash_key(long value) {
+	return chash_mix((unsigned long)value + 0x9E3779B97F4A7C15UL);
+}
+
+// fill lookup table from live_serv_list, also when routing is round robin so that control socket can switch any time.
+// caller holds live_serv_lock.
+void chash_rebuild() {
+	int count = 0;
+	for(struct live_server_entry* eptr = live_serv_list; eptr != NULL; eptr = eptr->next) count += 1;
+	free(chash.servers);
+	chash.servers = malloc((count > 0? count: 1) * sizeof(struct live_server_entry *));
+	count = 0;
+	for(struct live_server_entry* eptr = live_serv_list; eptr != NULL; eptr = eptr->next) chash.servers[count++] = eptr;
+	chash.count = count;
+	if(chash.table == NULL) chash.table = malloc(MAGLEV_SIZE * sizeof(int));
+	for(int i = 0; i < MAGLEV_SIZE; i++) chash.table[i] = -1;
+	if(count == 0) return;
+
+	// order of live_serv_list depends on history, sort by IP so that same membership gives same table.
+	for(int i = 1; i < count; i++) {
+		for(int j = i; j > 0 && strcmp(chash.servers[j - 1]->IP, chash.servers[j]->IP) > 0; j--) {
+			struct live_server_entry *tmp = chash.servers[j];
+			chash.servers[j] = chash.servers[j - 1];
+			chash.servers[j - 1] = tmp;
+		}
+	}
+	unsigned long offset[count], skip[count], next[count];
+	for(int i = 0; i < count; i++) {
+		offset[i] = chash_string(chash.servers[i]->IP, 1) % MAGLEV_SIZE;
+		skip[i] = chash_string(chash.servers[i]->IP, 2) % (MAGLEV_SIZE - 1) + 1;
+		next[i] = 0;
+	}
+	int filled = 0;
+	while(true) {
+		for(int i = 0; i < count; i++) {
+			unsigned long slot = (offset[i] + next[i] * skip[i]) % MAGLEV_SIZE;
+			while(chash.table[slot] >= 0) { // taken, try next slot of this server's permutation.
+				next[i] += 1;
+				slot = (offset[i] + next[i] * skip[i]) % MAGLEV_SIZE;
+			}
+			chash.table[slot] = i;
+			next[i] += 1;
+			filled += 1;
+			if(filled == MAGLEV_SIZE) return;
+		}
+	}
+}
+
+static inline long chash_outstanding(struct live_server_entry* eptr) {
+	long outstanding = __atomic_load_n(&eptr->sent, __ATOMIC_RELAXED) - eptr->received;
+	return outstanding > 0? outstanding: 0;
+}
+
+// home server of key, or the next one in table order when home is unhealthy or above bounded load. NULL if none is healthy.
+struct live_server_entry* chash_pick(unsigned long key) {
+	if(chash.count == 0) return NULL;
+	long total = 0;
+	int healthy = 0;
+	for(int i = 0; i < chash.count; i++) {
+		struct live_server_entry* eptr = chash.servers[i];
+		if(!server_usable(eptr)) continue;
+		total += chash_outstanding(eptr);
+		healthy += 1;
+	}
+	if(healthy == 0) return NULL;
+	long cap = (long)(chash.load_factor * (total + 1) / healthy + 0.999999); // ceil, at least 1.
+
+	__atomic_add_fetch(&chash.routed, 1, __ATOMIC_RELAXED);
+	unsigned long slot = key % MAGLEV_SIZE;
+	for(int probe = 0; probe < MAGLEV_SIZE; probe++) {
+		struct live_server_entry* eptr = chash.servers[chash.table[slot]];
+		if(server_usable(eptr) && chash_outstanding(eptr) < cap) {
+			if(probe > 0) __atomic_add_fetch(&chash.overflows, 1, __ATOMIC_RELAXED);
+			return eptr;
+		}
+		slot = (slot + 1) % MAGLEV_SIZE;
+	}
+	return NULL;
+}
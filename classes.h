@@ -0,0 +1,186 @@
+/*
+Request classes of load balancer (-Q option), so that interactive and batch traffic can share one pool of servers.
+
+Every generated request belongs to one class, picked at random by class share, and carries CLASS:<index> in its frame
+(no field means class 0). Requests wait in one FIFO per class and are sent by deficit round robin: on its turn a class
+gains its weight in credit and sends one request per credit, so under backlog the classes get servers in proportion to
+their weights whatever their arrival rates are. class with nothing queued keeps no credit.
+Backlog builds up here only when servers are full: -W limits outstanding requests per server (0 is no limit, then
+every request is sent at once and classes matter only on servers). servers run lower class index first (server.c),
+so list latency sensitive classes first and let -W keep bulk work from filling the servers.
+Spec is comma separated name:weight:share_pct[:slo_ms[:low-high]], eg. -Q interactive:4:20:50,batch:1:80:0:9000-10000
+slo_ms is p99 target reported to autoscaler (0 is none), low-high is REQ_DATA range of the class (default is -L/-H).
+Queues are used by request thread only, response threads measure per class latency from TS (queueing included).
+*/
+
+#define MAX_CLASSES 8
+#define CLASS_QUEUE_CAP 4096 // queued requests per class, more are shed.
+#define RES_SHARDS_MAX 8 // response threads of load balancer (-M option), each keeps own latency histograms.
+
+struct req_class {
+	char name[16];
+	double weight; // DRR credit per turn, > 0.
+	double share; // percent of generated requests.
+	long slo_us; // p99 latency target, 0 is none.
+	int range_low, range_high; // both 0 means range of request generator.
+
+	char (*queue)[FRAME_LEN]; // CLASS_QUEUE_CAP encoded frames, ring.
+	int head;
+	int count;
+	double deficit;
+
+	// metrics, reported with throughput.
+	long sent; // request thread.
+	long shed; // queue was full.
+	long p99_us; // of last report interval, read by autoscaler.
+	struct latency_hist shard_hist[RES_SHARDS_MAX]; // whole run, each written by one response thread only.
+	struct latency_hist total_hist; // merged shard_hist at last report, for BENCH summary.
+};
+
+struct class_table {
+	struct req_class list[MAX_CLASSES];
+	int count;
+	int turn; // class having DRR turn.
+	int queued; // requests in all queues.
+	int window; // -W option, outstanding requests per server, 0 is no limit.
+} classes;
+
+
+// parse -Q spec. returns false on bad spec.
+bool classes_parse(char *spec) {
+	char *save, *item;
+	classes.count = 0;
+	for(item = strtok_r(spec, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		if(classes.count == MAX_CLASSES) return false;
+		struct req_class *c = &classes.list[classes.count];
+		double slo_ms = 0;
+		memset(c, 0, sizeof(struct req_class));
+		int n = sscanf(item, "%15[^:]:%lf:%lf:%lf:%d-%d", c->name, &c->weight, &c->share, &slo_ms, &c->range_low, &c->range_high);
+		if(n < 3 || n == 5 || c->weight <= 0 || c->share < 0 || (n == 6 && c->range_high <= c->range_low)) return false;
+		c->slo_us = slo_ms * 1000;
+		classes.count += 1;
+	}
+	return classes.count > 0;
+}
+
+// one class taking everything when -Q is not given, frames then carry no CLASS field like before.
+void init_classes() {
+	if(classes.count == 0) {
+		memset(&classes.list[0], 0, sizeof(struct req_class));
+		strcpy(classes.list[0].name, "default");
+		classes.list[0].weight = 1;
+		classes.list[0].share = 100;
+		classes.count = 1;
+	}
+	for(int i = 0; i < classes.count; i++) classes.list[i].queue = malloc(CLASS_QUEUE_CAP * FRAME_LEN);
+}
+
+int class_find(const char *name) {
+	for(int i = 0; i < classes.count; i++) {
+		if(strcasecmp(classes.list[i].name, name) == 0) return i;
+	}
+	return -1;
+}
+
+// class of next generated request, by share.
+int class_pick() {
+	if(classes.count == 1) return 0;
+	double total = 0;
+	for(int i = 0; i < classes.count; i++) total += classes.list[i].share;
+	double r = rand() / (RAND_MAX + 1.0) * total;
+	for(int i = 0; i < classes.count; i++) {
+		if(r < classes.list[i].share) return i;
+		r -= classes.list[i].share;
+	}
+	return classes.count - 1;
+}
+
+// queue request frame on its class. returns false if the class is full and request is shed.
+bool class_enqueue(char *frame) {
+	long idx = 0;
+	frame_get_long(frame, "CLASS", &idx);
+	struct req_class *c = &classes.list[idx >= 0 && idx < classes.count? idx: 0];
+	if(c->count == CLASS_QUEUE_CAP) {
+		c->shed += 1;
+		return false;
+	}
+	memcpy(c->queue[(c->head + c->count) % CLASS_QUEUE_CAP], frame, FRAME_LEN);
+	c->count += 1;
+	classes.queued += 1;
+	return true;
+}
+
+// class to send from next by deficit round robin, -1 when nothing is queued. class keeps its turn while it has credit.
+int class_next() {
+	if(classes.queued == 0) return -1;
+	while(true) {
+		struct req_class *c = &classes.list[classes.turn];
+		if(c->count > 0 && c->deficit >= 1) return classes.turn;
+		if(c->count == 0) c->deficit = 0; // idle class doesn't save up credit.
+		classes.turn = (classes.turn + 1) % classes.count;
+		classes.list[classes.turn].deficit += classes.list[classes.turn].weight;
+	}
+}
+
+static inline char *class_head(int idx) {
+	return classes.list[idx].queue[classes.list[idx].head];
+}
+
+// head of class was sent, spend one credit.
+void class_pop(int idx) {
+	struct req_class *c = &classes.list[idx];
+	c->head = (c->head + 1) % CLASS_QUEUE_CAP;
+	c->count -= 1;
+	c->deficit -= 1;
+	c->sent += 1;
+	classes.queued -= 1;
+}
+
+// server may take one more request under -W window.
+static inline bool server_has_room(struct live_server_entry* eptr) {
+	return classes.window == 0 || chash_outstanding(eptr) < classes.window;
+}
+
+// response thread shard, latency from generation (TS field) so that time spent queued here counts.
+void class_record(char *frame, long now, int shard) {
+	long idx = 0, ts = 0;
+	frame_get_long(frame, "CLASS", &idx);
+	if(idx < 0 || idx >= classes.count || !frame_get_long(frame, "TS", &ts)) return;
+	hist_record_shared(&classes.list[idx].shard_hist[shard], now - ts);
+}
+
+// per class line of throughput report, first response thread. shard histograms are merged without stopping the
+// other shards, interval is the difference to the previous merge. nothing is printed with one class.
+void class_report(FILE *fd, int secs, int shards) {
+	struct latency_hist merged, part, interval;
+	for(int i = 0; i < classes.count; i++) {
+		struct req_class *c = &classes.list[i];
+		hist_reset(&merged);
+		for(int s = 0; s < shards; s++) {
+			hist_snapshot(&part, &c->shard_hist[s]);
+			hist_merge(&merged, &part);
+		}
+		hist_subtract(&interval, &merged, &c->total_hist);
+		c->p99_us = hist_percentile(&interval, 99);
+		if(classes.count > 1) fprintf(fd, "Class %s: serving %.2lf req/sec, 	p50: %ld us, p99: %ld us (slo %ld us), 	queued %d, shed %ld\n",
+			c->name, 1.0 * interval.total / secs, hist_percentile(&interval, 50), c->p99_us, c->slo_us, c->count, c->shed);
+		c->total_hist = merged;
+	}
+}
+
+// ,"classes":[...] for BENCH summary, empty with one class.
+int class_bench_json(char *out, int len) {
+	int n = 0;
+	if(classes.count == 1) {
+		out[0] = '\0';
+		return 0;
+	}
+	n += snprintf(out + n, len - n, ",\"classes\":[");
+	for(int i = 0; i < classes.count && n < len; i++) {
+		struct req_class *c = &classes.list[i];
+		n += snprintf(out + n, len - n, "%s{\"name\":\"%s\",\"served\":%lu,\"p50_us\":%ld,\"p99_us\":%ld,\"slo_us\":%ld,\"shed\":%ld}",
+			i > 0? ",": "", c->name, c->total_hist.total, hist_percentile(&c->total_hist, 50), hist_percentile(&c->total_hist, 99), c->slo_us, c->shed);
+	}
+	if(n < len) n += snprintf(out + n, len - n, "]");
+	return n;
+}
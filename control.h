@@ -0,0 +1,361 @@
+/*
+Control socket of load balancer (-S port, 127.0.0.1 only, 0 disables). offered load, request range and routing are
+changed at runtime without signals, eg. $ echo "RPS 500" | nc -q1 127.0.0.1 8282
+One command per line, every command gets one line back, "OK ..." or "ERR reason":
+  RPS <req/sec>                 constant offered load, stops running profile.
+  DELAY <micro-seconds>         same as RPS given as inter request delay.
+  LOW | HIGH                    preset low/high load.
+  RANGE <low> <high>            REQ_DATA range, bigger numbers cost more compute on servers.
+  SWING <amplitude> <period_s>  sine load around current req/sec.
+  ROUTE RR | CHASH [factor]     round robin or consistent hash routing (factor is bounded load, see chash.h).
+  HEDGE ON | OFF                hedging of slow requests.
+  CLASS <name> <weight> [share] DRR weight and traffic share (percent) of request class (classes.h).
+  WINDOW <requests>             outstanding requests per server, 0 is no limit.
+  PROFILE <file> | STOP         run scripted load profile from file, or stop it and keep current load.
+  STATUS                        current settings, servers with open circuit and request counters since start.
+  EXIT                          stop load balancer like SIGINT.
+
+Profile file has one phase per line, phases run one after another, '#' starts a comment:
+  step <seconds> <req/sec>                  hold load.
+  ramp <seconds> <from req/sec> <to req/sec> linear change.
+  sine <seconds> <mean> <amplitude> <period_s>
+  trace <file>                              recorded load, "<second> <req/sec>" lines (same as autoscaler_sim -t), linear in between.
+  range <low> <high>                        change REQ_DATA range, takes no time.
+  loop                                      start again from first phase.
+Load of running profile is updated every CONTROL_TICK_MS by control thread, so runs are repeatable.
+*/
+
+#define CONTROL_TICK_MS 100
+#define CONTROL_LINE_LEN 512
+#define PROFILE_MAX_PHASES 64
+
+enum {PHASE_STEP, PHASE_RAMP, PHASE_SINE, PHASE_TRACE, PHASE_RANGE, PHASE_LOOP};
+
+struct profile_phase {
+	int kind; // PHASE_* constants.
+	double seconds; // 0 for range and loop.
+	double a, b, c; // step: rps. ramp: from, to. sine: mean, amplitude, period. range: low, high.
+	double *trace_t; // trace points.
+	double *trace_rps;
+	int trace_len;
+};
+
+struct load_profile {
+	char name[256]; // file, or "swing".
+	struct profile_phase phases[PROFILE_MAX_PHASES];
+	int count;
+	bool running;
+	int phase; // current phase.
+	long phase_start; // micro-seconds, now_usec().
+} profile;
+
+struct control_context {
+	int port; // -S option.
+	int lstn_fd;
+	int client_fd; // one client at a time, new connection replaces old one.
+	char line[CONTROL_LINE_LEN]; // partial command line.
+	int line_len;
+	pthread_t thread;
+	bool running;
+	bool stop; // hot restart hands listening socket to new process.
+} control = {.port = 8282, .lstn_fd = -1, .client_fd = -1};
+
+// load_balancer.c
+void set_delay(unsigned int delay_us); // micro-seconds between generated requests.
+unsigned int get_delay();
+void set_preset_load(bool high);
+void set_range(int low, int high);
+int load_status(char *out, int len); // "rps=.. delay_us=.. range=.." of request generator.
+void request_exit(); // graceful stop by main thread.
+extern bool hedging;
+
+
+static void set_load(double rps) {
+	set_delay(rps < 1? 1000000: 1e6 / rps); // below 1 req/sec the generator would stall on one long sleep.
+}
+
+static double get_load() {
+	return 1e6 / get_delay();
+}
+
+static void profile_free() {
+	for(int i = 0; i < profile.count; i++) {
+		free(profile.phases[i].trace_t);
+		free(profile.phases[i].trace_rps);
+	}
+	memset(&profile, 0, sizeof(profile));
+}
+
+static bool profile_load_trace(struct profile_phase *ph, char *file) {
+	FILE *f = fopen(file, "r");
+	if(f == NULL) return false;
+	int cap = 256;
+	ph->trace_t = malloc(cap * sizeof(double));
+	ph->trace_rps = malloc(cap * sizeof(double));
+	double t, rps;
+	while(fscanf(f, "%lf %lf", &t, &rps) == 2) {
+		if(ph->trace_len == cap) {
+			cap *= 2;
+			ph->trace_t = realloc(ph->trace_t, cap * sizeof(double));
+			ph->trace_rps = realloc(ph->trace_rps, cap * sizeof(double));
+		}
+		ph->trace_t[ph->trace_len] = t;
+		ph->trace_rps[ph->trace_len] = rps;
+		ph->trace_len += 1;
+	}
+	fclose(f);
+	if(ph->trace_len == 0) return false;
+	ph->seconds = ph->trace_t[ph->trace_len - 1] - ph->trace_t[0];
+	return true;
+}
+
+// parse profile file into profile. on error err tells the line, profile is left empty.
+bool profile_load(char *file, char *err, int err_len) {
+	profile_free();
+	FILE *f = fopen(file, "r");
+	if(f == NULL) {
+		snprintf(err, err_len, "can't open %s", file);
+		return false;
+	}
+	char line[CONTROL_LINE_LEN];
+	int line_no = 0;
+	bool ok = true;
+	while(ok && fgets(line, sizeof(line), f) != NULL) {
+		line_no += 1;
+		char *hash = strchr(line, '#');
+		if(hash != NULL) *hash = '\0';
+		char kind[16], path[CONTROL_LINE_LEN];
+		if(sscanf(line, "%15s", kind) != 1) continue; // blank line.
+		if(profile.count == PROFILE_MAX_PHASES) {
+			snprintf(err, err_len, "more than %d phases", PROFILE_MAX_PHASES);
+			ok = false;
+			break;
+		}
+		struct profile_phase *ph = &profile.phases[profile.count];
+		memset(ph, 0, sizeof(struct profile_phase));
+		if(strcmp(kind, "step") == 0) {
+			ph->kind = PHASE_STEP;
+			ok = sscanf(line, "%*s %lf %lf", &ph->seconds, &ph->a) == 2;
+		} else if(strcmp(kind, "ramp") == 0) {
+			ph->kind = PHASE_RAMP;
+			ok = sscanf(line, "%*s %lf %lf %lf", &ph->seconds, &ph->a, &ph->b) == 3;
+		} else if(strcmp(kind, "sine") == 0) {
+			ph->kind = PHASE_SINE;
+			ok = sscanf(line, "%*s %lf %lf %lf %lf", &ph->seconds, &ph->a, &ph->b, &ph->c) == 4 && ph->c > 0;
+		} else if(strcmp(kind, "trace") == 0) {
+			ph->kind = PHASE_TRACE;
+			ok = sscanf(line, "%*s %511s", path) == 1 && profile_load_trace(ph, path);
+		} else if(strcmp(kind, "range") == 0) {
+			ph->kind = PHASE_RANGE;
+			ok = sscanf(line, "%*s %lf %lf", &ph->a, &ph->b) == 2 && ph->b > ph->a;
+		} else if(strcmp(kind, "loop") == 0) {
+			ph->kind = PHASE_LOOP;
+		} else ok = false;
+		profile.count += 1; // counted even on error so that profile_free() frees its trace.
+		if(!ok) snprintf(err, err_len, "bad phase at line %d", line_no);
+	}
+	fclose(f);
+	if(ok && profile.count == 0) {
+		snprintf(err, err_len, "no phases");
+		ok = false;
+	}
+	if(!ok) {
+		profile_free();
+		return false;
+	}
+	snprintf(profile.name, sizeof(profile.name), "%s", file);
+	return true;
+}
+
+static double trace_rps_at(struct profile_phase *ph, double t) {
+	t += ph->trace_t[0];
+	int i = 1;
+	while(i < ph->trace_len - 1 && ph->trace_t[i] < t) i++;
+	if(ph->trace_len == 1 || t <= ph->trace_t[i - 1]) return ph->trace_rps[i - 1];
+	if(t >= ph->trace_t[i]) return ph->trace_rps[i];
+	double frac = (t - ph->trace_t[i - 1]) / (ph->trace_t[i] - ph->trace_t[i - 1]);
+	return ph->trace_rps[i - 1] + frac * (ph->trace_rps[i] - ph->trace_rps[i - 1]);
+}
+
+void profile_start(long now) {
+	profile.running = true;
+	profile.phase = 0;
+	profile.phase_start = now;
+	printf("Load profile %s started, %d phases\n", profile.name, profile.count);
+}
+
+// move profile to phase of now and apply its load. called every CONTROL_TICK_MS.
+void profile_tick(long now) {
+	if(!profile.running) return;
+	for(int steps = 0; steps <= profile.count; steps++) { // phases taking no time are passed in same tick, loop of only those stops.
+		struct profile_phase *ph = &profile.phases[profile.phase];
+		double t = (now - profile.phase_start) / 1e6;
+		if(ph->kind == PHASE_RANGE) set_range(ph->a, ph->b);
+		if(ph->kind != PHASE_RANGE && ph->kind != PHASE_LOOP && t < ph->seconds) {
+			if(ph->kind == PHASE_STEP) set_load(ph->a);
+			else if(ph->kind == PHASE_RAMP) set_load(ph->a + (ph->b - ph->a) * t / ph->seconds);
+			else if(ph->kind == PHASE_SINE) set_load(ph->a + ph->b * sin(2 * M_PI * t / ph->c));
+			else if(ph->kind == PHASE_TRACE) set_load(trace_rps_at(ph, t));
+			return;
+		}
+		// phase is over, next one starts where this one should have ended so that timing doesn't drift.
+		if(ph->kind != PHASE_LOOP) profile.phase_start += ph->seconds * 1e6;
+		profile.phase = ph->kind == PHASE_LOOP? 0: profile.phase + 1;
+		if(profile.phase == profile.count) {
+			profile.running = false;
+			printf("Load profile %s finished, holding %.1lf req/sec\n", profile.name, get_load());
+			return;
+		}
+	}
+	profile.running = false; // only loop and range phases.
+}
+
+// handle one command line, reply is written to out.
+void control_command(char *line, char *out, int out_len) {
+	char cmd[16] = "", arg[CONTROL_LINE_LEN] = "";
+	double x = 0, y = 0;
+	int n = sscanf(line, "%15s %lf %lf", cmd, &x, &y);
+	sscanf(line, "%*s %511s", arg);
+	for(char *p = cmd; *p != '\0'; p++) if(*p >= 'a' && *p <= 'z') *p -= 'a' - 'A';
+	for(char *p = arg; *p != '\0' && strcmp(cmd, "PROFILE") != 0; p++) if(*p >= 'a' && *p <= 'z') *p -= 'a' - 'A';
+
+	if(strcmp(cmd, "RPS") == 0 && n >= 2 && x > 0) {
+		profile.running = false;
+		set_load(x);
+	} else if(strcmp(cmd, "DELAY") == 0 && n >= 2 && x > 0) {
+		profile.running = false;
+		set_delay(x);
+	} else if(strcmp(cmd, "LOW") == 0 || strcmp(cmd, "HIGH") == 0) {
+		profile.running = false;
+		set_preset_load(cmd[0] == 'H');
+	} else if(strcmp(cmd, "RANGE") == 0 && n == 3 && y > x && x >= 0) {
+		set_range(x, y);
+	} else if(strcmp(cmd, "SWING") == 0 && n == 3 && y > 0) {
+		double mean = get_load();
+		profile_free();
+		snprintf(profile.name, sizeof(profile.name), "swing");
+		profile.phases[0] = (struct profile_phase){.kind = PHASE_SINE, .seconds = 1e12, .a = mean, .b = x, .c = y};
+		profile.count = 1;
+		profile_start(now_usec());
+	} else if(strcmp(cmd, "ROUTE") == 0 && (strcmp(arg, "RR") == 0 || strcmp(arg, "CHASH") == 0)) {
+		double factor;
+		if(sscanf(line, "%*s %*s %lf", &factor) == 1 && factor >= 1) chash.load_factor = factor;
+		chash.enabled = strcmp(arg, "CHASH") == 0; // lookup table is kept up to date in both modes.
+	} else if(strcmp(cmd, "CLASS") == 0 && class_find(arg) >= 0) {
+		double weight, share;
+		int n = sscanf(line, "%*s %*s %lf %lf", &weight, &share);
+		if(n < 1 || weight <= 0 || (n == 2 && share < 0)) {
+			snprintf(out, out_len, "ERR want CLASS <name> <weight> [share]\n");
+			return;
+		}
+		classes.list[class_find(arg)].weight = weight;
+		if(n == 2) classes.list[class_find(arg)].share = share;
+	} else if(strcmp(cmd, "WINDOW") == 0 && n >= 2 && x >= 0) {
+		classes.window = x;
+	} else if(strcmp(cmd, "HEDGE") == 0 && (strcmp(arg, "ON") == 0 || strcmp(arg, "OFF") == 0)) {
+		hedging = strcmp(arg, "ON") == 0;
+	} else if(strcmp(cmd, "PROFILE") == 0 && strcmp(arg, "STOP") == 0) {
+		profile.running = false;
+	} else if(strcmp(cmd, "PROFILE") == 0 && arg[0] != '\0') {
+		char err[128];
+		if(!profile_load(arg, err, sizeof(err))) {
+			snprintf(out, out_len, "ERR %s\n", err);
+			return;
+		}
+		profile_start(now_usec());
+	} else if(strcmp(cmd, "EXIT") == 0) {
+		request_exit();
+	} else if(strcmp(cmd, "STATUS") != 0) {
+		snprintf(out, out_len, "ERR unknown command or bad arguments: %s\n", cmd);
+		return;
+	}
+	int len = snprintf(out, out_len, "OK ");
+	len += load_status(out + len, out_len - len);
+	snprintf(out + len, out_len - len, " route=%s load_factor=%.2lf hedging=%s profile=%s phase=%d/%d\n",
+		chash.enabled? "chash": "rr", chash.load_factor, hedging? "on": "off",
+		profile.running? profile.name: "none", profile.running? profile.phase + 1: 0, profile.running? profile.count: 0);
+}
+
+// read what client sent and answer every complete line. returns false when client is gone.
+static bool control_read(int fd) {
+	int len = read(fd, control.line + control.line_len, CONTROL_LINE_LEN - 1 - control.line_len);
+	if(len <= 0) return false;
+	control.line_len += len;
+	control.line[control.line_len] = '\0';
+	char *start = control.line, *nl;
+	while((nl = strchr(start, '\n')) != NULL) {
+		*nl = '\0';
+		if(nl > start && nl[-1] == '\r') nl[-1] = '\0';
+		char reply[CONTROL_LINE_LEN];
+		control_command(start, reply, sizeof(reply));
+		write(fd, reply, strlen(reply));
+		start = nl + 1;
+	}
+	control.line_len -= start - control.line;
+	memmove(control.line, start, control.line_len);
+	if(control.line_len == CONTROL_LINE_LEN - 1) control.line_len = 0; // line too long, drop it.
+	return true;
+}
+
+void *control_loop(void *arg) {
+	while(!control.stop) {
+		struct pollfd fds[2];
+		fds[0].fd = control.lstn_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = control.client_fd; // -1 is ignored by poll().
+		fds[1].events = POLLIN;
+		poll(fds, 2, CONTROL_TICK_MS);
+		if(fds[0].revents & POLLIN) {
+			int fd = accept(control.lstn_fd, NULL, NULL);
+			if(fd >= 0) {
+				if(control.client_fd >= 0) close(control.client_fd);
+				control.client_fd = fd;
+				control.line_len = 0;
+			}
+		}
+		if(control.client_fd >= 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) && !control_read(control.client_fd)) {
+			close(control.client_fd);
+			control.client_fd = -1;
+		}
+		profile_tick(now_usec());
+	}
+	if(control.client_fd >= 0) close(control.client_fd);
+	control.client_fd = -1;
+	return NULL;
+}
+
+static int control_lstn_sock_fd(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // control is local only.
+	addr.sin_port = htons(port);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 5) == -1) {
+		printf("Control socket on port %d failed, runtime control is off\n", port);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// control.lstn_fd is already set when it was handed over by hot restart (handoff.h).
+void init_control_thread() {
+	if(control.port <= 0 && control.lstn_fd < 0) return;
+	if(control.lstn_fd < 0) control.lstn_fd = control_lstn_sock_fd(control.port);
+	if(control.lstn_fd < 0) return;
+	printf("Control socket listening on 127.0.0.1:%d\n", control.port);
+	control.stop = false;
+	control.running = true;
+	pthread_create(&control.thread, NULL, &control_loop, NULL);
+}
+
+// thread stops within CONTROL_TICK_MS, listening socket stays open. running profile is not carried on.
+void stop_control_thread() {
+	if(!control.running) return;
+	control.stop = true;
+	pthread_join(control.thread, NULL);
+	control.running = false;
+}
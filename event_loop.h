@@ -0,0 +1,207 @@
+/*
+Single threaded event loop of autoscaler.
+
+Real clock: every timer is a timerfd in one epoll instance together with the load balancer socket and the fds libvirt
+asks for (hv_libvirt.h plugs its event implementation in here), so sampling ticks, lifecycle events and load balancer
+replies are all handled by one thread and no state needs a lock.
+Virtual clock (simulation): there are no fds. loop moves the clock straight to the next due timer with advance() and
+fires it, so the same tick handlers run through a simulated day.
+
+Timer interval 0 means disarmed, LOOP_ASAP fires on every loop iteration.
+Ids are slot indexes. a slot freed while a batch of events is dispatched is reused only after the batch.
+*/
+
+#define LOOP_MAX_TIMERS 32
+#define LOOP_MAX_WATCHES 32
+#define LOOP_MAX_EVENTS 32
+#define LOOP_TIMER_TAG (1UL << 32) // epoll data.u64 of timers, fds use their slot index.
+#define LOOP_ASAP 1e-9 // seconds.
+
+typedef void (*loop_timer_cb)(int id, void *arg);
+typedef void (*loop_fd_cb)(int id, int fd, int events, void *arg);
+
+struct loop_timer {
+	bool used;
+	bool freed; // removed during current dispatch.
+	int fd; // timerfd, -1 with virtual clock.
+	double interval; // seconds.
+	double due; // virtual clock only.
+	loop_timer_cb cb;
+	void *arg;
+};
+
+struct loop_watch {
+	bool used;
+	bool freed;
+	int fd;
+	int events; // EPOLL* flags.
+	loop_fd_cb cb;
+	void *arg;
+};
+
+struct event_loop {
+	int epoll_fd;
+	bool virtual_clock;
+	void (*advance)(unsigned int seconds); // moves virtual clock.
+	time_t (*now)();
+	void (*post_dispatch)(); // called after every batch of events, eg. deferred frees of libvirt.
+	struct loop_timer timers[LOOP_MAX_TIMERS];
+	struct loop_watch watches[LOOP_MAX_WATCHES];
+} loop;
+
+
+void loop_init(bool virtual_clock, void (*advance)(unsigned int seconds), time_t (*now)()) {
+	memset(&loop, 0, sizeof(loop));
+	loop.virtual_clock = virtual_clock;
+	loop.advance = advance;
+	loop.now = now;
+	loop.epoll_fd = virtual_clock? -1: epoll_create1(0);
+}
+
+static void loop_arm_timerfd(struct loop_timer *t) {
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec)); // zero disarms.
+	if(t->interval > 0) {
+		spec.it_value.tv_sec = (time_t)t->interval;
+		spec.it_value.tv_nsec = (long)((t->interval - (time_t)t->interval) * 1e9);
+		if(spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1;
+		spec.it_interval = spec.it_value;
+	}
+	timerfd_settime(t->fd, 0, &spec, NULL);
+}
+
+// returns timer id or -1.
+int loop_add_timer(double interval, loop_timer_cb cb, void *arg) {
+	for(int i = 0; i < LOOP_MAX_TIMERS; i++) {
+		struct loop_timer *t = &loop.timers[i];
+		if(t->used || t->freed) continue;
+		t->used = true;
+		t->interval = interval;
+		t->cb = cb;
+		t->arg = arg;
+		t->fd = -1;
+		if(loop.virtual_clock) {
+			t->due = loop.now() + interval;
+			return i;
+		}
+		t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		struct epoll_event interested_event;
+		interested_event.data.u64 = LOOP_TIMER_TAG | i;
+		interested_event.events = EPOLLIN;
+		epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, t->fd, &interested_event);
+		loop_arm_timerfd(t);
+		return i;
+	}
+	fprintf(stderr, "Event loop out of timers\n");
+	return -1;
+}
+
+void loop_update_timer(int id, double interval) {
+	if(id < 0 || id >= LOOP_MAX_TIMERS || !loop.timers[id].used) return;
+	struct loop_timer *t = &loop.timers[id];
+	t->interval = interval;
+	if(loop.virtual_clock) t->due = loop.now() + interval;
+	else loop_arm_timerfd(t);
+}
+
+void loop_remove_timer(int id) {
+	if(id < 0 || id >= LOOP_MAX_TIMERS || !loop.timers[id].used) return;
+	struct loop_timer *t = &loop.timers[id];
+	if(t->fd >= 0) close(t->fd); // closing removes it from epoll.
+	t->used = false;
+	t->freed = true;
+}
+
+// returns fd watch id or -1. real clock only.
+int loop_add_fd(int fd, int events, loop_fd_cb cb, void *arg) {
+	for(int i = 0; i < LOOP_MAX_WATCHES; i++) {
+		struct loop_watch *w = &loop.watches[i];
+		if(w->used || w->freed) continue;
+		struct epoll_event interested_event;
+		interested_event.data.u64 = i;
+		interested_event.events = events;
+		if(epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &interested_event) == -1) return -1;
+		w->used = true;
+		w->fd = fd;
+		w->events = events;
+		w->cb = cb;
+		w->arg = arg;
+		return i;
+	}
+	fprintf(stderr, "Event loop out of fd watches\n");
+	return -1;
+}
+
+void loop_update_fd(int id, int events) {
+	if(id < 0 || id >= LOOP_MAX_WATCHES || !loop.watches[id].used) return;
+	struct loop_watch *w = &loop.watches[id];
+	struct epoll_event interested_event;
+	interested_event.data.u64 = id;
+	interested_event.events = events;
+	epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, w->fd, &interested_event);
+	w->events = events;
+}
+
+void loop_remove_fd(int id) {	// fd itself is closed by its owner.
+	if(id < 0 || id >= LOOP_MAX_WATCHES || !loop.watches[id].used) return;
+	epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, loop.watches[id].fd, NULL);
+	loop.watches[id].used = false;
+	loop.watches[id].freed = true;
+}
+
+static void loop_end_dispatch() {
+	for(int i = 0; i < LOOP_MAX_TIMERS; i++) loop.timers[i].freed = false;
+	for(int i = 0; i < LOOP_MAX_WATCHES; i++) loop.watches[i].freed = false;
+	if(loop.post_dispatch != NULL) loop.post_dispatch();
+}
+
+// fire due timers of virtual clock, jumping clock to the earliest one first.
+static void loop_run_virtual() {
+	while(true) {
+		int next = -1;
+		for(int i = 0; i < LOOP_MAX_TIMERS; i++) {
+			struct loop_timer *t = &loop.timers[i];
+			if(t->used && t->interval > 0 && (next == -1 || t->due < loop.timers[next].due)) next = i;
+		}
+		if(next == -1) {
+			fprintf(stderr, "Event loop has nothing to wait for\n");
+			return;
+		}
+		double wait = loop.timers[next].due - loop.now();
+		if(wait >= 1) loop.advance((unsigned int)wait); // simulated clock moves in whole seconds.
+		for(int i = 0; i < LOOP_MAX_TIMERS; i++) {
+			struct loop_timer *t = &loop.timers[i];
+			if(!t->used || t->interval <= 0 || t->due > loop.now()) continue;
+			t->due += t->interval < 1? 1: t->interval;
+			t->cb(i, t->arg);
+		}
+		loop_end_dispatch();
+	}
+}
+
+void loop_run() {
+	if(loop.virtual_clock) {
+		loop_run_virtual();
+		return;
+	}
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	while(true) {
+		int nfds = epoll_wait(loop.epoll_fd, events, LOOP_MAX_EVENTS, -1);
+		for(int i = 0; i < nfds; i++) {
+			unsigned long tag = events[i].data.u64;
+			if(tag & LOOP_TIMER_TAG) {
+				int id = tag & (LOOP_TIMER_TAG - 1);
+				struct loop_timer *t = &loop.timers[id];
+				if(!t->used) continue; // removed by earlier event of this batch.
+				uint64_t expirations;
+				read(t->fd, &expirations, sizeof(expirations));
+				t->cb(id, t->arg);
+			} else {
+				struct loop_watch *w = &loop.watches[tag];
+				if(!w->used) continue;
+				w->cb(tag, w->fd, events[i].events, w->arg);
+			}
+		}
+		loop_end_dispatch();
+	}
+}
@@ -0,0 +1,100 @@
+/*
+Wire format shared by load balancer and server.
+
+Every request/response travels as one fixed size frame of FRAME_LEN bytes, text is NUL padded.
+eg. request  "REQ_ID:12;REQ_DATA:9500;"
+    response "REQ_ID:12;REQ_DATA:9500;RES_DATA:5216037;"
+
+Health check frames: load balancer sends "PING:<seq>;", server I/O thread answers "PONG:<seq>;" at once
+without going through compute workers. PONG is followed by load report of the server,
+eg. "PONG:7;Q:12;QMAX:4;W:4;BUSY:975;RPS:180;P50:21;P99:40;" (see add_load_report() of server.c).
+Request frames may carry TS (send time in micro-seconds), server copies all request fields to the response.
+REQ_DATA above KERNEL_N_MAX (kernels.h) is answered with "ERR:<max>;" instead of RES_DATA.
+
+TCP is a byte stream so one read() can return half a frame or many frames, frame_reader
+collects the bytes until a complete frame is available.
+*/
+
+#define FRAME_LEN 100 // size of every frame on the wire. don't change without changing both sides.
+
+
+struct frame_reader {	// partially received frame of one connection.
+	char buff[FRAME_LEN];
+	int len; // bytes of buff already filled.
+};
+
+/*
+Take bytes from (*data, *len) and return pointer to next complete frame or NULL if more bytes are needed.
+*data and *len are advanced past consumed bytes. Returned pointer is valid until next call.
+Complete frames lying entirely in data are returned in place without copying.
+*/
+static inline char *frame_next(struct frame_reader *fr, char **data, int *len) {
+	if(fr->len == 0 && *len >= FRAME_LEN) { // fast path: whole frame available in data.
+		char *frame = *data;
+		*data += FRAME_LEN;
+		*len -= FRAME_LEN;
+		return frame;
+	}
+	int need = FRAME_LEN - fr->len;
+	int take = *len < need? *len: need;
+	if(take > 0) {
+		memcpy(fr->buff + fr->len, *data, take);
+		fr->len += take;
+		*data += take;
+		*len -= take;
+	}
+	if(fr->len < FRAME_LEN) return NULL;
+	fr->len = 0;
+	return fr->buff;
+}
+
+
+/*
+Frame codec. a frame is list of "KEY:VALUE;" fields, eg. "REQ_ID:12;REQ_DATA:9500;TS:81234;".
+unknown fields are carried along untouched so new fields can be added without breaking old peers.
+*/
+
+// find field KEY in frame and parse its value. returns false if field is missing.
+static inline bool frame_get_long(const char *frame, const char *key, long *val) {
+	int key_len = strlen(key);
+	const char *p = frame;
+	const char *end = frame + strnlen(frame, FRAME_LEN);
+	while(p < end) {
+		if(strncmp(p, key, key_len) == 0 && p[key_len] == ':') {
+			*val = strtol(p + key_len + 1, NULL, 10); // base 10.
+			return true;
+		}
+		p = memchr(p, ';', end - p); // skip to next field.
+		if(p == NULL) return false;
+		p += 1;
+	}
+	return false;
+}
+
+// append field KEY:val; to frame. returns false if frame has no space left.
+static inline bool frame_add_long(char *frame, const char *key, long val) {
+	int len = strnlen(frame, FRAME_LEN);
+	if(len >= FRAME_LEN - 1) return false;
+	int n = snprintf(frame + len, FRAME_LEN - len, "%s:%ld;", key, val);
+	if(n < 0 || len + n >= FRAME_LEN) {
+		frame[len] = '\0'; // don't leave half written field.
+		return false;
+	}
+	return true;
+}
+
+// build request frame. ts is send time in micro-seconds, server echoes it back so that sender can measure latency.
+static inline void frame_encode_request(char *frame, long req_id, long req_data, long ts) {
+	memset(frame, 0, FRAME_LEN);
+	snprintf(frame, FRAME_LEN, "REQ_ID:%ld;REQ_DATA:%ld;TS:%ld;", req_id, req_data, ts);
+}
+
+static inline void frame_encode_ping(char *frame, const char *type, long seq) {	// type is "PING" or "PONG".
+	memset(frame, 0, FRAME_LEN);
+	snprintf(frame, FRAME_LEN, "%s:%ld;", type, seq);
+}
+
+static inline bool frame_is(const char *frame, const char *type) {	// true if first field of frame is type.
+	int len = strlen(type);
+	return strncmp(frame, type, len) == 0 && frame[len] == ':';
+}
@@ -0,0 +1,285 @@
+/*
+Hot restart of load balancer (-u path), a new build takes over from the running one without closing any socket.
+
+Running load balancer listens on unix socket at path. A new process started with the same -u connects there first:
+old process stops generating requests and accepting proxy clients, waits up to HANDOFF_DRAIN_US for requests in
+flight to be answered, stops its response and control threads and sends over SCM_RIGHTS
+  - header: autoscaler listening socket, autoscaler connection, control and proxy listening sockets, membership
+    generation, next REQ_ID and current offered load.
+  - one message per live_serv_list entry with its server socket, circuit state and partially read frame.
+  - requests still in flight, HANDOFF_BATCH per message, so that answers reaching the new process are matched.
+New process answers "OK" once everything is in place and carries on: servers and autoscaler keep their connections,
+autoscaler deltas keep applying to the same generation, nothing is lost or reconnected. Old process closes its copies
+(close, never shutdown, the sockets are shared), keeps the proxy sessions it has until clients close them (at most
+HANDOFF_SESSION_DRAIN_S) and exits. When new process fails before "OK" old one starts its threads again.
+Without a load balancer listening at path the process starts cold, either way it listens at path for the next restart.
+Messages are SOCK_SEQPACKET so every struct arrives whole. Both sides must be built with the same HANDOFF_VERSION.
+*/
+
+#include <sys/un.h>
+
+#define HANDOFF_VERSION 2
+#define HANDOFF_DRAIN_US 1000000 // in-flight requests left after this are handed over instead.
+#define HANDOFF_SESSION_DRAIN_S 60
+#define HANDOFF_TIMEOUT_MS 5000 // every message of the handoff, a stuck peer is given up.
+#define HANDOFF_BATCH 256 // in-flight entries per message.
+
+#define HANDOFF_FD_LISTEN 0 // autoscaler listening socket.
+#define HANDOFF_FD_AUTOSCALER 1
+#define HANDOFF_FD_CONTROL 2
+#define HANDOFF_FD_PROXY 3
+#define HANDOFF_FDS 4
+
+struct handoff_header {
+	int version;
+	int sizes[3]; // of the three structs, differ when builds don't match.
+	int has_fd[HANDOFF_FDS]; // sockets follow in this order, missing ones are skipped.
+	long membership_gen;
+	long request_id;
+	unsigned int inter_req_delay;
+	int range_low, range_high;
+	int servers;
+	int inflight;
+};
+
+struct handoff_server {
+	char IP[64];
+	int circuit;
+	int failures;
+	long open_usec;
+	long opened_at;
+	bool sock_dead;
+	long sent;
+	long received;
+	int partial_len; // frame read half when response thread stopped.
+	char partial[FRAME_LEN];
+};
+
+struct handoff_inflight {
+	long req_id;
+	long req_data;
+	long ts;
+	long first_sent_at; // monotonic clock, same in both processes.
+	long sent_at;
+	int server_idx; // position in server messages, -1 for none.
+	int hedge_idx;
+	int attempts;
+	int req_class;
+};
+
+struct handoff_context {
+	char *path; // -u option, NULL is off.
+	int lstn_fd;
+} handoff = {.lstn_fd = -1};
+
+
+static bool handoff_wait(int sock, short events) {
+	struct pollfd pfd = {.fd = sock, .events = events};
+	return poll(&pfd, 1, HANDOFF_TIMEOUT_MS) == 1 && (pfd.revents & events);
+}
+
+// one message with nfds sockets attached.
+static bool handoff_send(int sock, void *data, int len, int *fds, int nfds) {
+	struct iovec iov = {.iov_base = data, .iov_len = len};
+	struct msghdr msg;
+	char ctrl[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)];
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(nfds > 0) {
+		memset(ctrl, 0, sizeof(ctrl));
+		msg.msg_control = ctrl;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+	return handoff_wait(sock, POLLOUT) && sendmsg(sock, &msg, MSG_NOSIGNAL) == len;
+}
+
+// one message of exactly len bytes, attached sockets go to fds (unused ones are -1). false on short message or timeout.
+static bool handoff_recv(int sock, void *data, int len, int *fds, int max_fds) {
+	struct iovec iov = {.iov_base = data, .iov_len = len};
+	struct msghdr msg;
+	char ctrl[CMSG_SPACE(sizeof(int) * HANDOFF_FDS)];
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+	for(int i = 0; i < max_fds; i++) fds[i] = -1;
+	if(!handoff_wait(sock, POLLIN)) return false;
+	int n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *got = (int *)CMSG_DATA(cmsg);
+		for(int i = 0; i < count; i++) {
+			if(i < max_fds) fds[i] = got[i];
+			else close(got[i]); // more than expected, don't leak them.
+		}
+	}
+	return n == len && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+}
+
+static bool handoff_addr(char *path, struct sockaddr_un *addr) {
+	if(strlen(path) >= sizeof(addr->sun_path)) return false;
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+// connection to running load balancer, -1 when none listens at path.
+int handoff_connect(char *path) {
+	struct sockaddr_un addr;
+	if(!handoff_addr(path, &addr)) return -1;
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(sock < 0) return -1;
+	if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+// listen for next hot restart. socket file of previous process is replaced, it is not reachable any more.
+int handoff_listen(char *path) {
+	struct sockaddr_un addr;
+	if(!handoff_addr(path, &addr)) return -1;
+	int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(sock < 0) return -1;
+	unlink(path);
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 1) == -1) {
+		printf("Hot restart socket %s failed\n", path);
+		close(sock);
+		return -1;
+	}
+	printf("Hot restart socket listening on %s\n", path);
+	return sock;
+}
+
+static void handoff_header_init(struct handoff_header *h) {
+	memset(h, 0, sizeof(*h));
+	h->version = HANDOFF_VERSION;
+	h->sizes[0] = sizeof(struct handoff_header);
+	h->sizes[1] = sizeof(struct handoff_server);
+	h->sizes[2] = sizeof(struct handoff_inflight);
+}
+
+static bool handoff_header_valid(struct handoff_header *h) {
+	struct handoff_header want;
+	handoff_header_init(&want);
+	return h->version == want.version && memcmp(h->sizes, want.sizes, sizeof(want.sizes)) == 0;
+}
+
+// position of server socket in live_serv_list, the index both sides agree on. -1 when not there.
+static int handoff_server_idx(int server_fd) {
+	int idx = 0;
+	for(struct live_server_entry* eptr = live_serv_list; eptr != NULL; eptr = eptr->next, idx++) {
+		if(server_fd != -1 && eptr->server_sock_fd == server_fd) return idx;
+	}
+	return -1;
+}
+
+// old process: header with role sockets (-1 for missing ones), servers and in-flight requests. threads using them
+// are stopped. h has the scalar fields filled.
+bool handoff_send_state(int sock, struct handoff_header *h, int *role_fds, struct frame_reader *readers, int readers_len) {
+	int fds[HANDOFF_FDS], nfds = 0;
+	for(int i = 0; i < HANDOFF_FDS; i++) {
+		h->has_fd[i] = role_fds[i] >= 0;
+		if(role_fds[i] >= 0) fds[nfds++] = role_fds[i];
+	}
+	h->servers = 0;
+	for(struct live_server_entry* eptr = live_serv_list; eptr != NULL; eptr = eptr->next) h->servers += 1;
+	h->inflight = inflight.count;
+	if(!handoff_send(sock, h, sizeof(*h), fds, nfds)) return false;
+
+	struct handoff_server s;
+	for(struct live_server_entry* eptr = live_serv_list; eptr != NULL; eptr = eptr->next) {
+		send_wtail(eptr); // new process starts writing at a frame boundary. threads are stopped, no lock needed.
+		memset(&s, 0, sizeof(s));
+		snprintf(s.IP, sizeof(s.IP), "%s", eptr->IP);
+		s.circuit = eptr->circuit;
+		s.failures = eptr->failures;
+		s.open_usec = eptr->open_usec;
+		s.opened_at = eptr->opened_at;
+		s.sock_dead = eptr->sock_dead;
+		s.sent = eptr->sent;
+		s.received = eptr->received;
+		struct frame_reader *reader = &readers[eptr->server_sock_fd % readers_len];
+		s.partial_len = reader->len;
+		memcpy(s.partial, reader->buff, reader->len);
+		if(!handoff_send(sock, &s, sizeof(s), &eptr->server_sock_fd, 1)) return false;
+	}
+
+	struct handoff_inflight batch[HANDOFF_BATCH];
+	int n = 0, left = h->inflight;
+	for(int i = inflight.oldest; i != -1 && left > 0; i = inflight.slots[i].newer) { // oldest first, new process appends in the same order.
+		struct inflight_entry *e = &inflight.slots[i];
+		batch[n].req_id = e->req_id;
+		batch[n].req_data = e->req_data;
+		batch[n].ts = e->ts;
+		batch[n].first_sent_at = e->first_sent_at;
+		batch[n].sent_at = e->sent_at;
+		batch[n].server_idx = handoff_server_idx(e->server_fd);
+		batch[n].hedge_idx = handoff_server_idx(e->hedge_fd);
+		batch[n].attempts = e->attempts;
+		batch[n].req_class = e->req_class;
+		n += 1;
+		left -= 1;
+		if(n == HANDOFF_BATCH || left == 0) {
+			if(!handoff_send(sock, batch, n * sizeof(struct handoff_inflight), NULL, 0)) return false;
+			n = 0;
+		}
+	}
+	return true;
+}
+
+// new process: header and role sockets, missing ones are -1.
+bool handoff_recv_header(int sock, struct handoff_header *h, int *role_fds) {
+	int fds[HANDOFF_FDS];
+	if(!handoff_recv(sock, h, sizeof(*h), fds, HANDOFF_FDS)) return false;
+	int next = 0;
+	for(int i = 0; i < HANDOFF_FDS; i++) role_fds[i] = h->has_fd[i]? fds[next++]: -1;
+	if(handoff_header_valid(h)) return true;
+	printf("Hot restart: running load balancer is of another build (version %d)\n", h->version);
+	for(int i = 0; i < HANDOFF_FDS; i++) if(role_fds[i] >= 0) close(role_fds[i]);
+	return false;
+}
+
+// new process: next server and its socket (server_fd). false on error.
+bool handoff_recv_server(int sock, struct handoff_server *s, int *server_fd) {
+	if(!handoff_recv(sock, s, sizeof(*s), server_fd, 1)) return false;
+	s->IP[sizeof(s->IP) - 1] = '\0';
+	if(s->partial_len < 0 || s->partial_len >= FRAME_LEN) s->partial_len = 0;
+	return *server_fd >= 0;
+}
+
+// new process: in-flight requests. server_fds maps server index to socket of this process. false on error.
+bool handoff_recv_inflight(int sock, int count, int *server_fds, int servers) {
+	struct handoff_inflight batch[HANDOFF_BATCH];
+	int fd;
+	while(count > 0) {
+		int n = count < HANDOFF_BATCH? count: HANDOFF_BATCH;
+		if(!handoff_recv(sock, batch, n * sizeof(struct handoff_inflight), &fd, 0)) return false;
+		pthread_mutex_lock(&inflight.lock);
+		for(int i = 0; i < n; i++) {
+			struct inflight_entry *e = inflight_insert(batch[i].req_id);
+			if(e == NULL) continue;
+			e->req_data = batch[i].req_data;
+			e->ts = batch[i].ts;
+			e->first_sent_at = batch[i].first_sent_at;
+			e->sent_at = batch[i].sent_at;
+			e->server_fd = batch[i].server_idx >= 0 && batch[i].server_idx < servers? server_fds[batch[i].server_idx]: -1;
+			e->hedge_fd = batch[i].hedge_idx >= 0 && batch[i].hedge_idx < servers? server_fds[batch[i].hedge_idx]: -1;
+			e->attempts = batch[i].attempts;
+			e->req_class = batch[i].req_class;
+		}
+		pthread_mutex_unlock(&inflight.lock);
+		count -= n;
+	}
+	return true;
+}
@@ -0,0 +1,457 @@
+/*
+libvirt backend of hypervisor.h, talks to real domains through qemu:///system.
+
+libvirt's event implementation is autoscaler event loop (event_loop.h): handles and timeouts libvirt registers become
+epoll fds and timerfds of the loop, so domain lifecycle events arrive on the same thread as the sampling ticks.
+
+Guest addresses come from a domain -> IP cache. it is filled in bulk from DHCP leases of the active libvirt networks
+(one virNetworkGetDHCPLeases() per network answers for every guest), leases are matched to domains by the MAC
+addresses in domain XML, read once per domain. a known address costs no libvirt call, so notifications and consistency
+ticks never wait for discovery. entry of a domain is dropped on its lifecycle events and when autoscaler starts or
+stops it. lease files of libvirt dnsmasq are watched with inotify, a new lease marks the cache stale and next miss
+refreshes it once. without the watch misses refresh at most every LV_IP_RETRY_SEC. a domain not found in any network
+lease (eg. bridged to outside DHCP) is asked alone with virDomainInterfaceAddresses() like before.
+*/
+
+#define LV_LEASE_DIR "/var/lib/libvirt/dnsmasq" // <bridge>.status files, rewritten on every lease change.
+#define LV_IP_RETRY_SEC 1 // domain without address is looked up again after this.
+#define LV_LEASE_MAX_AGE 10 // miss refreshes leases after this even without inotify event, lease files may live elsewhere.
+#define LV_MAX_MACS 4 // interfaces per domain matched against leases.
+
+virConnectPtr conn;
+virDomainPtr *lv_doms; // list handed to autoscaler, lifecycle events are mapped back to these handles.
+int lv_doms_count = 0;
+
+struct lv_ip_entry {	// cached address of lv_doms[i].
+	char macs[LV_MAX_MACS][18]; // "52:54:00:..", from domain XML.
+	int n_macs; // -1 until XML is read.
+	char IP[64]; // "" when not known.
+	time_t tried_at; // last lookup that found nothing.
+	unsigned int cid; // guest CID of <vsock> device, 0 when not read yet or domain has none.
+} *lv_ips;
+
+bool lv_use_vsock = false; // autoscaler -V, domains are given to load balancer as "vsock:<cid>" when they have a CID.
+
+struct lv_lease_cache {
+	bool stale; // leases changed since last bulk refresh.
+	time_t refreshed_at;
+	int networks; // active networks seen by last refresh, 0 means leases can't be used.
+	int inotify_fd; // -1 when lease files can't be watched.
+	int watch; // event loop watch of inotify_fd.
+	long refreshes; // bulk refreshes, reported on close.
+	long single_lookups; // per domain lookups.
+} lv_leases = {.stale = true, .inotify_fd = -1, .watch = -1};
+
+struct lv_callback {	// libvirt callback of one loop fd watch or timer.
+	void *cb;
+	void *opaque;
+	virFreeCallback ff;
+} lv_handles[LOOP_MAX_WATCHES], lv_timeouts[LOOP_MAX_TIMERS];
+
+struct lv_callback lv_frees[LOOP_MAX_WATCHES + LOOP_MAX_TIMERS]; // ff must not be called from remove callback, run after dispatch.
+int lv_frees_count = 0;
+
+#define LV_SAMPLE_PARAMS 8 // typed params of one cpu stats sample, libvirt returns 3 (cpu_time, user_time, system_time).
+struct mem_pool sample_pool; // cpu stats are sampled every 5 seconds for every domain.
+
+static int lv_to_epoll(int events) {
+	return (events & VIR_EVENT_HANDLE_READABLE? EPOLLIN: 0) | (events & VIR_EVENT_HANDLE_WRITABLE? EPOLLOUT: 0);
+}
+
+static int lv_from_epoll(int events) {
+	return (events & EPOLLIN? VIR_EVENT_HANDLE_READABLE: 0) | (events & EPOLLOUT? VIR_EVENT_HANDLE_WRITABLE: 0) |
+		(events & EPOLLERR? VIR_EVENT_HANDLE_ERROR: 0) | (events & EPOLLHUP? VIR_EVENT_HANDLE_HANGUP: 0);
+}
+
+static double lv_interval(int timeout_ms) {	// libvirt: -1 disabled, 0 every loop iteration.
+	if(timeout_ms < 0) return 0;
+	if(timeout_ms == 0) return LOOP_ASAP;
+	return timeout_ms / 1000.0;
+}
+
+static void lv_defer_free(struct lv_callback *c) {
+	if(c->ff != NULL && lv_frees_count < LOOP_MAX_WATCHES + LOOP_MAX_TIMERS) lv_frees[lv_frees_count++] = *c;
+	c->ff = NULL;
+}
+
+static void lv_run_frees() {
+	for(int i = 0; i < lv_frees_count; i++) lv_frees[i].ff(lv_frees[i].opaque);
+	lv_frees_count = 0;
+}
+
+static void lv_handle_fired(int id, int fd, int events, void *arg) {
+	((virEventHandleCallback)lv_handles[id].cb)(id + 1, fd, lv_from_epoll(events), lv_handles[id].opaque);
+}
+
+static int lv_add_handle(int fd, int events, virEventHandleCallback cb, void *opaque, virFreeCallback ff) {
+	int id = loop_add_fd(fd, lv_to_epoll(events), lv_handle_fired, NULL);
+	if(id < 0) return -1;
+	lv_handles[id].cb = cb;
+	lv_handles[id].opaque = opaque;
+	lv_handles[id].ff = ff;
+	return id + 1; // libvirt ids start from 1.
+}
+
+static void lv_update_handle(int watch, int events) {
+	loop_update_fd(watch - 1, lv_to_epoll(events));
+}
+
+static int lv_remove_handle(int watch) {
+	if(watch < 1 || watch > LOOP_MAX_WATCHES || !loop.watches[watch - 1].used) return -1;
+	loop_remove_fd(watch - 1);
+	lv_defer_free(&lv_handles[watch - 1]);
+	return 0;
+}
+
+static void lv_timeout_fired(int id, void *arg) {
+	((virEventTimeoutCallback)lv_timeouts[id].cb)(id + 1, lv_timeouts[id].opaque);
+}
+
+static int lv_add_timeout(int timeout_ms, virEventTimeoutCallback cb, void *opaque, virFreeCallback ff) {
+	int id = loop_add_timer(lv_interval(timeout_ms), lv_timeout_fired, NULL);
+	if(id < 0) return -1;
+	lv_timeouts[id].cb = cb;
+	lv_timeouts[id].opaque = opaque;
+	lv_timeouts[id].ff = ff;
+	return id + 1;
+}
+
+static void lv_update_timeout(int timer, int timeout_ms) {
+	loop_update_timer(timer - 1, lv_interval(timeout_ms));
+}
+
+static int lv_remove_timeout(int timer) {
+	if(timer < 1 || timer > LOOP_MAX_TIMERS || !loop.timers[timer - 1].used) return -1;
+	loop_remove_timer(timer - 1);
+	lv_defer_free(&lv_timeouts[timer - 1]);
+	return 0;
+}
+
+static int lv_dom_index(hv_domain dom) {
+	for(int i = 0; i < lv_doms_count; i++) {
+		if(lv_doms[i] == (virDomainPtr)dom) return i;
+	}
+	return -1;
+}
+
+// forget address of domain, it gets a new lease when it boots again.
+static void lv_forget_ip(int idx) {
+	if(idx < 0) return;
+	lv_ips[idx].IP[0] = '\0';
+	lv_ips[idx].tried_at = 0;
+	lv_ips[idx].cid = 0; // auto assigned CID may change with next boot.
+}
+
+// guest CID from "<vsock model='virtio'><cid auto='yes' address='3'/></vsock>", auto assigned CID is only in the
+// XML of running domain. 0 when domain has no vsock device.
+static unsigned int lv_read_cid(hv_domain dom) {
+	unsigned int cid = 0;
+	char *xml = virDomainGetXMLDesc(dom, 0);
+	if(xml == NULL) return 0;
+	char *p = strstr(xml, "<vsock");
+	if(p != NULL) p = strstr(p, "<cid");
+	char *end = p != NULL? strchr(p, '>'): NULL;
+	if(end != NULL && (p = strstr(p, "address=")) != NULL && p < end) sscanf(p, "address=%*c%u", &cid);
+	free(xml);
+	return cid;
+}
+
+// MAC addresses of domain interfaces from its XML, "<mac address='52:54:00:aa:bb:cc'/>".
+static void lv_read_macs(int idx) {
+	struct lv_ip_entry *e = &lv_ips[idx];
+	e->n_macs = 0;
+	char *xml = virDomainGetXMLDesc(lv_doms[idx], 0);
+	if(xml == NULL) return;
+	for(char *p = strstr(xml, "<mac address="); p != NULL && e->n_macs < LV_MAX_MACS; p = strstr(p + 1, "<mac address=")) {
+		if(sscanf(p, "<mac address=%*c%17[0-9a-fA-F:]", e->macs[e->n_macs]) == 1) e->n_macs += 1;
+	}
+	free(xml);
+}
+
+// fill cache from DHCP leases of all active networks.
+static void lv_refresh_leases() {
+	virNetworkPtr *nets = NULL;
+	int n_nets = virConnectListAllNetworks(conn, &nets, VIR_CONNECT_LIST_NETWORKS_ACTIVE);
+	lv_leases.stale = false;
+	lv_leases.refreshed_at = time(NULL);
+	lv_leases.refreshes += 1;
+	lv_leases.networks = n_nets > 0? n_nets: 0;
+	for(int i = 0; i < lv_doms_count; i++) {
+		if(lv_ips[i].n_macs < 0) lv_read_macs(i);
+	}
+	for(int n = 0; n < n_nets; n++) {
+		virNetworkDHCPLeasePtr *leases = NULL;
+		int n_leases = virNetworkGetDHCPLeases(nets[n], NULL, &leases, 0);
+		for(int l = 0; l < n_leases; l++) {
+			if(leases[l]->type != VIR_IP_ADDR_TYPE_IPV4 || leases[l]->mac == NULL || leases[l]->ipaddr == NULL) continue;
+			for(int i = 0; i < lv_doms_count; i++) {
+				for(int m = 0; m < lv_ips[i].n_macs; m++) {
+					if(strcasecmp(lv_ips[i].macs[m], leases[l]->mac) == 0) snprintf(lv_ips[i].IP, sizeof(lv_ips[i].IP), "%s", leases[l]->ipaddr);
+				}
+			}
+		}
+		for(int l = 0; l < n_leases; l++) virNetworkDHCPLeaseFree(leases[l]);
+		free(leases);
+		virNetworkFree(nets[n]);
+	}
+	free(nets);
+}
+
+static void lv_leases_changed(int id, int fd, int events, void *arg) {
+	char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while(read(fd, buff, sizeof(buff)) > 0); // which file changed doesn't matter.
+	lv_leases.stale = true;
+}
+
+static void lv_watch_leases() {
+	lv_leases.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(lv_leases.inotify_fd >= 0 && inotify_add_watch(lv_leases.inotify_fd, LV_LEASE_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) >= 0) {
+		lv_leases.watch = loop_add_fd(lv_leases.inotify_fd, EPOLLIN, lv_leases_changed, NULL);
+		if(lv_leases.watch >= 0) return;
+	}
+	printf("Can't watch %s, guest addresses are refreshed on lookup misses\n", LV_LEASE_DIR);
+	if(lv_leases.inotify_fd >= 0) close(lv_leases.inotify_fd);
+	lv_leases.inotify_fd = -1;
+}
+
+static int lv_lifecycle(virConnectPtr c, virDomainPtr dom, int event, int detail, void *opaque) {
+	int hv_event;
+	if(event == VIR_DOMAIN_EVENT_STARTED) hv_event = HV_EVENT_STARTED;
+	else if(event == VIR_DOMAIN_EVENT_STOPPED) hv_event = HV_EVENT_STOPPED;
+	else return 0;
+	for(int i = 0; i < lv_doms_count; i++) {
+		if(strcmp(virDomainGetName(lv_doms[i]), virDomainGetName(dom)) == 0) { // event carries its own handle.
+			lv_forget_ip(i);
+			if(hv_lifecycle != NULL) hv_lifecycle(lv_doms[i], hv_event);
+			break;
+		}
+	}
+	return 0;
+}
+
+static int lv_open(const char *uri) {
+	pool_init(&sample_pool, "cpu sample", LV_SAMPLE_PARAMS * sizeof(virTypedParameter), 0);
+	virEventRegisterImpl(lv_add_handle, lv_update_handle, lv_remove_handle, lv_add_timeout, lv_update_timeout, lv_remove_timeout); // before connecting.
+	loop.post_dispatch = lv_run_frees;
+	conn = virConnectOpen(uri);
+	if(conn == NULL) return FAILED;
+	if(virConnectDomainEventRegisterAny(conn, NULL, VIR_DOMAIN_EVENT_ID_LIFECYCLE, VIR_DOMAIN_EVENT_CALLBACK(lv_lifecycle), NULL, NULL) < 0) {
+		printf("Lifecycle events not available, stopped domains are found by polling\n");
+	}
+	lv_watch_leases();
+	return SUCCESS;
+}
+
+static void lv_close() {
+	printf("Guest address lookups: %ld lease refreshes, %ld single domain lookups\n", lv_leases.refreshes, lv_leases.single_lookups);
+	if(lv_leases.inotify_fd >= 0) {
+		loop_remove_fd(lv_leases.watch);
+		close(lv_leases.inotify_fd);
+	}
+	virConnectClose(conn);
+}
+
+static int lv_list_domains(hv_domain **domains) {
+	virDomainPtr *doms = NULL;
+	int count = virConnectListAllDomains(conn, &doms, 0); // flags = 0
+	*domains = (hv_domain *)doms;
+	lv_doms = doms;
+	lv_doms_count = count > 0? count: 0;
+	free(lv_ips);
+	lv_ips = calloc(lv_doms_count > 0? lv_doms_count: 1, sizeof(struct lv_ip_entry));
+	for(int i = 0; i < lv_doms_count; i++) lv_ips[i].n_macs = -1;
+	lv_leases.stale = true;
+	return count;
+}
+
+static const char *lv_domain_name(hv_domain dom) {
+	return virDomainGetName((virDomainPtr)dom);
+}
+
+static int lv_is_active(hv_domain dom) {
+	return virDomainIsActive((virDomainPtr)dom);
+}
+
+// running domains in one call instead of virDomainIsActive() round trip per domain. names are cached in the handles.
+static int lv_active_states(hv_domain *domains, int count, char *active) {
+	virDomainPtr *doms = NULL;
+	int n = virConnectListAllDomains(conn, &doms, VIR_CONNECT_LIST_DOMAINS_ACTIVE);
+	if(n < 0) return -1;
+	for(int i = 0; i < count; i++) {
+		const char *name = virDomainGetName((virDomainPtr)domains[i]);
+		active[i] = 0;
+		for(int j = 0; j < n && active[i] == 0; j++) {
+			if(strcmp(name, virDomainGetName(doms[j])) == 0) active[i] = 1;
+		}
+	}
+	for(int j = 0; j < n; j++) virDomainFree(doms[j]);
+	free(doms);
+	return 0;
+}
+
+static int lv_create(hv_domain dom) {
+	lv_forget_ip(lv_dom_index(dom));
+	return virDomainCreate((virDomainPtr)dom);
+}
+
+static int lv_shutdown(hv_domain dom) {
+	lv_forget_ip(lv_dom_index(dom));
+	return virDomainShutdown((virDomainPtr)dom);
+}
+
+static int lv_num_active() {
+	return virConnectNumOfDomains(conn);
+}
+
+static unsigned long long lv_guest_cpu_time(hv_domain dom) {
+	virDomainPtr domPtr = (virDomainPtr)dom;
+	int nparams = virDomainGetCPUStats(domPtr, NULL, 0, -1, 1, 0); // nparams
+	if(nparams < 3) return 0;
+	bool pooled = nparams <= LV_SAMPLE_PARAMS;
+	virTypedParameterPtr params = pooled? pool_alloc(&sample_pool): calloc(nparams, sizeof(virTypedParameter));
+	unsigned long long int guest_time = 0;
+	if(virDomainGetCPUStats(domPtr, params, nparams, -1, 1, 0) >= 3) { // total stats.
+		guest_time = params[0].value.ul - (params[1].value.ul + params[2].value.ul);	// guest time = total - (user + system)
+	}
+	virTypedParamsClear(params, nparams); // frees string values if any, not the array.
+	if(pooled) pool_free(&sample_pool, params);
+	else free(params);
+	return guest_time > 0? guest_time: 0;	// somtimes guest time is -ve so to avoid overflow.
+}
+
+// vCPU stats of all domains in one call. steal is "delay" (run queue wait, libvirt >= 7.9), older libvirt has "wait".
+static int lv_vcpu_stats(hv_domain *domains, int count, struct hv_vcpu_sample *out) {
+	virDomainPtr list[count + 1];
+	memcpy(list, domains, count * sizeof(virDomainPtr));
+	list[count] = NULL;
+	memset(out, 0, count * sizeof(*out));
+	virDomainStatsRecordPtr *records = NULL;
+	int n = virDomainListGetStats(list, VIR_DOMAIN_STATS_VCPU, &records, 0);
+	if(n < 0) return -1;
+	for(int r = 0; r < n; r++) {
+		const char *name = virDomainGetName(records[r]->dom);
+		int i = 0;
+		while(i < count && strcmp(name, virDomainGetName(list[i])) != 0) i++;
+		unsigned int vcpus = 0;
+		if(i == count || virTypedParamsGetUInt(records[r]->params, records[r]->nparams, "vcpu.current", &vcpus) != 1) continue;
+		for(unsigned int v = 0; v < vcpus; v++) {
+			char key[80];
+			unsigned long long value = 0;
+			snprintf(key, sizeof(key), "vcpu.%u.time", v);
+			if(virTypedParamsGetULLong(records[r]->params, records[r]->nparams, key, &value) == 1) out[i].run_ns += value;
+			snprintf(key, sizeof(key), "vcpu.%u.delay", v);
+			if(virTypedParamsGetULLong(records[r]->params, records[r]->nparams, key, &value) != 1) {
+				snprintf(key, sizeof(key), "vcpu.%u.wait", v);
+				if(virTypedParamsGetULLong(records[r]->params, records[r]->nparams, key, &value) != 1) value = 0;
+			}
+			out[i].steal_ns += value;
+		}
+		out[i].vcpus = vcpus;
+	}
+	virDomainStatsRecordListFree(records);
+	return 0;
+}
+
+static int lv_host_cpu(hv_domain dom, struct hv_host_sample *out) {	// one connection is one host.
+	int nparams = 0;
+	if(virNodeGetCPUStats(conn, VIR_NODE_CPU_STATS_ALL_CPUS, NULL, &nparams, 0) != 0 || nparams <= 0) return -1;
+	virNodeCPUStats params[nparams];
+	if(virNodeGetCPUStats(conn, VIR_NODE_CPU_STATS_ALL_CPUS, params, &nparams, 0) != 0) return -1;
+	out->busy_ns = 0;
+	out->total_ns = 0;
+	for(int i = 0; i < nparams; i++) {
+		out->total_ns += params[i].value;
+		if(strcmp(params[i].field, VIR_NODE_CPU_STATS_KERNEL) == 0 || strcmp(params[i].field, VIR_NODE_CPU_STATS_USER) == 0) out->busy_ns += params[i].value;
+	}
+	return 0;
+}
+
+static void lv_free_ifaces(virDomainInterfacePtr *ifaces, int count) {
+	for(int i = 0; i < count; i++) virDomainInterfaceFree(ifaces[i]);
+	free(ifaces);
+}
+
+// address of one domain from libvirt, for domains the lease cache can't answer.
+static int lv_query_ip(hv_domain dom, char *IP, int len) {
+	virDomainInterfacePtr *ifaces = NULL;
+	lv_leases.single_lookups += 1;
+	int ifaces_count = virDomainInterfaceAddresses((virDomainPtr)dom, &ifaces, 0, 0);
+	if(ifaces == NULL && ifaces_count >= 0) return HV_IP_PENDING; // when machine is booting it gives NULL sometimes.
+	if(ifaces_count < 0) {
+		printf("Error getting interfaces\n");
+		return HV_IP_ERROR;
+	}
+	if(ifaces_count == 0 || ifaces[0]->naddrs == 0 || ifaces[0]->addrs[0].addr == NULL) {
+		lv_free_ifaces(ifaces, ifaces_count);
+		return HV_IP_PENDING;
+	}
+
+	virDomainIPAddressPtr ip_addr = ifaces[0]->addrs + 0; // only one interface hence ifaces[0] is used for VM IP. +0 for first entry of array of IPs of interface.
+	snprintf(IP, len, "%s", ip_addr->addr);
+	lv_free_ifaces(ifaces, ifaces_count);
+	return HV_IP_FOUND;
+}
+
+static int lv_domain_ip(hv_domain dom, char *IP, int len) {
+	int idx = lv_dom_index(dom);
+	if(idx < 0) return lv_query_ip(dom, IP, len); // not from lv_list_domains().
+	struct lv_ip_entry *e = &lv_ips[idx];
+	if(lv_use_vsock && e->cid == 0 && virDomainIsActive(dom) == 1) e->cid = lv_read_cid(dom);
+	if(lv_use_vsock && e->cid > 2) { // 0..2 are hypervisor and host.
+		snprintf(IP, len, "vsock:%u", e->cid);
+		return HV_IP_FOUND;
+	}
+	if(e->IP[0] == '\0') {
+		time_t now = time(NULL);
+		if(!lv_leases.stale && now - e->tried_at < LV_IP_RETRY_SEC) return HV_IP_PENDING; // looked up moments ago.
+		long age = now - lv_leases.refreshed_at;
+		if(lv_leases.stale || age >= LV_LEASE_MAX_AGE || (lv_leases.inotify_fd < 0 && age >= LV_IP_RETRY_SEC)) lv_refresh_leases();
+		if(e->IP[0] == '\0' && (lv_leases.networks == 0 || e->n_macs <= 0)) {
+			int found = lv_query_ip(dom, e->IP, sizeof(e->IP));
+			if(found != HV_IP_FOUND) e->IP[0] = '\0';
+			if(found == HV_IP_ERROR) return found;
+		}
+		if(e->IP[0] == '\0') {
+			e->tried_at = now;
+			return HV_IP_PENDING; // booting, no lease yet.
+		}
+	}
+	snprintf(IP, len, "%s", e->IP);
+	return HV_IP_FOUND;
+}
+
+static const char *lv_host_name(hv_domain dom) {	// one connection is one host.
+	static char *host = NULL;
+	if(host == NULL) host = virConnectGetHostname(conn);
+	return host != NULL? host: "localhost";
+}
+
+static void lv_sleep(unsigned int seconds) {
+	sleep(seconds);
+}
+
+static time_t lv_now() {
+	return time(NULL);
+}
+
+struct hypervisor hv_libvirt = {
+	.name = "libvirt",
+	.open = lv_open,
+	.close = lv_close,
+	.list_domains = lv_list_domains,
+	.domain_name = lv_domain_name,
+	.is_active = lv_is_active,
+	.active_states = lv_active_states,
+	.create = lv_create,
+	.shutdown = lv_shutdown,
+	.num_active = lv_num_active,
+	.guest_cpu_time = lv_guest_cpu_time,
+	.vcpu_stats = lv_vcpu_stats,
+	.host_cpu = lv_host_cpu,
+	.domain_ip = lv_domain_ip,
+	.notify = NULL, // real load balancer.
+	.outstanding = NULL, // real load balancer.
+	.host_name = lv_host_name,
+	.sleep = lv_sleep,
+	.now = lv_now,
+};
@@ -0,0 +1,217 @@
+/*
+Local backend of hypervisor.h, no libvirt and no VMs: a domain is a server process on this host with its own TCP port.
+bench/chaos runs autoscaler (-l server_path), load balancer and servers together on loopback with it and breaks them.
+- domain i is "local-<i+1>", it works in directory local-<i+1>/ (server.logs, server.pid) and listens on
+  127.0.0.1:<LOCAL_BASE_PORT + i>, which is its address for load balancer.
+- domain runs while its server.pid names a live process. servers started by someone else are adopted like running VMs
+  and keep running when autoscaler restarts.
+- create() forks, child sleeps boot_seconds (-b) and execs server, address is given out only after that.
+- shutdown() is SIGTERM, kill -9 from outside is a crashed VM. a timer finds stopped servers and reports HV_EVENT_STOPPED.
+- guest cpu time is utime + stime of the server process, one host.
+*/
+
+#define LOCAL_BASE_PORT 8081
+#define LOCAL_CHECK_INTERVAL 0.5 // seconds between checks for stopped servers.
+
+struct local_domain {
+	char name[16];
+	char addr[32];
+	int port;
+	pid_t pid; // 0 when not running.
+	double started_at; // local_clock() of create(), 0 for adopted servers.
+};
+
+struct local_config {
+	int doms_count;
+	double boot_seconds;
+	char *server; // path of server executable, -l option.
+	char *server_args; // -A option, split on spaces.
+} local_cfg = {
+	.doms_count = 2,
+	.boot_seconds = 0,
+	.server = NULL,
+	.server_args = "-t 1",
+};
+
+struct {
+	struct local_domain *doms;
+	struct local_domain **dom_ptrs; // returned by list_domains.
+	long clk_tck;
+} local;
+
+static double local_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// pid in server.pid if that process is alive, 0 otherwise. own children that exited are reaped here.
+static pid_t local_read_pid(struct local_domain *d) {
+	char path[64];
+	int pid = 0;
+	snprintf(path, sizeof(path), "%s/server.pid", d->name);
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL) return 0;
+	if(fscanf(fp, "%d", &pid) != 1) pid = 0;
+	fclose(fp);
+	if(pid <= 0) return 0;
+	if(waitpid(pid, NULL, WNOHANG) == pid) return 0; // our child, exited.
+	if(kill(pid, 0) == 0 || errno == EPERM) return pid;
+	return 0;
+}
+
+static void local_check(int id, void *arg) {
+	for(int i = 0; i < local_cfg.doms_count; i++) {
+		struct local_domain *d = &local.doms[i];
+		if(d->pid == 0 || local_read_pid(d) != 0) continue;
+		char path[64];
+		snprintf(path, sizeof(path), "%s/server.pid", d->name);
+		unlink(path);
+		d->pid = 0;
+		if(hv_lifecycle != NULL) hv_lifecycle(d, HV_EVENT_STOPPED);
+	}
+}
+
+static int local_open(const char *uri) {
+	if(local_cfg.server == NULL) return FAILED;
+	local.clk_tck = sysconf(_SC_CLK_TCK);
+	local.doms = calloc(local_cfg.doms_count, sizeof(struct local_domain));
+	local.dom_ptrs = calloc(local_cfg.doms_count, sizeof(struct local_domain *));
+	for(int i = 0; i < local_cfg.doms_count; i++) {
+		struct local_domain *d = &local.doms[i];
+		snprintf(d->name, sizeof(d->name), "local-%d", i + 1);
+		d->port = LOCAL_BASE_PORT + i;
+		snprintf(d->addr, sizeof(d->addr), "127.0.0.1:%d", d->port);
+		mkdir(d->name, 0755);
+		d->pid = local_read_pid(d);
+		if(d->pid != 0) printf("Adopted server of %s, pid %d\n", d->name, d->pid);
+		local.dom_ptrs[i] = d;
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0); // bench/chaos follows the log while it runs.
+	loop_add_timer(LOCAL_CHECK_INTERVAL, local_check, NULL);
+	printf("Local servers: %s %s, ports from %d, boot %.1lf s\n", local_cfg.server, local_cfg.server_args, LOCAL_BASE_PORT, local_cfg.boot_seconds);
+	return SUCCESS;
+}
+
+static void local_close() {
+	// servers keep running like VMs do when autoscaler stops.
+}
+
+static int local_list_domains(hv_domain **domains) {
+	*domains = (hv_domain *)local.dom_ptrs;
+	return local_cfg.doms_count;
+}
+
+static const char *local_domain_name(hv_domain dom) {
+	return ((struct local_domain *)dom)->name;
+}
+
+static int local_is_active(hv_domain dom) {
+	return ((struct local_domain *)dom)->pid != 0? 1: 0;
+}
+
+static int local_active_states(hv_domain *domains, int count, char *active) {
+	for(int i = 0; i < count; i++) active[i] = local_is_active(domains[i]);
+	return 0;
+}
+
+static int local_create(hv_domain dom) {
+	struct local_domain *d = dom;
+	if(d->pid != 0) return -1;
+	pid_t pid = fork();
+	if(pid < 0) return -1;
+	if(pid == 0) {
+		char port[16], args[256], *argv[32];
+		int argc = 0;
+		snprintf(port, sizeof(port), "%d", d->port);
+		snprintf(args, sizeof(args), "%s", local_cfg.server_args);
+		argv[argc++] = local_cfg.server;
+		argv[argc++] = "-p";
+		argv[argc++] = port;
+		for(char *arg = strtok(args, " "); arg != NULL && argc < 31; arg = strtok(NULL, " ")) argv[argc++] = arg;
+		argv[argc] = NULL;
+		if(chdir(d->name) != 0) _exit(1);
+		if(local_cfg.boot_seconds > 0) usleep(local_cfg.boot_seconds * 1e6);
+		execv(local_cfg.server, argv);
+		_exit(1);
+	}
+	char path[64];
+	snprintf(path, sizeof(path), "%s/server.pid", d->name);
+	FILE *fp = fopen(path, "w");
+	if(fp != NULL) {
+		fprintf(fp, "%d\n", pid);
+		fclose(fp);
+	}
+	d->pid = pid;
+	d->started_at = local_clock();
+	return 0;
+}
+
+static int local_shutdown(hv_domain dom) {
+	struct local_domain *d = dom;
+	if(d->pid == 0) return -1;
+	return kill(d->pid, SIGTERM) == 0? 0: -1;
+}
+
+static int local_num_active() {
+	int count = 0;
+	for(int i = 0; i < local_cfg.doms_count; i++) {
+		if(local.doms[i].pid != 0) count += 1;
+	}
+	return count;
+}
+
+static unsigned long long local_guest_cpu_time(hv_domain dom) {
+	struct local_domain *d = dom;
+	char path[64], line[1024];
+	unsigned long long utime = 0, stime = 0;
+	snprintf(path, sizeof(path), "/proc/%d/stat", d->pid);
+	FILE *fp = d->pid != 0? fopen(path, "r"): NULL;
+	if(fp == NULL) return 0;
+	char *fields = fgets(line, sizeof(line), fp) != NULL? strrchr(line, ')'): NULL; // command name may have spaces.
+	if(fields == NULL || sscanf(fields, ") %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) utime = stime = 0;
+	fclose(fp);
+	return (utime + stime) * 1000000000ULL / local.clk_tck;
+}
+
+static int local_domain_ip(hv_domain dom, char *IP, int len) {
+	struct local_domain *d = dom;
+	if(d->pid == 0) return HV_IP_ERROR;
+	if(d->started_at > 0 && local_clock() - d->started_at < local_cfg.boot_seconds) return HV_IP_PENDING; // still booting.
+	snprintf(IP, len, "%s", d->addr);
+	return HV_IP_FOUND;
+}
+
+static const char *local_host_name(hv_domain dom) {
+	return "localhost";
+}
+
+static void local_sleep(unsigned int seconds) {
+	sleep(seconds);
+}
+
+static time_t local_now() {
+	return time(NULL);
+}
+
+struct hypervisor hv_local = {
+	.name = "local",
+	.open = local_open,
+	.close = local_close,
+	.list_domains = local_list_domains,
+	.domain_name = local_domain_name,
+	.is_active = local_is_active,
+	.active_states = local_active_states,
+	.create = local_create,
+	.shutdown = local_shutdown,
+	.num_active = local_num_active,
+	.guest_cpu_time = local_guest_cpu_time,
+	.vcpu_stats = NULL, // process has no vCPUs, guest cpu time is used.
+	.host_cpu = NULL,
+	.domain_ip = local_domain_ip,
+	.notify = NULL, // real load balancer.
+	.outstanding = NULL, // real load balancer.
+	.host_name = local_host_name,
+	.sleep = local_sleep,
+	.now = local_now,
+};
@@ -0,0 +1,371 @@
+/*
+Simulated backend of hypervisor.h, no libvirt and no real sleeping.
+
+Time is a virtual clock which only moves when autoscaler event loop calls hv->sleep() to reach its next timer, so a
+whole day of traffic runs through the same tick handlers, scale_out() and scale_in() in seconds of wall time.
+Model:
+- offered load (req/sec) comes from trace file (-t, lines "<second> <req/sec>", linear in between) or built in
+  day curve: lowest at midnight, peak_rps at noon. +-5% noise with fixed seed so runs are repeatable.
+- every request costs cost_ms of guest cpu. load balancer splits requests evenly over serving domains,
+  a domain can't use more than 1 cpu second per second (one vCPU).
+- domain gets IP at 60% of boot_seconds and accepts load balancer connection after boot_seconds,
+  before that SCALE_OUT notifications fail like connect() would. booting burns boot_util of cpu.
+- a second is SLO violation when some serving domain needs more than slo_util cpu or nobody serves.
+- domain reaching OFF after shutdown is reported as HV_EVENT_STOPPED like libvirt lifecycle event.
+- domain i runs on host i % hosts. outstanding requests of a domain follow Little's law: rps share * cost.
+- host_cpus (-C) limits cpu of each host, 0 is unlimited. when domains of a host want more, each gets its share and
+  the rest is steal time of its vCPU, work of serving domains that is not done counts as SLO violation.
+Hourly lines "SIM hour ..." and final "SIM_REPORT {json}" are printed on stdout.
+*/
+
+#define SIM_OFF 0
+#define SIM_BOOTING 1
+#define SIM_RUNNING 2
+#define SIM_STOPPING 3
+
+struct sim_domain {
+	char name[16];
+	char IP[16];
+	char host[16];
+	int state;
+	double state_since; // virtual time when state was entered.
+	int host_idx;
+	double cpu_ns; // guest cpu time since boot.
+	double steal_ns; // vCPU waited for host cpu since boot.
+	bool serving; // load balancer is sending requests to it.
+};
+
+struct sim_config {
+	int doms_count;
+	double boot_seconds;
+	double shutdown_seconds;
+	double cost_ms; // guest cpu milli-seconds per request.
+	double peak_rps; // peak of built in day curve.
+	double duration; // virtual seconds to simulate.
+	double slo_util;
+	double boot_util; // cpu used while booting.
+	double idle_util; // cpu used by running domain without requests.
+	int hosts;
+	double host_cpus; // cpus of each host, 0 is unlimited.
+	char *trace_file;
+} sim_cfg = {
+	.doms_count = 2,
+	.boot_seconds = 30,
+	.shutdown_seconds = 5,
+	.cost_ms = 20, // sum_prime() of 9000..10000 with server -k ref takes ~20 ms.
+	.peak_rps = 80,
+	.duration = 86400,
+	.slo_util = 1.0,
+	.boot_util = 0.9,
+	.idle_util = 0.02,
+	.hosts = 1,
+	.host_cpus = 0,
+	.trace_file = NULL,
+};
+
+struct sim_state {
+	double now; // virtual clock in seconds.
+	struct sim_domain *doms;
+	struct sim_domain **dom_ptrs; // returned by list_domains.
+	double *trace_t; // trace points.
+	double *trace_rps;
+	int trace_len;
+	unsigned int seed;
+	double rps_per_serving; // load of last second on each serving domain.
+	double *host_busy_ns; // cpu used on each host since start.
+
+	// report
+	double vm_seconds; // seconds of domains not OFF (booting and stopping included).
+	double slo_violation_seconds;
+	double requests; // offered.
+	double requests_over_capacity; // offered above what serving domains can compute.
+	int scale_outs;
+	int scale_ins;
+	int peak_active;
+	double hour_vm_seconds;
+	double hour_violation_seconds;
+	double hour_requests;
+} sim;
+
+
+static void sim_load_trace(char *file) {
+	FILE *fd = fopen(file, "r");
+	if(fd == NULL) {
+		fprintf(stderr, "Error opening trace file: %s\n", file);
+		exit(1);
+	}
+	int cap = 64;
+	sim.trace_t = malloc(cap * sizeof(double));
+	sim.trace_rps = malloc(cap * sizeof(double));
+	char line[128];
+	while(fgets(line, sizeof(line), fd) != NULL) {
+		double t, rps;
+		if(line[0] == '#' || sscanf(line, "%lf %lf", &t, &rps) != 2) continue;
+		if(sim.trace_len == cap) {
+			cap *= 2;
+			sim.trace_t = realloc(sim.trace_t, cap * sizeof(double));
+			sim.trace_rps = realloc(sim.trace_rps, cap * sizeof(double));
+		}
+		sim.trace_t[sim.trace_len] = t;
+		sim.trace_rps[sim.trace_len] = rps;
+		sim.trace_len += 1;
+	}
+	fclose(fd);
+	if(sim.trace_len == 0) {
+		fprintf(stderr, "Trace file %s has no points\n", file);
+		exit(1);
+	}
+	printf("Loaded %d trace points from %s\n", sim.trace_len, file);
+}
+
+static double sim_offered_rps(double t) {
+	if(sim.trace_len > 0) {
+		if(t <= sim.trace_t[0]) return sim.trace_rps[0];
+		for(int i = 1; i < sim.trace_len; i++) {
+			if(t < sim.trace_t[i]) {
+				double f = (t - sim.trace_t[i-1]) / (sim.trace_t[i] - sim.trace_t[i-1]);
+				return sim.trace_rps[i-1] + f * (sim.trace_rps[i] - sim.trace_rps[i-1]);
+			}
+		}
+		return sim.trace_rps[sim.trace_len - 1];
+	}
+	double day = fmod(t, 86400) / 86400; // 0 at midnight, 0.5 at noon.
+	return sim_cfg.peak_rps * (0.15 + 0.85 * 0.5 * (1 - cos(2 * M_PI * day)));
+}
+
+static void sim_report() {
+	printf("SIM_REPORT {\"sim_seconds\":%.0lf,\"domains\":%d,\"vm_minutes\":%.1lf,\"slo_violation_minutes\":%.1lf,\"slo_violation_pct\":%.3lf,"
+		"\"requests\":%.0lf,\"requests_over_capacity\":%.0lf,\"scale_outs\":%d,\"scale_ins\":%d,\"peak_active\":%d}\n",
+		sim.now, sim_cfg.doms_count, sim.vm_seconds / 60, sim.slo_violation_seconds / 60, 100.0 * sim.slo_violation_seconds / sim.now,
+		sim.requests, sim.requests_over_capacity, sim.scale_outs, sim.scale_ins, sim.peak_active);
+	fflush(stdout);
+}
+
+// move virtual clock by one second and account cpu of every domain.
+static void sim_step() {
+	double rps = sim_offered_rps(sim.now) * (0.95 + 0.10 * rand_r(&sim.seed) / RAND_MAX);
+	int serving = 0, active = 0;
+	for(int i = 0; i < sim_cfg.doms_count; i++) {
+		if(sim.doms[i].state == SIM_RUNNING && sim.doms[i].serving) serving += 1;
+	}
+	double demand = serving > 0? rps / serving * sim_cfg.cost_ms / 1000: 0; // cpu seconds wanted per serving domain.
+	sim.rps_per_serving = serving > 0? rps / serving: 0;
+	bool violation = rps > 0 && (serving == 0 || demand > sim_cfg.slo_util);
+	if(serving == 0) sim.requests_over_capacity += rps;
+	else if(demand > 1.0) sim.requests_over_capacity += (demand - 1.0) * serving * 1000 / sim_cfg.cost_ms;
+
+	double want[sim_cfg.doms_count], host_want[sim_cfg.hosts];
+	for(int h = 0; h < sim_cfg.hosts; h++) host_want[h] = 0;
+	for(int i = 0; i < sim_cfg.doms_count; i++) {
+		struct sim_domain *d = &sim.doms[i];
+		double util = 0;
+		if(d->state == SIM_BOOTING) {
+			util = sim_cfg.boot_util;
+			if(sim.now + 1 - d->state_since >= sim_cfg.boot_seconds) {
+				d->state = SIM_RUNNING;
+				d->state_since = sim.now + 1;
+			}
+		} else if(d->state == SIM_RUNNING) {
+			util = d->serving? (demand < 1.0? demand: 1.0): sim_cfg.idle_util;
+			if(util < sim_cfg.idle_util) util = sim_cfg.idle_util;
+		} else if(d->state == SIM_STOPPING) {
+			util = sim_cfg.idle_util;
+			if(sim.now + 1 - d->state_since >= sim_cfg.shutdown_seconds) {
+				d->state = SIM_OFF;
+				d->cpu_ns = 0;
+				d->steal_ns = 0;
+				if(hv_lifecycle != NULL) hv_lifecycle(d, HV_EVENT_STOPPED);
+			}
+		}
+		want[i] = util;
+		host_want[d->host_idx] += util;
+		if(d->state != SIM_OFF) active += 1;
+	}
+	for(int i = 0; i < sim_cfg.doms_count; i++) { // hosts without enough cpus share them in proportion to what domains want.
+		struct sim_domain *d = &sim.doms[i];
+		double got = want[i];
+		if(sim_cfg.host_cpus > 0 && host_want[d->host_idx] > sim_cfg.host_cpus) got = want[i] * sim_cfg.host_cpus / host_want[d->host_idx];
+		d->cpu_ns += got * 1e9;
+		d->steal_ns += (want[i] - got) * 1e9;
+		sim.host_busy_ns[d->host_idx] += got * 1e9;
+		if(got < want[i] && d->state == SIM_RUNNING && d->serving) {
+			violation = true;
+			sim.requests_over_capacity += (want[i] - got) * 1000 / sim_cfg.cost_ms;
+		}
+	}
+
+	sim.now += 1;
+	sim.requests += rps;
+	sim.vm_seconds += active;
+	sim.hour_requests += rps;
+	sim.hour_vm_seconds += active;
+	if(violation) {
+		sim.slo_violation_seconds += 1;
+		sim.hour_violation_seconds += 1;
+	}
+	if(active > sim.peak_active) sim.peak_active = active;
+
+	if(fmod(sim.now, 3600) == 0) {
+		printf("SIM hour %.0lf: avg %.1lf req/sec, active %d, serving %d, vm_minutes %.1lf, slo_violation_minutes %.1lf\n",
+			sim.now / 3600, sim.hour_requests / 3600, active, serving, sim.hour_vm_seconds / 60, sim.hour_violation_seconds / 60);
+		sim.hour_requests = sim.hour_vm_seconds = sim.hour_violation_seconds = 0;
+	}
+	if(sim.now >= sim_cfg.duration) {
+		sim_report();
+		exit(0);
+	}
+}
+
+
+static int sim_open(const char *uri) {
+	sim.now = 0;
+	sim.seed = 12345;
+	sim.doms = calloc(sim_cfg.doms_count, sizeof(struct sim_domain));
+	sim.dom_ptrs = calloc(sim_cfg.doms_count, sizeof(struct sim_domain *));
+	if(sim_cfg.hosts <= 0) sim_cfg.hosts = 1;
+	sim.host_busy_ns = calloc(sim_cfg.hosts, sizeof(double));
+	for(int i = 0; i < sim_cfg.doms_count; i++) {
+		snprintf(sim.doms[i].name, sizeof(sim.doms[i].name), "sim-vm%d", i + 1);
+		snprintf(sim.doms[i].IP, sizeof(sim.doms[i].IP), "192.168.122.%d", 10 + i);
+		sim.doms[i].host_idx = i % sim_cfg.hosts;
+		snprintf(sim.doms[i].host, sizeof(sim.doms[i].host), "sim-host%d", sim.doms[i].host_idx + 1);
+		sim.doms[i].state = SIM_OFF;
+		sim.dom_ptrs[i] = &sim.doms[i];
+	}
+	if(sim_cfg.trace_file != NULL) sim_load_trace(sim_cfg.trace_file);
+	printf("Simulating %d domains for %.0lf seconds, boot %.0lf s, %.1lf ms cpu per request\n",
+		sim_cfg.doms_count, sim_cfg.duration, sim_cfg.boot_seconds, sim_cfg.cost_ms);
+	return SUCCESS;
+}
+
+static void sim_close() {
+	sim_report();
+}
+
+static int sim_list_domains(hv_domain **domains) {
+	*domains = (hv_domain *)sim.dom_ptrs;
+	return sim_cfg.doms_count;
+}
+
+static const char *sim_domain_name(hv_domain dom) {
+	return ((struct sim_domain *)dom)->name;
+}
+
+static int sim_is_active(hv_domain dom) {
+	return ((struct sim_domain *)dom)->state != SIM_OFF? 1: 0;
+}
+
+static int sim_active_states(hv_domain *domains, int count, char *active) {
+	for(int i = 0; i < count; i++) active[i] = sim_is_active(domains[i]);
+	return 0;
+}
+
+static int sim_create(hv_domain dom) {
+	struct sim_domain *d = dom;
+	if(d->state != SIM_OFF) return -1;
+	d->state = SIM_BOOTING;
+	d->state_since = sim.now;
+	d->cpu_ns = 0;
+	d->steal_ns = 0;
+	sim.scale_outs += 1;
+	return 0;
+}
+
+static int sim_shutdown(hv_domain dom) {
+	struct sim_domain *d = dom;
+	if(d->state != SIM_RUNNING && d->state != SIM_BOOTING) return -1;
+	d->state = SIM_STOPPING;
+	d->state_since = sim.now;
+	d->serving = false;
+	sim.scale_ins += 1;
+	return 0;
+}
+
+static int sim_num_active() {
+	int count = 0;
+	for(int i = 0; i < sim_cfg.doms_count; i++) {
+		if(sim.doms[i].state != SIM_OFF) count += 1;
+	}
+	return count;
+}
+
+static unsigned long long sim_guest_cpu_time(hv_domain dom) {
+	return ((struct sim_domain *)dom)->cpu_ns;
+}
+
+static int sim_vcpu_stats(hv_domain *domains, int count, struct hv_vcpu_sample *out) {
+	for(int i = 0; i < count; i++) {
+		struct sim_domain *d = domains[i];
+		out[i].vcpus = d->state != SIM_OFF? 1: 0;
+		out[i].run_ns = d->cpu_ns;
+		out[i].steal_ns = d->steal_ns;
+	}
+	return 0;
+}
+
+static int sim_host_cpu(hv_domain dom, struct hv_host_sample *out) {
+	if(sim_cfg.host_cpus <= 0) return -1; // unlimited host has no utilization.
+	out->busy_ns = sim.host_busy_ns[((struct sim_domain *)dom)->host_idx];
+	out->total_ns = sim.now * sim_cfg.host_cpus * 1e9;
+	return 0;
+}
+
+static int sim_domain_ip(hv_domain dom, char *IP, int len) {
+	struct sim_domain *d = dom;
+	if(d->state == SIM_OFF) return HV_IP_ERROR;
+	if(d->state == SIM_BOOTING && sim.now - d->state_since < 0.6 * sim_cfg.boot_seconds) return HV_IP_PENDING;
+	snprintf(IP, len, "%s", d->IP);
+	return HV_IP_FOUND;
+}
+
+static int sim_notify(hv_domain dom, int NOTI_TYPE, char *IP) {	// simulated load balancer.
+	struct sim_domain *d = dom;
+	if(NOTI_TYPE == NOTI_SCALE_IN) {
+		d->serving = false;
+		return SUCCESS;
+	}
+	if(d->state != SIM_RUNNING) return FAILED; // server process is not up yet, load balancer can't connect.
+	d->serving = true;
+	return SUCCESS;
+}
+
+static long sim_outstanding(hv_domain dom) {
+	struct sim_domain *d = dom;
+	if(!d->serving) return 0;
+	double in_flight = sim.rps_per_serving * sim_cfg.cost_ms / 1000; // Little's law with service time only.
+	return (long)(in_flight + 0.5);
+}
+
+static const char *sim_host_name(hv_domain dom) {
+	return ((struct sim_domain *)dom)->host;
+}
+
+static void sim_sleep(unsigned int seconds) {
+	for(unsigned int i = 0; i < seconds; i++) sim_step();
+}
+
+static time_t sim_now() {
+	return (time_t)sim.now;
+}
+
+struct hypervisor hv_sim = {
+	.name = "simulation",
+	.open = sim_open,
+	.close = sim_close,
+	.list_domains = sim_list_domains,
+	.domain_name = sim_domain_name,
+	.is_active = sim_is_active,
+	.active_states = sim_active_states,
+	.create = sim_create,
+	.shutdown = sim_shutdown,
+	.num_active = sim_num_active,
+	.guest_cpu_time = sim_guest_cpu_time,
+	.vcpu_stats = sim_vcpu_stats,
+	.host_cpu = sim_host_cpu,
+	.domain_ip = sim_domain_ip,
+	.notify = sim_notify,
+	.outstanding = sim_outstanding,
+	.host_name = sim_host_name,
+	.sleep = sim_sleep,
+	.now = sim_now,
+};
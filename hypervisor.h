@@ -0,0 +1,54 @@
+/*
+Hypervisor abstraction used by autoscaler. autoscaler never calls libvirt directly, it calls hv-> methods so that
+the same scaling policy (analyse_cpu_usage(), scale_out(), scale_in()) runs against real VMs (hv_libvirt.h) or
+against simulated VMs on a virtual clock (hv_sim.h).
+
+Return values follow libvirt conventions so that code reads same as before: is_active() 1/0/-1, create()/shutdown() 0 on success.
+*/
+
+typedef void *hv_domain; // opaque domain handle. it is virDomainPtr for libvirt backend.
+
+// domain_ip() results
+#define HV_IP_FOUND 1
+#define HV_IP_PENDING 0 // domain is booting and has no address yet, try again later.
+#define HV_IP_ERROR -1
+
+// lifecycle events, delivered by backend from autoscaler event loop (event_loop.h).
+#define HV_EVENT_STOPPED 0
+#define HV_EVENT_STARTED 1
+
+struct hv_vcpu_sample {	// cumulative, nano seconds summed over vCPUs of a domain.
+	int vcpus; // 0 when not known, guest_cpu_time() is used then.
+	unsigned long long run_ns; // vCPUs running.
+	unsigned long long steal_ns; // vCPUs runnable but waiting for a host cpu, guest sees it as steal time.
+};
+
+struct hv_host_sample {	// cumulative, nano seconds summed over host cpus.
+	unsigned long long busy_ns;
+	unsigned long long total_ns;
+};
+
+struct hypervisor {
+	const char *name;
+	int (*open)(const char *uri); // SUCCESS/FAILED
+	void (*close)();
+	int (*list_domains)(hv_domain **domains); // all defined domains, returns count or -1.
+	const char *(*domain_name)(hv_domain dom);
+	int (*is_active)(hv_domain dom);
+	int (*active_states)(hv_domain *domains, int count, char *active); // one query for all: active[i] 1/0, 0 or -1 on error.
+	int (*create)(hv_domain dom); // start domain.
+	int (*shutdown)(hv_domain dom);
+	int (*num_active)(); // number of running domains.
+	unsigned long long (*guest_cpu_time)(hv_domain dom); // cpu time used by guest in nano seconds since boot.
+	int (*vcpu_stats)(hv_domain *domains, int count, struct hv_vcpu_sample *out); // one query for all. 0 or -1 on error.
+	int (*host_cpu)(hv_domain dom, struct hv_host_sample *out); // host running dom. 0 or -1 when not known.
+	int (*domain_ip)(hv_domain dom, char *IP, int len); // HV_IP_* flags.
+	int (*notify)(hv_domain dom, int NOTI_TYPE, char *IP); // NULL means notify real load balancer over socket. SUCCESS/FAILED
+	long (*outstanding)(hv_domain dom); // requests sent to domain and not answered yet. NULL means ask real load balancer.
+	const char *(*host_name)(hv_domain dom); // host running the domain, scale in prefers emptying hosts.
+	void (*sleep)(unsigned int seconds);
+	time_t (*now)();
+};
+
+struct hypervisor *hv; // backend selected in main().
+void (*hv_lifecycle)(hv_domain dom, int event); // set by autoscaler before open(), NULL ignores events.
@@ -0,0 +1,150 @@
+/*
+In-flight request table of load balancer. one entry per request sent and not yet answered, keyed by REQ_ID.
+
+Open addressing hash with linear probing: entries live directly in one array (no malloc per request),
+removal shifts following entries of the same probe run back so no tombstones are needed.
+Entries are also linked by slot index in order of sent_at, so timeouts are found from the oldest end without
+scanning the whole array. moving an entry during removal fixes up its neighbours.
+Lock order: live_serv_lock is taken before inflight.lock.
+*/
+
+#define INFLIGHT_CAP (1 << 16) // slots, power of two. table refuses inserts above 3/4 load.
+#define INFLIGHT_EMPTY -1 // req_id of free slot.
+
+struct inflight_entry {
+	long req_id;
+	long req_data;
+	long ts; // TS of generation, resends carry it so class latency counts from there (classes.h).
+	long first_sent_at; // time of first send (micro-seconds), latency is measured from here.
+	long sent_at; // time of last send, request timeout counts from here.
+	int server_fd; // server socket carrying the request.
+	int hedge_fd; // server socket carrying the hedged copy, -1 when not hedged.
+	int attempts; // sends including retries (not hedge).
+	int req_class; // classes.h, retries and hedges keep it.
+	int older, newer; // neighbour slots in sent_at order, -1 at the ends.
+};
+
+struct inflight_table {
+	struct inflight_entry *slots;
+	int count;
+	int oldest, newest; // ends of sent_at order, -1 when empty.
+	pthread_mutex_t lock;
+
+	// metrics, reported with throughput.
+	long retries; // re-sent after timeout or server failure.
+	long hedges; // duplicate sent after hedge delay.
+	long duplicates; // answers arriving after request was already answered.
+	long lost; // given up after MAX_ATTEMPTS.
+	long overflow; // not sent because table was full.
+} inflight;
+
+
+static inline unsigned int inflight_slot(long req_id) {
+	return (unsigned int)(((unsigned long)req_id * 0x9E3779B97F4A7C15UL) >> 48) & (INFLIGHT_CAP - 1); // fibonacci hashing.
+}
+
+void init_inflight() {
+	inflight.slots = malloc(INFLIGHT_CAP * sizeof(struct inflight_entry));
+	for(int i = 0; i < INFLIGHT_CAP; i++) inflight.slots[i].req_id = INFLIGHT_EMPTY;
+	inflight.count = 0;
+	inflight.oldest = inflight.newest = -1;
+	pthread_mutex_init(&inflight.lock, NULL);
+}
+
+static void inflight_unlink(int i) {
+	struct inflight_entry *e = &inflight.slots[i];
+	if(e->older != -1) inflight.slots[e->older].newer = e->newer;
+	else inflight.oldest = e->newer;
+	if(e->newer != -1) inflight.slots[e->newer].older = e->older;
+	else inflight.newest = e->older;
+}
+
+static void inflight_append(int i) {
+	struct inflight_entry *e = &inflight.slots[i];
+	e->older = inflight.newest;
+	e->newer = -1;
+	if(inflight.newest != -1) inflight.slots[inflight.newest].newer = i;
+	else inflight.oldest = i;
+	inflight.newest = i;
+}
+
+// entry was moved into slot to, its neighbours must point to the new slot.
+static void inflight_relink(int to) {
+	struct inflight_entry *e = &inflight.slots[to];
+	if(e->older != -1) inflight.slots[e->older].newer = to;
+	else inflight.oldest = to;
+	if(e->newer != -1) inflight.slots[e->newer].older = to;
+	else inflight.newest = to;
+}
+
+// caller holds inflight.lock. returns NULL if not found.
+struct inflight_entry *inflight_find(long req_id) {
+	unsigned int i = inflight_slot(req_id);
+	while(inflight.slots[i].req_id != INFLIGHT_EMPTY) {
+		if(inflight.slots[i].req_id == req_id) return &inflight.slots[i];
+		i = (i + 1) & (INFLIGHT_CAP - 1);
+	}
+	return NULL;
+}
+
+// request thread stops sending while table is full, requests wait in their class queue for answers to make room.
+// only request thread inserts, so the table can't fill up between this check and inflight_insert().
+static inline bool inflight_full() {
+	return __atomic_load_n(&inflight.count, __ATOMIC_RELAXED) >= INFLIGHT_CAP / 4 * 3;
+}
+
+// caller holds inflight.lock. entry becomes newest, caller sets sent_at to now. returns NULL if table is full.
+struct inflight_entry *inflight_insert(long req_id) {
+	if(inflight_full()) {
+		inflight.overflow += 1;
+		return NULL;
+	}
+	unsigned int i = inflight_slot(req_id);
+	while(inflight.slots[i].req_id != INFLIGHT_EMPTY && inflight.slots[i].req_id != req_id) {
+		i = (i + 1) & (INFLIGHT_CAP - 1);
+	}
+	if(inflight.slots[i].req_id == INFLIGHT_EMPTY) inflight.count += 1;
+	else inflight_unlink(i);
+	inflight.slots[i].req_id = req_id;
+	inflight_append(i);
+	return &inflight.slots[i];
+}
+
+// caller holds inflight.lock. e was sent again, it becomes newest. caller sets sent_at to now.
+void inflight_touch(struct inflight_entry *e) {
+	int i = e - inflight.slots;
+	inflight_unlink(i);
+	inflight_append(i);
+}
+
+// caller holds inflight.lock. e could not be sent now, it becomes oldest with sent_at 0 so next sweep retries it.
+void inflight_retry_soon(struct inflight_entry *e) {
+	int i = e - inflight.slots;
+	inflight_unlink(i);
+	e->sent_at = 0;
+	e->older = -1;
+	e->newer = inflight.oldest;
+	if(inflight.oldest != -1) inflight.slots[inflight.oldest].older = i;
+	else inflight.newest = i;
+	inflight.oldest = i;
+}
+
+// caller holds inflight.lock. e must point into the table.
+void inflight_remove(struct inflight_entry *e) {
+	unsigned int i = e - inflight.slots;
+	unsigned int j = i;
+	inflight_unlink(i);
+	while(true) { // backward shift deletion.
+		j = (j + 1) & (INFLIGHT_CAP - 1);
+		if(inflight.slots[j].req_id == INFLIGHT_EMPTY) break;
+		unsigned int home = inflight_slot(inflight.slots[j].req_id);
+		// move j into hole i if its home slot is not between hole and j (cyclically).
+		if(((j - home) & (INFLIGHT_CAP - 1)) >= ((j - i) & (INFLIGHT_CAP - 1))) {
+			inflight.slots[i] = inflight.slots[j];
+			inflight_relink(i);
+			i = j;
+		}
+	}
+	inflight.slots[i].req_id = INFLIGHT_EMPTY;
+	inflight.count -= 1;
+}
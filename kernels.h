@@ -0,0 +1,365 @@
+/*
+Compute kernels of server: sum of primes <= n, answer of sum_prime() (server.h).
+
+reference: trial division of every number, the original sum_prime(). O(n^2 / log n), ~50 ms for n = 10^4. kept as
+  the definition other kernels are checked against, and for load experiments that need the old cost (server -k ref).
+sieve (default): bit packed sieve of odd numbers kept as a table that grows upto the largest n asked so far, so a
+  request is a lookup:  sum(n) = 2 + prefix[word of n] + primes of that word upto n.
+  - one bit per odd number (wheel of 2), bit k is number 2k + 1. a 64 bit word covers 128 numbers.
+  - every segment starts as a copy of the pre-sieved pattern of 3, 5, 7, 11 and 13 (wheel), it repeats every
+    KERNEL_WHEEL_BYTES bytes. primes from 17 upto sqrt are crossed off one bit at a time.
+  - prime sum of a word is branch free: count * first number + 2 * sum of positions of set bits, sum of positions
+    is sum over j of 2^j * popcount(word & position_mask[j]).
+  - prefix is a prefix sum over word sums.
+  table upto KERNEL_TABLE_MAX (or init_kernels() argument) is reserved up front (mmap, pages are used only when
+  reached) so workers read it without lock while one of them grows it. n above the table is sieved on the fly.
+  when address space is short (ulimit -v) the table is halved until it maps, without any table every request is
+  sieved on the fly.
+n above KERNEL_N_MAX is refused (kernel_sum_primes() returns -1, server answers ERR), so the on the fly sieve stays
+bounded and the sum fits a long (overflows near n = 2 * 10^10).
+Pattern copy, word sums and prefix sum have scalar, SSE2 and AVX2 versions. backend is picked at startup with
+__builtin_cpu_supports(), or fixed at compile time with -DKERNEL_BACKEND=KERNEL_SCALAR|KERNEL_SSE2|KERNEL_AVX2
+(make server KERNEL_BACKEND=...). table content doesn't depend on backend.
+*/
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <immintrin.h>
+
+#define KERNEL_AUTO 0
+#define KERNEL_SCALAR 1
+#define KERNEL_SSE2 2
+#define KERNEL_AVX2 3
+#ifndef KERNEL_BACKEND
+#define KERNEL_BACKEND KERNEL_AUTO
+#endif
+
+#define KERNEL_TABLE_MAX (1L << 30) // default numbers covered by the table, 128 MB of virtual memory.
+#define KERNEL_N_MAX (1L << 30) // largest n answered, sum of primes upto it is ~2.8 * 10^16.
+#define KERNEL_SEGMENT_WORDS 4096 // 32 KB of bits per segment, fits L1/L2 while primes are crossed off.
+#define KERNEL_WHEEL_BYTES 15015 // 3 * 5 * 7 * 11 * 13, pattern of 120120 odd numbers.
+#define KERNEL_WHEEL_PAD 64 // pattern is stored twice plus this so vector copies never wrap inside a load.
+
+struct kernel_backend {
+	const char *name;
+	void (*fill)(uint8_t *dst, long len, long offset); // dst = wheel pattern from byte offset, cyclic.
+	void (*word_sums)(const uint64_t *words, long n, long first, long *sums); // first is number of bit 0 of words[0].
+	void (*scan)(const long *in, long n, long carry, long *out); // out[i] = carry + in[0] + .. + in[i - 1].
+};
+
+struct prime_table {
+	const struct kernel_backend *backend;
+	bool use_reference; // -k ref option of server.
+	uint8_t *wheel; // 2 * KERNEL_WHEEL_BYTES + KERNEL_WHEEL_PAD bytes.
+	int *base_primes; // odd primes from 17 upto sqrt of KERNEL_N_MAX, table and on the fly sieve share them.
+	int n_base;
+	long table_words; // table size, words of 128 numbers.
+	uint64_t *bits; // table, 1 bit means prime.
+	long *prefix; // prefix[w] = sum of odd primes below 128 * w.
+	long covered; // words of table sieved and summed, read without lock.
+	pthread_mutex_t grow_lock;
+} primes;
+
+static const uint64_t kernel_pos_masks[6] = {
+	0xAAAAAAAAAAAAAAAAUL, 0xCCCCCCCCCCCCCCCCUL, 0xF0F0F0F0F0F0F0F0UL,
+	0xFF00FF00FF00FF00UL, 0xFFFF0000FFFF0000UL, 0xFFFFFFFF00000000UL
+};
+
+
+bool is_prime(long n) {
+	if(n < 2) return false;
+	for(int i = 2; i < n; i++) {
+		if(n % i == 0) return false;
+	}
+	return true;
+}
+
+long sum_primes_reference(long n) {
+	long sum = 0;
+	for(int i = 2; i <= n; i++) {
+		if(is_prime(i) == true) sum += i;
+	}
+	return sum;
+}
+
+// scalar backend.
+
+static void fill_scalar(uint8_t *dst, long len, long offset) {
+	while(len > 0) {
+		long chunk = KERNEL_WHEEL_BYTES - offset < len? KERNEL_WHEEL_BYTES - offset: len;
+		memcpy(dst, primes.wheel + offset, chunk);
+		dst += chunk;
+		len -= chunk;
+		offset = 0;
+	}
+}
+
+static inline long word_sum(uint64_t w, long first) {
+	long positions = 0;
+	for(int j = 0; j < 6; j++) positions += (long)__builtin_popcountll(w & kernel_pos_masks[j]) << j;
+	return __builtin_popcountll(w) * first + 2 * positions;
+}
+
+static void word_sums_scalar(const uint64_t *words, long n, long first, long *sums) {
+	for(long i = 0; i < n; i++) sums[i] = word_sum(words[i], first + 128 * i);
+}
+
+static void scan_scalar(const long *in, long n, long carry, long *out) {
+	for(long i = 0; i < n; i++) {
+		out[i] = carry;
+		carry += in[i];
+	}
+}
+
+// SSE2 backend.
+
+__attribute__((target("sse2")))
+static void fill_sse2(uint8_t *dst, long len, long offset) {
+	long i = 0;
+	for(; i + 16 <= len; i += 16) { // pattern is stored twice so offset + 16 never runs off it.
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(primes.wheel + offset)));
+		offset += 16;
+		if(offset >= KERNEL_WHEEL_BYTES) offset -= KERNEL_WHEEL_BYTES;
+	}
+	fill_scalar(dst + i, len - i, offset);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i popcount_sse2(__m128i v) {	// per 64 bit lane.
+	const __m128i m1 = _mm_set1_epi8(0x55), m2 = _mm_set1_epi8(0x33), m4 = _mm_set1_epi8(0x0f);
+	v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi64(v, 1), m1));
+	v = _mm_add_epi8(_mm_and_si128(v, m2), _mm_and_si128(_mm_srli_epi64(v, 2), m2));
+	v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi64(v, 4)), m4);
+	return _mm_sad_epu8(v, _mm_setzero_si128()); // byte counts summed into each 64 bit lane.
+}
+
+__attribute__((target("sse2")))
+static void word_sums_sse2(const uint64_t *words, long n, long first, long *sums) {
+	long i = 0;
+	for(; i + 2 <= n; i += 2) {
+		__m128i w = _mm_loadu_si128((const __m128i *)(words + i));
+		__m128i positions = _mm_setzero_si128();
+		for(int j = 0; j < 6; j++) {
+			__m128i c = popcount_sse2(_mm_and_si128(w, _mm_set1_epi64x(kernel_pos_masks[j])));
+			positions = _mm_add_epi64(positions, _mm_slli_epi64(c, j));
+		}
+		long count[2], pos[2];
+		_mm_storeu_si128((__m128i *)count, popcount_sse2(w));
+		_mm_storeu_si128((__m128i *)pos, positions);
+		sums[i] = count[0] * (first + 128 * i) + 2 * pos[0]; // SSE2 has no 64 bit multiply.
+		sums[i + 1] = count[1] * (first + 128 * (i + 1)) + 2 * pos[1];
+	}
+	word_sums_scalar(words + i, n - i, first + 128 * i, sums + i);
+}
+
+__attribute__((target("sse2")))
+static void scan_sse2(const long *in, long n, long carry, long *out) {
+	__m128i c = _mm_set1_epi64x(carry);
+	long i = 0;
+	for(; i + 2 <= n; i += 2) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(in + i)); // [a, b]
+		__m128i inclusive = _mm_add_epi64(x, _mm_slli_si128(x, 8)); // [a, a + b]
+		_mm_storeu_si128((__m128i *)(out + i), _mm_add_epi64(c, _mm_sub_epi64(inclusive, x)));
+		c = _mm_add_epi64(c, _mm_unpackhi_epi64(inclusive, inclusive));
+	}
+	long rest;
+	_mm_storel_epi64((__m128i *)&rest, c);
+	scan_scalar(in + i, n - i, rest, out + i);
+}
+
+// AVX2 backend.
+
+__attribute__((target("avx2")))
+static void fill_avx2(uint8_t *dst, long len, long offset) {
+	long i = 0;
+	for(; i + 32 <= len; i += 32) {
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(primes.wheel + offset)));
+		offset += 32;
+		if(offset >= KERNEL_WHEEL_BYTES) offset -= KERNEL_WHEEL_BYTES;
+	}
+	fill_scalar(dst + i, len - i, offset);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i popcount_avx2(__m256i v) {	// per 64 bit lane, nibble lookup.
+	const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	__m256i c = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(v, low)), _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi64(v, 4), low)));
+	return _mm256_sad_epu8(c, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static void word_sums_avx2(const uint64_t *words, long n, long first, long *sums) {
+	long i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m256i w = _mm256_loadu_si256((const __m256i *)(words + i));
+		__m256i positions = _mm256_setzero_si256();
+		for(int j = 0; j < 6; j++) {
+			__m256i c = popcount_avx2(_mm256_and_si256(w, _mm256_set1_epi64x(kernel_pos_masks[j])));
+			positions = _mm256_add_epi64(positions, _mm256_slli_epi64(c, j));
+		}
+		// count * first: counts are <= 64 and first < 2^32 within the table, 32 x 32 bit multiply is exact.
+		__m256i base = _mm256_add_epi64(_mm256_set1_epi64x(first + 128 * i), _mm256_setr_epi64x(0, 128, 256, 384));
+		__m256i count = popcount_avx2(w);
+		__m256i sum;
+		if(first + 128 * (i + 4) < (1L << 32)) sum = _mm256_mul_epu32(count, base);
+		else {
+			long c[4], b[4];
+			_mm256_storeu_si256((__m256i *)c, count);
+			_mm256_storeu_si256((__m256i *)b, base);
+			sum = _mm256_setr_epi64x(c[0] * b[0], c[1] * b[1], c[2] * b[2], c[3] * b[3]);
+		}
+		sum = _mm256_add_epi64(sum, _mm256_slli_epi64(positions, 1));
+		_mm256_storeu_si256((__m256i *)(sums + i), sum);
+	}
+	word_sums_scalar(words + i, n - i, first + 128 * i, sums + i);
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(const long *in, long n, long carry, long *out) {
+	__m256i c = _mm256_set1_epi64x(carry);
+	long i = 0;
+	for(; i + 4 <= n; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(in + i)); // [a, b, c, d]
+		__m256i inclusive = _mm256_add_epi64(x, _mm256_slli_si256(x, 8)); // [a, a + b, c, c + d], shift is per 128 bit half.
+		__m256i low_total = _mm256_permute4x64_epi64(inclusive, _MM_SHUFFLE(1, 1, 1, 1)); // a + b in every lane.
+		inclusive = _mm256_add_epi64(inclusive, _mm256_blend_epi32(_mm256_setzero_si256(), low_total, 0xF0));
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_add_epi64(c, _mm256_sub_epi64(inclusive, x)));
+		c = _mm256_add_epi64(c, _mm256_permute4x64_epi64(inclusive, _MM_SHUFFLE(3, 3, 3, 3)));
+	}
+	long rest[4];
+	_mm256_storeu_si256((__m256i *)rest, c);
+	scan_scalar(in + i, n - i, rest[0], out + i);
+}
+
+const struct kernel_backend kernel_backends[] = {
+	{"scalar", fill_scalar, word_sums_scalar, scan_scalar},
+	{"sse2", fill_sse2, word_sums_sse2, scan_sse2},
+	{"avx2", fill_avx2, word_sums_avx2, scan_avx2},
+};
+
+// sieve.
+
+// odd primes from 17 upto limit with plain sieve.
+static int *small_primes(long limit, int *count) {
+	char *composite = calloc(limit + 1, 1);
+	int *list = malloc((limit / 2 + 1) * sizeof(int));
+	*count = 0;
+	for(long i = 3; i <= limit; i += 2) {
+		if(composite[i]) continue;
+		if(i >= 17) list[(*count)++] = i;
+		for(long j = i * i; j <= limit; j += 2 * i) composite[j] = 1;
+	}
+	free(composite);
+	return list;
+}
+
+// sieve words [w0, w0 + n) into seg. base primes must reach sqrt of last number of segment.
+static void sieve_segment(uint64_t *seg, long w0, long n, const int *base, int n_base) {
+	primes.backend->fill((uint8_t *)seg, n * 8, (w0 * 8) % KERNEL_WHEEL_BYTES);
+	if(w0 == 0) seg[0] = (seg[0] & ~1UL) | (1UL << 1) | (1UL << 2) | (1UL << 3) | (1UL << 5) | (1UL << 6); // 1 is not prime, 3..13 are.
+	long k0 = w0 * 64, k1 = (w0 + n) * 64; // bit range, bit k is number 2k + 1.
+	for(int i = 0; i < n_base; i++) {
+		long p = base[i];
+		if(p * p > 2 * k1 + 1) break;
+		long k = (p * p - 1) / 2; // first multiple to cross is p * p, later ones are 2p apart so p bits apart.
+		if(k < k0) k += (k0 - k + p - 1) / p * p;
+		for(k -= k0; k < k1 - k0; k += p) seg[k >> 6] &= ~(1UL << (k & 63));
+	}
+}
+
+// table_max is numbers covered by table, 0 means KERNEL_TABLE_MAX.
+void init_kernels(long table_max) {
+	uint8_t pattern[KERNEL_WHEEL_BYTES];
+	memset(pattern, 0xff, sizeof(pattern));
+	int wheel_primes[] = {3, 5, 7, 11, 13};
+	for(int i = 0; i < 5; i++) {
+		for(long k = (wheel_primes[i] - 1) / 2; k < KERNEL_WHEEL_BYTES * 8; k += wheel_primes[i]) pattern[k >> 3] &= ~(1 << (k & 7));
+	}
+	primes.wheel = malloc(2 * KERNEL_WHEEL_BYTES + KERNEL_WHEEL_PAD);
+	memcpy(primes.wheel, pattern, KERNEL_WHEEL_BYTES);
+	memcpy(primes.wheel + KERNEL_WHEEL_BYTES, pattern, KERNEL_WHEEL_BYTES);
+	memcpy(primes.wheel + 2 * KERNEL_WHEEL_BYTES, pattern, KERNEL_WHEEL_PAD);
+
+	if(KERNEL_BACKEND != KERNEL_AUTO) primes.backend = &kernel_backends[KERNEL_BACKEND - 1];
+	else if(__builtin_cpu_supports("avx2")) primes.backend = &kernel_backends[2];
+	else if(__builtin_cpu_supports("sse2")) primes.backend = &kernel_backends[1];
+	else primes.backend = &kernel_backends[0];
+
+	if(table_max <= 0 || table_max > KERNEL_N_MAX) table_max = table_max <= 0? KERNEL_TABLE_MAX: KERNEL_N_MAX; // n above is never asked.
+	primes.table_words = table_max / 128;
+	if(primes.table_words < 1) primes.table_words = 1;
+	long root = 1;
+	while(root * root < KERNEL_N_MAX) root++;
+	primes.base_primes = small_primes(root, &primes.n_base);
+	long wanted = primes.table_words;
+	for(; primes.table_words > 0; primes.table_words /= 2) {
+		primes.bits = mmap(NULL, primes.table_words * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		primes.prefix = mmap(NULL, primes.table_words * sizeof(long), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(primes.bits != MAP_FAILED && primes.prefix != MAP_FAILED) break;
+		if(primes.bits != MAP_FAILED) munmap(primes.bits, primes.table_words * sizeof(uint64_t));
+		if(primes.prefix != MAP_FAILED) munmap(primes.prefix, primes.table_words * sizeof(long));
+	}
+	if(primes.table_words < wanted) fprintf(stderr, "prime table of %ld numbers can't be mapped, using %ld\n", 128 * wanted, 128 * primes.table_words);
+	if(primes.table_words == 0) {
+		primes.bits = NULL;
+		primes.prefix = NULL;
+	}
+	primes.covered = 0;
+	pthread_mutex_init(&primes.grow_lock, NULL);
+}
+
+// extend table to at least words words. table doubles so that growing requests don't sieve a segment each.
+static void grow_table(long words) {
+	pthread_mutex_lock(&primes.grow_lock);
+	long covered = primes.covered;
+	if(words > covered) {
+		if(words < 2 * covered) words = 2 * covered;
+		words = (words + KERNEL_SEGMENT_WORDS - 1) / KERNEL_SEGMENT_WORDS * KERNEL_SEGMENT_WORDS;
+		if(words > primes.table_words) words = primes.table_words;
+		long sums[KERNEL_SEGMENT_WORDS];
+		for(long w0 = covered; w0 < words; w0 += KERNEL_SEGMENT_WORDS) {
+			long n = words - w0 < KERNEL_SEGMENT_WORDS? words - w0: KERNEL_SEGMENT_WORDS;
+			sieve_segment(primes.bits + w0, w0, n, primes.base_primes, primes.n_base);
+			primes.backend->word_sums(primes.bits + w0, n, 128 * w0 + 1, sums);
+			long carry = w0 == 0? 0: primes.prefix[w0 - 1] + word_sum(primes.bits[w0 - 1], 128 * (w0 - 1) + 1);
+			primes.backend->scan(sums, n, carry, primes.prefix + w0);
+		}
+		__atomic_store_n(&primes.covered, words, __ATOMIC_RELEASE); // bits and prefix below are complete.
+	}
+	pthread_mutex_unlock(&primes.grow_lock);
+}
+
+// sum of odd primes in words [w0, w1) above the table, sieved into a temporary segment.
+static long sum_beyond_table(long w0, long w1, long last_k) {
+	uint64_t seg[KERNEL_SEGMENT_WORDS];
+	long sums[KERNEL_SEGMENT_WORDS];
+	long total = 0;
+	for(long s = w0; s < w1; s += KERNEL_SEGMENT_WORDS) {
+		long n = w1 - s < KERNEL_SEGMENT_WORDS? w1 - s: KERNEL_SEGMENT_WORDS;
+		sieve_segment(seg, s, n, primes.base_primes, primes.n_base);
+		if(s + n == w1 && (last_k & 63) != 63) seg[n - 1] &= (2UL << (last_k & 63)) - 1; // numbers above n.
+		primes.backend->word_sums(seg, n, 128 * s + 1, sums);
+		for(long i = 0; i < n; i++) total += sums[i];
+	}
+	return total;
+}
+
+// -1 for n above KERNEL_N_MAX.
+long kernel_sum_primes(long n) {
+	if(n > KERNEL_N_MAX) return -1;
+	if(primes.use_reference) return sum_primes_reference(n);
+	if(n < 2) return 0;
+	if(n == 2) return 2;
+	long k = (n - 1) / 2; // bit of largest odd number <= n.
+	long w = k / 64;
+	if(primes.table_words == 0) return 2 + sum_beyond_table(0, w + 1, k); // table could not be mapped.
+	if(w >= __atomic_load_n(&primes.covered, __ATOMIC_ACQUIRE)) grow_table(w + 1);
+	if(w < primes.table_words) {
+		uint64_t last = primes.bits[w];
+		if((k & 63) != 63) last &= (2UL << (k & 63)) - 1;
+		return 2 + primes.prefix[w] + word_sum(last, 128 * w + 1);
+	}
+	return 2 + primes.prefix[primes.table_words - 1] + word_sum(primes.bits[primes.table_words - 1], 128 * (primes.table_words - 1) + 1) +
+		sum_beyond_table(primes.table_words, w + 1, k);
+}
@@ -0,0 +1,243 @@
+/*
+Table of live servers (backends) known to the load balancer. one entry per server IP,
+new entries are added at the head of the list.
+
+Every entry has a circuit breaker driven by health checks of the response thread:
+CLOSED    requests are sent to the server.
+OPEN      server failed (ping deadline missed, response timeout, hangup, write error), no requests are sent.
+HALF_OPEN after open time one probe ping is sent (reconnecting first if socket is dead), PONG closes the
+          circuit again, failure opens it with doubled open time.
+Entries are only removed on SCALE_IN or SYNC from autoscaler, ejected servers keep their entry.
+PONG of a server carries its load report (frame.h), the last one is kept in the entry and handed to autoscaler
+with OUTSTANDING replies.
+*/
+
+#define CIRCUIT_CLOSED 0
+#define CIRCUIT_OPEN 1
+#define CIRCUIT_HALF_OPEN 2
+#define GUEST_LOAD_MAX_AGE_US 3000000 // older load report is not passed on, server stopped answering pings.
+
+// write locked for insert/delete of entries and health checks, request thread is stopped around insert/delete instead.
+// response threads read lock it while they handle answers of their servers. writers go first so that health checks
+// are not starved by busy response threads.
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+pthread_rwlock_t live_serv_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+#else
+pthread_rwlock_t live_serv_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
+struct live_server_entry {
+	char *IP;
+	int server_sock_fd;
+	bool high_load;
+	pthread_mutex_t write_lock; // request thread and health checks write on same socket, frames must not interleave.
+	char wtail[FRAME_LEN]; // rest of frame send_frame_nowait() could not write, goes out before any other byte.
+	int wtail_len;
+
+	int circuit; // CIRCUIT_* flags, see circuit_state().
+	int failures; // consecutive failures while circuit is closed.
+	long open_usec; // how long circuit stays open before half open probe, doubles on every failed probe.
+	long opened_at; // time circuit was opened (micro-seconds, now_usec()).
+	bool sock_dead; // peer closed the socket, probe has to reconnect.
+	long ping_seq; // seq of last ping sent.
+	long ping_sent_at; // 0 when no ping is outstanding.
+	long last_ping_at; // time of last ping, pings are sent every PING_INTERVAL_US.
+	long sent; // requests written (request thread).
+	long received; // responses read (response thread).
+	long last_progress_at; // last response or start of outstanding requests, used for response timeout.
+	struct guest_load {	// last load report of server, written by response thread.
+		long queued; // tasks waiting for compute workers.
+		long queued_max; // deepest queue of one worker.
+		long workers;
+		long busy_permille; // worker time spent computing.
+		long rps;
+		long p50_us; // compute time.
+		long p99_us;
+		long at; // 0 when server never reported.
+	} load;
+	struct live_server_entry* next;
+} *live_serv_list = NULL;
+
+// response thread changes circuit fields and sock_dead of its servers under read lock and request thread reads them
+// without lock, so they are accessed with __atomic builtins. circuit is stored last with release, a thread that sees
+// it OPEN sees opened_at and open_usec of that failure too.
+static inline int circuit_state(struct live_server_entry* eptr) {
+	return __atomic_load_n(&eptr->circuit, __ATOMIC_ACQUIRE);
+}
+
+static inline void circuit_set(struct live_server_entry* eptr, int state) {
+	__atomic_store_n(&eptr->circuit, state, __ATOMIC_RELEASE);
+}
+
+// requests can be sent to the server.
+static inline bool server_usable(struct live_server_entry* eptr) {
+	return circuit_state(eptr) == CIRCUIT_CLOSED && !__atomic_load_n(&eptr->sock_dead, __ATOMIC_ACQUIRE);
+}
+
+
+// keep load report of PONG frame, servers of older build answer bare PONG.
+void guest_load_update(struct live_server_entry* eptr, char *frame, long now) {
+	struct guest_load *l = &eptr->load;
+	if(!frame_get_long(frame, "BUSY", &l->busy_permille)) return;
+	frame_get_long(frame, "Q", &l->queued);
+	frame_get_long(frame, "QMAX", &l->queued_max);
+	frame_get_long(frame, "W", &l->workers);
+	frame_get_long(frame, "RPS", &l->rps);
+	frame_get_long(frame, "P50", &l->p50_us);
+	frame_get_long(frame, "P99", &l->p99_us);
+	l->at = now;
+}
+
+void print_live_servers() {
+	struct live_server_entry* ptr = live_serv_list;
+	printf("--------------- Printing Live Servers -----------\n");
+	while(ptr != NULL) {
+		printf("IP: %s, FD: %d, HIGH_LOAD: %d, CIRCUIT: %s\n", ptr->IP, ptr->server_sock_fd, ptr->high_load,
+			circuit_state(ptr) == CIRCUIT_CLOSED? "CLOSED": circuit_state(ptr) == CIRCUIT_OPEN? "OPEN": "HALF_OPEN");
+		ptr = ptr->next;
+	}
+	printf("-------------------------------------------------\n");
+}
+
+struct mem_pool server_entry_pool; // entries come and go with every scale out/in, recycled instead of malloc().
+
+struct live_server_entry* insert_server_entry(char *IP, int server_sock_fd) {
+	if(server_entry_pool.obj_size == 0) pool_init(&server_entry_pool, "server entry", sizeof(struct live_server_entry), 0);
+	struct live_server_entry* eptr = pool_alloc(&server_entry_pool);
+	eptr->IP = calloc(strlen(IP)+1, sizeof(char));
+	strcpy(eptr->IP, IP);
+	eptr->server_sock_fd = server_sock_fd;
+	eptr->high_load = false;
+	pthread_mutex_init(&eptr->write_lock, NULL);
+	eptr->wtail_len = 0;
+	eptr->circuit = CIRCUIT_CLOSED;
+	eptr->failures = 0;
+	eptr->open_usec = 0;
+	eptr->opened_at = 0;
+	eptr->sock_dead = false;
+	eptr->ping_seq = 0;
+	eptr->ping_sent_at = 0;
+	eptr->last_ping_at = 0;
+	eptr->sent = 0;
+	eptr->received = 0;
+	eptr->last_progress_at = 0;
+	memset(&eptr->load, 0, sizeof(eptr->load));
+	eptr->next = NULL;
+
+	if(live_serv_list == NULL) {
+		live_serv_list = eptr;
+		return eptr;
+	}
+	eptr->next = live_serv_list;
+	live_serv_list = eptr;
+	return eptr;
+}
+
+// entry must already be unlinked from live_serv_list.
+void free_server_entry(struct live_server_entry* eptr) {
+	free(eptr->IP);
+	pthread_mutex_destroy(&eptr->write_lock);
+	pool_free(&server_entry_pool, eptr);
+}
+
+void delete_server_entry(char *IP) {
+	printf("Deleting server entry IP%s:\n", IP);
+	if(live_serv_list == NULL) {
+		return;
+	}
+	struct live_server_entry* eptr = live_serv_list;
+	if(strcmp(eptr->IP, IP) == 0) {
+		live_serv_list = eptr->next;
+		free_server_entry(eptr);
+		return;
+	}
+	while(eptr->next != NULL && strcmp(eptr->next->IP, IP) != 0) {
+		eptr = eptr->next;
+	}
+	if(eptr->next == NULL) return;
+	struct live_server_entry* tmp = eptr->next;
+	eptr->next = eptr->next->next;
+	free_server_entry(tmp);
+	return;
+}
+
+struct live_server_entry* get_server_entry(char *IP) {
+	if(live_serv_list == NULL) {
+		return NULL;
+	}
+	struct live_server_entry* eptr = live_serv_list;
+	while(eptr != NULL && strcmp(eptr->IP, IP) != 0) {
+		eptr = eptr->next;
+	}
+	return eptr;
+}
+
+struct live_server_entry* get_server_entry_by_fd(int server_sock_fd) {
+	struct live_server_entry* eptr = live_serv_list;
+	while(eptr != NULL && eptr->server_sock_fd != server_sock_fd) {
+		eptr = eptr->next;
+	}
+	return eptr;
+}
+
+// write len bytes, waiting for socket buffer space if needed. started is true when bytes of the frame went out before,
+// such a frame can't be dropped. caller holds write_lock. returns bytes written.
+static int send_waiting(int sock_fd, const char *buff, int len, bool started) {
+	int done = 0, stuck = 0;
+	while(done < len) {
+		int n = send(sock_fd, buff + done, len - done, MSG_NOSIGNAL); // no SIGPIPE, error is returned.
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { // socket is non blocking, server is slow in reading.
+			struct pollfd pfd = {.fd = sock_fd, .events = POLLOUT};
+			if(poll(&pfd, 1, 100) > 0) continue;
+			if((done == 0 && !started) || ++stuck == 10) break; // drop the frame if nothing is written yet, half written frame gets 1 second. health checks deal with the server.
+			continue;
+		}
+		if(n <= 0) break;
+		done += n;
+	}
+	return done;
+}
+
+// finish frame left half written by send_frame_nowait(). caller holds write_lock. returns false on socket error.
+static bool send_wtail(struct live_server_entry* eptr) {
+	if(eptr->wtail_len == 0) return true;
+	bool ok = send_waiting(eptr->server_sock_fd, eptr->wtail, eptr->wtail_len, true) == eptr->wtail_len;
+	eptr->wtail_len = 0; // stream is broken if not ok, health checks deal with the server.
+	return ok;
+}
+
+// write one complete frame, waiting for socket buffer space if needed. returns false on socket error.
+bool send_frame(struct live_server_entry* eptr, char *frame) {
+	pthread_mutex_lock(&eptr->write_lock);
+	bool ok = send_wtail(eptr) && send_waiting(eptr->server_sock_fd, frame, FRAME_LEN, false) == FRAME_LEN;
+	pthread_mutex_unlock(&eptr->write_lock);
+	return ok;
+}
+
+// send_frame() that never waits, used for retries and hedges while live_serv_lock is held. when the socket or its
+// write lock is busy nothing is written, *busy is set and caller tries again later. a frame the socket takes only
+// part of counts as sent, its rest is kept in wtail and goes out first with the next frame. returns true if sent.
+bool send_frame_nowait(struct live_server_entry* eptr, char *frame, bool *busy) {
+	*busy = true;
+	if(pthread_mutex_trylock(&eptr->write_lock) != 0) return false; // writer may be waiting in poll().
+	bool sent = false;
+	int n = 0;
+	if(eptr->wtail_len > 0) {
+		n = send(eptr->server_sock_fd, eptr->wtail, eptr->wtail_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(n > 0) {
+			eptr->wtail_len -= n;
+			memmove(eptr->wtail, eptr->wtail + n, eptr->wtail_len);
+		}
+	}
+	if(n >= 0 && eptr->wtail_len == 0) {
+		n = send(eptr->server_sock_fd, frame, FRAME_LEN, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(n > 0) {
+			eptr->wtail_len = FRAME_LEN - n;
+			memcpy(eptr->wtail, frame + n, eptr->wtail_len);
+			sent = true;
+		}
+	}
+	if(sent || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) *busy = false;
+	pthread_mutex_unlock(&eptr->write_lock);
+	return sent;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // splice() for proxy mode.
 #include <stdio.h> 
 #include <stdlib.h> 
 #include <string.h> 
@@ -13,6 +14,24 @@
 #include <arpa/inet.h>
 #include <time.h>
 #include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <getopt.h>
+#include <linux/errqueue.h>
+#include <math.h>
+#include "frame.h"
+#include "transport.h"
+#include "stats.h"
+#include "pool.h"
+#include "affinity.h"
+#include "live_servers.h"
+#include "inflight.h"
+#include "chash.h"
+#include "classes.h"
+#include "proxy.h"
+#include "control.h"
+#include "trace.h"
+#include "handoff.h"
 
 #define SUCCESS 1
 #define FAILED -1 // don't change to zero could be treated as socket_fd in connect_to_server() method.
@@ -22,55 +41,94 @@ char *STR_FAILED = "FAILED";
 
 // function prototypes
 void *process_server_responses(void *arg); // server method to echo the client query. we can prepare server response for query.
-void init_response_thread(); // creating threads and creating epoll instance for each thread.
+void init_response_thread(bool append); // creating threads and creating epoll instance for each thread.
 void make_non_block_socket(int fd); // make the socket fd non blocking so that read/write on fd can be performed without blocking.
 int create_lstn_sock_fd(); // create listening socket.
+int connect_to_server_timeout(char *IP, int timeout_ms); // connect to server process at backend address IP (transport.h).
+void connect_to_servers(char **IPs, int count, int *fds, int timeout_ms);
 
 
-int auto_sclr_sock_fd; // autoscaler socket fo.
-int lstn_sock_fd; // listening socket fd used to connect to auto scaler.
+int auto_sclr_sock_fd = -1; // autoscaler socket fo.
+int lstn_sock_fd = -1; // listening socket fd used to connect to auto scaler.
 
 
+// responses are read by n_res_shards threads (-M option), server socket fd belongs to shard fd % n_res_shards. each shard
+// has its own epoll instance and counters, only the shard writes its counters and first shard adds them up for reports.
 struct my_epoll_context { // this is custom structure used for data storation.
 	int epoll_fd; // this is file descriptor of epoll instance. we will add remove socket fds using this epoll_fd.
 	struct epoll_event *response_events; // when we wait on epoll then list of event will be returned(of type 'struct epoll_event') and we will store those in this memory (NOTE: we have already created memory for this pointer).
 	// you can store response events anywhere but it is good to store the data related to same epoll in same structure.
-} my_epoll; // only one epoll is created to receive responses from server. and any no of threads can manage it but I used one thread to monitor responses.
+	pthread_t thread;
+	long responses; // whole run, read by first shard without lock.
+	long cache_hits; // responses served from server result cache (HIT field).
+	struct latency_hist hist; // latency of whole run.
+} __attribute__((aligned(64))) res_shards[RES_SHARDS_MAX]; // own cache lines, shards don't share counters.
+int n_res_shards = 1;
+int event_batch = 64; // -e option, events returned by one epoll_wait().
+#define EVENT_BATCH_MAX 1024
+FILE *responses_fd; // response.txt, written by every shard.
 
 
 struct threads {
 	pthread_t req_thread; // request generator threads.
 	void * req_thread_args;
 
-	pthread_t res_thread;
-	void * res_thread_args;
+	void * res_thread_args; // set to stop response threads.
 
 } threads;
 
-struct live_server_entry {
-	char *IP;
-	int server_sock_fd;
-	bool high_load;
-	struct live_server_entry* next;
-} *live_serv_list = NULL;
-
-
 struct request_meta {
 	long request_id;
 	int range_high; // request data max value.
 	int range_low; // request data min value.
-	int swing_delay; // could be +ve/-ve;
 	unsigned int low_load_delay; // 1000 micro-second for usleep().
 	unsigned int high_load_delay; // 10 micro-seconds for usleep().
 	unsigned int inter_req_delay; // in micro-seconds. set to 1 seconds. let the signal handler decide.
 	time_t service_start_time; // set any high value
 } req_meta;
 
+int run_seconds = 0; // -d option, stop after these many seconds and print BENCH summary. 0 means run forever.
+
+// membership sync with autoscaler (SYNC message). every change of live server set bumps the generation, autoscaler
+// sends deltas on top of the generation it saw last. starts from clock so that a restarted load balancer never
+// accepts a delta meant for the old one.
+long membership_gen;
+#define SYNC_MAX_PAYLOAD 16384 // bytes of one snapshot, ~1000 servers.
+#define SYNC_MAX_SERVERS 1024
+#define SYNC_CONNECT_TIMEOUT_MS 500 // new servers of one SYNC are connected in parallel within this.
+
+// placement indexes of affinity.h (-a option), consecutive so that threads sharing in-flight table and server list
+// run on one NUMA node. proxy thread uses next one (PROXY_THREAD_PLACE), more response threads come after it.
+#define REQ_THREAD_PLACE 0
+#define RES_THREAD_PLACE 1
+#define res_shard_place(i) ((i) == 0? RES_THREAD_PLACE: PROXY_THREAD_PLACE + (i))
+
+#define MAX_FDS 1024 // response threads keep partial frame of every server socket indexed by fd.
+struct frame_reader *readers;
+
+// health check settings, a hung server is ejected within PING_INTERVAL_US + CB_FAILURE_THRESHOLD * PING_DEADLINE_US.
+#define PING_INTERVAL_US 50000 // ping every server every 50 ms.
+#define PING_DEADLINE_US 150000 // PONG must come back within 150 ms.
+#define RESPONSE_TIMEOUT_US 1000000 // requests outstanding but no response for 1 second.
+#define CB_FAILURE_THRESHOLD 2 // consecutive failures to open the circuit. hangup and write errors open it at once.
+#define CB_OPEN_MIN_US 500000 // first half open probe after 0.5 second.
+#define CB_OPEN_MAX_US 8000000 // probe interval doubles upto 8 seconds.
+#define PROBE_CONNECT_TIMEOUT_MS 100 // reconnect of dead socket during half open probe.
+#define PROBE_MAX_RECONNECTS 16 // dead sockets reconnected per health check, others wait for next one.
+#define PING_MAX_PER_TICK 64 // pings sent per health check, others wait for next one.
+
+// retry and hedging of in-flight requests.
+#define REQUEST_TIMEOUT_US 2000000 // request not answered in 2 seconds is sent to another server.
+#define MAX_ATTEMPTS 3 // sends of one request before it is counted lost.
+#define SWEEP_INTERVAL_US 10000 // in-flight table is scanned for timeouts and hedges every 10 ms.
+#define HEALTH_TICK_US 1000 // health checks write lock the server list, not more often than this.
+bool hedging = false; // -E option, send duplicate of slow requests to another server and keep first answer.
+long hedge_delay_us = 0; // p95 latency of last report interval, 0 until first report.
+
 void init_req_meta() {
 	req_meta.request_id = 0;
 	req_meta.range_high = 1e4; // keep range smaller so that there is constant time per ops.
 	req_meta.range_low = 9e3;
-	req_meta.swing_delay = 0; 
 	req_meta.low_load_delay = 5.5e5;
 	req_meta.high_load_delay = 2e5;//2e5 for > 80% utilization
 	req_meta.inter_req_delay = 5.5e5; // start with low load always.
@@ -78,112 +136,328 @@ void init_req_meta() {
 	return;
 }
 
-void print_live_servers() {
-	struct live_server_entry* ptr = live_serv_list;
-	printf("--------------- Printing Live Servers -----------\n");
-	while(ptr != NULL) {
-		printf("IP: %s, FD: %d, HIGH_LOAD: %d\n", ptr->IP, ptr->server_sock_fd, ptr->high_load);
-		ptr = ptr->next;
+// next request frame, random or from replayed trace. returns false when replayed trace is over or the request
+// thread is being stopped.
+bool get_request(char *buff, int buff_len) {
+	long int request_data;
+	int req_class;
+	if(trace.replay != NULL) {
+		if(!trace_next(&request_data, &req_class, &threads.req_thread_args)) return false; // sleeps until recorded time.
+		if(req_class >= classes.count) req_class = 0; // recorded with more classes than -Q gives.
+	} else {
+		// sleep(5);
+		usleep(req_meta.inter_req_delay);
+		req_class = class_pick();
+		int low = req_meta.range_low, high = req_meta.range_high; // control thread may be changing them.
+		if(classes.list[req_class].range_high > 0) {
+			low = classes.list[req_class].range_low;
+			high = classes.list[req_class].range_high;
+		}
+		request_data = low + rand() % (high > low? high - low: 1);
 	}
-	printf("-------------------------------------------------\n");
+	long now = now_usec();
+	trace_capture(now, request_data, req_class);
+	frame_encode_request(buff, req_meta.request_id, request_data, now); // server echoes TS back, used for latency.
+	if(classes.count > 1) frame_add_long(buff, "CLASS", req_class);
+	req_meta.request_id += 1;
+
+	return true;
 }
 
-struct live_server_entry* insert_server_entry(char *IP, int server_sock_fd) {
-	struct live_server_entry* eptr = malloc(sizeof(struct live_server_entry));
-	eptr->IP = calloc(strlen(IP)+1, sizeof(char));
-	strcpy(eptr->IP, IP);
-	eptr->server_sock_fd = server_sock_fd;
-	eptr->high_load = false;
-	eptr->next = NULL;
+// send request frame to server and account it for response timeout. returns false on write error.
+bool send_request(struct live_server_entry* eptr, char *frame) {
+	if(eptr->sent == eptr->received) eptr->last_progress_at = now_usec(); // server was idle, response timeout starts now.
+	if(!send_frame(eptr, frame)) return false;
+	__atomic_add_fetch(&eptr->sent, 1, __ATOMIC_RELAXED); // request thread and retries of response thread.
+	return true;
+}
 
-	if(live_serv_list == NULL) {
-		live_serv_list = eptr;
-		return eptr;
+// send_request() that never waits, *busy tells that socket was full and it can be tried again (send_frame_nowait()).
+bool try_send_request(struct live_server_entry* eptr, char *frame, bool *busy) {
+	if(eptr->sent == eptr->received) eptr->last_progress_at = now_usec();
+	if(!send_frame_nowait(eptr, frame, busy)) return false;
+	__atomic_add_fetch(&eptr->sent, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+// healthy server other than exclude_fd, rotating so retries spread. with allow_same the excluded server is
+// returned when it is the only healthy one. caller holds live_serv_lock.
+struct live_server_entry* pick_other_server(int exclude_fd, bool allow_same) {
+	static unsigned int turn = 0;
+	int count = 0;
+	for(struct live_server_entry* eptr = live_serv_list; eptr != NULL; eptr = eptr->next) count += 1;
+	if(count == 0) return NULL;
+	unsigned int start = __atomic_add_fetch(&turn, 1, __ATOMIC_RELAXED); // response threads retry at the same time.
+	struct live_server_entry* eptr = live_serv_list;
+	for(unsigned int i = 0; i < start % count; i++) eptr = eptr->next;
+	struct live_server_entry* same = NULL;
+	for(int i = 0; i < count; i++) {
+		if(server_usable(eptr)) {
+			if(eptr->server_sock_fd != exclude_fd) return eptr;
+			same = eptr;
+		}
+		eptr = eptr->next != NULL? eptr->next: live_serv_list;
 	}
-	eptr->next = live_serv_list;
-	live_serv_list = eptr;
-	return eptr;
+	return allow_same? same: NULL;
 }
 
-void delete_server_entry(char *IP) {
-	printf("Deleting server entry IP%s:\n", IP);
-	if(live_serv_list == NULL) {
-		return;
+// retry or hedge picked under inflight.lock and sent after it is released, so writes to a slow server don't hold
+// up response threads completing requests. callers hold live_serv_lock, even for writing, so sends never wait: a
+// full socket leaves the request to next sweep.
+#define RESEND_RETRY 0
+#define RESEND_HEDGE 1
+#define RESEND_LOST 2 // given up, only removed.
+#define SWEEP_BATCH 256 // resends of one sweep, the rest waits for next sweep.
+struct inflight_resend {
+	long req_id;
+	long req_data;
+	long ts;
+	int req_class;
+	int exclude_fd; // server having the request now.
+	int kind;
+	int sent_fd; // server it went to, -1 if none.
+	bool busy; // server socket was full, try again soon.
+};
+
+static void resend_collect(struct inflight_resend *r, struct inflight_entry *e, int exclude_fd, int kind) {
+	r->req_id = e->req_id;
+	r->req_data = e->req_data;
+	r->ts = e->ts;
+	r->req_class = e->req_class;
+	r->exclude_fd = exclude_fd;
+	r->kind = kind;
+	r->sent_fd = -1;
+	r->busy = false;
+}
+
+// send collected requests on other servers, then record where they went. entries answered meanwhile are skipped.
+// caller holds live_serv_lock (read lock is enough), not inflight.lock.
+static void resend_inflight(struct inflight_resend *list, int n, long now) {
+	for(int i = 0; i < n; i++) {
+		if(list[i].kind == RESEND_LOST) continue;
+		struct live_server_entry* srv = pick_other_server(list[i].exclude_fd, list[i].kind == RESEND_RETRY);
+		if(srv == NULL) continue;
+		char frame[FRAME_LEN];
+		frame_encode_request(frame, list[i].req_id, list[i].req_data, list[i].ts);
+		if(classes.count > 1) frame_add_long(frame, "CLASS", list[i].req_class);
+		if(try_send_request(srv, frame, &list[i].busy)) list[i].sent_fd = srv->server_sock_fd; // on error health checks open its circuit.
 	}
-	struct live_server_entry* eptr = live_serv_list;
-	if(strcmp(eptr->IP, IP) == 0) {
-		live_serv_list = eptr->next;
-		free(eptr);
-		return;
+	pthread_mutex_lock(&inflight.lock);
+	for(int i = 0; i < n; i++) {
+		struct inflight_entry *e = inflight_find(list[i].req_id);
+		if(e == NULL) continue;
+		if(list[i].kind == RESEND_LOST) {
+			inflight.lost += 1;
+			inflight_remove(e);
+		} else if(list[i].kind == RESEND_RETRY) {
+			if(list[i].busy) {
+				inflight_retry_soon(e);
+				continue;
+			}
+			e->sent_at = now; // wait full timeout again even if no server is available now.
+			inflight_touch(e);
+			if(list[i].sent_fd == -1) continue;
+			e->server_fd = list[i].sent_fd;
+			e->attempts += 1;
+			inflight.retries += 1;
+		} else if(list[i].sent_fd != -1) {
+			e->hedge_fd = list[i].sent_fd;
+			inflight.hedges += 1;
+		}
 	}
-	while(eptr->next != NULL && strcmp(eptr->next->IP, IP) != 0) {
-		eptr = eptr->next;
+	pthread_mutex_unlock(&inflight.lock);
+}
+
+// server failed or is removed, move its requests to other servers. caller holds live_serv_lock (read lock is enough).
+void retry_server_requests(int server_sock_fd) {
+	long now = now_usec();
+	pthread_mutex_lock(&inflight.lock);
+	struct inflight_resend *list = malloc((inflight.count > 0? inflight.count: 1) * sizeof(struct inflight_resend));
+	int n = 0;
+	for(int i = inflight.oldest; i != -1 && list != NULL; i = inflight.slots[i].newer) {
+		struct inflight_entry *e = &inflight.slots[i];
+		if(e->hedge_fd == server_sock_fd) e->hedge_fd = -1;
+		if(e->server_fd != server_sock_fd) continue;
+		if(e->hedge_fd != -1) { // hedged copy is still running, let it answer.
+			e->server_fd = e->hedge_fd;
+			e->hedge_fd = -1;
+			continue;
+		}
+		resend_collect(&list[n++], e, server_sock_fd, RESEND_RETRY);
 	}
-	if(eptr->next == NULL) return;
-	struct live_server_entry* tmp = eptr->next;
-	eptr->next = eptr->next->next;
-	free(tmp);
-	return;
+	pthread_mutex_unlock(&inflight.lock);
+	resend_inflight(list, n, now); // timeouts retry what did not fit if malloc failed.
+	free(list);
 }
 
-struct live_server_entry* get_server_entry(char *IP) {
-	if(live_serv_list == NULL) {
-		return NULL;
+// timeouts and hedges of in-flight requests, called by first response thread every SWEEP_INTERVAL_US.
+// walks from the oldest entry and stops at the first one too young to time out or be hedged.
+void sweep_inflight(long now) {
+	struct inflight_resend list[SWEEP_BATCH];
+	int n = 0;
+	long hedge_delay = hedging? hedge_delay_us: 0; // report of first response thread changes it.
+	long young = hedge_delay > 0 && hedge_delay < REQUEST_TIMEOUT_US? hedge_delay: REQUEST_TIMEOUT_US;
+	pthread_rwlock_rdlock(&live_serv_lock);
+	pthread_mutex_lock(&inflight.lock);
+	for(int i = inflight.oldest; i != -1 && n < SWEEP_BATCH; i = inflight.slots[i].newer) {
+		struct inflight_entry *e = &inflight.slots[i];
+		if(now - e->sent_at <= young) break;
+		if(now - e->sent_at > REQUEST_TIMEOUT_US) {
+			resend_collect(&list[n++], e, e->server_fd, e->attempts >= MAX_ATTEMPTS? RESEND_LOST: RESEND_RETRY);
+		} else if(hedge_delay > 0 && e->hedge_fd == -1 && e->attempts == 1 && now - e->first_sent_at > hedge_delay) {
+			resend_collect(&list[n++], e, e->server_fd, RESEND_HEDGE);
+		}
 	}
-	struct live_server_entry* eptr = live_serv_list;
-	while(eptr != NULL && strcmp(eptr->IP, IP) != 0) {
-		eptr = eptr->next;
+	pthread_mutex_unlock(&inflight.lock);
+	resend_inflight(list, n, now);
+	pthread_rwlock_unlock(&live_serv_lock);
+}
+
+// failure seen for server. fatal failures (hangup, write error) open the circuit at once.
+// response threads call it under read lock, only the thread whose compare and swap opens the circuit retries.
+void circuit_failure(struct live_server_entry* eptr, const char *reason, bool fatal, long now) {
+	__atomic_store_n(&eptr->ping_sent_at, 0, __ATOMIC_RELAXED);
+	int state = circuit_state(eptr);
+	if(state == CIRCUIT_OPEN) return;
+	if(state == CIRCUIT_HALF_OPEN) { // probe failed, stay away longer.
+		long open_usec = __atomic_load_n(&eptr->open_usec, __ATOMIC_RELAXED) * 2;
+		__atomic_store_n(&eptr->open_usec, open_usec > CB_OPEN_MAX_US? CB_OPEN_MAX_US: open_usec, __ATOMIC_RELAXED);
+	} else {
+		int failures = __atomic_add_fetch(&eptr->failures, 1, __ATOMIC_RELAXED);
+		if(!fatal && failures < CB_FAILURE_THRESHOLD) return;
+		__atomic_store_n(&eptr->open_usec, CB_OPEN_MIN_US, __ATOMIC_RELAXED);
 	}
-	return eptr;
+	__atomic_store_n(&eptr->opened_at, now, __ATOMIC_RELAXED);
+	if(!__atomic_compare_exchange_n(&eptr->circuit, &state, CIRCUIT_OPEN, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return;
+	if(state == CIRCUIT_CLOSED) printf("Server IP:%s ejected (%s), circuit OPEN\n", eptr->IP, reason);
+	retry_server_requests(eptr->server_sock_fd); // don't lose what was outstanding on it.
 }
 
-static inline void update_swing() {
-	req_meta.inter_req_delay += req_meta.swing_delay;
+void circuit_success(struct live_server_entry* eptr) {
+	__atomic_store_n(&eptr->failures, 0, __ATOMIC_RELAXED);
+	int state = CIRCUIT_HALF_OPEN;
+	if(__atomic_compare_exchange_n(&eptr->circuit, &state, CIRCUIT_CLOSED, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		printf("Server IP:%s recovered, circuit CLOSED\n", eptr->IP);
+		__atomic_store_n(&eptr->open_usec, 0, __ATOMIC_RELAXED);
+		eptr->last_progress_at = now_usec();
+	}
+}
 
-	if(req_meta.inter_req_delay < req_meta.high_load_delay) { // very high load reduce load. means increase the req delay.
-		if(req_meta.swing_delay < 0) req_meta.swing_delay *= -1;
-		return;
+// returns false if in-flight table is full.
+bool track_request(char *frame, int server_sock_fd) {
+	long req_id = 0, req_data = 0, req_class = 0, now = now_usec(), ts = now;
+	frame_get_long(frame, "REQ_ID", &req_id);
+	frame_get_long(frame, "REQ_DATA", &req_data);
+	frame_get_long(frame, "TS", &ts);
+	frame_get_long(frame, "CLASS", &req_class);
+	pthread_mutex_lock(&inflight.lock);
+	struct inflight_entry *e = inflight_insert(req_id);
+	if(e != NULL) {
+		e->req_data = req_data;
+		e->ts = ts;
+		e->req_class = req_class;
+		e->first_sent_at = now;
+		e->sent_at = now;
+		e->server_fd = server_sock_fd;
+		e->hedge_fd = -1;
+		e->attempts = 1;
 	}
-	if(req_meta.inter_req_delay > req_meta.low_load_delay) { // very low load decrease delay.
-		if(req_meta.swing_delay > 0) req_meta.swing_delay *= -1;
-		return;
+	pthread_mutex_unlock(&inflight.lock);
+	return e != NULL;
+}
+
+// first answer of request removes it from in-flight table and returns its latency, later answers return -1.
+long complete_request(char *frame, long now) {
+	long req_id;
+	if(!frame_get_long(frame, "REQ_ID", &req_id)) return -1;
+	pthread_mutex_lock(&inflight.lock);
+	struct inflight_entry *e = inflight_find(req_id);
+	long latency = -1;
+	if(e == NULL) {
+		inflight.duplicates += 1; // hedged copy or retry answered after the first one.
+	} else {
+		latency = now - e->first_sent_at;
+		inflight_remove(e);
 	}
-	return;
+	pthread_mutex_unlock(&inflight.lock);
+	return latency;
 }
 
-void get_request(char *buff, int buff_len) {
-	// sleep(5);
-	usleep(req_meta.inter_req_delay);
-	if(req_meta.swing_delay != 0) update_swing();
+// track and send request on server, circuit is opened on write error. returns false on write error.
+bool dispatch_request(struct live_server_entry* ptr, char *buff) {
+	// before sending so that response can't come back first. untracked answer would count as duplicate, so a request
+	// that doesn't fit is dropped (counted in inflight.overflow). senders check inflight_full() before taking it.
+	if(!track_request(buff, ptr->server_sock_fd)) return true;
+	// printf("Writing on socket fd: %d\n", ptr->server_sock_fd);
+	if(send_request(ptr, buff)) return true;
+	printf("Server disconnected at IP:%s\n", ptr->IP);
+	pthread_rwlock_wrlock(&live_serv_lock);
+	circuit_failure(ptr, "write failed", true, now_usec());
+	pthread_rwlock_unlock(&live_serv_lock);
+	return false;
+}
 
-	long int request_data = req_meta.range_low + rand() % (req_meta.range_high - req_meta.range_low);
-	sprintf(buff, "REQ_ID:%ld;REQ_DATA:%ld;", req_meta.request_id, request_data);
-	req_meta.request_id += 1;
+// send queued requests to ptr in class order (classes.h) while it has room. returns true if anything was sent.
+bool send_queued(struct live_server_entry* ptr) {
+	bool sent = false;
+	int idx;
+	while(server_has_room(ptr) && !inflight_full() && (idx = class_next()) >= 0) {
+		char *frame = class_head(idx);
+		class_pop(idx); // a failed write is retried from in-flight table, not from the queue.
+		if(!dispatch_request(ptr, frame)) return sent;
+		sent = true;
+	}
+	return sent;
+}
 
-	return;
+// consistent hash routing of queued requests, stops at first request whose server is full so class order holds.
+bool send_queued_chash() {
+	bool sent = false;
+	int idx;
+	while(!inflight_full() && (idx = class_next()) >= 0) {
+		char *frame = class_head(idx);
+		long req_data = 0;
+		frame_get_long(frame, "REQ_DATA", &req_data);
+		struct live_server_entry* ptr = chash_pick(chash_key(req_data));
+		if(ptr == NULL || ptr->high_load || !server_has_room(ptr)) break;
+		class_pop(idx);
+		if(!dispatch_request(ptr, frame)) break;
+		sent = true;
+	}
+	return sent;
 }
 
 void *generate_requests(void *arg) {
 	// TODO:
 	// use system time and for given interval generate fixed number of request in round-robbin so that when new domain is spawns then no of request per domain decreases.
-	static int buff_len = 100;
+	static int buff_len = FRAME_LEN;
 	char buff[buff_len];
 	struct live_server_entry* ptr;
+	pin_thread(REQ_THREAD_PLACE); // thread is restarted on every scale out/in.
 	while(true) {
-		ptr = live_serv_list;
-		while(ptr != NULL && ptr->high_load == false) {
-			get_request(buff, buff_len);
-			// printf("Writing on socket fd: %d\n", ptr->server_sock_fd);
-			int flag = write(ptr->server_sock_fd, buff, buff_len);
-			if(flag < 0) {
-				close(ptr->server_sock_fd);
-				printf("Server disconnected at IP:%s\n", ptr->IP);
-				delete_server_entry(ptr->IP);
+		bool generated = false; // get_request() waited the inter request delay.
+		if(chash.enabled) { // server is picked by request data, same data goes to same server.
+			if(chash.count > 0 && get_request(buff, buff_len)) {
+				class_enqueue(buff);
+				generated = true;
+			}
+			send_queued_chash();
+		} else {
+			ptr = live_serv_list;
+			while(ptr != NULL && ptr->high_load == false) {
+				if(circuit_state(ptr) != CIRCUIT_CLOSED) { // ejected by health checks.
+					ptr = ptr->next;
+					continue;
+				}
+				if(get_request(buff, buff_len)) { // false when replayed trace is over, backlog still drains.
+					class_enqueue(buff); // without -W it is sent right below.
+					generated = true;
+				}
+				send_queued(ptr);
 				ptr = ptr->next;
-				continue;
 			}
-			ptr = ptr->next;
 		}
+		if(!generated && threads.req_thread_args == NULL) usleep(req_meta.inter_req_delay); // no healthy server, don't spin.
 
 		if(threads.req_thread_args != NULL) {
 			break;
@@ -194,80 +468,309 @@ void *generate_requests(void *arg) {
 
 
 void init_request_thread() {
+	if(proxy_port > 0) return; // clients send the requests in proxy mode.
 	threads.req_thread_args = NULL;
 	pthread_create(&threads.req_thread, NULL, &generate_requests, NULL); // creating the thread
 	return;
 }
 
 void stop_request_thread() {
+	if(proxy_port > 0) return;
 	threads.req_thread_args = (void *)1;
 	pthread_join(threads.req_thread, NULL);
 	return;
 }
 
-void *process_server_responses(void *arg) {
+void watch_server_socket(int server_sock_fd) {
+	struct my_epoll_context *shard = &res_shards[server_sock_fd % n_res_shards];
+	readers[server_sock_fd % MAX_FDS].len = 0;
+	struct epoll_event interested_event; // struct epoll_event is inbuilt structure we just created variable of this struct type to store interested event data for this epoll instance.
+	interested_event.data.fd = server_sock_fd; // adding the socket fd
+	interested_event.events = EPOLLIN | EPOLLET | EPOLLRDHUP; // adding the event type for this socket fd. EPOLLRDHUP tells when server closes connection.
+	epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, server_sock_fd, &interested_event); // adding the socket to epoll instance.
+}
 
-	FILE *fd = fopen("response.txt", "w");
-	setbuf(fd, NULL);
-	time_t cur_time;
-	time(&cur_time);
-	fprintf(fd, "###############   Processing Server Responses Start Time: %s", ctime(&cur_time));
+// new socket of server whose old one died, caller holds live_serv_lock for writing.
+void replace_server_socket(struct live_server_entry* eptr, int server_sock_fd) {
+	make_non_block_socket(server_sock_fd);
+	pthread_mutex_lock(&eptr->write_lock);
+	close(eptr->server_sock_fd);
+	eptr->server_sock_fd = server_sock_fd;
+	pthread_mutex_unlock(&eptr->write_lock);
+	__atomic_store_n(&eptr->sock_dead, false, __ATOMIC_RELEASE);
+	eptr->received = eptr->sent; // responses outstanding on old socket are lost.
+	watch_server_socket(server_sock_fd);
+}
 
-	long int response_count = 0;
-	long int last_request_id = 0;
-	time_t last_time = time(NULL);
+// never waits: a ping that finds the socket full counts as sent, its deadline catches a server that stopped reading.
+// health check is the only writer of ping_seq, the shard owning the socket reads it and clears ping_sent_at.
+bool send_ping(struct live_server_entry* eptr, long now) {
+	char frame[FRAME_LEN];
+	bool busy;
+	long seq = eptr->ping_seq + 1;
+	frame_encode_ping(frame, "PING", seq);
+	__atomic_store_n(&eptr->ping_seq, seq, __ATOMIC_RELAXED);
+	eptr->last_ping_at = now;
+	__atomic_store_n(&eptr->ping_sent_at, now, __ATOMIC_RELEASE);
+	return send_frame_nowait(eptr, frame, &busy) || busy;
+}
+
+// half open servers with dead socket, connected without holding live_serv_lock, then probed.
+void reconnect_servers(char (*IPs)[64], int count, long now) {
+	char *list[PROBE_MAX_RECONNECTS];
+	int fds[PROBE_MAX_RECONNECTS];
+	for(int i = 0; i < count; i++) list[i] = IPs[i];
+	connect_to_servers(list, count, fds, PROBE_CONNECT_TIMEOUT_MS);
+	pthread_rwlock_wrlock(&live_serv_lock);
+	for(int i = 0; i < count; i++) {
+		struct live_server_entry* eptr = get_server_entry(IPs[i]);
+		if(eptr == NULL || eptr->circuit != CIRCUIT_HALF_OPEN || !eptr->sock_dead) { // removed or changed meanwhile.
+			if(fds[i] != FAILED) close(fds[i]);
+			continue;
+		}
+		if(fds[i] != FAILED) replace_server_socket(eptr, fds[i]);
+		if(fds[i] == FAILED || !send_ping(eptr, now)) circuit_failure(eptr, "probe failed", true, now);
+	}
+	pthread_rwlock_unlock(&live_serv_lock);
+}
+
+// pings decided by check_server_health, sent under read lock once the scan is done. probes are pings of half
+// open servers, an entry removed or changed meanwhile is skipped.
+void send_pings(char (*IPs)[64], bool *probe, int count, long now) {
+	pthread_rwlock_rdlock(&live_serv_lock);
+	for(int i = 0; i < count; i++) {
+		struct live_server_entry* eptr = get_server_entry(IPs[i]);
+		if(eptr == NULL || circuit_state(eptr) != (probe[i]? CIRCUIT_HALF_OPEN: CIRCUIT_CLOSED)) continue;
+		if(__atomic_load_n(&eptr->ping_sent_at, __ATOMIC_ACQUIRE) != 0) continue;
+		if(!send_ping(eptr, now)) circuit_failure(eptr, probe[i]? "probe failed": "ping write failed", true, now);
+	}
+	pthread_rwlock_unlock(&live_serv_lock);
+}
+
+// active health checks, called by first response thread every HEALTH_TICK_US. scans under read lock so response
+// threads and proxy go on, circuit moves by compare and swap since the owning shard may fail it meanwhile.
+void check_server_health(long now) {
+	char dead[PROBE_MAX_RECONNECTS][64], ping[PING_MAX_PER_TICK][64];
+	bool probe[PING_MAX_PER_TICK];
+	int n_dead = 0, n_ping = 0;
+	pthread_rwlock_rdlock(&live_serv_lock);
+	for(struct live_server_entry* eptr = live_serv_list; eptr != NULL; eptr = eptr->next) {
+		int state = circuit_state(eptr);
+		if(state == CIRCUIT_OPEN) {
+			if(now - __atomic_load_n(&eptr->opened_at, __ATOMIC_RELAXED) < __atomic_load_n(&eptr->open_usec, __ATOMIC_RELAXED)) continue;
+			bool sock_dead = __atomic_load_n(&eptr->sock_dead, __ATOMIC_ACQUIRE);
+			if(sock_dead? n_dead == PROBE_MAX_RECONNECTS: n_ping == PING_MAX_PER_TICK) continue; // next tick.
+			if(!__atomic_compare_exchange_n(&eptr->circuit, &state, CIRCUIT_HALF_OPEN, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) continue;
+			if(sock_dead) { // connected after the lock is released, other threads go on meanwhile.
+				snprintf(dead[n_dead++], sizeof(dead[0]), "%s", eptr->IP);
+				continue;
+			}
+			probe[n_ping] = true; // send one probe.
+			snprintf(ping[n_ping++], sizeof(ping[0]), "%s", eptr->IP);
+			continue;
+		}
+		long ping_sent_at = __atomic_load_n(&eptr->ping_sent_at, __ATOMIC_ACQUIRE);
+		if(ping_sent_at != 0) {
+			if(now - ping_sent_at > PING_DEADLINE_US) circuit_failure(eptr, "ping deadline missed", false, now);
+			continue;
+		}
+		if(state != CIRCUIT_CLOSED) continue;
+		long last_progress_at = __atomic_load_n(&eptr->last_progress_at, __ATOMIC_RELAXED);
+		if(eptr->sent > eptr->received && last_progress_at != 0 && now - last_progress_at > RESPONSE_TIMEOUT_US) {
+			__atomic_store_n(&eptr->last_progress_at, now, __ATOMIC_RELAXED);
+			circuit_failure(eptr, "response timeout", false, now);
+			continue;
+		}
+		if(now - eptr->last_ping_at >= PING_INTERVAL_US && n_ping < PING_MAX_PER_TICK) {
+			probe[n_ping] = false;
+			snprintf(ping[n_ping++], sizeof(ping[0]), "%s", eptr->IP);
+		}
+	}
+	pthread_rwlock_unlock(&live_serv_lock);
+	if(n_ping > 0) send_pings(ping, probe, n_ping, now);
+	if(n_dead > 0) reconnect_servers(dead, n_dead, now);
+}
+
+// response thread of one shard, reads answers of servers in its epoll. first shard also runs health checks and
+// in-flight sweeps and prints the reports, adding up counters of all shards without stopping them.
+void *process_server_responses(void *arg) {
+	struct my_epoll_context *shard = arg;
+	int idx = shard - res_shards;
+	if(!pin_thread(res_shard_place(idx))) printf("Pinning response thread %d failed\n", idx);
+	if(shard->response_events == NULL) shard->response_events = local_alloc(event_batch * sizeof(struct epoll_event)); // this memory location will be passed to epoll_wait to write the response events.
+	if(idx == 0 && readers == NULL) __atomic_store_n(&readers, local_alloc(MAX_FDS * sizeof(struct frame_reader)), __ATOMIC_RELEASE); // partial frame per server socket.
+
+	// report state of first shard, static so that it goes on when threads start again after failed hot restart.
+	static long int last_request_id = 0;
+	static time_t last_time = 0;
 	time_t now_time;
 
-	static int buff_len = 100;
+	long int response_count = 0; // of last report interval.
+	static long int total_responses = 0; // whole run for BENCH summary.
+	long cache_hits = 0; // responses served from server result cache (HIT field).
+	static long total_cache_hits = 0;
+	static long reports = 0;
+	static long start_usec = 0;
+	if(start_usec == 0) {
+		start_usec = now_usec();
+		last_time = time(NULL);
+	}
+	long last_sweep = now_usec(), last_health = 0;
+	struct latency_hist hist; // latency of last report interval.
+	static struct latency_hist total_hist; // latency of whole run, all shards at last report.
+	struct latency_hist part;
+
+	static int buff_len = 32 * FRAME_LEN; // read many frames per read() call.
 	char buff[buff_len];
 	int nfds, len;
 	while(true) {
-		nfds = epoll_wait(my_epoll.epoll_fd, my_epoll.response_events, 10, 1);// 10 is the maxevents to be returned by call (we have allocated space for 10 events during epoll instance creation you can increase) 1 timeout means wait for 1 second.
+		nfds = epoll_wait(shard->epoll_fd, shard->response_events, event_batch, 1); // 1 ms timeout so that health checks and reports run when servers are quiet.
 		for(int i = 0; i < nfds; i++) {
-			int sock_fd = my_epoll.response_events[i].data.fd;
+			int sock_fd = shard->response_events[i].data.fd;
+			uint32_t events = shard->response_events[i].events;
+			struct frame_reader *reader = &readers[sock_fd % MAX_FDS];
+			pthread_rwlock_rdlock(&live_serv_lock); // entry of this fd is touched by this shard only.
+			struct live_server_entry* eptr = get_server_entry_by_fd(sock_fd);
 			len = read(sock_fd, buff, sizeof(buff));
-			if(len == 0) { // event occured but no data means server disconnected. don't close fd let autoscaler inform what to do.
-				// printf("Server disconnected sock fd: %d\n", sock_fd);
-				continue;
-			}
 			while(len > 0) {
-				fprintf(fd, "Server response: %s\n", buff);
+				char *data = buff;
+				char *frame;
+				long now = now_usec();
+				while((frame = frame_next(reader, &data, &len)) != NULL) {
+					frame[FRAME_LEN - 1] = '\0';
+					if(frame_is(frame, "PONG")) {
+						long seq = 0;
+						frame_get_long(frame, "PONG", &seq);
+						long ping_sent_at = eptr == NULL? 0: __atomic_load_n(&eptr->ping_sent_at, __ATOMIC_ACQUIRE);
+						if(ping_sent_at != 0 && seq == __atomic_load_n(&eptr->ping_seq, __ATOMIC_RELAXED) &&
+								__atomic_compare_exchange_n(&eptr->ping_sent_at, &ping_sent_at, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+							circuit_success(eptr);
+						}
+						if(eptr != NULL) guest_load_update(eptr, frame, now);
+						continue;
+					}
+					if(eptr != NULL) {
+						eptr->received += 1;
+						eptr->last_progress_at = now;
+					}
+					long latency = complete_request(frame, now); // latency from first send, retries included.
+					if(latency < 0) continue; // duplicate answer.
+					fprintf(responses_fd, "Server response: %s\n", frame);
+					long hit = 0;
+					if(frame_get_long(frame, "HIT", &hit) && hit) __atomic_store_n(&shard->cache_hits, shard->cache_hits + 1, __ATOMIC_RELAXED);
+					hist_record_shared(&shard->hist, latency);
+					class_record(frame, now, idx);
+					__atomic_store_n(&shard->responses, shard->responses + 1, __ATOMIC_RELAXED);
+				}
 				len = read(sock_fd, buff, sizeof(buff));
-				response_count += 1;
 			}
+			// no data with event or hangup means server disconnected. don't close fd let autoscaler inform what to do, half open probe reconnects.
+			if(len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) || (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+				epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, sock_fd, NULL);
+				reader->len = 0;
+				if(eptr != NULL) {
+					printf("Server disconnected at IP:%s\n", eptr->IP);
+					__atomic_store_n(&eptr->sock_dead, true, __ATOMIC_RELEASE);
+					circuit_failure(eptr, "connection closed", true, now_usec()); // retries go out under read lock without waiting on full sockets.
+				}
+			}
+			pthread_rwlock_unlock(&live_serv_lock);
 		}
 		if(threads.res_thread_args != NULL) {
 			break;
 		}
+		if(idx != 0) continue;
+		if(now_usec() - last_health >= HEALTH_TICK_US) {
+			last_health = now_usec();
+			check_server_health(last_health);
+		}
+		if(now_usec() - last_sweep >= SWEEP_INTERVAL_US) {
+			last_sweep = now_usec();
+			sweep_inflight(last_sweep);
+		}
 
 		now_time = time(NULL);
-		if(now_time > last_time + 5) {	// for every 5 seconds.
+		bool run_over = run_seconds > 0 && now_usec() - start_usec >= run_seconds * 1000000L;
+		if(now_time > last_time + 5 || run_over) {	// for every 5 seconds.
 			int sec_diff = now_time-last_time;
-			printf("Throughput: Serving %.2lf req/sec, 	Sending %.2lf req/sec\n", (1.0 * response_count)/sec_diff, (req_meta.request_id - last_request_id) * 1.00 /sec_diff);
-			response_count = 0;
+			if(sec_diff == 0) sec_diff = 1;
+			// counters of shards only grow, interval is the difference to what was added up last time.
+			long responses = 0, hits = 0;
+			struct latency_hist merged;
+			hist_reset(&merged);
+			for(int s = 0; s < n_res_shards; s++) {
+				responses += __atomic_load_n(&res_shards[s].responses, __ATOMIC_RELAXED);
+				hits += __atomic_load_n(&res_shards[s].cache_hits, __ATOMIC_RELAXED);
+				hist_snapshot(&part, &res_shards[s].hist);
+				hist_merge(&merged, &part);
+			}
+			hist_subtract(&hist, &merged, &total_hist);
+			response_count = responses - total_responses;
+			cache_hits = hits - total_cache_hits;
+			printf("Throughput: Serving %.2lf req/sec, 	Sending %.2lf req/sec, 	Latency p50: %ld us, p99: %ld us\n", (1.0 * response_count)/sec_diff, (req_meta.request_id - last_request_id) * 1.00 /sec_diff, hist_percentile(&hist, 50), hist_percentile(&hist, 99));
+			printf("In-flight: %d, 	Retries: %ld, 	Hedges: %ld, 	Duplicates: %ld, 	Lost: %ld, 	Overflow: %ld\n", inflight.count, inflight.retries, inflight.hedges, inflight.duplicates, inflight.lost, inflight.overflow);
+			if(proxy_port > 0) printf("Proxy: sessions %d, 	accepted %ld, 	rejected %ld, 	closed bytes up %ld, down %ld, 	zerocopy sends %ld (copied %ld)\n", proxy.active, proxy.accepted, proxy.rejected, proxy.bytes_up, proxy.bytes_down, proxy.zc_sends, proxy.zc_copied);
+			if(chash.enabled) printf("Consistent hash: cache hits %.1lf%%, 	overflow %.1lf%% of %ld routed\n", response_count > 0? 100.0 * cache_hits / response_count: 0.0,
+				chash.routed > 0? 100.0 * chash.overflows / chash.routed: 0.0, chash.routed);
+			class_report(stdout, sec_diff, n_res_shards);
+			if(hist.total >= 20) hedge_delay_us = hist_percentile(&hist, 95); // hedge only the slowest 5%.
+			total_hist = merged;
+			total_responses = responses;
+			total_cache_hits = hits;
 			last_request_id = req_meta.request_id;
 			last_time = now_time;
+			reports += 1;
+			if(reports % 12 == 0) pool_report(stdout); // every minute, in use counts must stay flat under flat load.
+		}
+		if(run_over) { // benchmark run finished, print machine readable summary and stop the process.
+			double secs = (now_usec() - start_usec) / 1e6;
+			char class_json[MAX_CLASSES * 128];
+			class_bench_json(class_json, sizeof(class_json));
+			printf("BENCH {\"seconds\":%.3lf,\"sent\":%ld,\"served\":%ld,\"throughput\":%.2lf,\"p50_us\":%ld,\"p99_us\":%ld,\"max_us\":%ld,"
+				"\"retries\":%ld,\"hedges\":%ld,\"duplicates\":%ld,\"lost\":%ld,\"cache_hit_pct\":%.2lf,\"response_threads\":%d%s}\n",
+				secs, req_meta.request_id, total_responses, total_responses / secs,
+				hist_percentile(&total_hist, 50), hist_percentile(&total_hist, 99), total_hist.max,
+				inflight.retries, inflight.hedges, inflight.duplicates, inflight.lost,
+				total_responses > 0? 100.0 * total_cache_hits / total_responses: 0.0, n_res_shards, class_json);
+			fflush(stdout);
+			exit(0);
 		}
 	}
-	fprintf(fd, "Total request sent: %ld\n", req_meta.request_id);
-	time(&cur_time);
-	fprintf(fd, "#####################   Processing stopped at: %s", ctime(&cur_time));
-	fflush(fd);
-	fclose(fd);
+	return NULL;
 }
 
 void stop_response_thread() {
 	threads.res_thread_args = (void *)1;
-	pthread_join(threads.res_thread, NULL);
+	for(int i = 0; i < n_res_shards; i++) pthread_join(res_shards[i].thread, NULL);
+	time_t cur_time;
+	fprintf(responses_fd, "Total request sent: %ld\n", req_meta.request_id);
+	time(&cur_time);
+	fprintf(responses_fd, "#####################   Processing stopped at: %s", ctime(&cur_time));
+	fflush(responses_fd);
+	fclose(responses_fd);
 	return;
 }
 
 
-void init_response_thread() {
-	pthread_t res_thread; // response threads.
-	my_epoll.epoll_fd = epoll_create1(0); // creating the epoll instance for this thread it returns the epoll instance fd.
-	my_epoll.response_events = calloc(10, sizeof(struct epoll_event)); // this memory location will be passed to epoll_wait to write the response events.
-	pthread_create(&res_thread, NULL, &process_server_responses, (void *)-1); // creating the thread
+// mode "w" on start, "a" when threads start again after failed hot restart.
+void start_response_threads(char *mode) {
+	responses_fd = fopen("response.txt", mode);
+	setbuf(responses_fd, NULL);
+	time_t cur_time;
+	time(&cur_time);
+	fprintf(responses_fd, "###############   Processing Server Responses Start Time: %s", ctime(&cur_time));
+
+	threads.res_thread_args = NULL;
+	for(int i = 0; i < n_res_shards; i++) {
+		pthread_create(&res_shards[i].thread, NULL, &process_server_responses, &res_shards[i]); // creating the thread
+		if(i == 0) while(__atomic_load_n(&readers, __ATOMIC_ACQUIRE) == NULL) usleep(100); // allocated by first response thread on its own node, scale out writes it.
+	}
+}
+
+// append keeps response.txt of the process this one took over from.
+void init_response_thread(bool append) {
+	for(int i = 0; i < n_res_shards; i++) res_shards[i].epoll_fd = epoll_create1(0); // creating the epoll instance for this thread it returns the epoll instance fd.
+	start_response_threads(append? "a": "w");
 }
 
 void make_non_block_socket(int fd) {
@@ -291,6 +794,9 @@ int create_lstn_sock_fd() {
 		exit(0);
 	} else printf("Listening socket created\n");
 
+	int reuse = 1; // restarted load balancer can bind again while old autoscaler connection is in TIME_WAIT.
+	setsockopt(lstn_sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
 	lstn_socket.sin_family = AF_INET;
 	lstn_socket.sin_addr.s_addr = htonl(INADDR_ANY); // since autoscaler is on same host.
 	lstn_socket.sin_port = htons(8181); // auto scaler will connect on this port.
@@ -310,30 +816,70 @@ int create_lstn_sock_fd() {
 }
 
 
-int connect_to_server(char *IP) {
-	struct sockaddr_in server_address;
-
-	int sock_fd, flag;
-	sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if(sock_fd == -1) {
-		printf("server socket creation failed");
-		return FAILED;
-	} else printf("server socket created\n");
-
-	server_address.sin_family = AF_INET;
-	// IP of server pc to connect with. INADDR_LOOPBACK is 127.0.0.1 i.e. localhost you can specify IP
-	server_address.sin_addr.s_addr =  inet_addr(IP); //htonl(INADDR_ANY);
-	// port of server process on server pc.
-	server_address.sin_port = htons(8080);
-
-	flag = connect(sock_fd, (struct sockaddr *)&server_address, sizeof(server_address));
+int connect_to_server_timeout(char *IP, int timeout_ms) {	// timeout_ms -1 blocks like plain connect().
+	bool in_progress;
+	int flag = 0;
+	int sock_fd = transport_connect(IP, timeout_ms >= 0, &in_progress);
+	if(sock_fd == -1) flag = -1;
+	else if(in_progress) { // non blocking connect, wait for it upto timeout.
+		struct pollfd pfd = {.fd = sock_fd, .events = POLLOUT};
+		int err = ETIMEDOUT;
+		socklen_t err_len = sizeof(err);
+		if(poll(&pfd, 1, timeout_ms) == 1) getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+		flag = err == 0? 0: -1;
+	}
 	if(flag == -1) {
 		printf("Error conecting server at IP: %s\n", IP);
+		if(sock_fd != -1) close(sock_fd);
 		return FAILED;
 	} else printf("Connected to server at IP: %s\n", IP);
 	return sock_fd;
 }
 
+int connect_to_server(char *IP) {
+	return connect_to_server_timeout(IP, -1);
+}
+
+// connect to many servers at once, all of them together wait at most timeout_ms. fds[i] is FAILED if IPs[i] didn't answer.
+void connect_to_servers(char **IPs, int count, int *fds, int timeout_ms) {
+	struct pollfd pfds[count];
+	int waiting = 0;
+	long deadline = now_usec() + timeout_ms * 1000L;
+	for(int i = 0; i < count; i++) {
+		bool in_progress;
+		pfds[i].fd = -1; // poll() skips negative fds.
+		pfds[i].events = POLLOUT;
+		fds[i] = transport_connect(IPs[i], true, &in_progress);
+		if(!in_progress) continue; // connected at once (loopback, unix socket) or failed.
+		pfds[i].fd = fds[i];
+		waiting += 1;
+	}
+	while(waiting > 0) {
+		long left_ms = (deadline - now_usec()) / 1000;
+		if(left_ms <= 0 || poll(pfds, count, left_ms) <= 0) break;
+		for(int i = 0; i < count; i++) {
+			if(pfds[i].fd < 0 || pfds[i].revents == 0) continue;
+			int err = 0;
+			socklen_t err_len = sizeof(err);
+			getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &err, &err_len);
+			if(err != 0) {
+				close(fds[i]);
+				fds[i] = FAILED;
+			}
+			pfds[i].fd = -1;
+			waiting -= 1;
+		}
+	}
+	for(int i = 0; i < count; i++) {
+		if(pfds[i].fd >= 0) { // timed out.
+			close(fds[i]);
+			fds[i] = FAILED;
+		}
+		if(fds[i] == FAILED) printf("Error conecting server at IP: %s\n", IPs[i]);
+		else printf("Connected to server at IP: %s\n", IPs[i]);
+	}
+}
+
 void destroy() {
 
 	printf("Started destroying ...\n");
@@ -347,41 +893,80 @@ void destroy() {
 		printf("Server: %s socket closed\n", ptr->IP);
 		ptr = ptr->next;
 	}
+	if(handoff.lstn_fd >= 0) {
+		close(handoff.lstn_fd);
+		unlink(handoff.path);
+	}
+	pool_report(stdout); // anything still in use here besides live server entries is a leak.
 	printf("Finished destroying.\n");
 	return;
 }
 
-void signal_handler(int sig_type) {
-	if(sig_type == SIGINT) {
-		printf("\nEnter one choice: LOW | HIGH | SWING | EXIT\n");
-		char choice[10];
-		scanf("%s", choice);
-		if(strcmp(choice, "LOW") == 0) {
-			req_meta.inter_req_delay = req_meta.low_load_delay;
-			req_meta.swing_delay = 0;
-		} else 	if(strcmp(choice, "HIGH") == 0) {
-			req_meta.inter_req_delay = req_meta.high_load_delay;
-			req_meta.swing_delay = 0;
-		} else 	if(strcmp(choice, "SWING") == 0) {
-			scanf("%d", &req_meta.swing_delay);//5000 + rand() % 100;
-			printf("SWING delay set to: %d micro-seconds\n", req_meta.swing_delay);
-		} else 	if(strcmp(choice, "EXIT") == 0) {
-			printf("Exiting\n");
-			threads.req_thread_args = (void *)1;
-			pthread_join(threads.req_thread, NULL);
-			printf("Request thread stopped\n");
-			printf("Waiting for 3 seconds for any server responses ...\n");
-			sleep(3);
-			threads.res_thread_args = (void *)1;
-			sleep(3);
-			pthread_join(threads.res_thread, NULL);
-			printf("Response thread stopped\n");
-			destroy();
-			exit(0);
-		} else {
-			printf("INVALID CHOICE\n");
-		}
+// load settings used by control socket (control.h).
+void set_delay(unsigned int delay_us) {
+	req_meta.inter_req_delay = delay_us;
+}
 
+unsigned int get_delay() {
+	return req_meta.inter_req_delay;
+}
+
+void set_preset_load(bool high) {
+	req_meta.inter_req_delay = high? req_meta.high_load_delay: req_meta.low_load_delay;
+}
+
+void set_range(int low, int high) {
+	req_meta.range_low = low;
+	req_meta.range_high = high;
+}
+
+// settings and counters since start, bench/chaos polls them to follow a fault.
+int load_status(char *out, int len) {
+	int servers = 0, open = 0;
+	long served = 0;
+	pthread_rwlock_rdlock(&live_serv_lock);
+	for(struct live_server_entry* eptr = live_serv_list; eptr != NULL; eptr = eptr->next) {
+		servers += 1;
+		if(circuit_state(eptr) != CIRCUIT_CLOSED) open += 1;
+	}
+	pthread_rwlock_unlock(&live_serv_lock);
+	for(int s = 0; s < n_res_shards; s++) served += __atomic_load_n(&res_shards[s].responses, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&inflight.lock);
+	int n = snprintf(out, len, "rps=%.1lf delay_us=%u range=%d:%d servers=%d open=%d window=%d sent=%ld served=%ld in_flight=%d retries=%ld lost=%ld",
+		1e6 / req_meta.inter_req_delay, req_meta.inter_req_delay, req_meta.range_low, req_meta.range_high, servers, open, classes.window,
+		req_meta.request_id, served, inflight.count, inflight.retries, inflight.lost);
+	pthread_mutex_unlock(&inflight.lock);
+	for(int i = 0; i < classes.count && classes.count > 1 && n < len; i++) {
+		n += snprintf(out + n, len - n, " %s=%.2lf:%.0lf:%d", classes.list[i].name, classes.list[i].weight, classes.list[i].share, classes.list[i].count);
+	}
+	return n < len? n: len - 1;
+}
+
+bool exit_requested = false;
+
+// wake main thread out of read()/accept() on autoscaler sockets, it sees exit_requested and stops. async signal safe.
+void request_exit() {
+	exit_requested = true;
+	shutdown(auto_sclr_sock_fd, SHUT_RDWR);
+	shutdown(lstn_sock_fd, SHUT_RDWR);
+}
+
+// stop generating, give servers time to answer what is in flight, then close everything.
+void graceful_exit() {
+	printf("Exiting\n");
+	stop_request_thread();
+	printf("Request thread stopped\n");
+	printf("Waiting for 3 seconds for any server responses ...\n");
+	sleep(3);
+	stop_response_thread();
+	printf("Response threads stopped\n");
+	destroy();
+	exit(0);
+}
+
+void signal_handler(int sig_type) {
+	if(sig_type == SIGINT) { // load is changed through control socket now, SIGINT only stops.
+		request_exit();
 	} else if(sig_type == SIGTERM) {
 		printf("Got SIGTERM exiting\n");
 		exit(0);
@@ -399,6 +984,7 @@ int connect_to_autoscaler() {
 	printf("Waiting for autoscaler ...\n");
 	while(true) {
 		auto_sclr_sock_fd = accept(lstn_sock_fd, (struct sockaddr *)&client_addr, &len);
+		if(exit_requested) return FAILED;
 		if(auto_sclr_sock_fd == -1) {
 			fprintf(stderr, "Error connecting autoscaler\n");
 			sleep(3);
@@ -415,7 +1001,7 @@ void scale_out(char *message, int msg_len, char *IP) {
 	
 	if(ptr != NULL) { 	// already running.
 		printf("Server is already running.\n");
-		strcpy(message, STR_SUCCESS);
+		snprintf(message, msg_len, "%s;%ld;", STR_SUCCESS, membership_gen);
 		write(auto_sclr_sock_fd, message, msg_len);
 		return;
 	}
@@ -427,18 +1013,18 @@ void scale_out(char *message, int msg_len, char *IP) {
 		return;
 	}
 	make_non_block_socket(server_sock_fd); // so that response thread do not block(means entire process does not block)
-	
-	struct epoll_event interested_event; // struct epoll_event is inbuilt structure we just created variable of this struct type to store interested event data for this epoll instance.
-	interested_event.data.fd = server_sock_fd; // adding the socket fd
-	interested_event.events = EPOLLIN | EPOLLET; // adding the event type for this socket fd.
-	epoll_ctl(my_epoll.epoll_fd, EPOLL_CTL_ADD, server_sock_fd, &interested_event); // adding the socket to epoll instance.
-	
-	strcpy(message, STR_SUCCESS);
-	write(auto_sclr_sock_fd, message, msg_len);
 
 	stop_request_thread();
+	pthread_rwlock_wrlock(&live_serv_lock);
 	insert_server_entry(IP, server_sock_fd);
+	chash_rebuild(); // ~1/N of keys move to the new server.
+	watch_server_socket(server_sock_fd);
+	pthread_rwlock_unlock(&live_serv_lock);
 	init_request_thread();
+	membership_gen += 1;
+
+	snprintf(message, msg_len, "%s;%ld;", STR_SUCCESS, membership_gen);
+	write(auto_sclr_sock_fd, message, msg_len);
 
 	return;
 }
@@ -447,20 +1033,28 @@ void scale_in(char *message, int msg_len, char *IP) {
 	struct live_server_entry* ptr = get_server_entry(IP);
 	if(ptr == NULL) {
 		printf("Server already disconnected at IP:%s\n", IP);
-		strcpy(message, STR_SUCCESS);
+		snprintf(message, msg_len, "%s;%ld;", STR_SUCCESS, membership_gen);
 		write(auto_sclr_sock_fd, message, msg_len);
 		return;
 	}
 	// 
+	stop_request_thread();
+	pthread_rwlock_wrlock(&live_serv_lock);
+	circuit_set(ptr, CIRCUIT_OPEN); // retries must not pick the server going away.
+	retry_server_requests(ptr->server_sock_fd);
 	if(close(ptr->server_sock_fd) == 0) { // since only of sock_fd for each IP(no multiple fds by using dup, dup2) hence closing fd will also remove from epoll context no need of epoll_ctl(EPOLL_CTL_DEL)
-		strcpy(message, STR_SUCCESS);
-		write(auto_sclr_sock_fd, message, msg_len);
-		printf("Disconnected from server at IP:%s\n", IP);
-		stop_request_thread();
 		delete_server_entry(IP);
+		chash_rebuild();
+		pthread_rwlock_unlock(&live_serv_lock);
 		init_request_thread();
+		membership_gen += 1;
+		printf("Disconnected from server at IP:%s\n", IP); // IP points into message.
+		snprintf(message, msg_len, "%s;%ld;", STR_SUCCESS, membership_gen);
+		write(auto_sclr_sock_fd, message, msg_len);
 		return;
 	}
+	pthread_rwlock_unlock(&live_serv_lock);
+	init_request_thread();
 	strcpy(message, STR_FAILED);
 	write(auto_sclr_sock_fd, message, msg_len);
 	return;
@@ -482,22 +1076,350 @@ void check_consistency(char *message, int msg_len, char *IP) {
 	return;
 }
 
-void main() {
+// read exactly len bytes of autoscaler stream. false if autoscaler went away.
+static bool read_autoscaler(char *buff, int len) {
+	while(len > 0) {
+		int n = read(auto_sclr_sock_fd, buff, len);
+		if(n <= 0) return false;
+		buff += n;
+		len -= n;
+	}
+	return true;
+}
+
+// skip len bytes of autoscaler stream, next message starts after them.
+static void drain_autoscaler(long len) {
+	char buff[4096];
+	while(len > 0) {
+		int n = read(auto_sclr_sock_fd, buff, len < (long)sizeof(buff)? len: (long)sizeof(buff));
+		if(n <= 0) return; // disconnected, main loop sees it on next read.
+		len -= n;
+	}
+}
+
+static bool sync_listed(char **list, int count, char *IP) {
+	for(int i = 0; i < count; i++) {
+		if(strcmp(list[i], IP) == 0) return true;
+	}
+	return false;
+}
+
+/*
+Membership snapshot of autoscaler, "SYNC;<base_gen>;<payload_len>;" followed by payload_len bytes of comma separated
+entries. base_gen 0 is full snapshot: "ip" must be served, "~ip" is being scaled out/in and is left as it is, every
+other server is removed. otherwise payload is delta on top of base_gen: "+ip" add, "-ip" remove, refused when
+generation has moved on since. new servers are connected in parallel, then the whole diff is applied with one stop of
+request thread and one chash_rebuild(). reply "SUCCESS;<gen>;<failed connects>;" or "FAILED;<gen>;".
+payload above SYNC_MAX_PAYLOAD is skipped and refused, without a payload length the connection is dropped since the
+next message can't be found.
+*/
+void sync_membership(char *message, int msg_len, char *base_s) {
+	char *len_s = strtok(NULL, ";");
+	long base = base_s != NULL? atol(base_s): -1;
+	long len = len_s != NULL? atol(len_s): -1;
+	static char payload[SYNC_MAX_PAYLOAD + 1];
+	if(len < 0) {
+		printf("Bad SYNC from autoscaler, no payload length, dropping connection\n");
+		shutdown(auto_sclr_sock_fd, SHUT_RDWR); // main loop reconnects.
+		return;
+	}
+	bool ok = len <= SYNC_MAX_PAYLOAD && read_autoscaler(payload, len);
+	if(len > SYNC_MAX_PAYLOAD) drain_autoscaler(len);
+	payload[ok? len: 0] = '\0';
+	if(!ok || base < 0 || (base != 0 && base != membership_gen)) {
+		if(!ok) printf("Bad SYNC from autoscaler, %ld bytes\n", len);
+		snprintf(message, msg_len, "%s;%ld;", STR_FAILED, membership_gen);
+		write(auto_sclr_sock_fd, message, msg_len);
+		return;
+	}
+
+	char *want[SYNC_MAX_SERVERS], *keep[SYNC_MAX_SERVERS], *adds[SYNC_MAX_SERVERS], *removes[SYNC_MAX_SERVERS];
+	int n_want = 0, n_keep = 0, n_adds = 0, n_removes = 0;
+	char *save, *item;
+	for(item = strtok_r(payload, ",", &save); item != NULL && n_want < SYNC_MAX_SERVERS && n_keep < SYNC_MAX_SERVERS && n_removes < SYNC_MAX_SERVERS; item = strtok_r(NULL, ",", &save)) {
+		if(item[0] == '~') keep[n_keep++] = item + 1;
+		else if(item[0] == '-' && get_server_entry(item + 1) != NULL && !sync_listed(removes, n_removes, item + 1)) removes[n_removes++] = item + 1;
+		else if(item[0] == '+' || item[0] != '-') {
+			char *IP = item[0] == '+'? item + 1: item;
+			want[n_want++] = IP;
+			if(get_server_entry(IP) == NULL && !sync_listed(adds, n_adds, IP)) adds[n_adds++] = IP;
+		}
+	}
+	if(base == 0) { // full snapshot, anything not listed goes.
+		for(struct live_server_entry* eptr = live_serv_list; eptr != NULL && n_removes < SYNC_MAX_SERVERS; eptr = eptr->next) {
+			if(!sync_listed(want, n_want, eptr->IP) && !sync_listed(keep, n_keep, eptr->IP) && !sync_listed(removes, n_removes, eptr->IP)) removes[n_removes++] = eptr->IP;
+		}
+	}
+
+	int fds[n_adds > 0? n_adds: 1], failed = 0;
+	connect_to_servers(adds, n_adds, fds, SYNC_CONNECT_TIMEOUT_MS); // main thread is the only writer of the list, no lock needed to read it.
+	for(int i = 0; i < n_adds; i++) failed += fds[i] == FAILED;
+	if(n_adds - failed > 0 || n_removes > 0) {
+		stop_request_thread();
+		pthread_rwlock_wrlock(&live_serv_lock);
+		for(int i = 0; i < n_adds; i++) { // first, so that requests of removed servers can be retried on them.
+			if(fds[i] == FAILED) continue;
+			insert_server_entry(adds[i], fds[i]);
+			watch_server_socket(fds[i]);
+		}
+		for(int i = 0; i < n_removes; i++) {
+			char IP[64];
+			snprintf(IP, sizeof(IP), "%s", removes[i]); // may point into the entry being freed.
+			struct live_server_entry* ptr = get_server_entry(IP);
+			if(ptr == NULL) continue; // already removed.
+			circuit_set(ptr, CIRCUIT_OPEN); // retries must not pick the server going away.
+			retry_server_requests(ptr->server_sock_fd);
+			close(ptr->server_sock_fd);
+			delete_server_entry(IP);
+		}
+		chash_rebuild();
+		pthread_rwlock_unlock(&live_serv_lock);
+		init_request_thread();
+		membership_gen += 1;
+		printf("Membership generation %ld: %s sync, %d added, %d removed, %d failed to connect\n", membership_gen,
+			base == 0? "full": "delta", n_adds - failed, n_removes, failed);
+		print_live_servers();
+	}
+	snprintf(message, msg_len, "%s;%ld;%d;", STR_SUCCESS, membership_gen, failed);
+	write(auto_sclr_sock_fd, message, msg_len);
+}
+
+// autoscaler scores scale in victims with outstanding requests and scales on load report of the server.
+// reply "SUCCESS;<outstanding>;<queued>;<workers>;<busy_permille>;<rps>;<p99_us>;", workers 0 when no fresh report.
+void report_outstanding(char *message, int msg_len, char *IP) {
+	pthread_rwlock_rdlock(&live_serv_lock); // load of two reports may mix while the shard updates it, fine for a signal.
+	struct live_server_entry* ptr = get_server_entry(IP);
+	if(ptr != NULL) {
+		long outstanding = __atomic_load_n(&ptr->sent, __ATOMIC_RELAXED) - ptr->received;
+		struct guest_load l = ptr->load;
+		if(l.at == 0 || now_usec() - l.at > GUEST_LOAD_MAX_AGE_US) memset(&l, 0, sizeof(l));
+		snprintf(message, msg_len, "%s;%ld;%ld;%ld;%ld;%ld;%ld;", STR_SUCCESS, outstanding > 0? outstanding: 0,
+			l.queued, l.workers, l.busy_permille, l.rps, l.p99_us);
+	} else strcpy(message, STR_FAILED);
+	pthread_rwlock_unlock(&live_serv_lock);
+	write(auto_sclr_sock_fd, message, msg_len);
+}
+
+// per class signal for autoscaler, IP field of CLASS_LOAD message is class index.
+// reply "SUCCESS;<name>;<queued>;<p99_us>;<slo_us>;", FAILED past the last class.
+void report_class_load(char *message, int msg_len, char *idx) {
+	int i = idx != NULL? atoi(idx): -1;
+	if(i >= 0 && i < classes.count) {
+		struct req_class *c = &classes.list[i];
+		snprintf(message, msg_len, "%s;%s;%d;%ld;%ld;", STR_SUCCESS, c->name, c->count, c->p99_us, c->slo_us);
+	} else strcpy(message, STR_FAILED);
+	write(auto_sclr_sock_fd, message, msg_len);
+}
+
+// old process, new build connected on handoff socket: stop, hand everything over (handoff.h) and exit. returns only
+// when new process failed, threads are running again then.
+void hot_restart_out() {
+	int conn = accept4(handoff.lstn_fd, NULL, NULL, SOCK_CLOEXEC);
+	if(conn < 0) return;
+	printf("Hot restart: new process connected, handing off\n");
+	stop_request_thread();
+	if(proxy_port > 0) proxy_set_accepting(false);
+	long deadline = now_usec() + HANDOFF_DRAIN_US;
+	while(inflight.count > 0 && now_usec() < deadline) usleep(1000); // response threads still read answers.
+	stop_control_thread();
+	stop_response_thread();
+
+	struct handoff_header h;
+	handoff_header_init(&h);
+	h.membership_gen = membership_gen;
+	h.request_id = req_meta.request_id;
+	h.inter_req_delay = req_meta.inter_req_delay;
+	h.range_low = req_meta.range_low;
+	h.range_high = req_meta.range_high;
+	int role_fds[HANDOFF_FDS] = {lstn_sock_fd, auto_sclr_sock_fd, control.lstn_fd, proxy_port > 0? proxy.lstn_fd: -1};
+	pthread_rwlock_wrlock(&live_serv_lock);
+	pthread_mutex_lock(&inflight.lock);
+	bool sent = handoff_send_state(conn, &h, role_fds, readers, MAX_FDS);
+	pthread_mutex_unlock(&inflight.lock);
+	pthread_rwlock_unlock(&live_serv_lock);
+	char ack[3] = "";
+	if(!sent || !handoff_recv(conn, ack, sizeof(ack), NULL, 0) || strcmp(ack, "OK") != 0) {
+		printf("Hot restart failed, carrying on\n");
+		close(conn);
+		start_response_threads("a");
+		init_control_thread();
+		if(proxy_port > 0) proxy_set_accepting(true);
+		init_request_thread();
+		return;
+	}
+	close(conn);
+	printf("Hot restart: handed off %d servers and %d requests in flight\n", h.servers, h.inflight);
+
+	// new process keeps the sockets open, these are only copies. -1 so that signal handler does not shut them down.
+	int fd = lstn_sock_fd;
+	lstn_sock_fd = -1;
+	close(fd);
+	fd = auto_sclr_sock_fd;
+	auto_sclr_sock_fd = -1;
+	close(fd);
+	close(handoff.lstn_fd);
+	if(proxy_port > 0) {
+		printf("Waiting for %d proxy sessions to close ...\n", proxy.active);
+		for(int i = 0; i < HANDOFF_SESSION_DRAIN_S && proxy.active > 0; i++) sleep(1);
+	}
+	printf("Exiting after hot restart\n");
+	exit(0);
+}
+
+// new process: take sockets and settings over from load balancer running at handoff.path. returns connection to it
+// for hot_restart_finish(), -1 when there is none and process starts cold.
+int hot_restart_begin(struct handoff_header *h) {
+	if(handoff.path == NULL) return -1;
+	int conn = handoff_connect(handoff.path);
+	if(conn < 0) return -1;
+	int role_fds[HANDOFF_FDS];
+	if(!handoff_recv_header(conn, h, role_fds)) {
+		printf("Hot restart: no state from running load balancer, starting cold\n");
+		close(conn);
+		return -1;
+	}
+	lstn_sock_fd = role_fds[HANDOFF_FD_LISTEN];
+	auto_sclr_sock_fd = role_fds[HANDOFF_FD_AUTOSCALER];
+	control.lstn_fd = role_fds[HANDOFF_FD_CONTROL];
+	proxy.lstn_fd = role_fds[HANDOFF_FD_PROXY];
+	if(proxy_port == 0 && proxy.lstn_fd >= 0) close(proxy.lstn_fd); // old one proxied, this one generates.
+	membership_gen = h->membership_gen;
+	req_meta.request_id = h->request_id; // answers of handed off requests must not match new ones.
+	req_meta.inter_req_delay = h->inter_req_delay;
+	req_meta.range_low = h->range_low;
+	req_meta.range_high = h->range_high;
+	printf("Hot restart: took over sockets of running load balancer, generation %ld\n", membership_gen);
+	return conn;
+}
+
+// new process, response threads are running: servers and in-flight requests of old process, then "OK" so that it
+// exits. a broken handoff exits here, old process carries on.
+void hot_restart_finish(int conn, struct handoff_header *h) {
+	struct handoff_server *list = malloc((h->servers + 1) * sizeof(struct handoff_server));
+	int *fds = malloc((h->servers + 1) * sizeof(int));
+	int got = 0;
+	while(got < h->servers && handoff_recv_server(conn, &list[got], &fds[got])) got += 1;
+	if(got < h->servers || !handoff_recv_inflight(conn, h->inflight, fds, got)) { // in-flight first, answers may come as soon as sockets are watched.
+		printf("Hot restart: handoff broken after %d of %d servers, exiting\n", got, h->servers);
+		exit(1);
+	}
+	long now = now_usec();
+	pthread_rwlock_wrlock(&live_serv_lock);
+	for(int i = got - 1; i >= 0; i--) { // insert_server_entry() prepends, keep order of old process.
+		struct live_server_entry* eptr = insert_server_entry(list[i].IP, fds[i]);
+		eptr->circuit = list[i].circuit;
+		eptr->failures = list[i].failures;
+		eptr->open_usec = list[i].open_usec;
+		eptr->opened_at = list[i].opened_at;
+		eptr->sock_dead = list[i].sock_dead;
+		eptr->sent = list[i].sent;
+		eptr->received = list[i].received;
+		eptr->last_progress_at = now;
+		if(eptr->sock_dead) continue; // half open probe reconnects it.
+		watch_server_socket(fds[i]);
+		struct frame_reader *reader = &readers[fds[i] % MAX_FDS];
+		memcpy(reader->buff, list[i].partial, list[i].partial_len);
+		reader->len = list[i].partial_len;
+	}
+	chash_rebuild();
+	pthread_rwlock_unlock(&live_serv_lock);
+	char ack[3] = "OK";
+	handoff_send(conn, ack, sizeof(ack), NULL, 0);
+	close(conn);
+	printf("Hot restart: %d servers and %d requests in flight taken over\n", got, h->inflight);
+	print_live_servers();
+	free(list);
+	free(fds);
+}
+
+void parse_args(int argc, char *argv[]) {
+	int opt;
+	while((opt = getopt(argc, argv, "r:L:H:d:EP:ZCB:aS:R:T:X:Q:W:M:e:u:")) != -1) {
+		switch(opt) {
+			case 'r': req_meta.inter_req_delay = atoi(optarg); break; // micro-seconds between requests.
+			case 'L': req_meta.range_low = atoi(optarg); break;
+			case 'H': req_meta.range_high = atoi(optarg); break;
+			case 'd': run_seconds = atoi(optarg); break;
+			case 'E': hedging = true; break;
+			case 'P': proxy_port = atoi(optarg); break; // proxy clients on this port instead of generating requests.
+			case 'Z': proxy_zerocopy = true; break; // proxy with recv()/send(MSG_ZEROCOPY) instead of splice().
+			case 'C': chash.enabled = true; break; // consistent hash routing by request data (client IP in proxy mode).
+			case 'B': chash.load_factor = atof(optarg); break; // bounded load of consistent hash, >= 1.
+			case 'a': pinning = true; break; // pin request, response and proxy threads to CPUs.
+			case 'S': control.port = atoi(optarg); break; // control socket port, 0 is off.
+			case 'R': // record generated requests.
+				if(!trace_open_capture(optarg)) {
+					fprintf(stderr, "Can't create trace file %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'T': // replay recorded requests instead of generating them.
+				if(!trace_open_replay(optarg)) {
+					fprintf(stderr, "Can't read trace file %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'X': trace.speed = atof(optarg); break; // replay speed, 0 is as fast as possible.
+			case 'Q': // request classes, see classes.h.
+				if(!classes_parse(optarg)) {
+					fprintf(stderr, "Bad class spec, want name:weight:share_pct[:slo_ms[:low-high]],...\n");
+					exit(1);
+				}
+				break;
+			case 'W': classes.window = atoi(optarg); break; // outstanding requests per server, 0 is no limit.
+			case 'M': n_res_shards = atoi(optarg); break; // response threads.
+			case 'e': event_batch = atoi(optarg); break; // epoll events per wait of response thread.
+			case 'u': handoff.path = optarg; break; // hot restart socket, see handoff.h.
+			default:
+				fprintf(stderr, "Usage: %s [-r inter_req_delay_us] [-L range_low] [-H range_high] [-d run_seconds] [-E] [-P proxy_port] [-Z] [-C] [-B load_factor] [-a] [-S control_port] [-R capture_file] [-T replay_file [-X speed]] [-Q classes] [-W window] [-M response_threads] [-e event_batch] [-u hot_restart_socket]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if(req_meta.range_high <= req_meta.range_low) req_meta.range_high = req_meta.range_low + 1;
+	if(chash.load_factor < 1) chash.load_factor = 1;
+	if(n_res_shards < 1) n_res_shards = 1;
+	if(n_res_shards > RES_SHARDS_MAX) n_res_shards = RES_SHARDS_MAX;
+	if(event_batch < 1) event_batch = 1;
+	if(event_batch > EVENT_BATCH_MAX) event_batch = EVENT_BATCH_MAX;
+}
+
+void main(int argc, char *argv[]) {
+
+	init_req_meta(); // initializing request meta data.
+	parse_args(argc, argv);
+	init_inflight();
+	init_classes();
+	membership_gen = time(NULL) * 1000L;
+	topology_init();
+	topology_report(stdout);
+	int places[] = {REQ_THREAD_PLACE, PROXY_THREAD_PLACE};
+	placement_report(stdout, proxy_port > 0? "proxy thread": "request thread", proxy_port > 0? &places[1]: &places[0], 1);
+	int res_places[RES_SHARDS_MAX];
+	for(int i = 0; i < n_res_shards; i++) res_places[i] = res_shard_place(i);
+	placement_report(stdout, "response threads", res_places, n_res_shards);
 
 	// register signal handler in main thead so that main thread calls signal handler.
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
 	signal(SIGPIPE, signal_handler);
 	
-	lstn_sock_fd = create_lstn_sock_fd();
+	struct handoff_header handoff_h;
+	int handoff_conn = hot_restart_begin(&handoff_h); // sockets of running load balancer, -1 is cold start.
+	if(lstn_sock_fd < 0) lstn_sock_fd = create_lstn_sock_fd();
+	init_control_thread(); // usable while waiting for autoscaler too.
+
+	if(auto_sclr_sock_fd < 0) connect_to_autoscaler();
+	if(exit_requested) { // stopped before autoscaler came, nothing is running yet.
+		destroy();
+		exit(0);
+	}
 	
-	connect_to_autoscaler();
+	init_response_thread(handoff_conn >= 0); // response collector thread.
+	if(handoff_conn >= 0) hot_restart_finish(handoff_conn, &handoff_h); // servers are watched before anything is sent.
 
-	init_req_meta(); // initializing request meta data.
-	
 	init_request_thread(); // request generator thread.
-
-	init_response_thread(); // response collector thread.
+	if(proxy_port > 0) init_proxy_thread(proxy.lstn_fd); // client connections thread.
+	if(handoff.path != NULL) handoff.lstn_fd = handoff_listen(handoff.path); // for the next build.
 
 	static int msg_len = 50;
 	char message[msg_len];
@@ -505,9 +1427,22 @@ void main() {
 	char *IP;
 
 	while(true) { // talk to autoscaler.
+		struct pollfd fds[2] = {{.fd = auto_sclr_sock_fd, .events = POLLIN}, {.fd = handoff.lstn_fd, .events = POLLIN}};
+		poll(fds, 2, -1); // messages are read whole, a hot restart starts between two of them.
+		if(exit_requested) graceful_exit();
+		if(fds[1].revents & POLLIN) {
+			hot_restart_out();
+			continue;
+		}
+		if(fds[0].revents == 0) continue;
 		int flag = read(auto_sclr_sock_fd, message, msg_len);
 		// printf("Reading autoscaler message:%s, flag:%d\n", message, flag);
-		sleep(1);
+		while(flag > 0 && flag < msg_len) { // autoscaler pipelines messages, collect the rest of this one.
+			int more = read(auto_sclr_sock_fd, message + flag, msg_len - flag);
+			if(more <= 0) break;
+			flag += more;
+		}
+		if(exit_requested) graceful_exit();
 		if(flag == 0) {
 			printf("Autoscaler disconnected.\n");
 			connect_to_autoscaler();
@@ -535,6 +1470,18 @@ void main() {
 			check_consistency(message, msg_len, IP);
 			continue;
 		}
+		if(strcmp(TYPE, "OUTSTANDING") == 0) {
+			report_outstanding(message, msg_len, IP);
+			continue;
+		}
+		if(strcmp(TYPE, "SYNC") == 0) {
+			sync_membership(message, msg_len, IP);
+			continue;
+		}
+		if(strcmp(TYPE, "CLASS_LOAD") == 0) {
+			report_class_load(message, msg_len, IP);
+			continue;
+		}
 	}
 	return;
 }
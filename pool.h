@@ -0,0 +1,106 @@
+/*
+Fixed size object pools shared by server, load balancer and autoscaler.
+
+Objects of one size are carved out of slabs of slab_objs objects. freed objects go on the pool free list and
+are handed out again, slabs are never given back, so a long running process grows only up to its peak in use and
+then stays flat in RSS instead of fragmenting the heap with malloc()/free() of every connection, task or sample.
+Leak accounting: every pool counts objects in use, peak, allocs and frees. pool_report() prints one line per pool,
+an in use count that keeps climbing while load is flat is a leak. pool_free() of NULL is ignored like free().
+*/
+
+#define POOL_SLAB_OBJS 64 // default objects per slab.
+#define POOL_ALIGN 16
+#define POOL_MAX 64 // pools registered for pool_report().
+
+struct pool_obj {	// header of free object, overlaps object memory.
+	struct pool_obj *next;
+};
+
+struct pool_slab {
+	struct pool_slab *next;
+	char objs[] __attribute__((aligned(POOL_ALIGN)));
+};
+
+struct mem_pool {
+	const char *name;
+	size_t obj_size; // rounded up to POOL_ALIGN.
+	int slab_objs;
+	struct pool_obj *free_list;
+	struct pool_slab *slabs;
+	pthread_mutex_t lock;
+
+	// accounting.
+	long in_use;
+	long peak;
+	long allocs;
+	long frees;
+	long slab_count;
+};
+
+struct mem_pool *pools[POOL_MAX];
+int pools_count = 0;
+
+
+// slab_objs 0 means POOL_SLAB_OBJS, big buffers should use few objects per slab.
+void pool_init(struct mem_pool *p, const char *name, size_t obj_size, int slab_objs) {
+	memset(p, 0, sizeof(struct mem_pool));
+	p->name = name;
+	p->slab_objs = slab_objs > 0? slab_objs: POOL_SLAB_OBJS;
+	if(obj_size < sizeof(struct pool_obj)) obj_size = sizeof(struct pool_obj);
+	p->obj_size = (obj_size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+	pthread_mutex_init(&p->lock, NULL);
+	if(pools_count < POOL_MAX) pools[pools_count++] = p;
+}
+
+// caller holds p->lock.
+static bool pool_grow(struct mem_pool *p) {
+	struct pool_slab *slab = malloc(sizeof(struct pool_slab) + p->slab_objs * p->obj_size);
+	if(slab == NULL) return false;
+	slab->next = p->slabs;
+	p->slabs = slab;
+	p->slab_count += 1;
+	for(int i = p->slab_objs - 1; i >= 0; i--) {
+		struct pool_obj *o = (struct pool_obj *)(slab->objs + i * p->obj_size);
+		o->next = p->free_list;
+		p->free_list = o;
+	}
+	return true;
+}
+
+// zeroed object like calloc(), NULL when out of memory.
+void *pool_alloc(struct mem_pool *p) {
+	pthread_mutex_lock(&p->lock);
+	if(p->free_list == NULL && !pool_grow(p)) {
+		pthread_mutex_unlock(&p->lock);
+		return NULL;
+	}
+	struct pool_obj *o = p->free_list;
+	p->free_list = o->next;
+	p->in_use += 1;
+	p->allocs += 1;
+	if(p->in_use > p->peak) p->peak = p->in_use;
+	pthread_mutex_unlock(&p->lock);
+	memset(o, 0, p->obj_size);
+	return o;
+}
+
+void pool_free(struct mem_pool *p, void *ptr) {
+	if(ptr == NULL) return;
+	struct pool_obj *o = ptr;
+	pthread_mutex_lock(&p->lock);
+	o->next = p->free_list;
+	p->free_list = o;
+	p->in_use -= 1;
+	p->frees += 1;
+	pthread_mutex_unlock(&p->lock);
+}
+
+// one line per registered pool.
+void pool_report(FILE *fd) {
+	for(int i = 0; i < pools_count; i++) {
+		struct mem_pool *p = pools[i];
+		fprintf(fd, "Pool %s: in use %ld, peak %ld, allocs %ld, frees %ld, slabs %ld (%ld KB)\n", p->name, p->in_use, p->peak,
+			p->allocs, p->frees, p->slab_count, p->slab_count * (long)(sizeof(struct pool_slab) + p->slab_objs * p->obj_size) / 1024);
+	}
+	fflush(fd);
+}
@@ -0,0 +1,398 @@
+/*
+Proxy mode of load balancer (-P port): real clients connect to the load balancer instead of requests being generated.
+
+It is a L4 proxy: every client connection gets its own connection to one healthy server from live_serv_list, so
+responses coming back on that server connection belong to that client only (demultiplexing is per connection and
+the bytes never have to be parsed). Both directions are pumped by one proxy thread with edge triggered epoll:
+- splice mode (default): socket -> pipe -> socket with splice(), data stays in kernel pages, no user-space copy.
+- copy mode (-Z): recv() into a buffer and send(), chunks of ZC_MIN_BYTES or more are sent with MSG_ZEROCOPY.
+  frames are only 100 bytes so this pays off when clients pipeline many frames and one read returns a large batch.
+  buffer is not reused until kernel reports the zero copy send complete on the socket error queue.
+Sessions whose server is scaled in or ejected by health checks are closed, client reconnects and gets another server.
+Server connection is connected without blocking, session starts pumping when its socket becomes writable.
+EOF is passed on as shutdown(SHUT_WR) once everything read before it is forwarded, a client that half closes after its
+last request still gets the answers. session is closed when both directions ended.
+*/
+
+#define PROXY_CHUNK (64 * 1024) // max bytes moved by one splice()/recv().
+#define ZC_MIN_BYTES (16 * 1024) // MSG_ZEROCOPY costs page pinning and a completion, only worth it for big sends.
+#define PROXY_CONNECT_TIMEOUT_MS 200 // checked every PROXY_CHECK_US.
+#define PROXY_CHECK_US 100000 // sessions of removed/ejected servers and stuck connects are closed within 100 ms.
+#define PROXY_THREAD_PLACE 2 // placement index of affinity.h, next to request and response threads.
+
+int proxy_port = 0; // -P option, 0 means proxy mode is off and requests are generated.
+bool proxy_zerocopy = false; // -Z option.
+
+void make_non_block_socket(int fd);
+
+struct proxy_pipe {	// one direction of a session.
+	int pipe_fd[2]; // splice mode: bytes read from source wait here for destination.
+	int buffered; // splice mode: bytes in pipe.
+	char *buff; // copy mode.
+	int len; // copy mode: bytes in buff.
+	int off; // copy mode: bytes of buff already sent.
+	int zc_pending; // copy mode: MSG_ZEROCOPY sends not yet completed, buff can't be refilled.
+	long bytes; // forwarded, for stats.
+	bool eof; // source closed its side, destination gets shutdown(SHUT_WR) once pipe is empty.
+	bool done; // EOF passed on, nothing more moves in this direction.
+};
+
+struct proxy_session;
+struct proxy_end {	// epoll data.ptr points to this so event tells session and side.
+	struct proxy_session *session;
+	bool is_client;
+};
+
+struct proxy_session {
+	int client_fd;
+	int server_fd;
+	char IP[64]; // server the session is bound to.
+	struct proxy_pipe up; // client -> server.
+	struct proxy_pipe down; // server -> client.
+	struct proxy_end client_end;
+	struct proxy_end server_end;
+	bool connecting; // server connect in progress, nothing is pumped yet.
+	long connect_deadline; // now_usec() after which connect is given up.
+	bool closed;
+	struct proxy_session *next;
+};
+
+struct proxy_context {
+	int lstn_fd;
+	int epoll_fd;
+	struct proxy_session *sessions;
+	pthread_t thread;
+	unsigned int turn; // round robbin over healthy servers.
+
+	// stats, read by response thread for throughput report.
+	int active;
+	long accepted;
+	long rejected; // no healthy server or connect to it failed.
+	long bytes_up;
+	long bytes_down;
+	long zc_sends;
+	long zc_copied; // kernel fell back to copy (eg. loopback).
+
+	bool stop_accepting; // hot restart, new process accepts clients from now on.
+	bool accepting; // listening socket is in epoll.
+} proxy = {.lstn_fd = -1};
+
+struct mem_pool session_pool;
+struct mem_pool proxy_buff_pool; // PROXY_CHUNK buffers of copy mode.
+
+
+static int proxy_lstn_sock_fd(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 128) == -1) {
+		printf("Proxy listening socket on port %d failed\n", port);
+		exit(0);
+	}
+	make_non_block_socket(fd);
+	printf("Proxy listening for clients on port %d (%s)\n", port, proxy_zerocopy? "copy + MSG_ZEROCOPY": "splice");
+	return fd;
+}
+
+// healthy server for new client session. caller holds live_serv_lock (read lock is enough, proxy.turn is proxy
+// thread only).
+// with -C client keeps its server across connections (client IP is the key), otherwise round robin.
+static struct live_server_entry* proxy_pick_server(int client_fd) {
+	if(chash.enabled) {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		unsigned long key = 0;
+		if(getpeername(client_fd, (struct sockaddr *)&addr, &len) == 0) key = ntohl(addr.sin_addr.s_addr);
+		return chash_pick(chash_key(key));
+	}
+	int count = 0;
+	for(struct live_server_entry* eptr = live_serv_list; eptr != NULL; eptr = eptr->next) count += 1;
+	if(count == 0) return NULL;
+	struct live_server_entry* eptr = live_serv_list;
+	for(unsigned int i = 0; i < proxy.turn % count; i++) eptr = eptr->next;
+	proxy.turn += 1;
+	for(int i = 0; i < count; i++) {
+		if(server_usable(eptr)) return eptr;
+		eptr = eptr->next != NULL? eptr->next: live_serv_list;
+	}
+	return NULL;
+}
+
+static bool proxy_init_pipe(struct proxy_pipe *p) {
+	memset(p, 0, sizeof(struct proxy_pipe));
+	p->pipe_fd[0] = p->pipe_fd[1] = -1;
+	if(proxy_zerocopy) {
+		p->buff = pool_alloc(&proxy_buff_pool);
+		return p->buff != NULL;
+	}
+	return pipe2(p->pipe_fd, O_NONBLOCK) == 0;
+}
+
+static void proxy_free_pipe(struct proxy_pipe *p) {
+	if(p->pipe_fd[0] >= 0) close(p->pipe_fd[0]);
+	if(p->pipe_fd[1] >= 0) close(p->pipe_fd[1]);
+	pool_free(&proxy_buff_pool, p->buff); // pending zero copy sends of a closed socket are dropped by kernel.
+}
+
+static void proxy_watch(int fd, struct proxy_end *end) {
+	struct epoll_event interested_event;
+	interested_event.data.ptr = end;
+	interested_event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP; // edge triggered, both directions are pumped on any event.
+	epoll_ctl(proxy.epoll_fd, EPOLL_CTL_ADD, fd, &interested_event);
+}
+
+static void proxy_accept() {
+	while(true) {
+		int client_fd = accept(proxy.lstn_fd, NULL, NULL);
+		if(client_fd < 0) return; // EAGAIN, all pending connections accepted.
+
+		char IP[64];
+		pthread_rwlock_rdlock(&live_serv_lock);
+		struct live_server_entry* eptr = proxy_pick_server(client_fd);
+		if(eptr != NULL) strcpy(IP, eptr->IP);
+		pthread_rwlock_unlock(&live_serv_lock);
+		bool in_progress = false;
+		int server_fd = eptr != NULL? transport_connect(IP, true, &in_progress): -1; // thread goes on with other sessions meanwhile.
+		struct proxy_session *s = server_fd >= 0? pool_alloc(&session_pool): NULL;
+		if(s == NULL) {
+			proxy.rejected += 1;
+			close(client_fd);
+			if(server_fd >= 0) close(server_fd);
+			continue;
+		}
+
+		s->client_fd = client_fd;
+		s->server_fd = server_fd;
+		strcpy(s->IP, IP);
+		s->connecting = in_progress;
+		s->connect_deadline = now_usec() + PROXY_CONNECT_TIMEOUT_MS * 1000L;
+		if(!proxy_init_pipe(&s->up) || !proxy_init_pipe(&s->down)) {
+			printf("Proxy session setup failed\n");
+			proxy_free_pipe(&s->up);
+			proxy_free_pipe(&s->down);
+			close(client_fd);
+			close(server_fd);
+			pool_free(&session_pool, s);
+			continue;
+		}
+		make_non_block_socket(client_fd);
+		make_non_block_socket(server_fd);
+		if(proxy_zerocopy) {
+			int one = 1;
+			setsockopt(client_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+			setsockopt(server_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+		}
+		s->client_end.session = s;
+		s->client_end.is_client = true;
+		s->server_end.session = s;
+		s->server_end.is_client = false;
+		s->next = proxy.sessions;
+		proxy.sessions = s;
+		proxy.active += 1;
+		if(!s->connecting) proxy.accepted += 1;
+		proxy_watch(client_fd, &s->client_end);
+		proxy_watch(server_fd, &s->server_end);
+	}
+}
+
+static void proxy_close(struct proxy_session *s) {
+	if(s->closed) return;
+	s->closed = true; // freed by proxy_reap() after current event batch, other events may still point to it.
+	close(s->client_fd); // closing removes fds from epoll.
+	close(s->server_fd);
+	proxy_free_pipe(&s->up);
+	proxy_free_pipe(&s->down);
+	proxy.active -= 1;
+	proxy.bytes_up += s->up.bytes;
+	proxy.bytes_down += s->down.bytes;
+}
+
+static void proxy_reap() {
+	struct proxy_session **pp = &proxy.sessions;
+	while(*pp != NULL) {
+		struct proxy_session *s = *pp;
+		if(s->closed) {
+			*pp = s->next;
+			pool_free(&session_pool, s);
+		} else pp = &s->next;
+	}
+}
+
+// read MSG_ZEROCOPY completions of fd. returns false on socket error.
+static bool proxy_zc_complete(int fd, struct proxy_pipe *p) {
+	while(p->zc_pending > 0) {
+		char control[128];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if(recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+		for(struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if(serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				if(serr->ee_errno != 0) return false;
+				continue;
+			}
+			p->zc_pending -= serr->ee_data - serr->ee_info + 1; // completed range of send ids.
+			if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) proxy.zc_copied += 1;
+		}
+	}
+	return true;
+}
+
+// pass EOF of source on after its last bytes.
+static void proxy_shutdown(int to, struct proxy_pipe *p) {
+	shutdown(to, SHUT_WR);
+	p->done = true;
+}
+
+// move bytes from -> to. returns false when session must be closed (error).
+static bool proxy_pump(int from, int to, struct proxy_pipe *p) {
+	while(!p->done) {
+		if(proxy_zerocopy) {
+			if(!proxy_zc_complete(to, p)) return false;
+			if(p->off < p->len) {
+				int left = p->len - p->off;
+				int flags = MSG_NOSIGNAL | (left >= ZC_MIN_BYTES? MSG_ZEROCOPY: 0);
+				int n = send(to, p->buff + p->off, left, flags);
+				if(n < 0) return errno == EAGAIN || errno == EWOULDBLOCK; // wait for EPOLLOUT.
+				if(flags & MSG_ZEROCOPY) {
+					p->zc_pending += 1;
+					proxy.zc_sends += 1;
+				}
+				p->off += n;
+				p->bytes += n;
+				continue;
+			}
+			if(p->eof) { // queued sends, zero copy ones too, go out before FIN.
+				proxy_shutdown(to, p);
+				break;
+			}
+			if(p->zc_pending > 0) return true; // buff still owned by kernel, completion comes as EPOLLERR.
+			int n = recv(from, p->buff, PROXY_CHUNK, 0);
+			if(n == 0) {
+				p->eof = true;
+				continue;
+			}
+			if(n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+			p->len = n;
+			p->off = 0;
+			continue;
+		}
+		if(p->buffered > 0) {
+			int n = splice(p->pipe_fd[0], NULL, to, NULL, p->buffered, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if(n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+			p->buffered -= n;
+			p->bytes += n;
+			continue;
+		}
+		if(p->eof) {
+			proxy_shutdown(to, p);
+			break;
+		}
+		int n = splice(from, NULL, p->pipe_fd[1], NULL, PROXY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(n == 0) p->eof = true;
+		else if(n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+		else p->buffered += n;
+	}
+	return true;
+}
+
+// server socket of connecting session became writable or failed. returns false if connect failed.
+static bool proxy_connected(struct proxy_session *s) {
+	int err = 0;
+	socklen_t err_len = sizeof(err);
+	if(getsockopt(s->server_fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err != 0) {
+		printf("Proxy connect to server at IP: %s failed\n", s->IP);
+		proxy.rejected += 1;
+		return false;
+	}
+	s->connecting = false;
+	proxy.accepted += 1;
+	return true;
+}
+
+// close sessions whose server was scaled in or ejected by health checks, or didn't answer connect in time.
+static void proxy_check_servers() {
+	long now = now_usec();
+	pthread_rwlock_rdlock(&live_serv_lock); // sessions are proxy thread only, the list is just looked up.
+	for(struct proxy_session *s = proxy.sessions; s != NULL; s = s->next) {
+		if(s->closed) continue;
+		if(s->connecting && now > s->connect_deadline) {
+			proxy.rejected += 1;
+			proxy_close(s);
+			continue;
+		}
+		struct live_server_entry* eptr = get_server_entry(s->IP);
+		if(eptr == NULL || circuit_state(eptr) == CIRCUIT_OPEN) proxy_close(s);
+	}
+	pthread_rwlock_unlock(&live_serv_lock);
+	proxy_reap();
+}
+
+static void proxy_watch_listener() {
+	struct epoll_event interested_event;
+	interested_event.data.ptr = NULL; // NULL marks listening socket.
+	interested_event.events = EPOLLIN | EPOLLET;
+	epoll_ctl(proxy.epoll_fd, EPOLL_CTL_ADD, proxy.lstn_fd, &interested_event);
+}
+
+void *proxy_clients(void *arg) {
+	if(!pin_thread(PROXY_THREAD_PLACE)) printf("Pinning proxy thread failed\n");
+	struct epoll_event events[64];
+	long last_check = now_usec();
+	while(true) {
+		if(proxy.stop_accepting == proxy.accepting) { // hot restart took clients over, or failed and gives them back.
+			if(proxy.accepting) epoll_ctl(proxy.epoll_fd, EPOLL_CTL_DEL, proxy.lstn_fd, NULL); // running sessions are pumped until they close.
+			else proxy_watch_listener();
+			__atomic_store_n(&proxy.accepting, !proxy.stop_accepting, __ATOMIC_RELEASE);
+		}
+		int nfds = epoll_wait(proxy.epoll_fd, events, 64, PROXY_CHECK_US / 1000);
+		for(int i = 0; i < nfds; i++) {
+			struct proxy_end *end = events[i].data.ptr;
+			if(end == NULL) { // listening socket.
+				proxy_accept();
+				continue;
+			}
+			struct proxy_session *s = end->session;
+			if(s->closed) continue;
+			if(s->connecting) { // client bytes wait in its socket, pumped once connected.
+				if(end->is_client || (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) == 0) continue;
+				if(!proxy_connected(s)) {
+					proxy_close(s);
+					continue;
+				}
+			}
+			if(!proxy_pump(s->client_fd, s->server_fd, &s->up) || !proxy_pump(s->server_fd, s->client_fd, &s->down)) {
+				proxy_close(s);
+			} else if(s->up.done && s->down.done) proxy_close(s);
+		}
+		proxy_reap();
+		if(now_usec() - last_check >= PROXY_CHECK_US) {
+			last_check = now_usec();
+			proxy_check_servers();
+		}
+	}
+}
+
+// lstn_fd is listening socket handed over by hot restart (handoff.h), -1 creates it.
+void init_proxy_thread(int lstn_fd) {
+	memset(&proxy, 0, sizeof(proxy));
+	pool_init(&session_pool, "proxy session", sizeof(struct proxy_session), 0);
+	pool_init(&proxy_buff_pool, "proxy buffer", PROXY_CHUNK, 4);
+	proxy.lstn_fd = lstn_fd >= 0? lstn_fd: proxy_lstn_sock_fd(proxy_port);
+	proxy.accepting = true;
+	proxy.epoll_fd = epoll_create1(0);
+	proxy_watch_listener();
+	pthread_create(&proxy.thread, NULL, &proxy_clients, NULL);
+}
+
+// stop or start again taking new clients, returns once proxy thread has done it.
+void proxy_set_accepting(bool on) {
+	proxy.stop_accepting = !on;
+	while(__atomic_load_n(&proxy.accepting, __ATOMIC_ACQUIRE) != on) usleep(1000);
+}
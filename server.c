@@ -1,90 +1,572 @@
 /*
-This server program echoes the client query. Multiple clients are supported.
-Number of worker threads can be specified for handling client query. Main process is
-handling listening socket in main() mehtod.
+This server program answers the client query (sum of primes). Multiple clients are supported.
+Main process is handling listening socket in main() mehtod.
 
-Each worker thread is handling one epoll instance in this design(single worker thread can handle many epoll instances), one epoll instance is handling many socket fds for events.
-new client's connection request is allocated to worker threads in round robbin fashion.
+The work is done in two stages so that one expensive query does not stall other connections:
+1. I/O threads: each I/O thread is handling one epoll instance, one epoll instance is handling many socket fds for events.
+   new client's connection request is allocated to I/O threads in round robbin fashion. I/O thread reads the socket,
+   cuts the byte stream into frames and pushes one task per frame to the compute pool. it never runs sum_prime().
+2. compute workers: one worker per vCPU. each worker has its own task queue, I/O threads spread tasks over the queues
+   and a worker whose queue is empty steals from the other queues so that every core is used no matter on which
+   I/O thread the connections landed. every queue keeps one FIFO per priority level (CLASS field of request, see
+   classes.h of load balancer) and workers take the highest level queued anywhere first, so latency sensitive classes
+   bypass bulk work already waiting. levels are strict, load balancer decides how much bulk work is let in.
+Finished tasks are handed back to the I/O thread owning the connection through a completion list. worker writes the
+eventfd of I/O thread only when the list was empty so many completions are delivered with one wakeup.
+Connections, tasks and write buffers come from pools (pool.h). tasks are allocated and freed by the same I/O thread
+so every I/O thread has its own task pool. I/O thread 0 logs pool usage every POOL_REPORT_SEC seconds.
+Every PONG carries a load report of the guest (queued tasks, busy fraction of workers, requests/sec and compute time
+percentiles over the last LOAD_WINDOW_US), load balancer passes it on to autoscaler which scales on it instead of
+guessing from host side cpu time.
+Thread counts follow the CPUs the server may use (affinity.h). with -a threads are pinned: I/O threads on the last CPUs
+of each NUMA node, workers on the rest, and an I/O thread queues its tasks to workers of its own node. every pinned
+thread allocates its own buffers after pinning so they are on its node. epoll contexts and task queues are cache line
+aligned so that threads updating neighbouring entries don't bounce one line between cores.
 
 */
 
-#include <stdio.h> 
-#include <stdlib.h> 
-#include <string.h> 
-#include <sys/socket.h> 
-#include <sys/types.h> 
-#include <netdb.h> 
-#include <netinet/in.h> 
+#define _GNU_SOURCE // CPU_SET(), pthread_setaffinity_np().
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netdb.h>
+#include <netinet/in.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <time.h>
+#include <getopt.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include "frame.h"
+#include "transport.h"
+#include "stats.h"
+#include "kernels.h"
 #include "server.h"
+#include "pool.h"
+#include "affinity.h"
 
 FILE *logs_fd; // server.logs file.
 
 // function prototypes
-void *echo(void *thread_no); // server method to echo the client query. we can prepare server response for query.
-void init_epolls_threads(); // creating threads and creating epoll instance for each thread.
+void *serve(void *thread_no); // I/O thread method, reads the client queries and writes the responses.
+void *compute(void *worker_no); // compute worker method, runs sum_prime() for tasks.
+void init_epolls_threads(); // creating I/O threads and creating epoll instance for each thread.
+void init_compute_workers(); // creating compute workers and their task queues.
 void make_non_block_socket(int fd); // make the socket fd non blocking so that read/write on fd can be performed without blocking.
-int create_lstn_sock_fd(); // create listening socket.
+int create_lstn_sock_fd(char *addr); // create listening socket.
 
 
-int n_threads = 2; // number of threads handling clients requests.
+int n_threads = 0; // number of I/O threads handling clients sockets, 0 means one per 8 CPUs.
+int n_workers = 0; // number of compute workers, 0 means one per CPU (per CPU left by I/O threads when pinned).
+int *io_place; // placement index (affinity.h) of every I/O thread.
+int *worker_place; // placement index of every compute worker.
+int cache_slots = 0; // result cache slots, 0 means no cache.
+char *listen_addrs[4]; // -l option, transports (transport.h) listened on besides TCP.
+int n_listen_addrs = 0;
+char tcp_addr[32] = "tcp:"; // -p option, port 8080 when not given.
+
+#define MAX_EVENTS 10 // max events returned by one epoll_wait.
+#define READ_FRAMES 32 // I/O thread reads upto these many frames with one read() call.
+#define WBUFF_FRAMES 8 // pooled write buffer, grows on heap only when client does not read its responses.
+#define POOL_REPORT_SEC 10
+#define PRIORITY_LEVELS 4 // CLASS 0 is served first, CLASS 3 and above share the lowest level.
+#define LOAD_WINDOW_US 1000000 // load report on PONG covers this much time, recomputed when older.
+
+
+struct connection {	// state of one client connection. only the owning I/O thread touches it.
+	int sock_fd;
+	int io_idx; // I/O thread owning this connection.
+	int refs; // one reference while socket is open + one per task in compute pool. freed when it drops to zero.
+	bool closed; // client disconnected, responses of tasks still in pool are dropped.
+	struct frame_reader reader; // partially received frame.
+	char *wbuff; // responses not yet written because socket buffer was full.
+	int wlen; // bytes pending in wbuff.
+	int wcap; // size of wbuff. WBUFF_FRAMES * FRAME_LEN means it is from wbuff_pool.
+	bool want_out; // EPOLLOUT is registered for this socket.
+	bool dirty; // in the flush list of current completion batch.
+	struct connection *next_dirty;
+};
+
+struct task {	// one query travelling from I/O thread to compute worker and back.
+	struct connection *conn;
+	struct task *next;
+	int level; // priority level, from CLASS field.
+	char buff[FRAME_LEN]; // request frame, replaced by response frame after compute.
+};
 
 struct my_epoll_context { // this is custom structure used for data storation.
 	int epoll_fd; // this is file descriptor of epoll instance. we will add, remove socket fds using this epoll_fd.
+	int event_fd; // compute workers write this fd to wake up I/O thread when tasks are completed.
 	struct epoll_event *response_events; // when we wait on epoll then list of event will be returned(of type 'struct epoll_event') and we will store those in this memory (NOTE: we have already created memory for this pointer).
 	// you can store response events anywhere but it is good to store the data related to same epoll in same structure.
-};
+	struct mem_pool task_pool; // only this I/O thread allocates and frees its tasks.
+	pthread_mutex_t done_lock; // protects completion list.
+	struct task *done_head; // completed tasks waiting to be written by this I/O thread.
+	struct task *done_tail;
+	unsigned int next_worker; // round robbin index to spread tasks over worker queues.
+	int *local_workers; // workers on the NUMA node of this I/O thread, all workers when not pinned.
+	int n_local;
+} __attribute__((aligned(64)));
 
-struct my_epoll_context *epolls; // each thread has one epoll instance and all the socket fds allocated to thread will be in thread's epoll instance. epoll instance can have many socket/file fds to detect events.
+struct mem_pool conn_pool; // connections, allocated by main thread and freed by I/O threads.
+struct mem_pool wbuff_pool; // WBUFF_FRAMES frames write buffers.
 
+struct my_epoll_context *epolls; // each I/O thread has one epoll instance and all the socket fds allocated to thread will be in thread's epoll instance. epoll instance can have many socket/file fds to detect events.
 
-void *serve(void *thread_no) {
-	int thread_idx = *(int *)thread_no;
 
-	static int buff_len = 100;
-	char buff[buff_len];
+struct task_queue {	// FIFOs of tasks owned by one compute worker, other workers steal from it when they are idle.
+	pthread_mutex_t lock;
+	struct task *head[PRIORITY_LEVELS];
+	struct task *tail[PRIORITY_LEVELS];
+	int count[PRIORITY_LEVELS];
+} __attribute__((aligned(64)));
+
+struct compute_pool {
+	struct task_queue *queues; // one queue per worker.
+	int pending; // tasks in all queues. updated atomically.
+	int level_pending[PRIORITY_LEVELS]; // tasks of every level in all queues, workers skip empty levels without scanning queues.
+	long served[PRIORITY_LEVELS]; // logged with pool usage.
+	int idle; // workers sleeping on idle_cond. updated atomically.
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	struct worker_load *load; // one per worker.
+} pool;
+
+struct worker_load {	// written by its compute worker only, read by I/O threads building load reports.
+	long busy_us; // time spent in sum_prime().
+	long served;
+	struct latency_hist compute; // compute time of every request, micro-seconds.
+} __attribute__((aligned(64)));
+
+struct load_report {	// last window, shared by I/O threads answering pings.
+	pthread_mutex_t lock;
+	long at; // end of last window, micro-seconds.
+	long busy_us; // totals of all workers at end of last window.
+	long served;
+	struct latency_hist compute;
+	int busy_permille; // of last window.
+	long rps;
+	long p50_us;
+	long p99_us;
+} load_rep = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+
+static void queue_push(struct task_queue *q, struct task *t) {
+	int level = t->level;
+	t->next = NULL;
+	pthread_mutex_lock(&q->lock);
+	if(q->tail[level] == NULL) q->head[level] = t;
+	else q->tail[level]->next = t;
+	q->tail[level] = t;
+	q->count[level] += 1;
+	pthread_mutex_unlock(&q->lock);
+}
+
+static struct task *queue_pop(struct task_queue *q, int level) {
+	if(__atomic_load_n(&q->count[level], __ATOMIC_RELAXED) == 0) return NULL; // don't take the lock of empty queues while stealing.
+	pthread_mutex_lock(&q->lock);
+	struct task *t = q->head[level];
+	if(t != NULL) {
+		q->head[level] = t->next;
+		if(q->head[level] == NULL) q->tail[level] = NULL;
+		q->count[level] -= 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return t;
+}
+
+void submit_task(struct my_epoll_context *ctx, struct task *t) {
+	struct task_queue *q = &pool.queues[ctx->local_workers[ctx->next_worker++ % ctx->n_local]];
+	queue_push(q, t);
+	__atomic_add_fetch(&pool.level_pending[t->level], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pool.pending, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&pool.idle, __ATOMIC_SEQ_CST) > 0) { // wake one sleeping worker, any worker can steal this task.
+		pthread_mutex_lock(&pool.idle_lock);
+		pthread_cond_signal(&pool.idle_cond);
+		pthread_mutex_unlock(&pool.idle_lock);
+	}
+}
+
+// highest priority task queued anywhere, own queue first at every level.
+static struct task *take_task(int worker_idx) {
+	struct task *t = NULL;
+	for(int level = 0; t == NULL && level < PRIORITY_LEVELS; level++) {
+		if(__atomic_load_n(&pool.level_pending[level], __ATOMIC_RELAXED) == 0) continue;
+		t = queue_pop(&pool.queues[worker_idx], level);
+		for(int i = 1; t == NULL && i < n_workers; i++) { // steal.
+			t = queue_pop(&pool.queues[(worker_idx + i) % n_workers], level);
+		}
+	}
+	if(t != NULL) {
+		__atomic_sub_fetch(&pool.level_pending[t->level], 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&pool.pending, 1, __ATOMIC_SEQ_CST);
+	}
+	return t;
+}
+
+void complete_task(struct task *t) {
+	struct my_epoll_context *ctx = &epolls[t->conn->io_idx];
+	t->next = NULL;
+	pthread_mutex_lock(&ctx->done_lock);
+	bool was_empty = ctx->done_head == NULL;
+	if(was_empty) ctx->done_head = t;
+	else ctx->done_tail->next = t;
+	ctx->done_tail = t;
+	pthread_mutex_unlock(&ctx->done_lock);
+
+	if(was_empty) { // I/O thread has not been woken up for this batch yet.
+		uint64_t one = 1;
+		write(ctx->event_fd, &one, sizeof(one));
+	}
+}
+
+void *compute(void *worker_no) {
+	int worker_idx = (long)worker_no;
+	if(!pin_thread(worker_place[worker_idx])) fprintf(logs_fd, "pinning compute worker %d failed\n", worker_idx);
 
-	int nfds, len;
 	while(true) {
-		nfds = epoll_wait(epolls[thread_idx].epoll_fd, epolls[thread_idx].response_events, 10, -1);// 10 is the maxevents to be returned by call (we have allocated space for 10 events during epoll instance creation you can increase) -1 timeout means it will never timeout means call returns in case of events/interrupts.
-		for(int i = 0; i < nfds; i++) {
-			int sock_fd = epolls[thread_idx].response_events[i].data.fd;
+		struct task *t = take_task(worker_idx);
+		if(t == NULL) {
+			pthread_mutex_lock(&pool.idle_lock);
+			__atomic_add_fetch(&pool.idle, 1, __ATOMIC_SEQ_CST);
+			while(__atomic_load_n(&pool.pending, __ATOMIC_SEQ_CST) == 0) { // submit_task() increments pending before checking idle so no wakeup is lost.
+				pthread_cond_wait(&pool.idle_cond, &pool.idle_lock);
+			}
+			__atomic_sub_fetch(&pool.idle, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&pool.idle_lock);
+			continue;
+		}
+		long start = now_usec();
+		sum_prime(t->buff, FRAME_LEN);
+		long took = now_usec() - start;
+		struct worker_load *w = &pool.load[worker_idx];
+		hist_record(&w->compute, took);
+		__atomic_store_n(&w->busy_us, w->busy_us + took, __ATOMIC_RELAXED);
+		__atomic_store_n(&w->served, w->served + 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&pool.served[t->level], 1, __ATOMIC_RELAXED);
+		complete_task(t);
+	}
+}
+
+// append load report to PONG frame: Q queued tasks, QMAX deepest worker queue, W workers, BUSY permille of worker time
+// in sum_prime(), RPS, P50/P99 compute time (us). window is recomputed by the first ping after LOAD_WINDOW_US, counters
+// of workers are read without stopping them so a window may be off by the request being finished.
+void add_load_report(char *frame) {
+	long now = now_usec();
+	pthread_mutex_lock(&load_rep.lock);
+	if(now - load_rep.at >= LOAD_WINDOW_US) {
+		long busy = 0, served = 0;
+		struct latency_hist total, window;
+		memset(&total, 0, sizeof(total));
+		for(int i = 0; i < n_workers; i++) {
+			busy += __atomic_load_n(&pool.load[i].busy_us, __ATOMIC_RELAXED);
+			served += __atomic_load_n(&pool.load[i].served, __ATOMIC_RELAXED);
+			hist_merge(&total, &pool.load[i].compute);
+		}
+		memset(&window, 0, sizeof(window));
+		for(int i = 0; i < HIST_BUCKETS; i++) window.counts[i] = total.counts[i] - load_rep.compute.counts[i];
+		window.total = total.total - load_rep.compute.total;
+		window.max = total.max;
+		if(load_rep.at != 0) {
+			long elapsed = now - load_rep.at;
+			load_rep.busy_permille = 1000 * (busy - load_rep.busy_us) / (elapsed * n_workers);
+			load_rep.rps = 1000000L * (served - load_rep.served) / elapsed;
+			load_rep.p50_us = hist_percentile(&window, 50);
+			load_rep.p99_us = hist_percentile(&window, 99);
+		}
+		load_rep.at = now;
+		load_rep.busy_us = busy;
+		load_rep.served = served;
+		load_rep.compute = total;
+	}
+	int queued_max = 0;
+	for(int i = 0; i < n_workers; i++) {
+		int queued = 0;
+		for(int level = 0; level < PRIORITY_LEVELS; level++) queued += __atomic_load_n(&pool.queues[i].count[level], __ATOMIC_RELAXED);
+		if(queued > queued_max) queued_max = queued;
+	}
+	frame_add_long(frame, "Q", __atomic_load_n(&pool.pending, __ATOMIC_RELAXED));
+	frame_add_long(frame, "QMAX", queued_max);
+	frame_add_long(frame, "W", n_workers);
+	frame_add_long(frame, "BUSY", load_rep.busy_permille);
+	frame_add_long(frame, "RPS", load_rep.rps);
+	frame_add_long(frame, "P50", load_rep.p50_us);
+	frame_add_long(frame, "P99", load_rep.p99_us);
+	pthread_mutex_unlock(&load_rep.lock);
+}
+
+// size thread counts from topology and give every thread its placement index. I/O threads take the last free CPU of
+// every node in turn, workers take the remaining CPUs in node order, both wrap around when there are more threads than CPUs.
+void plan_threads() {
+	if(n_threads <= 0) n_threads = (topo.n_cpus + 7) / 8; // reading frames is cheap next to sum_prime().
+	if(n_workers <= 0) n_workers = pinning && topo.n_cpus > n_threads? topo.n_cpus - n_threads: topo.n_cpus;
+	io_place = calloc(n_threads, sizeof(int));
+	worker_place = calloc(n_workers, sizeof(int));
+
+	bool taken[topo.n_cpus];
+	memset(taken, 0, sizeof(taken));
+	for(int i = 0; i < n_threads; i++) {
+		io_place[i] = topo.n_cpus - 1 - i % topo.n_cpus;
+		if(i >= topo.n_cpus) continue; // more I/O threads than CPUs, share.
+		int node = -1, rank = 0; // node number (i % n_nodes) in topology order.
+		for(int k = 0; k < topo.n_cpus; k++) {
+			if(k > 0 && topo.node_of[k] != topo.node_of[k - 1]) rank += 1;
+			if(rank == i % topo.n_nodes) node = topo.node_of[k];
+		}
+		for(int k = topo.n_cpus - 1; k >= 0; k--) {
+			if(!taken[k] && topo.node_of[k] == node) {
+				io_place[i] = k;
+				break;
+			}
+		}
+		if(taken[io_place[i]]) { // node is full, any free CPU.
+			for(int k = topo.n_cpus - 1; k >= 0 && taken[io_place[i]]; k--) io_place[i] = k;
+		}
+		taken[io_place[i]] = true;
+	}
+	int free_cpus = 0;
+	for(int k = 0; k < topo.n_cpus; k++) {
+		if(!taken[k] && free_cpus < n_workers) worker_place[free_cpus++] = k;
+	}
+	for(int w = free_cpus; w < n_workers; w++) worker_place[w] = w % topo.n_cpus; // oversubscribed, share with everyone.
+	if(!pinning) return;
+	if(n_threads + n_workers > topo.n_cpus) fprintf(logs_fd, "%d threads pinned on %d CPUs, some CPUs are shared\n", n_threads + n_workers, topo.n_cpus);
+}
+
+void init_compute_workers() {
+	pool.queues = aligned_alloc(64, n_workers * sizeof(struct task_queue));
+	memset(pool.queues, 0, n_workers * sizeof(struct task_queue));
+	pool.load = aligned_alloc(64, n_workers * sizeof(struct worker_load));
+	memset(pool.load, 0, n_workers * sizeof(struct worker_load));
+	pool.pending = 0;
+	pool.idle = 0;
+	pthread_mutex_init(&pool.idle_lock, NULL);
+	pthread_cond_init(&pool.idle_cond, NULL);
+
+	pthread_t workers[n_workers];
+	for(int i = 0; i < n_workers; i++) {
+		pthread_mutex_init(&pool.queues[i].lock, NULL);
+		pthread_create(&workers[i], NULL, &compute, (void *)(long)i); // index is passed in the pointer itself.
+	}
+	fprintf(logs_fd, "compute workers: %d\n", n_workers);
+	placement_report(logs_fd, "compute workers", worker_place, n_workers);
+}
 
-			len = read(sock_fd, buff, buff_len);
 
-			if(len == 0) { // event occured but client didn't query means client disconnected.
-				close(sock_fd);
-				fprintf(logs_fd, "load balancer disconnected. socket fd: %d closed of thread no: %d\n", sock_fd, thread_idx);
+static void release_conn(struct connection *conn) {
+	conn->refs -= 1;
+	if(conn->refs == 0) {
+		if(conn->wcap == WBUFF_FRAMES * FRAME_LEN) pool_free(&wbuff_pool, conn->wbuff);
+		else free(conn->wbuff);
+		pool_free(&conn_pool, conn);
+	}
+}
+
+static void close_conn(struct my_epoll_context *ctx, struct connection *conn) {
+	if(conn->closed) return;
+	epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, conn->sock_fd, NULL);
+	close(conn->sock_fd);
+	fprintf(logs_fd, "load balancer disconnected. socket fd: %d closed of thread no: %d\n", conn->sock_fd, conn->io_idx);
+	conn->closed = true;
+	release_conn(conn); // tasks still in compute pool keep conn alive.
+}
+
+static void watch_writable(struct my_epoll_context *ctx, struct connection *conn, bool on) {
+	struct epoll_event interested_event;
+	interested_event.data.ptr = conn;
+	interested_event.events = EPOLLIN | EPOLLET | (on? EPOLLOUT: 0);
+	epoll_ctl(ctx->epoll_fd, EPOLL_CTL_MOD, conn->sock_fd, &interested_event);
+}
+
+// write pending responses. returns false if connection is broken.
+static bool flush_conn(struct my_epoll_context *ctx, struct connection *conn) {
+	int done = 0;
+	while(done < conn->wlen) {
+		int n = write(conn->sock_fd, conn->wbuff + done, conn->wlen - done);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return false;
+		}
+		done += n;
+	}
+	memmove(conn->wbuff, conn->wbuff + done, conn->wlen - done);
+	conn->wlen -= done;
+	if((conn->wlen > 0) != conn->want_out) { // socket buffer full, ask epoll to tell when it is writable again.
+		conn->want_out = conn->wlen > 0;
+		watch_writable(ctx, conn, conn->want_out);
+	}
+	return true;
+}
+
+static void queue_response(struct connection *conn, char *buff) {
+	if(conn->wlen + FRAME_LEN > conn->wcap) {
+		if(conn->wcap == 0) {
+			conn->wbuff = pool_alloc(&wbuff_pool);
+			conn->wcap = WBUFF_FRAMES * FRAME_LEN;
+		} else if(conn->wcap == WBUFF_FRAMES * FRAME_LEN) { // client is slow, move off the pool.
+			char *big = malloc(2 * conn->wcap);
+			memcpy(big, conn->wbuff, conn->wlen);
+			pool_free(&wbuff_pool, conn->wbuff);
+			conn->wbuff = big;
+			conn->wcap *= 2;
+		} else {
+			conn->wcap *= 2;
+			conn->wbuff = realloc(conn->wbuff, conn->wcap);
+		}
+	}
+	memcpy(conn->wbuff + conn->wlen, buff, FRAME_LEN);
+	conn->wlen += FRAME_LEN;
+}
+
+// write back all the tasks completed by compute workers since last wakeup.
+static void drain_completions(struct my_epoll_context *ctx) {
+	uint64_t count;
+	read(ctx->event_fd, &count, sizeof(count));
+
+	pthread_mutex_lock(&ctx->done_lock);
+	struct task *t = ctx->done_head;
+	ctx->done_head = ctx->done_tail = NULL;
+	pthread_mutex_unlock(&ctx->done_lock);
+
+	struct connection *dirty = NULL; // connections having new responses, each is flushed once for the whole batch.
+	while(t != NULL) {
+		struct task *next = t->next;
+		struct connection *conn = t->conn;
+		if(!conn->closed) {
+			queue_response(conn, t->buff);
+			if(!conn->dirty) {
+				conn->dirty = true;
+				conn->next_dirty = dirty;
+				dirty = conn;
+			}
+		}
+		pool_free(&ctx->task_pool, t);
+		release_conn(conn); // open connection is still referenced by its socket so only closed ones are freed here.
+		t = next;
+	}
+	while(dirty != NULL) {
+		struct connection *next = dirty->next_dirty;
+		dirty->dirty = false;
+		if(!dirty->closed && !flush_conn(ctx, dirty)) close_conn(ctx, dirty);
+		dirty = next;
+	}
+}
+
+// read all the requests in this socket and hand them to compute pool.
+static void read_requests(struct my_epoll_context *ctx, struct connection *conn) {
+	char rbuff[READ_FRAMES * FRAME_LEN];
+	bool pong = false; // health check answered, flush before returning.
+	while(true) {
+		int len = read(conn->sock_fd, rbuff, sizeof(rbuff));
+		if(len == 0) { // event occured but client didn't query means client disconnected.
+			close_conn(ctx, conn);
+			return;
+		}
+		if(len < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) close_conn(ctx, conn);
+			else if(pong && !flush_conn(ctx, conn)) close_conn(ctx, conn);
+			return;
+		}
+		char *data = rbuff;
+		char *frame;
+		while((frame = frame_next(&conn->reader, &data, &len)) != NULL) {
+			if(frame_is(frame, "PING")) { // health check of load balancer, answered by I/O thread so that busy workers don't delay it.
+				long seq = 0;
+				char reply[FRAME_LEN];
+				frame[FRAME_LEN - 1] = '\0';
+				frame_get_long(frame, "PING", &seq);
+				frame_encode_ping(reply, "PONG", seq);
+				add_load_report(reply);
+				queue_response(conn, reply);
+				pong = true;
 				continue;
 			}
-			// read all the requests in this socket.
-			while(len > 0) {
-				fprintf(logs_fd, "Client: %s\n", buff);
-				sum_prime(buff, buff_len);
-				write(sock_fd, buff, buff_len);
-				len = read(sock_fd, buff, buff_len);
+			struct task *t = pool_alloc(&ctx->task_pool);
+			memcpy(t->buff, frame, FRAME_LEN);
+			t->buff[FRAME_LEN - 1] = '\0';
+			long cls = 0;
+			frame_get_long(t->buff, "CLASS", &cls);
+			t->level = cls <= 0? 0: cls >= PRIORITY_LEVELS? PRIORITY_LEVELS - 1: cls;
+			t->conn = conn;
+			conn->refs += 1;
+			fprintf(logs_fd, "Client: %s\n", t->buff);
+			submit_task(ctx, t);
+		}
+	}
+}
+
+void *serve(void *thread_no) {
+	int thread_idx = (long)thread_no;
+	struct my_epoll_context *ctx = &epolls[thread_idx];
+	time_t last_report = time(NULL);
+	if(!pin_thread(io_place[thread_idx])) fprintf(logs_fd, "pinning I/O thread %d failed\n", thread_idx);
+	ctx->response_events = local_alloc(MAX_EVENTS * sizeof(struct epoll_event)); // only this thread uses it.
+
+	int nfds;
+	while(true) {
+		nfds = epoll_wait(ctx->epoll_fd, ctx->response_events, MAX_EVENTS, thread_idx == 0? POOL_REPORT_SEC * 1000: -1); // MAX_EVENTS is the maxevents to be returned by call (we have allocated space for MAX_EVENTS events during epoll instance creation you can increase) -1 timeout means it will never timeout means call returns in case of events/interrupts, first thread wakes up for the report.
+		if(thread_idx == 0 && time(NULL) - last_report >= POOL_REPORT_SEC) { // leak accounting.
+			last_report = time(NULL);
+			pool_report(logs_fd);
+			if(cache.slots > 0) fprintf(logs_fd, "cache: hits %ld, misses %ld\n", cache.hits, cache.misses);
+			fprintf(logs_fd, "served by priority: %ld %ld %ld %ld, queued %d\n", pool.served[0], pool.served[1], pool.served[2], pool.served[3], pool.pending);
+		}
+		for(int i = 0; i < nfds; i++) {
+			struct connection *conn = ctx->response_events[i].data.ptr;
+			if(conn == NULL) { // eventfd, compute workers finished some tasks.
+				drain_completions(ctx);
+				continue;
+			}
+			if(conn->closed) continue; // closed while handling earlier event of this batch.
+			conn->refs += 1; // keep conn alive while handling its event.
+			if(ctx->response_events[i].events & EPOLLOUT) {
+				if(!flush_conn(ctx, conn)) close_conn(ctx, conn);
+			}
+			if(!conn->closed && (ctx->response_events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+				read_requests(ctx, conn);
 			}
+			release_conn(conn);
 		}
 	}
 }
 
 
 void init_epolls_threads() {
-	pthread_t workers[n_threads]; // worker threads.
-	epolls = (struct my_epoll_context *) malloc(n_threads * sizeof(struct my_epoll_context)); // array of epoll_context and each context is handled by one thread.
+	pthread_t workers[n_threads]; // I/O threads.
+	epolls = aligned_alloc(64, n_threads * sizeof(struct my_epoll_context)); // array of epoll_context and each context is handled by one thread.
+	memset(epolls, 0, n_threads * sizeof(struct my_epoll_context));
 	for(int i = 0; i < n_threads; i++) {
 		epolls[i].epoll_fd = epoll_create1(0); // creating the epoll instance for this thread it returns the epoll instance fd.
-		epolls[i].response_events = calloc(10, sizeof(struct epoll_event)); // this memory location will be passed to epoll_wait to write the response events.
+		// response_events is allocated by the I/O thread itself, epoll_wait() writes the response events there.
+		epolls[i].local_workers = calloc(n_workers, sizeof(int));
+		for(int w = 0; w < n_workers; w++) {
+			if(!pinning || topology_node(worker_place[w]) == topology_node(io_place[i])) epolls[i].local_workers[epolls[i].n_local++] = w;
+		}
+		if(epolls[i].n_local == 0) { // no worker on this node.
+			for(int w = 0; w < n_workers; w++) epolls[i].local_workers[epolls[i].n_local++] = w;
+		}
+		epolls[i].event_fd = eventfd(0, EFD_NONBLOCK);
+		pool_init(&epolls[i].task_pool, "task", sizeof(struct task), 0);
+		pthread_mutex_init(&epolls[i].done_lock, NULL);
+		epolls[i].done_head = epolls[i].done_tail = NULL;
+		epolls[i].next_worker = i;
+
+		struct epoll_event interested_event;
+		interested_event.data.ptr = NULL; // NULL marks the eventfd, connections store their struct connection pointer.
+		interested_event.events = EPOLLIN | EPOLLET;
+		epoll_ctl(epolls[i].epoll_fd, EPOLL_CTL_ADD, epolls[i].event_fd, &interested_event);
 
-		int *thread_no = (int *) malloc(sizeof(int));
-		*thread_no = i;
-		pthread_create(&workers[i], NULL, &serve, (void *)thread_no); // creating the thread
+		pthread_create(&workers[i], NULL, &serve, (void *)(long)i); // creating the thread, index is passed in the pointer itself.
 	}
+	placement_report(logs_fd, "I/O threads", io_place, n_threads);
 }
 
 void make_non_block_socket(int fd) {
@@ -97,32 +579,12 @@ void make_non_block_socket(int fd) {
 	}
 }
 
-int create_lstn_sock_fd() {
-	int flag;
-	
-	struct sockaddr_in lstn_socket, client_addr;
-	
-	int lstn_sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+int create_lstn_sock_fd(char *addr) {	// "tcp:" is port 8080 on every interface.
+	int lstn_sock_fd = transport_listen(addr, 5);
 	if(lstn_sock_fd == -1) {
-		fprintf(logs_fd, "listening socket creation failed\n");
+		fprintf(logs_fd, "listening on %s failed\n", addr);
 		exit(0);
-	} else fprintf(logs_fd, "listening socket created\n");
-
-	lstn_socket.sin_family = AF_INET;
-	lstn_socket.sin_addr.s_addr = htonl(INADDR_ANY);
-	lstn_socket.sin_port = htons(8080);
-
-	flag = bind(lstn_sock_fd, (struct sockaddr *)&lstn_socket, sizeof(lstn_socket));
-	if(flag == -1) {
-		fprintf(logs_fd, "Bind failed\n");
-		exit(0);
-	} else fprintf(logs_fd, "Bind successful\n");
-
-	flag = listen(lstn_sock_fd, 5);
-	if(flag == -1) {
-		fprintf(logs_fd, "Error listening on socket\n");
-		exit(0);
-	} else fprintf(logs_fd, "listening...\n");
+	} else fprintf(logs_fd, "listening on %s...\n", addr);
 	return lstn_sock_fd;
 }
 
@@ -142,20 +604,53 @@ void init_logs() {
 }
 
 
-int main() {
-	int clnt_sock_fd, len, flag, turn = 0;
-	int lstn_sock_fd; // listening socket fd
+void parse_args(int argc, char *argv[]) {
+	int opt;
+	while((opt = getopt(argc, argv, "t:w:c:ak:l:p:")) != -1) {
+		switch(opt) {
+			case 't': n_threads = atoi(optarg); break; // I/O threads, 0 is automatic.
+			case 'w': n_workers = atoi(optarg); break; // compute workers, 0 is automatic.
+			case 'a': pinning = true; break; // pin threads to CPUs.
+			case 'k': primes.use_reference = strcmp(optarg, "ref") == 0; break; // "ref" keeps original trial division cost.
+			case 'c': cache_slots = atoi(optarg); break; // result cache, 0 is off.
+			case 'l': if(n_listen_addrs < 4) listen_addrs[n_listen_addrs++] = optarg; break; // eg. unix:/tmp/prime.sock, vsock.
+			case 'p': snprintf(tcp_addr, sizeof(tcp_addr), "tcp:0.0.0.0:%d", atoi(optarg)); break; // several servers on one host.
+			default:
+				fprintf(stderr, "Usage: %s [-t io_threads] [-w compute_workers] [-c cache_slots] [-a] [-k sieve|ref] [-l unix:path|vsock[:port]]... [-p tcp_port]\n", argv[0]);
+				exit(1);
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int clnt_sock_fd, turn = 0;
+	struct pollfd lstn[1 + 4]; // listening sockets, TCP first.
 
+	parse_args(argc, argv);
 	init_logs();
 
-	lstn_sock_fd = create_lstn_sock_fd();
+	lstn[0].fd = create_lstn_sock_fd(tcp_addr);
+	for(int i = 0; i < n_listen_addrs; i++) lstn[1 + i].fd = create_lstn_sock_fd(listen_addrs[i]);
+	for(int i = 0; i <= n_listen_addrs; i++) lstn[i].events = POLLIN;
+	topology_init();
+	topology_report(logs_fd);
+	plan_threads();
+	init_kernels(0);
+	fprintf(logs_fd, "prime kernel: %s\n", primes.use_reference? "reference": primes.backend->name);
+	if(cache_slots > 0) init_cache(cache_slots);
+	pool_init(&conn_pool, "connection", sizeof(struct connection), 0);
+	pool_init(&wbuff_pool, "write buffer", WBUFF_FRAMES * FRAME_LEN, 0);
+	init_compute_workers();
 	init_epolls_threads();
 
 	while(1) {
-		struct sockaddr_in client_addr;
-		len = sizeof(client_addr);
-		// accept(listen_fd, NULL, NULL); we can use this also because we are not using client IP,port etc. hence no point in passing second argument. second argument is reference to structure in which connected clients IP, port is stored.
-		clnt_sock_fd = accept(lstn_sock_fd, (struct sockaddr *)&client_addr, &len);
+		int l = 0; // listening socket having a connection to accept.
+		if(n_listen_addrs > 0) { // with TCP only accept() blocks by itself.
+			if(poll(lstn, 1 + n_listen_addrs, -1) <= 0) continue;
+			while(l < n_listen_addrs && (lstn[l].revents & POLLIN) == 0) l++;
+		}
+		// we are not using client address hence no point in passing second argument.
+		clnt_sock_fd = accept(lstn[l].fd, NULL, NULL);
 		if(clnt_sock_fd == -1) {
 			fprintf(logs_fd, "Error accepting: error:%d\n", clnt_sock_fd);
 			//exit(0);
@@ -164,13 +659,18 @@ int main() {
 
 		// for EPOLLET events it is advisable to use non-blocking operations on fd eg. read/write on socket.
 		make_non_block_socket(clnt_sock_fd);
-		
+
+		struct connection *conn = pool_alloc(&conn_pool);
+		conn->sock_fd = clnt_sock_fd;
+		conn->io_idx = turn;
+		conn->refs = 1; // reference of open socket.
+
 		struct epoll_event interested_event; // struct epoll_event is inbuilt structure we just created variable of this struct type to store interested event data for this epoll instance.
-		interested_event.data.fd = clnt_sock_fd; // adding the socket fd
+		interested_event.data.ptr = conn; // adding the connection state, I/O thread gets it back with the event.
 		interested_event.events = EPOLLIN | EPOLLET; // adding the event type for this socket fd.
 		epoll_ctl(epolls[turn].epoll_fd, EPOLL_CTL_ADD, clnt_sock_fd, &interested_event); // adding the socket to epoll instance.
 		fprintf(logs_fd, "socket fd:%d added to thread no: %d\n", clnt_sock_fd, turn);
 		turn = (turn + 1) % n_threads;
 	}
-	close(lstn_sock_fd);
-}
\ No newline at end of file
+	for(int i = 0; i <= n_listen_addrs; i++) close(lstn[i].fd);
+}
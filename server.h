@@ -1,6 +1,5 @@
 
 
-bool is_prime(long n);
 void sum_prime(char *buff, int n);
 
 void print(char *buff, int len) {
@@ -12,33 +11,73 @@ void println(char *buff, int buff_len) {
 }
 
 
-bool is_prime(long n) {
-	if(n < 2) return false;
-	for(int i = 2; i < n; i++) {
-		if(n % i == 0) return false;
-	}
-	return true;
+/*
+Result cache of sum_prime(), off unless init_cache() is called (server -c option).
+Direct mapped: REQ_DATA hashes to one slot which keeps the last key computed there. compute workers share it,
+slots are guarded by CACHE_STRIPES locks so workers rarely wait for each other.
+Answers served from cache carry HIT:1 so that load balancer can measure hit rate of the whole fleet.
+*/
+#define CACHE_STRIPES 64
+#define CACHE_EMPTY -1
+
+struct result_cache {
+	int slots; // 0 means cache is off.
+	long *keys;
+	long *values;
+	pthread_mutex_t locks[CACHE_STRIPES];
+	long hits;
+	long misses;
+} cache;
+
+void init_cache(int slots) {
+	cache.slots = slots;
+	cache.keys = malloc(slots * sizeof(long));
+	cache.values = malloc(slots * sizeof(long));
+	for(int i = 0; i < slots; i++) cache.keys[i] = CACHE_EMPTY;
+	for(int i = 0; i < CACHE_STRIPES; i++) pthread_mutex_init(&cache.locks[i], NULL);
+}
+
+static inline int cache_slot(long key) {
+	return ((unsigned long)key * 0x9E3779B97F4A7C15UL >> 32) % cache.slots;
+}
+
+bool cache_get(long key, long *value) {
+	int slot = cache_slot(key);
+	pthread_mutex_t *lock = &cache.locks[slot % CACHE_STRIPES];
+	pthread_mutex_lock(lock);
+	bool hit = cache.keys[slot] == key;
+	if(hit) *value = cache.values[slot];
+	pthread_mutex_unlock(lock);
+	__atomic_add_fetch(hit? &cache.hits: &cache.misses, 1, __ATOMIC_RELAXED);
+	return hit;
+}
+
+void cache_put(long key, long value) {
+	int slot = cache_slot(key);
+	pthread_mutex_t *lock = &cache.locks[slot % CACHE_STRIPES];
+	pthread_mutex_lock(lock);
+	cache.keys[slot] = key;
+	cache.values[slot] = value;
+	pthread_mutex_unlock(lock);
 }
 
 void sum_prime(char *buff, int len) {
-	char tmp[100];
-	strcpy(tmp, buff);
-	
-	strtok(tmp, ";");
-	strtok(NULL, ":");
-	char *t = strtok(NULL, ";");
-
-	long num = strtol(t, NULL, 10); // base 10.
-
-	// printf("\nFound num query:%ld, ", num);
-	long sum = 0;
-	for(int i = 2; i <= num; i++) {
-		if(is_prime(i) == true) {
-			sum += i;
-			// printf("prime: %d, ", i);
-		}
+	long num = 0;
+	frame_get_long(buff, "REQ_DATA", &num);
+
+	long cached;
+	if(cache.slots > 0 && cache_get(num, &cached)) {
+		frame_add_long(buff, "RES_DATA", cached);
+		frame_add_long(buff, "HIT", 1);
+		return;
+	}
+
+	long sum = kernel_sum_primes(num); // kernels.h.
+	if(sum < 0) { // above KERNEL_N_MAX.
+		frame_add_long(buff, "ERR", KERNEL_N_MAX);
+		return;
 	}
-	sprintf(tmp, "%sRES_DATA:%ld;", buff, sum);
-	strcpy(buff, tmp);
+	if(cache.slots > 0) cache_put(num, sum);
+	frame_add_long(buff, "RES_DATA", sum); // response is request fields + RES_DATA.
 	return;
 }
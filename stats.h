@@ -0,0 +1,94 @@
+/*
+Latency histogram and clock helpers used for throughput/latency reports.
+
+Histogram is log-linear: values below 16 us have own bucket, above that every power of two is
+split in 8 buckets so percentiles are within 12.5% of the real value with fixed 2.5 KB memory.
+*/
+
+#define HIST_BUCKETS 320
+
+struct latency_hist {
+	unsigned long counts[HIST_BUCKETS];
+	unsigned long total; // number of values recorded.
+	unsigned long long sum; // sum of values, used for mean.
+	long max;
+};
+
+static inline long now_usec() {	// monotonic clock in micro-seconds, not affected by system time change.
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static inline int hist_bucket(long v) {
+	if(v < 16) return v < 0? 0: v;
+	int exp = 63 - __builtin_clzl(v); // floor(log2(v)), >= 4 here.
+	int idx = 16 + (exp - 4) * 8 + ((v >> (exp - 3)) & 7);
+	return idx < HIST_BUCKETS? idx: HIST_BUCKETS - 1;
+}
+
+static inline long hist_bucket_value(int idx) {	// lowest value falling in bucket idx.
+	if(idx < 16) return idx;
+	int exp = (idx - 16) / 8 + 4;
+	return (1L << exp) + ((long)((idx - 16) % 8) << (exp - 3));
+}
+
+static inline void hist_record(struct latency_hist *h, long v) {
+	h->counts[hist_bucket(v)] += 1;
+	h->total += 1;
+	h->sum += v;
+	if(v > h->max) h->max = v;
+}
+
+static inline void hist_merge(struct latency_hist *dst, struct latency_hist *src) {
+	for(int i = 0; i < HIST_BUCKETS; i++) dst->counts[i] += src->counts[i];
+	dst->total += src->total;
+	dst->sum += src->sum;
+	if(src->max > dst->max) dst->max = src->max;
+}
+
+static inline long hist_percentile(struct latency_hist *h, double p) {	// p in [0, 100]. returns 0 for empty histogram.
+	if(h->total == 0) return 0;
+	unsigned long rank = (unsigned long)(p / 100.0 * h->total);
+	if(rank >= h->total) rank = h->total - 1;
+	unsigned long seen = 0;
+	for(int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if(seen > rank) return hist_bucket_value(i);
+	}
+	return h->max;
+}
+
+static inline void hist_reset(struct latency_hist *h) {
+	memset(h, 0, sizeof(struct latency_hist));
+}
+
+// hist_record for histogram that other threads take snapshots of, only this thread writes it. relaxed stores are
+// plain moves, no lock prefix.
+static inline void hist_record_shared(struct latency_hist *h, long v) {
+	int b = hist_bucket(v);
+	__atomic_store_n(&h->counts[b], h->counts[b] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+	if(v > h->max) __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+// copy of histogram another thread keeps recording into (hist_record_shared), counts only grow. taken without lock so buckets may be a
+// few values apart from each other, total is counted from the copied buckets to stay consistent with them.
+static inline void hist_snapshot(struct latency_hist *dst, struct latency_hist *src) {
+	dst->total = 0;
+	for(int i = 0; i < HIST_BUCKETS; i++) {
+		dst->counts[i] = __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+		dst->total += dst->counts[i];
+	}
+	dst->sum = __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	dst->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+}
+
+// values recorded between two snapshots of the same histogram, max is of the whole run.
+static inline void hist_subtract(struct latency_hist *dst, struct latency_hist *now, struct latency_hist *before) {
+	for(int i = 0; i < HIST_BUCKETS; i++) dst->counts[i] = now->counts[i] - before->counts[i];
+	dst->total = now->total - before->total;
+	dst->sum = now->sum - before->sum;
+	dst->max = now->max;
+}
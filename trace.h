@@ -0,0 +1,113 @@
+/*
+Request trace capture (-R file) and replay (-T file, -X speed) of load balancer.
+
+Capture writes every generated request as arrival time, REQ_DATA and request class (classes.h). replay feeds the same
+stream back through generate_requests() instead of rand() and inter request delay, so a scaling or latency problem
+seen once can be run again exactly, against the same or a changed build.
+File: "LBTRACE2" then one record per request: varint micro-seconds since previous request, varint zigzag REQ_DATA,
+varint class. a request costs 5-7 bytes, a day at 1000 req/sec is ~0.6 GB. "LBTRACE1" files (no class, every
+request is class 0) are still replayed.
+Replay keeps the recorded schedule from replay start: speed 2 sends twice as fast, speed 0 sends as fast as the
+request thread can. schedule is absolute so it doesn't drift when request thread is restarted on scale out/in.
+*/
+
+#define TRACE_MAGIC "LBTRACE2"
+#define TRACE_MAGIC_V1 "LBTRACE1" // without class.
+#define TRACE_SLEEP_SLICE_US 10000 // replay waits in slices so that stop_request_thread() isn't held up by a gap.
+
+struct trace_context {
+	FILE *capture; // -R file.
+	long last_capture; // time of last captured request, micro-seconds.
+
+	FILE *replay; // -T file.
+	bool has_class; // LBTRACE2 file.
+	double speed; // -X option, 0 is max speed.
+	long trace_time; // recorded time of last replayed request, micro-seconds from first one.
+	long start; // now_usec() of replay start.
+	long replayed;
+	bool finished;
+	bool pending; // record decoded but not sent yet, request thread was stopped while waiting for its time.
+	long pending_data;
+	int pending_class;
+} trace = {.speed = 1};
+
+
+static void trace_put_varint(FILE *f, unsigned long v) {
+	while(v >= 0x80) {
+		fputc((v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+	fputc(v, f);
+}
+
+static bool trace_get_varint(FILE *f, unsigned long *v) {
+	*v = 0;
+	for(int shift = 0; shift < 64; shift += 7) {
+		int c = fgetc(f);
+		if(c == EOF) return false;
+		*v |= (unsigned long)(c & 0x7f) << shift;
+		if((c & 0x80) == 0) return true;
+	}
+	return false; // corrupt.
+}
+
+bool trace_open_capture(char *file) {
+	trace.capture = fopen(file, "w");
+	if(trace.capture == NULL) return false;
+	setvbuf(trace.capture, NULL, _IOFBF, 1 << 16); // flushed on exit().
+	fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace.capture);
+	return true;
+}
+
+bool trace_open_replay(char *file) {
+	char magic[sizeof(TRACE_MAGIC)] = "";
+	trace.replay = fopen(file, "r");
+	if(trace.replay == NULL) return false;
+	bool ok = fread(magic, 1, strlen(TRACE_MAGIC), trace.replay) == strlen(TRACE_MAGIC);
+	trace.has_class = strcmp(magic, TRACE_MAGIC) == 0;
+	if(!ok || (!trace.has_class && strcmp(magic, TRACE_MAGIC_V1) != 0)) {
+		fclose(trace.replay);
+		trace.replay = NULL;
+		return false;
+	}
+	return true;
+}
+
+// request thread only.
+void trace_capture(long now, long req_data, int req_class) {
+	if(trace.capture == NULL) return;
+	trace_put_varint(trace.capture, trace.last_capture == 0? 0: now - trace.last_capture);
+	trace_put_varint(trace.capture, ((unsigned long)req_data << 1) ^ (req_data >> 63)); // zigzag, small negatives stay small.
+	trace_put_varint(trace.capture, req_class);
+	trace.last_capture = now;
+}
+
+// next recorded request, sleeps until its time. false when trace is over or *stop got set while waiting, the record
+// is then kept pending for the restarted request thread. request thread only.
+bool trace_next(long *req_data, int *req_class, void **stop) {
+	if(trace.finished) return false;
+	if(!trace.pending) {
+		unsigned long delta, zz, cls = 0;
+		if(!trace_get_varint(trace.replay, &delta) || !trace_get_varint(trace.replay, &zz) || (trace.has_class && !trace_get_varint(trace.replay, &cls))) {
+			trace.finished = true;
+			printf("Trace replay finished, %ld requests\n", trace.replayed);
+			return false;
+		}
+		trace.pending_data = (long)(zz >> 1) ^ -(long)(zz & 1);
+		trace.pending_class = cls;
+		trace.trace_time += delta;
+		trace.pending = true;
+	}
+	if(trace.start == 0) trace.start = now_usec();
+	while(trace.speed > 0) {
+		long wait = trace.start + (long)(trace.trace_time / trace.speed) - now_usec();
+		if(wait <= 0) break;
+		if(__atomic_load_n(stop, __ATOMIC_ACQUIRE) != NULL) return false;
+		usleep(wait < TRACE_SLEEP_SLICE_US? wait: TRACE_SLEEP_SLICE_US);
+	}
+	*req_data = trace.pending_data;
+	*req_class = trace.pending_class;
+	trace.pending = false;
+	trace.replayed += 1;
+	return true;
+}
@@ -0,0 +1,85 @@
+/*
+Transports between load balancer and servers, picked per backend by its address (SCALE_OUT/SYNC of autoscaler):
+  "10.0.0.5", "tcp:10.0.0.5[:port]"   TCP through the virtual network of the VMs, port 8080 by default.
+  "vsock:<cid>[:port]"                AF_VSOCK straight to the guest over virtio, no IP stack and no NAT. cid is the
+                                      guest CID of the domain's <vsock> device (autoscaler -V reads it from libvirt).
+  "unix:<path>"                       AF_UNIX stream socket, server on the same machine (loopback benchmarks).
+Frames are the same on every transport. server always listens on TCP and also on the addresses given with -l
+("vsock[:port]" listens on any CID).
+*/
+
+#include <sys/un.h>
+#include <linux/vm_sockets.h>
+
+#define TRANSPORT_PORT 8080
+
+union transport_addr {
+	struct sockaddr sa;
+	struct sockaddr_in in;
+	struct sockaddr_un un;
+	struct sockaddr_vm vm;
+};
+
+// fill addr from backend address, returns false on malformed address. listening addresses may leave out the host.
+static bool transport_parse(const char *text, union transport_addr *addr, socklen_t *len) {
+	memset(addr, 0, sizeof(*addr));
+	unsigned int cid = VMADDR_CID_ANY, port = TRANSPORT_PORT;
+	if(strncmp(text, "unix:", 5) == 0) {
+		if(strlen(text + 5) == 0 || strlen(text + 5) >= sizeof(addr->un.sun_path)) return false;
+		addr->un.sun_family = AF_UNIX;
+		strcpy(addr->un.sun_path, text + 5);
+		*len = sizeof(addr->un);
+		return true;
+	}
+	if(strncmp(text, "vsock", 5) == 0 && (text[5] == '\0' || text[5] == ':')) {
+		if(text[5] == ':' && sscanf(text + 6, "%u:%u", &cid, &port) < 1) return false;
+		addr->vm.svm_family = AF_VSOCK;
+		addr->vm.svm_cid = cid;
+		addr->vm.svm_port = port;
+		*len = sizeof(addr->vm);
+		return true;
+	}
+	if(strncmp(text, "tcp:", 4) == 0) text += 4;
+	char host[64];
+	if(sscanf(text, "%63[^:]:%u", host, &port) < 1) strcpy(host, "0.0.0.0");
+	addr->in.sin_family = AF_INET;
+	addr->in.sin_port = htons(port);
+	if(inet_pton(AF_INET, host, &addr->in.sin_addr) != 1) return false;
+	*len = sizeof(addr->in);
+	return true;
+}
+
+// socket to backend, connected or with nonblock still connecting (*in_progress). -1 when address is bad or connect
+// failed at once.
+static int transport_connect(const char *text, bool nonblock, bool *in_progress) {
+	union transport_addr addr;
+	socklen_t len;
+	*in_progress = false;
+	if(!transport_parse(text, &addr, &len)) return -1;
+	int fd = socket(addr.sa.sa_family, SOCK_STREAM | (nonblock? SOCK_NONBLOCK: 0), 0);
+	if(fd == -1) return -1;
+	if(connect(fd, &addr.sa, len) == 0) return fd;
+	if(nonblock && (errno == EINPROGRESS || errno == EAGAIN)) { // unix sockets say EAGAIN when backlog is full.
+		*in_progress = errno == EINPROGRESS;
+		if(*in_progress) return fd;
+	}
+	close(fd);
+	return -1;
+}
+
+// listening socket on address, -1 on failure. stale unix socket file of a previous run is removed first.
+static int transport_listen(const char *text, int backlog) {
+	union transport_addr addr;
+	socklen_t len;
+	if(!transport_parse(text, &addr, &len)) return -1;
+	int fd = socket(addr.sa.sa_family, SOCK_STREAM, 0);
+	if(fd == -1) return -1;
+	int reuse = 1; // restarted server can bind again while old connections are in TIME_WAIT.
+	if(addr.sa.sa_family == AF_INET) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if(addr.sa.sa_family == AF_UNIX) unlink(addr.un.sun_path);
+	if(bind(fd, &addr.sa, len) == -1 || listen(fd, backlog) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}